@@ -0,0 +1,276 @@
+-- complain if script is sourced in psql, rather than via ALTER EXTENSION
+\echo Use "ALTER EXTENSION optimized_like UPDATE TO '1.2'" to load this file. \quit
+
+COMMENT ON FUNCTION build_optimized_index(text, text) IS 
+'Build an optimized bitmap index for wildcard pattern matching on the specified table and column; a partitioned table gets one sub-index per leaf partition';
+
+CREATE FUNCTION build_optimized_index(
+    table_name text,
+    column_name text,
+    parallel_workers integer
+) RETURNS boolean
+AS 'MODULE_PATHNAME', 'build_optimized_index'
+LANGUAGE C STRICT;
+
+COMMENT ON FUNCTION build_optimized_index(text, text, integer) IS
+'Build the index with up to parallel_workers background workers scanning block ranges of the heap';
+
+CREATE FUNCTION build_optimized_index(
+    table_name text,
+    column_name text,
+    parallel_workers integer,
+    key_column text
+) RETURNS boolean
+AS 'MODULE_PATHNAME', 'build_optimized_index'
+LANGUAGE C STRICT;
+
+COMMENT ON FUNCTION build_optimized_index(text, text, integer, text) IS
+'Build the index and keep the integer key_column of every row, returned as key by optimized_like_query_rows';
+
+CREATE FUNCTION build_optimized_dictionary_index(
+    table_name text,
+    column_name text
+) RETURNS boolean
+AS 'MODULE_PATHNAME', 'build_optimized_dictionary_index'
+LANGUAGE C STRICT;
+
+COMMENT ON FUNCTION build_optimized_dictionary_index(text, text) IS
+'Build the index over the distinct values of the column with a value-to-rows mapping; suited to columns with heavy repetition';
+
+CREATE FUNCTION build_optimized_dictionary_index(
+    table_name text,
+    column_name text,
+    key_column text
+) RETURNS boolean
+AS 'MODULE_PATHNAME', 'build_optimized_dictionary_index'
+LANGUAGE C STRICT;
+
+COMMENT ON FUNCTION build_optimized_dictionary_index(text, text, text) IS
+'Build a dictionary index and keep the integer key_column of every row';
+
+CREATE FUNCTION optimized_like_query(
+    table_name text,
+    column_name text,
+    pattern text
+) RETURNS integer
+AS 'MODULE_PATHNAME', 'optimized_like_query'
+LANGUAGE C STRICT;
+
+COMMENT ON FUNCTION optimized_like_query(text, text, text) IS
+'Return the count of records matching the given wildcard pattern using the index built on table_name.column_name';
+
+CREATE FUNCTION optimized_like_query(
+    table_name text,
+    column_name text,
+    pattern text,
+    partitions regclass[]
+) RETURNS integer
+AS 'MODULE_PATHNAME', 'optimized_like_query'
+LANGUAGE C STRICT;
+
+COMMENT ON FUNCTION optimized_like_query(text, text, text, regclass[]) IS
+'Count matches over the partitions of a partitioned table that are listed in partitions (or lie below one of them)';
+
+-- The result of optimized_like_query_rows gained tid, key and partition
+-- columns; a function's result type cannot be changed in place
+DROP FUNCTION optimized_like_query_rows(text);
+
+CREATE FUNCTION optimized_like_query_rows(
+    pattern text
+) RETURNS TABLE(row_id integer, value text, tid tid, key bigint, partition regclass)
+AS 'MODULE_PATHNAME', 'optimized_like_query_rows'
+LANGUAGE C STRICT;
+
+COMMENT ON FUNCTION optimized_like_query_rows(text) IS
+'Return all records matching the given wildcard pattern using the optimized index, with their ctid and key for joining back to the table';
+
+CREATE FUNCTION optimized_like_query_rows(
+    table_name text,
+    column_name text,
+    pattern text
+) RETURNS TABLE(row_id integer, value text, tid tid, key bigint, partition regclass)
+AS 'MODULE_PATHNAME', 'optimized_like_query_rows'
+LANGUAGE C STRICT;
+
+COMMENT ON FUNCTION optimized_like_query_rows(text, text, text) IS
+'Return all records matching the given wildcard pattern using the index built on table_name.column_name';
+
+CREATE FUNCTION optimized_like_query_rows(
+    table_name text,
+    column_name text,
+    pattern text,
+    partitions regclass[]
+) RETURNS TABLE(row_id integer, value text, tid tid, key bigint, partition regclass)
+AS 'MODULE_PATHNAME', 'optimized_like_query_rows'
+LANGUAGE C STRICT;
+
+COMMENT ON FUNCTION optimized_like_query_rows(text, text, text, regclass[]) IS
+'Return matches from the partitions of a partitioned table that are listed in partitions (or lie below one of them)';
+
+CREATE FUNCTION optimized_like_query_rows(
+    pattern text,
+    max_rows integer
+) RETURNS TABLE(row_id integer, value text, tid tid, key bigint, partition regclass)
+AS 'MODULE_PATHNAME', 'optimized_like_query_rows_limit'
+LANGUAGE C STRICT;
+
+COMMENT ON FUNCTION optimized_like_query_rows(text, integer) IS
+'Return at most max_rows matching records; no candidates are verified once max_rows rows have been found';
+
+CREATE FUNCTION optimized_like_query_rows(
+    table_name text,
+    column_name text,
+    pattern text,
+    max_rows integer
+) RETURNS TABLE(row_id integer, value text, tid tid, key bigint, partition regclass)
+AS 'MODULE_PATHNAME', 'optimized_like_query_rows_limit'
+LANGUAGE C STRICT;
+
+COMMENT ON FUNCTION optimized_like_query_rows(text, text, text, integer) IS
+'Return at most max_rows records matching the pattern in the index built on table_name.column_name';
+
+CREATE FUNCTION optimized_like_query_rows(
+    table_name text,
+    column_name text,
+    pattern text,
+    partitions regclass[],
+    max_rows integer
+) RETURNS TABLE(row_id integer, value text, tid tid, key bigint, partition regclass)
+AS 'MODULE_PATHNAME', 'optimized_like_query_rows_limit'
+LANGUAGE C STRICT;
+
+COMMENT ON FUNCTION optimized_like_query_rows(text, text, text, regclass[], integer) IS
+'Return at most max_rows matches from the listed partitions of a partitioned table';
+
+-- Release the index built on a table column
+CREATE FUNCTION optimized_like_drop_index(
+    table_name text,
+    column_name text
+) RETURNS boolean
+AS 'MODULE_PATHNAME', 'optimized_like_drop_index'
+LANGUAGE C STRICT;
+
+COMMENT ON FUNCTION optimized_like_drop_index(text, text) IS
+'Release the index built on table_name.column_name; returns false if none was loaded';
+
+-- Incremental maintenance: statement-level triggers queue the changed values
+-- and apply them to the index as one batch when the transaction commits
+CREATE FUNCTION optimized_like_maintain()
+RETURNS trigger
+AS 'MODULE_PATHNAME', 'optimized_like_maintain'
+LANGUAGE C;
+
+CREATE FUNCTION optimized_like_enable_maintenance(
+    table_name text,
+    column_name text
+) RETURNS void
+AS $$
+DECLARE
+    rel regclass := table_name::regclass;
+BEGIN
+    -- Each partition has its own index, but statement triggers only see the
+    -- rows of the table named in the statement, without their partition
+    IF EXISTS (SELECT 1 FROM pg_catalog.pg_class c
+               WHERE c.oid = rel AND (c.relkind = 'p' OR c.relispartition)) THEN
+        RAISE EXCEPTION 'optimized_like maintenance is not supported on partitioned table %', rel
+            USING ERRCODE = 'feature_not_supported',
+                  DETAIL = 'Changes made through the partitioned table cannot be routed to the index of each partition.',
+                  HINT = 'Rebuild the index with build_optimized_index after changing the table.';
+    END IF;
+    EXECUTE format('CREATE TRIGGER %I AFTER INSERT ON %s '
+                   'REFERENCING NEW TABLE AS optimized_like_new '
+                   'FOR EACH STATEMENT EXECUTE FUNCTION optimized_like_maintain(%L)',
+                   'optimized_like_ins_' || column_name, rel, column_name);
+    EXECUTE format('CREATE TRIGGER %I AFTER UPDATE ON %s '
+                   'REFERENCING OLD TABLE AS optimized_like_old NEW TABLE AS optimized_like_new '
+                   'FOR EACH STATEMENT EXECUTE FUNCTION optimized_like_maintain(%L)',
+                   'optimized_like_upd_' || column_name, rel, column_name);
+    EXECUTE format('CREATE TRIGGER %I AFTER DELETE ON %s '
+                   'REFERENCING OLD TABLE AS optimized_like_old '
+                   'FOR EACH STATEMENT EXECUTE FUNCTION optimized_like_maintain(%L)',
+                   'optimized_like_del_' || column_name, rel, column_name);
+END;
+$$ LANGUAGE plpgsql;
+
+COMMENT ON FUNCTION optimized_like_enable_maintenance(text, text) IS
+'Install triggers that keep the index on table_name.column_name up to date as rows change';
+
+CREATE FUNCTION optimized_like_disable_maintenance(
+    table_name text,
+    column_name text
+) RETURNS void
+AS $$
+DECLARE
+    rel regclass := table_name::regclass;
+BEGIN
+    EXECUTE format('DROP TRIGGER IF EXISTS %I ON %s', 'optimized_like_ins_' || column_name, rel);
+    EXECUTE format('DROP TRIGGER IF EXISTS %I ON %s', 'optimized_like_upd_' || column_name, rel);
+    EXECUTE format('DROP TRIGGER IF EXISTS %I ON %s', 'optimized_like_del_' || column_name, rel);
+END;
+$$ LANGUAGE plpgsql;
+
+COMMENT ON FUNCTION optimized_like_disable_maintenance(text, text) IS
+'Remove the triggers installed by optimized_like_enable_maintenance';
+
+-- Fold the applied changes back into a single base image
+CREATE FUNCTION optimized_like_compact_index(
+    table_name text,
+    column_name text
+) RETURNS boolean
+AS 'MODULE_PATHNAME', 'optimized_like_compact_index'
+LANGUAGE C STRICT;
+
+COMMENT ON FUNCTION optimized_like_compact_index(text, text) IS
+'Merge the incremental changes of the index on table_name.column_name into a new base image without reading the table';
+
+-- Persist the loaded index to PGDATA/pg_optimized_like
+CREATE FUNCTION optimized_like_save_index(
+    file_name text DEFAULT NULL
+) RETURNS text
+AS 'MODULE_PATHNAME', 'optimized_like_save_index'
+LANGUAGE C;
+
+COMMENT ON FUNCTION optimized_like_save_index(text) IS
+'Write the loaded index to PGDATA/pg_optimized_like (default name: table.column.oli) and return its path';
+
+CREATE FUNCTION optimized_like_save_index(
+    table_name text,
+    column_name text,
+    file_name text DEFAULT NULL
+) RETURNS text
+AS 'MODULE_PATHNAME', 'optimized_like_save_index'
+LANGUAGE C;
+
+COMMENT ON FUNCTION optimized_like_save_index(text, text, text) IS
+'Write the index built on table_name.column_name to PGDATA/pg_optimized_like and return its path';
+
+-- Map a saved index file instead of rebuilding from the table
+CREATE FUNCTION optimized_like_load_index(
+    file_name text
+) RETURNS boolean
+AS 'MODULE_PATHNAME', 'optimized_like_load_index'
+LANGUAGE C STRICT;
+
+COMMENT ON FUNCTION optimized_like_load_index(text) IS
+'Memory-map an index file saved by optimized_like_save_index and serve queries on its table column without a rebuild';
+
+-- Index files live in the data directory; keep them superuser-only
+REVOKE ALL ON FUNCTION optimized_like_save_index(text) FROM PUBLIC;
+REVOKE ALL ON FUNCTION optimized_like_save_index(text, text, text) FROM PUBLIC;
+REVOKE ALL ON FUNCTION optimized_like_load_index(text) FROM PUBLIC;
+
+-- Index access method: CREATE INDEX ... USING optimized_like (col) lets the
+-- planner use the bitmap index for ordinary col LIKE 'pattern' predicates
+CREATE FUNCTION optimized_like_handler(internal)
+RETURNS index_am_handler
+AS 'MODULE_PATHNAME', 'optimized_like_handler'
+LANGUAGE C;
+
+CREATE ACCESS METHOD optimized_like TYPE INDEX HANDLER optimized_like_handler;
+
+COMMENT ON ACCESS METHOD optimized_like IS
+'Positional bitmap index for LIKE pattern matching on text columns';
+
+CREATE OPERATOR CLASS text_optimized_like_ops
+DEFAULT FOR TYPE text USING optimized_like AS
+    OPERATOR 1 ~~ (text, text);
@@ -1,18 +1,19 @@
 /*
- * optimized_like_roaring.c
- * PostgreSQL extension - ULTIMATE VERSION
+ * optimized_like.c
+ * Roaring bitmap index for LIKE pattern matching in PostgreSQL
  * 
- * Combines correctness from working version with hardware optimizations
+ * Each indexed string sets one bit per byte and position in a flat
+ * [char][position] bitmap directory over its first MAX_POSITIONS bytes, one
+ * per byte anywhere in the string, and one for its length.  A pattern is
+ * answered by intersecting the bitmaps of its fixed bytes, then verifying
+ * the candidates that the bitmaps alone cannot settle.
  * 
- * OPTIMIZATIONS:
- * 1. Hash tables for O(1) lookups (vs O(n) linear search)
- * 2. CPU prefetching and cache alignment
- * 3. Branch prediction hints
- * 4. Loop unrolling
- * 5. Query result caching
- * 6. Bloom filters for fast negatives
- * 7. Correct contiguous pattern matching
- * 8. Optimized string search
+ * The index is built from a table column (in parallel, over distinct values,
+ * or with n-grams, positional bigrams, gap pairs or a suffix array), shared
+ * between backends through DSM, saved to and mapped from a file, kept up to
+ * date by statement triggers, or created as an index access method.  Zone
+ * maps, a per-index query cache with a bloom filter and prefetching during
+ * verification keep queries on large indexes cheap.
  */
 
  #include "postgres.h"
@@ -23,14 +24,63 @@
  #include "catalog/pg_type.h"
  #include "funcapi.h"
  #include "executor/spi.h"
+ #include "lib/ilist.h"
  #include "lib/stringinfo.h"
  #include "utils/timestamp.h"
+ #include "miscadmin.h"
+ #include "pgstat.h"
+ #include "port/atomics.h"
+ #include "storage/dsm.h"
+ #include "storage/fd.h"
+ #include "storage/ipc.h"
+ #include "storage/lwlock.h"
+ #include "storage/shmem.h"
+ #include "utils/array.h"
+ #include "utils/guc.h"
+ #include "utils/hsearch.h"
+ #include "utils/inval.h"
+ #include "utils/lsyscache.h"
+ #include "utils/rel.h"
+ #include "utils/selfuncs.h"
+ #include "utils/tuplestore.h"
+ #include "utils/varlena.h"
+ #include "access/amapi.h"
+ #include "access/heapam.h"
+ #include "access/parallel.h"
+ #include "access/xact.h"
+ #include "access/generic_xlog.h"
+ #include "access/reloptions.h"
+ #include "access/relscan.h"
+ #include "access/tableam.h"
+ #include "access/transam.h"
+ #include "catalog/index.h"
+ #include "catalog/namespace.h"
+ #include "catalog/partition.h"
+ #include "catalog/pg_am.h"
+ #include "catalog/pg_inherits.h"
+ #include "commands/trigger.h"
+ #include "commands/vacuum.h"
+ #include "mb/pg_wchar.h"
+ #include "nodes/tidbitmap.h"
+ #include "executor/tuptable.h"
+ #include "storage/bufmgr.h"
+ #include "storage/indexfsm.h"
+ #include "storage/lmgr.h"
+ #include "storage/shm_toc.h"
+ #include "utils/snapmgr.h"
+ #include "utils/syscache.h"
  #include <string.h>
+ #include <sys/mman.h>
+ #include <sys/stat.h>
  
  #ifdef HAVE_ROARING
  #include "roaring.h"
  #else
  typedef void roaring_bitmap_t;
+ #if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+ #define USE_X86_BITSET_KERNELS
+ #include <immintrin.h>
+ #endif
  #endif
  
  #ifdef PG_MODULE_MAGIC
@@ -54,9 +104,15 @@
  
  #define MAX_POSITIONS 256
  #define CHAR_RANGE 256
- #define HASH_TABLE_SIZE 4096
  #define QUERY_CACHE_SIZE 512
  #define BLOOM_SIZE 4096
+ #define MAX_DELTA_SEGMENTS 16
+ #define SEGMENT_ROWS 65536      /* rows per zone map; one CRoaring container */
+ #define ZONE_POSITIONS 8        /* leading/trailing positions with char masks */
+ #define MAX_GRAM_TERMS 64       /* n-grams one query plans with */
+ 
+ /* Bitmaps one query can intersect: every char, both anchors, grams, length, zones */
+ #define MAX_AND_INPUTS (CHAR_RANGE + 2 * MAX_POSITIONS + MAX_GRAM_TERMS + 2)
  
  /* ==================== BLOOM FILTER ==================== */
  
@@ -107,6 +163,12 @@
      roaring_bitmap_add(rb, value);
  }
  
+ /* Add every value in [lo, hi) */
+ static FORCE_INLINE void roaring_add_range(RoaringBitmap *rb, uint32_t lo, uint32_t hi)
+ {
+     roaring_bitmap_add_range(rb, lo, hi);
+ }
+ 
  static FORCE_INLINE RoaringBitmap* roaring_and(const RoaringBitmap *a, const RoaringBitmap *b)
  {
      return roaring_bitmap_and(a, b);
@@ -117,6 +179,18 @@
      return roaring_bitmap_or(a, b);
  }
  
+ /* |a AND b| without building the intersection */
+ static FORCE_INLINE uint64_t roaring_and_count(const RoaringBitmap *a, const RoaringBitmap *b)
+ {
+     return roaring_bitmap_and_cardinality(a, b);
+ }
+ 
+ /* Whether a AND b is non-empty, stopping at the first common value */
+ static FORCE_INLINE bool roaring_intersects(const RoaringBitmap *a, const RoaringBitmap *b)
+ {
+     return roaring_bitmap_intersect(a, b);
+ }
+ 
  static FORCE_INLINE uint64_t roaring_count(const RoaringBitmap *rb)
  {
      return roaring_bitmap_get_cardinality(rb);
@@ -127,6 +201,11 @@
      return roaring_bitmap_is_empty(rb);
  }
  
+ static FORCE_INLINE bool roaring_contains(const RoaringBitmap *rb, uint32_t value)
+ {
+     return roaring_bitmap_contains(rb, value);
+ }
+ 
  static FORCE_INLINE uint32_t* roaring_to_array(const RoaringBitmap *rb, uint64_t *count)
  {
      *count = roaring_bitmap_get_cardinality(rb);
@@ -136,6 +215,24 @@
      return array;
  }
  
+ /* Walks a bitmap a batch of values at a time, without building the whole array */
+ typedef roaring_uint32_iterator_t RoaringIterator;
+ 
+ static FORCE_INLINE void roaring_iterator_start(const RoaringBitmap *rb, RoaringIterator *it)
+ {
+     roaring_init_iterator(rb, it);
+ }
+ 
+ /* Up to max next values into out; 0 once the bitmap is exhausted */
+ static FORCE_INLINE uint32_t roaring_iterator_read(RoaringIterator *it, uint32_t *out, uint32_t max)
+ {
+     return roaring_read_uint32_iterator(it, out, max);
+ }
+ 
+ static FORCE_INLINE void roaring_iterator_end(RoaringIterator *it)
+ {
+ }
+ 
  static FORCE_INLINE size_t roaring_size_bytes(const RoaringBitmap *rb)
  {
      return roaring_bitmap_size_in_bytes(rb);
@@ -151,1291 +248,8999 @@
      return roaring_bitmap_copy(rb);
  }
  
+ /* Intersection of n >= 2 bitmaps ordered by ascending cardinality */
+ static RoaringBitmap* roaring_and_sorted(const RoaringBitmap **bms, int n)
+ {
+     RoaringBitmap *result = roaring_bitmap_and(bms[0], bms[1]);
+     int i;
+     
+     for (i = 2; i < n && !roaring_bitmap_is_empty(result); i++)
+         roaring_bitmap_and_inplace(result, bms[i]);
+     return result;
+ }
+ 
+ static FORCE_INLINE size_t roaring_frozen_size(const RoaringBitmap *rb)
+ {
+     return roaring_bitmap_frozen_size_in_bytes(rb);
+ }
+ 
+ static FORCE_INLINE void roaring_frozen_write(const RoaringBitmap *rb, char *buf)
+ {
+     roaring_bitmap_frozen_serialize(rb, buf);
+ }
+ 
+ /*
+  * Read-only view over a frozen bitmap; buf must be 32-byte aligned.  NULL if
+  * the len bytes at buf are not a valid frozen bitmap.
+  */
+ static FORCE_INLINE RoaringBitmap* roaring_frozen_view(const char *buf, size_t len)
+ {
+     return (RoaringBitmap *)roaring_bitmap_frozen_view(buf, len);
+ }
+ 
+ /*
+  * Whether the frozen bitmap at buf is well formed (ordered keys, sorted
+  * containers, true cardinalities) and holds no value >= bound
+  */
+ static bool roaring_frozen_check(const char *buf, size_t len, uint64_t bound)
+ {
+     const roaring_bitmap_t *rb = roaring_bitmap_frozen_view(buf, len);
+     const char *reason;
+     bool valid;
+     
+     if (!rb)
+         return false;
+     valid = roaring_bitmap_internal_validate(rb, &reason) &&
+             (roaring_bitmap_is_empty(rb) || roaring_bitmap_maximum(rb) < bound);
+     roaring_bitmap_free(rb);
+     return valid;
+ }
+ 
+ /* Copy of rb with every value moved up by offset */
+ static FORCE_INLINE RoaringBitmap* roaring_shift(const RoaringBitmap *rb, uint32_t offset)
+ {
+     return roaring_bitmap_add_offset(rb, offset);
+ }
+ 
  #else
  
- /* Optimized fallback bitmap */
+ /*
+  * Fallback bitmap used without CRoaring, organised the same way: values are
+  * split into 64K chunks by their high 16 bits and every non-empty chunk is a
+  * container in the cheapest of three forms for its contents:
+  *
+  *   array  - sorted low halves, at most ARRAY_MAX_CARD of them
+  *   bitset - CONTAINER_WORDS words covering the whole chunk
+  *   run    - sorted (start, length - 1) pairs
+  *
+  * Memory follows cardinality, and AND/OR only touch chunks present in their
+  * inputs.  Rows are added in ascending order during a build, so roaring_add()
+  * checks the last container and the end of an array first.  Results of
+  * operations and frozen images re-pick the cheapest form; containers built
+  * by roaring_add() stay arrays or bitsets until then.
+  */
+ 
+ #define CONTAINER_ARRAY     1
+ #define CONTAINER_BITSET    2
+ #define CONTAINER_RUN       3
+ #define CONTAINER_WORDS     1024    /* uint64 words of a bitset container */
+ #define ARRAY_MAX_CARD      4096    /* an array larger than this is a bitset */
+ 
  typedef struct {
-     CACHE_ALIGNED uint64_t *blocks;
-     int num_blocks;
+     uint16_t key;               /* high 16 bits of the values */
+     uint8_t type;
+     int32_t card;
+     int32_t n;                  /* array: values, run: pairs, bitset: unused */
+     int32_t capacity;           /* allocated values or pairs */
+     void *data;
+ } BitmapContainer;
+ 
+ typedef struct {
+     BitmapContainer *containers;    /* sorted by key, none empty */
+     int num_containers;
      int capacity;
-     bool is_palloc;
+     bool is_palloc;                 /* false for views: data points into an image */
  } RoaringBitmap;
  
- static FORCE_INLINE RoaringBitmap* roaring_create(void)
+ /* Frozen form: this header, one FrozenContainer per container, then payloads */
+ typedef struct {
+     uint32_t num_containers;
+     uint32_t pad;
+ } FrozenHeader;
+ 
+ typedef struct {
+     uint16_t key;
+     uint8_t type;
+     uint8_t pad;
+     uint32_t card;
+     uint32_t n;
+     uint32_t offset;            /* payload offset from the frozen header, 8-byte aligned */
+ } FrozenContainer;
+ 
+ /* ---- bitset kernels ---- */
+ 
+ /*
+  * Whole-container bitset loops, the hot path of the fallback.  Scalar, AVX2
+  * and AVX-512 (with VPOPCNTQ) versions exist and bitset_kernels_init() picks
+  * one from cpuid when the library is loaded.  AND and OR return the
+  * cardinality of what they wrote, so results are never counted in a second
+  * pass; and_any stops at the first common bit without writing anything.
+  */
+ typedef struct {
+     int (*op_and)(uint64_t *dst, const uint64_t *x, const uint64_t *y);
+     int (*op_or)(uint64_t *dst, const uint64_t *x, const uint64_t *y);
+     int (*and_count)(const uint64_t *x, const uint64_t *y);
+     bool (*and_any)(const uint64_t *x, const uint64_t *y);
+     int (*card)(const uint64_t *words);
+     const char *name;
+ } BitsetKernels;
+ 
+ static int bitset_and_scalar(uint64_t *dst, const uint64_t *x, const uint64_t *y)
  {
-     RoaringBitmap *rb = (RoaringBitmap *)palloc(sizeof(RoaringBitmap));
-     rb->num_blocks = 0;
-     rb->capacity = 16;
-     rb->blocks = (uint64_t *)palloc0(rb->capacity * sizeof(uint64_t));
-     rb->is_palloc = true;
-     return rb;
+     int card = 0, i;
+     
+     for (i = 0; i < CONTAINER_WORDS; i++)
+     {
+         dst[i] = x[i] & y[i];
+         card += __builtin_popcountll(dst[i]);
+     }
+     return card;
  }
  
- static FORCE_INLINE void roaring_add(RoaringBitmap *rb, uint32_t value)
+ static int bitset_or_scalar(uint64_t *dst, const uint64_t *x, const uint64_t *y)
  {
-     int block = value >> 6;
-     int bit = value & 63;
+     int card = 0, i;
      
-     if (unlikely(block >= rb->capacity))
+     for (i = 0; i < CONTAINER_WORDS; i++)
      {
-         int new_cap = block + 1;
-         rb->blocks = (uint64_t *)repalloc(rb->blocks, new_cap * sizeof(uint64_t));
-         memset(rb->blocks + rb->capacity, 0, (new_cap - rb->capacity) * sizeof(uint64_t));
-         rb->capacity = new_cap;
+         dst[i] = x[i] | y[i];
+         card += __builtin_popcountll(dst[i]);
      }
-     if (block >= rb->num_blocks)
-         rb->num_blocks = block + 1;
-     rb->blocks[block] |= (1ULL << bit);
+     return card;
  }
  
- static RoaringBitmap* roaring_and(const RoaringBitmap *a, const RoaringBitmap *b)
+ static int bitset_and_count_scalar(const uint64_t *x, const uint64_t *y)
  {
-     RoaringBitmap *result = roaring_create();
-     int min_blocks = (a->num_blocks < b->num_blocks) ? a->num_blocks : b->num_blocks;
-     int i;
+     int card = 0, i;
      
-     if (unlikely(min_blocks == 0))
-         return result;
+     for (i = 0; i < CONTAINER_WORDS; i++)
+         card += __builtin_popcountll(x[i] & y[i]);
+     return card;
+ }
+ 
+ static bool bitset_and_any_scalar(const uint64_t *x, const uint64_t *y)
+ {
+     int i;
      
-     if (result->capacity < min_blocks)
-     {
-         result->blocks = (uint64_t *)repalloc(result->blocks, min_blocks * sizeof(uint64_t));
-         result->capacity = min_blocks;
-     }
-     result->num_blocks = min_blocks;
+     for (i = 0; i < CONTAINER_WORDS; i += 4)
+         if ((x[i] & y[i]) | (x[i + 1] & y[i + 1]) | (x[i + 2] & y[i + 2]) | (x[i + 3] & y[i + 3]))
+             return true;
+     return false;
+ }
+ 
+ static int bitset_card_scalar(const uint64_t *words)
+ {
+     int card = 0, i;
      
-     /* Unrolled loop */
-     for (i = 0; i + 3 < min_blocks; i += 4)
-     {
-         PREFETCH(&a->blocks[i + 8]);
-         PREFETCH(&b->blocks[i + 8]);
-         result->blocks[i] = a->blocks[i] & b->blocks[i];
-         result->blocks[i+1] = a->blocks[i+1] & b->blocks[i+1];
-         result->blocks[i+2] = a->blocks[i+2] & b->blocks[i+2];
-         result->blocks[i+3] = a->blocks[i+3] & b->blocks[i+3];
-     }
-     for (; i < min_blocks; i++)
-         result->blocks[i] = a->blocks[i] & b->blocks[i];
+     for (i = 0; i < CONTAINER_WORDS; i++)
+         card += __builtin_popcountll(words[i]);
+     return card;
+ }
+ 
+ static BitsetKernels bitset_kernels = {
+     bitset_and_scalar, bitset_or_scalar, bitset_and_count_scalar,
+     bitset_and_any_scalar, bitset_card_scalar, "scalar"
+ };
+ 
+ #ifdef USE_X86_BITSET_KERNELS
+ 
+ #define TARGET_AVX2     __attribute__((target("avx2")))
+ #define TARGET_AVX512   __attribute__((target("avx512f,avx512vpopcntdq")))
+ 
+ /* Per-64-bit-lane popcount via nibble lookup (no VPOPCNT before AVX-512) */
+ static TARGET_AVX2 FORCE_INLINE __m256i popcount_avx2(__m256i v)
+ {
+     const __m256i lookup = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+                                             0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+     const __m256i low = _mm256_set1_epi8(0x0f);
+     __m256i counts = _mm256_add_epi8(
+         _mm256_shuffle_epi8(lookup, _mm256_and_si256(v, low)),
+         _mm256_shuffle_epi8(lookup, _mm256_and_si256(_mm256_srli_epi16(v, 4), low)));
      
-     return result;
+     return _mm256_sad_epu8(counts, _mm256_setzero_si256());
  }
  
- static RoaringBitmap* roaring_or(const RoaringBitmap *a, const RoaringBitmap *b)
+ static TARGET_AVX2 FORCE_INLINE int sum_avx2(__m256i v)
  {
-     RoaringBitmap *result = roaring_create();
-     int max_blocks = (a->num_blocks > b->num_blocks) ? a->num_blocks : b->num_blocks;
-     int min_blocks = (a->num_blocks < b->num_blocks) ? a->num_blocks : b->num_blocks;
+     return (int)(_mm256_extract_epi64(v, 0) + _mm256_extract_epi64(v, 1) +
+                  _mm256_extract_epi64(v, 2) + _mm256_extract_epi64(v, 3));
+ }
+ 
+ static TARGET_AVX2 int bitset_and_avx2(uint64_t *dst, const uint64_t *x, const uint64_t *y)
+ {
+     __m256i acc = _mm256_setzero_si256();
      int i;
      
-     if (unlikely(max_blocks == 0))
-         return result;
-     
-     if (result->capacity < max_blocks)
+     for (i = 0; i < CONTAINER_WORDS; i += 4)
      {
-         result->blocks = (uint64_t *)repalloc(result->blocks, max_blocks * sizeof(uint64_t));
-         result->capacity = max_blocks;
+         __m256i v = _mm256_and_si256(_mm256_loadu_si256((const __m256i *)(x + i)),
+                                      _mm256_loadu_si256((const __m256i *)(y + i)));
+         
+         _mm256_storeu_si256((__m256i *)(dst + i), v);
+         acc = _mm256_add_epi64(acc, popcount_avx2(v));
      }
-     result->num_blocks = max_blocks;
-     
-     for (i = 0; i < min_blocks; i++)
-         result->blocks[i] = a->blocks[i] | b->blocks[i];
-     
-     if (a->num_blocks > min_blocks)
-         memcpy(result->blocks + min_blocks, a->blocks + min_blocks,
-                (a->num_blocks - min_blocks) * sizeof(uint64_t));
-     else if (b->num_blocks > min_blocks)
-         memcpy(result->blocks + min_blocks, b->blocks + min_blocks,
-                (b->num_blocks - min_blocks) * sizeof(uint64_t));
-     
-     return result;
+     return sum_avx2(acc);
  }
  
- static uint64_t roaring_count(const RoaringBitmap *rb)
+ static TARGET_AVX2 int bitset_or_avx2(uint64_t *dst, const uint64_t *x, const uint64_t *y)
  {
-     uint64_t count = 0;
+     __m256i acc = _mm256_setzero_si256();
      int i;
      
-     for (i = 0; i + 3 < rb->num_blocks; i += 4)
+     for (i = 0; i < CONTAINER_WORDS; i += 4)
      {
-         count += __builtin_popcountll(rb->blocks[i]);
-         count += __builtin_popcountll(rb->blocks[i+1]);
-         count += __builtin_popcountll(rb->blocks[i+2]);
-         count += __builtin_popcountll(rb->blocks[i+3]);
+         __m256i v = _mm256_or_si256(_mm256_loadu_si256((const __m256i *)(x + i)),
+                                     _mm256_loadu_si256((const __m256i *)(y + i)));
+         
+         _mm256_storeu_si256((__m256i *)(dst + i), v);
+         acc = _mm256_add_epi64(acc, popcount_avx2(v));
      }
-     for (; i < rb->num_blocks; i++)
-         count += __builtin_popcountll(rb->blocks[i]);
-     
-     return count;
+     return sum_avx2(acc);
  }
  
- static FORCE_INLINE bool roaring_is_empty(const RoaringBitmap *rb)
+ static TARGET_AVX2 int bitset_and_count_avx2(const uint64_t *x, const uint64_t *y)
  {
-     for (int i = 0; i < rb->num_blocks; i++)
-         if (rb->blocks[i])
-             return false;
-     return true;
+     __m256i acc = _mm256_setzero_si256();
+     int i;
+     
+     for (i = 0; i < CONTAINER_WORDS; i += 4)
+         acc = _mm256_add_epi64(acc, popcount_avx2(
+             _mm256_and_si256(_mm256_loadu_si256((const __m256i *)(x + i)),
+                              _mm256_loadu_si256((const __m256i *)(y + i)))));
+     return sum_avx2(acc);
  }
  
- static uint32_t* roaring_to_array(const RoaringBitmap *rb, uint64_t *count)
+ static TARGET_AVX2 bool bitset_and_any_avx2(const uint64_t *x, const uint64_t *y)
  {
-     uint32_t *array;
-     int idx = 0, i;
-     uint64_t bits, base;
-     
-     *count = roaring_count(rb);
-     if (unlikely(*count == 0))
-         return NULL;
-     
-     array = (uint32_t *)palloc(*count * sizeof(uint32_t));
+     int i;
      
-     for (i = 0; i < rb->num_blocks; i++)
-     {
-         bits = rb->blocks[i];
-         if (!bits) continue;
-         
-         base = (uint64_t)i << 6;
-         while (bits)
-         {
-             array[idx++] = (uint32_t)(base + __builtin_ctzll(bits));
-             bits &= bits - 1;
-         }
-     }
-     return array;
+     for (i = 0; i < CONTAINER_WORDS; i += 4)
+         if (!_mm256_testz_si256(_mm256_loadu_si256((const __m256i *)(x + i)),
+                                 _mm256_loadu_si256((const __m256i *)(y + i))))
+             return true;
+     return false;
  }
  
- static size_t roaring_size_bytes(const RoaringBitmap *rb)
+ static TARGET_AVX2 int bitset_card_avx2(const uint64_t *words)
  {
-     return sizeof(RoaringBitmap) + rb->capacity * sizeof(uint64_t);
+     __m256i acc = _mm256_setzero_si256();
+     int i;
+     
+     for (i = 0; i < CONTAINER_WORDS; i += 4)
+         acc = _mm256_add_epi64(acc, popcount_avx2(_mm256_loadu_si256((const __m256i *)(words + i))));
+     return sum_avx2(acc);
  }
  
- static void roaring_free(RoaringBitmap *rb)
+ static TARGET_AVX512 int bitset_and_avx512(uint64_t *dst, const uint64_t *x, const uint64_t *y)
  {
-     if (rb)
+     __m512i acc = _mm512_setzero_si512();
+     int i;
+     
+     for (i = 0; i < CONTAINER_WORDS; i += 8)
      {
-         if (rb->blocks && rb->is_palloc)
-             pfree(rb->blocks);
-         pfree(rb);
+         __m512i v = _mm512_and_si512(_mm512_loadu_si512(x + i), _mm512_loadu_si512(y + i));
+         
+         _mm512_storeu_si512(dst + i, v);
+         acc = _mm512_add_epi64(acc, _mm512_popcnt_epi64(v));
      }
+     return (int)_mm512_reduce_add_epi64(acc);
  }
  
- static RoaringBitmap* roaring_copy(const RoaringBitmap *rb)
+ static TARGET_AVX512 int bitset_or_avx512(uint64_t *dst, const uint64_t *x, const uint64_t *y)
  {
-     RoaringBitmap *copy = roaring_create();
-     if (rb->num_blocks > 0)
+     __m512i acc = _mm512_setzero_si512();
+     int i;
+     
+     for (i = 0; i < CONTAINER_WORDS; i += 8)
      {
-         copy->blocks = (uint64_t *)repalloc(copy->blocks, rb->num_blocks * sizeof(uint64_t));
-         copy->num_blocks = rb->num_blocks;
-         copy->capacity = rb->num_blocks;
-         memcpy(copy->blocks, rb->blocks, rb->num_blocks * sizeof(uint64_t));
+         __m512i v = _mm512_or_si512(_mm512_loadu_si512(x + i), _mm512_loadu_si512(y + i));
+         
+         _mm512_storeu_si512(dst + i, v);
+         acc = _mm512_add_epi64(acc, _mm512_popcnt_epi64(v));
      }
-     return copy;
+     return (int)_mm512_reduce_add_epi64(acc);
  }
  
- #endif
- 
- /* ==================== HASH TABLE STRUCTURES ==================== */
- 
- typedef struct PosHashEntry {
-     int pos;
-     RoaringBitmap *bitmap;
-     struct PosHashEntry *next;
- } PosHashEntry;
- 
- typedef struct {
-     CACHE_ALIGNED PosHashEntry *buckets[HASH_TABLE_SIZE];
- } PosHashTable;
- 
- typedef struct {
-     RoaringBitmap **length_bitmaps;
-     int max_length;
- } LengthIndex;
- 
- typedef struct CacheEntry {
-     char *pattern;
-     uint32_t *results;
-     uint64_t count;
-     uint64_t last_used;
-     struct CacheEntry *next;
- } CacheEntry;
- 
- typedef struct {
-     CACHE_ALIGNED CacheEntry *entries[QUERY_CACHE_SIZE];
-     uint64_t access_counter;
-     BloomFilter bloom;
- } QueryCache;
+ static TARGET_AVX512 int bitset_and_count_avx512(const uint64_t *x, const uint64_t *y)
+ {
+     __m512i acc = _mm512_setzero_si512();
+     int i;
+     
+     for (i = 0; i < CONTAINER_WORDS; i += 8)
+         acc = _mm512_add_epi64(acc, _mm512_popcnt_epi64(
+             _mm512_and_si512(_mm512_loadu_si512(x + i), _mm512_loadu_si512(y + i))));
+     return (int)_mm512_reduce_add_epi64(acc);
+ }
  
- typedef struct RoaringIndex {
-     CACHE_ALIGNED PosHashTable pos_idx[CHAR_RANGE];
-     CACHE_ALIGNED PosHashTable neg_idx[CHAR_RANGE];
-     CACHE_ALIGNED RoaringBitmap *char_cache[CHAR_RANGE];
-     LengthIndex length_idx;
-     QueryCache query_cache;
+ static TARGET_AVX512 bool bitset_and_any_avx512(const uint64_t *x, const uint64_t *y)
+ {
+     int i;
      
-     char **data;
-     int num_records;
-     int max_len;
-     size_t memory_used;
- } RoaringIndex;
+     for (i = 0; i < CONTAINER_WORDS; i += 8)
+         if (_mm512_test_epi64_mask(_mm512_loadu_si512(x + i), _mm512_loadu_si512(y + i)))
+             return true;
+     return false;
+ }
  
- static RoaringIndex *global_index = NULL;
- static MemoryContext index_context = NULL;
+ static TARGET_AVX512 int bitset_card_avx512(const uint64_t *words)
+ {
+     __m512i acc = _mm512_setzero_si512();
+     int i;
+     
+     for (i = 0; i < CONTAINER_WORDS; i += 8)
+         acc = _mm512_add_epi64(acc, _mm512_popcnt_epi64(_mm512_loadu_si512(words + i)));
+     return (int)_mm512_reduce_add_epi64(acc);
+ }
  
- /* ==================== HASH FUNCTIONS ==================== */
+ #endif                          /* USE_X86_BITSET_KERNELS */
  
- static FORCE_INLINE uint32_t hash_position(int pos)
+ static void bitset_kernels_init(void)
  {
-     return ((uint32_t)pos * 2654435761U) & (HASH_TABLE_SIZE - 1);
+ #ifdef USE_X86_BITSET_KERNELS
+     __builtin_cpu_init();
+     if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512vpopcntdq"))
+     {
+         BitsetKernels k = {
+             bitset_and_avx512, bitset_or_avx512, bitset_and_count_avx512,
+             bitset_and_any_avx512, bitset_card_avx512, "avx512"
+         };
+         
+         bitset_kernels = k;
+     }
+     else if (__builtin_cpu_supports("avx2"))
+     {
+         BitsetKernels k = {
+             bitset_and_avx2, bitset_or_avx2, bitset_and_count_avx2,
+             bitset_and_any_avx2, bitset_card_avx2, "avx2"
+         };
+         
+         bitset_kernels = k;
+     }
+ #endif
  }
  
- static FORCE_INLINE uint32_t hash_string(const char *str)
+ /* ---- bitset helpers, shared by every container form ---- */
+ 
+ static FORCE_INLINE void words_set_range(uint64_t *words, uint32_t lo, uint32_t hi)
  {
-     uint32_t hash = 5381;
-     int c;
-     
-     while ((c = *str++))
-         hash = ((hash << 5) + hash) + c;
+     uint32_t first = lo >> 6, last = hi >> 6, i;
+     uint64_t first_mask = ~0ULL << (lo & 63);
+     uint64_t last_mask = ~0ULL >> (63 - (hi & 63));
      
-     return hash % QUERY_CACHE_SIZE;
+     if (first == last)
+     {
+         words[first] |= first_mask & last_mask;
+         return;
+     }
+     words[first] |= first_mask;
+     for (i = first + 1; i < last; i++)
+         words[i] = ~0ULL;
+     words[last] |= last_mask;
  }
  
- /* ==================== POSITION BITMAP ACCESS (HASH TABLE) ==================== */
+ static FORCE_INLINE int words_card(const uint64_t *words)
+ {
+     return bitset_kernels.card(words);
+ }
  
- static FORCE_INLINE RoaringBitmap* get_pos_bitmap(unsigned char ch, int pos)
+ static int words_nruns(const uint64_t *words)
  {
-     uint32_t bucket = hash_position(pos);
-     PosHashEntry *entry = global_index->pos_idx[ch].buckets[bucket];
+     uint64_t carry = 0;
+     int runs = 0, i;
      
-     while (entry)
+     for (i = 0; i < CONTAINER_WORDS; i++)
      {
-         if (likely(entry->pos == pos))
-             return entry->bitmap;
-         entry = entry->next;
+         uint64_t w = words[i];
+         
+         runs += __builtin_popcountll(w & ~((w << 1) | carry));
+         carry = w >> 63;
      }
-     return NULL;
+     return runs;
  }
  
- static FORCE_INLINE RoaringBitmap* get_neg_bitmap(unsigned char ch, int neg_offset)
+ /* First bit at or after from that is set (or clear), -1 if none */
+ static int words_next(const uint64_t *words, int from, bool set)
  {
-     uint32_t bucket = hash_position(neg_offset);
-     PosHashEntry *entry = global_index->neg_idx[ch].buckets[bucket];
+     int i = from >> 6;
+     uint64_t w;
      
-     while (entry)
+     if (from >= CONTAINER_WORDS * 64)
+         return -1;
+     w = (set ? words[i] : ~words[i]) & (~0ULL << (from & 63));
+     while (!w)
      {
-         if (likely(entry->pos == neg_offset))
-             return entry->bitmap;
-         entry = entry->next;
+         if (++i >= CONTAINER_WORDS)
+             return -1;
+         w = set ? words[i] : ~words[i];
      }
-     return NULL;
+     return (i << 6) + __builtin_ctzll(w);
  }
  
- static void set_pos_bitmap(unsigned char ch, int pos, RoaringBitmap *bm)
+ static void words_to_array(const uint64_t *words, uint16_t *out)
  {
-     uint32_t bucket = hash_position(pos);
-     PosHashEntry *entry = global_index->pos_idx[ch].buckets[bucket];
+     int n = 0, i;
      
-     while (entry)
+     for (i = 0; i < CONTAINER_WORDS; i++)
      {
-         if (entry->pos == pos)
+         uint64_t w = words[i];
+         
+         while (w)
          {
-             entry->bitmap = bm;
-             return;
+             out[n++] = (uint16_t)((i << 6) + __builtin_ctzll(w));
+             w &= w - 1;
          }
-         entry = entry->next;
      }
-     
-     entry = (PosHashEntry *)MemoryContextAlloc(index_context, sizeof(PosHashEntry));
-     entry->pos = pos;
-     entry->bitmap = bm;
-     entry->next = global_index->pos_idx[ch].buckets[bucket];
-     global_index->pos_idx[ch].buckets[bucket] = entry;
  }
  
- static void set_neg_bitmap(unsigned char ch, int neg_offset, RoaringBitmap *bm)
+ static void words_to_runs(const uint64_t *words, uint16_t *out)
  {
-     uint32_t bucket = hash_position(neg_offset);
-     PosHashEntry *entry = global_index->neg_idx[ch].buckets[bucket];
+     int start = words_next(words, 0, true);
+     int n = 0;
      
-     while (entry)
+     while (start >= 0)
      {
-         if (entry->pos == neg_offset)
-         {
-             entry->bitmap = bm;
-             return;
-         }
-         entry = entry->next;
+         int end = words_next(words, start, false);
+         
+         if (end < 0)
+             end = CONTAINER_WORDS * 64;
+         out[2 * n] = (uint16_t)start;
+         out[2 * n + 1] = (uint16_t)(end - 1 - start);
+         n++;
+         start = words_next(words, end, true);
      }
-     
-     entry = (PosHashEntry *)MemoryContextAlloc(index_context, sizeof(PosHashEntry));
-     entry->pos = neg_offset;
-     entry->bitmap = bm;
-     entry->next = global_index->neg_idx[ch].buckets[bucket];
-     global_index->neg_idx[ch].buckets[bucket] = entry;
  }
  
- /* ==================== QUERY CACHE ==================== */
+ /* ---- containers ---- */
  
- static void init_query_cache(void)
+ static FORCE_INLINE Size container_payload_size(uint8_t type, int n)
  {
-     for (int i = 0; i < QUERY_CACHE_SIZE; i++)
-         global_index->query_cache.entries[i] = NULL;
-     global_index->query_cache.access_counter = 0;
-     bloom_init(&global_index->query_cache.bloom);
+     switch (type)
+     {
+         case CONTAINER_ARRAY:
+             return n * sizeof(uint16_t);
+         case CONTAINER_BITSET:
+             return CONTAINER_WORDS * sizeof(uint64_t);
+         default:
+             return n * 2 * sizeof(uint16_t);
+     }
  }
  
- static CacheEntry* cache_lookup(const char *pattern)
+ /* Cheapest form for a container of card values in nruns runs; *n is its length */
+ static uint8_t container_pick_type(int card, int nruns, int *n)
  {
-     uint32_t hash = hash_string(pattern);
-     
-     if (!bloom_check(&global_index->query_cache.bloom, hash))
-         return NULL;
-     
-     CacheEntry *entry = global_index->query_cache.entries[hash];
+     Size run_size = container_payload_size(CONTAINER_RUN, nruns);
+     Size other_size = card <= ARRAY_MAX_CARD ?
+         container_payload_size(CONTAINER_ARRAY, card) :
+         container_payload_size(CONTAINER_BITSET, 0);
      
-     while (entry)
+     if (run_size < other_size)
      {
-         if (strcmp(entry->pattern, pattern) == 0)
-         {
-             entry->last_used = ++global_index->query_cache.access_counter;
-             return entry;
-         }
-         entry = entry->next;
+         *n = nruns;
+         return CONTAINER_RUN;
      }
-     return NULL;
+     *n = card;
+     return card <= ARRAY_MAX_CARD ? CONTAINER_ARRAY : CONTAINER_BITSET;
  }
  
- static void cache_insert(const char *pattern, uint32_t *results, uint64_t count)
+ static void container_to_words(const BitmapContainer *c, uint64_t *words)
  {
-     if (count > 50000) return;
-     
-     uint32_t hash = hash_string(pattern);
-     CacheEntry *entry = (CacheEntry *)MemoryContextAlloc(index_context, sizeof(CacheEntry));
-     
-     entry->pattern = MemoryContextStrdup(index_context, pattern);
-     entry->results = (uint32_t *)MemoryContextAlloc(index_context, count * sizeof(uint32_t));
-     memcpy(entry->results, results, count * sizeof(uint32_t));
-     entry->count = count;
-     entry->last_used = ++global_index->query_cache.access_counter;
+     const uint16_t *values = (const uint16_t *)c->data;
+     int i;
      
-     entry->next = global_index->query_cache.entries[hash];
-     global_index->query_cache.entries[hash] = entry;
+     if (c->type == CONTAINER_BITSET)
+     {
+         memcpy(words, c->data, CONTAINER_WORDS * sizeof(uint64_t));
+         return;
+     }
+     memset(words, 0, CONTAINER_WORDS * sizeof(uint64_t));
+     if (c->type == CONTAINER_ARRAY)
+     {
+         for (i = 0; i < c->n; i++)
+             words[values[i] >> 6] |= 1ULL << (values[i] & 63);
+     }
+     else
+     {
+         for (i = 0; i < c->n; i++)
+             words_set_range(words, values[2 * i], values[2 * i] + values[2 * i + 1]);
+     }
+ }
+ 
+ static int container_nruns(const BitmapContainer *c)
+ {
+     const uint16_t *values = (const uint16_t *)c->data;
+     int runs, i;
      
-     bloom_add(&global_index->query_cache.bloom, hash);
+     switch (c->type)
+     {
+         case CONTAINER_ARRAY:
+             runs = c->n > 0;
+             for (i = 1; i < c->n; i++)
+                 runs += values[i] != values[i - 1] + 1;
+             return runs;
+         case CONTAINER_BITSET:
+             return words_nruns((const uint64_t *)c->data);
+         default:
+             return c->n;
+     }
  }
  
- /* ==================== PATTERN ANALYSIS ==================== */
+ /* Write the values of words into out in the given form */
+ static void words_to_payload(const uint64_t *words, uint8_t type, void *out)
+ {
+     if (type == CONTAINER_ARRAY)
+         words_to_array(words, (uint16_t *)out);
+     else if (type == CONTAINER_RUN)
+         words_to_runs(words, (uint16_t *)out);
+     else
+         memcpy(out, words, CONTAINER_WORDS * sizeof(uint64_t));
+ }
  
- typedef struct {
-     char **slices;
-     int slice_count;
-     bool starts_with_percent;
-     bool ends_with_percent;
- } PatternInfo;
+ /* (Re)fill c from a bitset holding card > 0 values, in the cheapest form */
+ static void container_from_words(BitmapContainer *c, const uint64_t *words, int card)
+ {
+     c->type = container_pick_type(card, words_nruns(words), &c->n);
+     c->card = card;
+     c->capacity = c->n;
+     c->data = palloc(container_payload_size(c->type, c->n));
+     words_to_payload(words, c->type, c->data);
+ }
  
- static FORCE_INLINE int count_non_wildcard(const char *s)
+ static void container_copy(BitmapContainer *dst, const BitmapContainer *src)
  {
-     int count = 0;
-     while (*s)
+     Size size = container_payload_size(src->type, src->n);
+     
+     *dst = *src;
+     dst->capacity = src->n;
+     dst->data = palloc(size);
+     memcpy(dst->data, src->data, size);
+ }
+ 
+ static FORCE_INLINE int array_lower_bound(const uint16_t *values, int n, uint16_t low)
+ {
+     int lo = 0, hi = n;
+     
+     while (lo < hi)
      {
-         if (*s != '_')
-             count++;
-         s++;
+         int mid = (lo + hi) >> 1;
+         
+         if (values[mid] < low)
+             lo = mid + 1;
+         else
+             hi = mid;
      }
-     return count;
+     return lo;
  }
  
- static PatternInfo* analyze_pattern(const char *pattern)
+ static FORCE_INLINE bool container_contains(const BitmapContainer *c, uint16_t low)
  {
-     PatternInfo *info = (PatternInfo *)palloc(sizeof(PatternInfo));
-     int plen = strlen(pattern);
-     int slice_cap = 16;
-     int slice_count = 0;
-     const char *start = pattern;
-     const char *p;
-     int len;
-     
-     info->starts_with_percent = (plen > 0 && pattern[0] == '%');
-     info->ends_with_percent = (plen > 0 && pattern[plen - 1] == '%');
-     info->slices = (char **)palloc(slice_cap * sizeof(char *));
+     const uint16_t *values = (const uint16_t *)c->data;
+     int lo, hi;
      
-     for (p = pattern; *p; p++)
+     switch (c->type)
      {
-         if (*p == '%')
-         {
-             len = p - start;
-             if (len > 0)
+         case CONTAINER_ARRAY:
+             lo = array_lower_bound(values, c->n, low);
+             return lo < c->n && values[lo] == low;
+         case CONTAINER_BITSET:
+             return (((const uint64_t *)c->data)[low >> 6] >> (low & 63)) & 1;
+         default:
+             /* Last run starting at or before low */
+             lo = 0;
+             hi = c->n - 1;
+             while (lo < hi)
              {
-                 if (slice_count >= slice_cap)
-                 {
-                     slice_cap *= 2;
-                     info->slices = (char **)repalloc(info->slices, slice_cap * sizeof(char *));
-                 }
-                 info->slices[slice_count++] = pnstrdup(start, len);
+                 int mid = (lo + hi + 1) >> 1;
+                 
+                 if (values[2 * mid] <= low)
+                     lo = mid;
+                 else
+                     hi = mid - 1;
              }
-             start = p + 1;
-         }
+             return c->n > 0 && values[2 * lo] <= low &&
+                    low <= values[2 * lo] + values[2 * lo + 1];
      }
+ }
+ 
+ static void container_add(BitmapContainer *c, uint16_t low)
+ {
+     uint16_t *values = (uint16_t *)c->data;
+     uint64_t *words;
+     int pos = c->n;
      
-     len = p - start;
-     if (len > 0)
+     if (c->type == CONTAINER_ARRAY)
      {
-         if (slice_count >= slice_cap)
+         if (c->n > 0 && values[c->n - 1] >= low)
          {
-             slice_cap *= 2;
-             info->slices = (char **)repalloc(info->slices, slice_cap * sizeof(char *));
+             pos = array_lower_bound(values, c->n, low);
+             if (values[pos] == low)
+                 return;
          }
-         info->slices[slice_count++] = pnstrdup(start, len);
+         if (c->n < ARRAY_MAX_CARD)
+         {
+             if (c->n == c->capacity)
+             {
+                 c->capacity = c->capacity ? Min(c->capacity * 2, ARRAY_MAX_CARD) : 4;
+                 c->data = values = c->data ?
+                     (uint16_t *)repalloc(values, c->capacity * sizeof(uint16_t)) :
+                     (uint16_t *)palloc(c->capacity * sizeof(uint16_t));
+             }
+             memmove(values + pos + 1, values + pos, (c->n - pos) * sizeof(uint16_t));
+             values[pos] = low;
+             c->n++;
+             c->card++;
+             return;
+         }
+     }
+     else if (c->type == CONTAINER_BITSET)
+     {
+         words = (uint64_t *)c->data;
+         c->card += !((words[low >> 6] >> (low & 63)) & 1);
+         words[low >> 6] |= 1ULL << (low & 63);
+         return;
      }
+     else if (container_contains(c, low))
+         return;
      
-     info->slice_count = slice_count;
-     return info;
+     /* A full array or a run container becomes a bitset */
+     words = (uint64_t *)palloc(CONTAINER_WORDS * sizeof(uint64_t));
+     container_to_words(c, words);
+     if (c->data)
+         pfree(c->data);
+     c->type = CONTAINER_BITSET;
+     c->data = words;
+     c->n = 0;
+     c->capacity = 0;
+     words[low >> 6] |= 1ULL << (low & 63);
+     c->card++;
  }
  
- static void free_pattern_info(PatternInfo *info)
+ /* Number of values written to out, each with high half key */
+ static int container_to_uint32(const BitmapContainer *c, uint32_t *out)
  {
-     for (int i = 0; i < info->slice_count; i++)
-         pfree(info->slices[i]);
-     pfree(info->slices);
-     pfree(info);
+     const uint16_t *values = (const uint16_t *)c->data;
+     uint32_t base = (uint32_t)c->key << 16;
+     int n = 0, i;
+     uint32_t v;
+     
+     switch (c->type)
+     {
+         case CONTAINER_ARRAY:
+             for (i = 0; i < c->n; i++)
+                 out[n++] = base | values[i];
+             break;
+         case CONTAINER_BITSET:
+             for (i = 0; i < CONTAINER_WORDS; i++)
+             {
+                 uint64_t w = ((const uint64_t *)c->data)[i];
+                 
+                 while (w)
+                 {
+                     out[n++] = base + (i << 6) + __builtin_ctzll(w);
+                     w &= w - 1;
+                 }
+             }
+             break;
+         default:
+             for (i = 0; i < c->n; i++)
+                 for (v = values[2 * i]; v <= (uint32_t)values[2 * i] + values[2 * i + 1]; v++)
+                     out[n++] = base | v;
+             break;
+     }
+     return n;
  }
  
- /* ==================== OPTIMIZED MATCHING FUNCTIONS ==================== */
+ /* ---- bitmaps ---- */
  
- static RoaringBitmap* match_at_pos(const char *pattern, int start_pos)
+ static FORCE_INLINE RoaringBitmap* roaring_create(void)
  {
-     RoaringBitmap *result = NULL;
-     RoaringBitmap *char_bm, *temp;
-     int pos = start_pos;
-     int plen = strlen(pattern);
-     int i;
+     RoaringBitmap *rb = (RoaringBitmap *)palloc(sizeof(RoaringBitmap));
+     
+     rb->containers = NULL;
+     rb->num_containers = 0;
+     rb->capacity = 0;
+     rb->is_palloc = true;
+     return rb;
+ }
+ 
+ /* Index of the container for key, or -(insertion point) - 1 */
+ static FORCE_INLINE int container_find(const RoaringBitmap *rb, uint16_t key)
+ {
+     int lo = 0, hi = rb->num_containers - 1;
      
-     for (i = 0; i < plen; i++)
+     if (likely(hi >= 0) && rb->containers[hi].key <= key)
+         return rb->containers[hi].key == key ? hi : -(hi + 2);
+     while (lo <= hi)
      {
-         if (pattern[i] == '_')
-         {
-             pos++;
-             continue;
-         }
+         int mid = (lo + hi) >> 1;
          
-         if (i + 1 < plen && pattern[i + 1] != '_')
-             PREFETCH(get_pos_bitmap((unsigned char)pattern[i + 1], pos + 1));
-         
-         char_bm = get_pos_bitmap((unsigned char)pattern[i], pos);
-         if (unlikely(!char_bm))
-         {
-             if (result) roaring_free(result);
-             return roaring_create();
-         }
-         
-         if (!result)
-         {
-             result = roaring_copy(char_bm);
-         }
+         if (rb->containers[mid].key < key)
+             lo = mid + 1;
+         else if (rb->containers[mid].key > key)
+             hi = mid - 1;
          else
-         {
-             temp = roaring_and(result, char_bm);
-             roaring_free(result);
-             result = temp;
-             
-             if (unlikely(roaring_is_empty(result)))
-                 return result;
-         }
-         pos++;
+             return mid;
+     }
+     return -(lo + 1);
+ }
+ 
+ /* New empty array container for key at position at */
+ static BitmapContainer* container_insert(RoaringBitmap *rb, int at, uint16_t key)
+ {
+     BitmapContainer *c;
+     
+     if (rb->num_containers == rb->capacity)
+     {
+         rb->capacity = rb->capacity ? rb->capacity * 2 : 4;
+         rb->containers = rb->containers ?
+             (BitmapContainer *)repalloc(rb->containers, rb->capacity * sizeof(BitmapContainer)) :
+             (BitmapContainer *)palloc(rb->capacity * sizeof(BitmapContainer));
      }
+     memmove(rb->containers + at + 1, rb->containers + at,
+             (rb->num_containers - at) * sizeof(BitmapContainer));
+     rb->num_containers++;
      
-     return result ? result : roaring_create();
+     c = &rb->containers[at];
+     c->key = key;
+     c->type = CONTAINER_ARRAY;
+     c->card = 0;
+     c->n = 0;
+     c->capacity = 0;
+     c->data = NULL;
+     return c;
  }
  
- static RoaringBitmap* match_at_neg_pos(const char *pattern, int end_offset)
+ static FORCE_INLINE BitmapContainer* container_append(RoaringBitmap *rb, uint16_t key)
  {
-     RoaringBitmap *result = NULL;
-     RoaringBitmap *char_bm, *temp;
-     int plen = strlen(pattern);
-     int i, pos;
+     return container_insert(rb, rb->num_containers, key);
+ }
+ 
+ static FORCE_INLINE void roaring_add(RoaringBitmap *rb, uint32_t value)
+ {
+     int i = container_find(rb, (uint16_t)(value >> 16));
+     BitmapContainer *c = i >= 0 ? &rb->containers[i] :
+         container_insert(rb, -i - 1, (uint16_t)(value >> 16));
+     
+     container_add(c, (uint16_t)value);
+ }
+ 
+ /* Add every value in [lo, hi) */
+ static void roaring_add_range(RoaringBitmap *rb, uint32_t lo, uint32_t hi)
+ {
+     uint64_t words[CONTAINER_WORDS];
+     uint64_t v = lo;
      
-     for (i = plen - 1; i >= 0; i--)
+     while (v < hi)
      {
-         if (pattern[i] == '_')
-             continue;
+         uint16_t key = (uint16_t)(v >> 16);
+         uint64_t end = Min((uint64_t)hi, ((uint64_t)key + 1) << 16);
+         int i = container_find(rb, key);
+         BitmapContainer *c = i >= 0 ? &rb->containers[i] : container_insert(rb, -i - 1, key);
          
-         pos = -(plen - i);
+         container_to_words(c, words);
+         words_set_range(words, (uint32_t)(v & 0xFFFF), (uint32_t)((end - 1) & 0xFFFF));
+         if (c->data)
+             pfree(c->data);
+         container_from_words(c, words, words_card(words));
+         v = end;
+     }
+ }
+ 
+ /* Intersection of two containers with the same key, appended to result if non-empty */
+ static void container_and(const BitmapContainer *x, const BitmapContainer *y, RoaringBitmap *result)
+ {
+     uint64_t wx[CONTAINER_WORDS], wy[CONTAINER_WORDS];
+     BitmapContainer *c;
+     int card, i;
+     
+     if (x->type != CONTAINER_ARRAY && y->type == CONTAINER_ARRAY)
+     {
+         const BitmapContainer *t = x;
          
-         if (i > 0 && pattern[i - 1] != '_')
-             PREFETCH(get_neg_bitmap((unsigned char)pattern[i - 1], -(plen - i + 1)));
+         x = y;
+         y = t;
+     }
+     
+     if (x->type == CONTAINER_ARRAY)
+     {
+         const uint16_t *xv = (const uint16_t *)x->data;
+         uint16_t *out = (uint16_t *)palloc(Min(x->n, y->card) * sizeof(uint16_t));
+         int n = 0;
          
-         char_bm = get_neg_bitmap((unsigned char)pattern[i], pos);
-         if (unlikely(!char_bm))
+         if (y->type == CONTAINER_ARRAY)
          {
-             if (result) roaring_free(result);
-             return roaring_create();
+             const uint16_t *yv = (const uint16_t *)y->data;
+             int j = 0;
+             
+             for (i = 0; i < x->n && j < y->n;)
+             {
+                 if (xv[i] < yv[j])
+                     i++;
+                 else if (xv[i] > yv[j])
+                     j++;
+                 else
+                 {
+                     out[n++] = xv[i];
+                     i++;
+                     j++;
+                 }
+             }
          }
-         
-         if (!result)
+         else
          {
-             result = roaring_copy(char_bm);
+             for (i = 0; i < x->n; i++)
+                 if (container_contains(y, xv[i]))
+                     out[n++] = xv[i];
          }
-         else
+         
+         if (n == 0)
          {
-             temp = roaring_and(result, char_bm);
-             roaring_free(result);
-             result = temp;
-             
-             if (unlikely(roaring_is_empty(result)))
-                 return result;
+             pfree(out);
+             return;
          }
+         c = container_append(result, x->key);
+         c->card = c->n = c->capacity = n;
+         c->data = out;
+         return;
+     }
+     
+     if (x->type == CONTAINER_BITSET && y->type == CONTAINER_BITSET)
+         card = bitset_kernels.op_and(wx, (const uint64_t *)x->data, (const uint64_t *)y->data);
+     else
+     {
+         container_to_words(x, wx);
+         container_to_words(y, wy);
+         card = bitset_kernels.op_and(wx, wx, wy);
      }
+     if (card > 0)
+         container_from_words(container_append(result, x->key), wx, card);
+ }
+ 
+ static RoaringBitmap* roaring_and(const RoaringBitmap *a, const RoaringBitmap *b)
+ {
+     RoaringBitmap *result = roaring_create();
+     int i = 0, j = 0;
      
-     return result ? result : roaring_create();
+     while (i < a->num_containers && j < b->num_containers)
+     {
+         uint16_t ka = a->containers[i].key;
+         uint16_t kb = b->containers[j].key;
+         
+         if (ka < kb)
+             i++;
+         else if (ka > kb)
+             j++;
+         else
+             container_and(&a->containers[i++], &b->containers[j++], result);
+     }
+     return result;
  }
  
- static RoaringBitmap* get_char_candidates(const char *pattern)
+ /*
+  * Size of the intersection of two containers with the same key, or with
+  * any_only whether it is non-empty (then 0 or 1); nothing is written
+  */
+ static int container_and_count(const BitmapContainer *x, const BitmapContainer *y, bool any_only)
  {
-     RoaringBitmap *result = NULL;
-     RoaringBitmap *temp;
-     bool seen[CHAR_RANGE] = {false};
-     int i;
+     uint64_t wx[CONTAINER_WORDS], wy[CONTAINER_WORDS];
+     const uint64_t *px, *py;
+     int count = 0, i;
      
-     for (i = 0; pattern[i]; i++)
+     if (x->type != CONTAINER_ARRAY && y->type == CONTAINER_ARRAY)
      {
-         unsigned char ch = (unsigned char)pattern[i];
-         if (pattern[i] != '_' && pattern[i] != '%' && !seen[ch])
+         const BitmapContainer *t = x;
+         
+         x = y;
+         y = t;
+     }
+     
+     if (x->type == CONTAINER_ARRAY)
+     {
+         const uint16_t *xv = (const uint16_t *)x->data;
+         
+         if (y->type == CONTAINER_ARRAY)
          {
-             seen[ch] = true;
-             
-             if (pattern[i + 1])
-                 PREFETCH(global_index->char_cache[(unsigned char)pattern[i + 1]]);
+             const uint16_t *yv = (const uint16_t *)y->data;
+             int j = 0;
              
-             if (likely(global_index->char_cache[ch]))
+             for (i = 0; i < x->n && j < y->n;)
              {
-                 if (!result)
-                 {
-                     result = roaring_copy(global_index->char_cache[ch]);
-                 }
+                 if (xv[i] < yv[j])
+                     i++;
+                 else if (xv[i] > yv[j])
+                     j++;
                  else
                  {
-                     temp = roaring_and(result, global_index->char_cache[ch]);
-                     roaring_free(result);
-                     result = temp;
-                     
-                     if (unlikely(roaring_is_empty(result)))
-                         return result;
+                     if (any_only)
+                         return 1;
+                     count++;
+                     i++;
+                     j++;
                  }
              }
-             else
+             return count;
+         }
+         for (i = 0; i < x->n; i++)
+             if (container_contains(y, xv[i]))
              {
-                 if (result) roaring_free(result);
-                 return roaring_create();
+                 if (any_only)
+                     return 1;
+                 count++;
              }
-         }
+         return count;
      }
      
-     return result;
+     px = (const uint64_t *)x->data;
+     py = (const uint64_t *)y->data;
+     if (x->type != CONTAINER_BITSET)
+     {
+         container_to_words(x, wx);
+         px = wx;
+     }
+     if (y->type != CONTAINER_BITSET)
+     {
+         container_to_words(y, wy);
+         py = wy;
+     }
+     return any_only ? bitset_kernels.and_any(px, py) : bitset_kernels.and_count(px, py);
  }
  
- /* Optimized contiguous pattern matching */
- static FORCE_INLINE bool matches_at_position(const char *str, const char *pattern)
+ static uint64_t roaring_and_walk(const RoaringBitmap *a, const RoaringBitmap *b, bool any_only)
  {
-     const char *s = str;
-     const char *p = pattern;
+     uint64_t count = 0;
+     int i = 0, j = 0;
      
-     while (*p)
+     while (i < a->num_containers && j < b->num_containers)
      {
-         if (*p == '_')
-         {
-             if (unlikely(!*s)) return false;
-             s++;
-             p++;
-         }
-         else if (likely(*s == *p))
-         {
-             s++;
-             p++;
-         }
+         uint16_t ka = a->containers[i].key;
+         uint16_t kb = b->containers[j].key;
+         
+         if (ka < kb)
+             i++;
+         else if (ka > kb)
+             j++;
          else
          {
-             return false;
+             count += container_and_count(&a->containers[i++], &b->containers[j++], any_only);
+             if (any_only && count)
+                 break;
          }
      }
-     
-     return true;
+     return count;
  }
  
- static FORCE_INLINE const char* find_pattern(const char *str, const char *pattern)
+ /* |a AND b| without building the intersection */
+ static FORCE_INLINE uint64_t roaring_and_count(const RoaringBitmap *a, const RoaringBitmap *b)
  {
-     const char *s = str;
-     
-     while (*s)
-     {
-         PREFETCH(s + 64);
-         if (matches_at_position(s, pattern))
-             return s;
-         s++;
-     }
-     
-     return NULL;
+     return roaring_and_walk(a, b, false);
  }
  
- static FORCE_INLINE bool contains_substring(const char *str, const char *pattern)
+ /* Whether a AND b is non-empty, stopping at the first common value */
+ static FORCE_INLINE bool roaring_intersects(const RoaringBitmap *a, const RoaringBitmap *b)
  {
-     return find_pattern(str, pattern) != NULL;
+     return roaring_and_walk(a, b, true) != 0;
  }
  
- static RoaringBitmap* verify_multislice_pattern(RoaringBitmap *candidates, PatternInfo *info)
+ /* Union of two containers with the same key, appended to result */
+ static void container_or(const BitmapContainer *x, const BitmapContainer *y, RoaringBitmap *result)
  {
-     uint64_t count, i, j;
-     uint32_t *indices;
-     uint32_t idx;
-     const char *str;
-     const char *search_start;
-     const char *match_pos;
-     const char *slice_ptr;
-     bool all_found;
-     RoaringBitmap *verified = roaring_create();
+     uint64_t wx[CONTAINER_WORDS], wy[CONTAINER_WORDS];
+     BitmapContainer *c;
+     int card, i;
      
-     indices = roaring_to_array(candidates, &count);
-     
-     if (!indices)
-         return verified;
-     
-     for (i = 0; i < count; i++)
+     if (x->type == CONTAINER_ARRAY && y->type == CONTAINER_ARRAY &&
+         x->n + y->n <= ARRAY_MAX_CARD)
      {
-         idx = indices[i];
-         
-         if (i + 1 < count)
-             PREFETCH(global_index->data[indices[i + 1]]);
+         const uint16_t *xv = (const uint16_t *)x->data;
+         const uint16_t *yv = (const uint16_t *)y->data;
+         uint16_t *out = (uint16_t *)palloc((x->n + y->n) * sizeof(uint16_t));
+         int j = 0, n = 0;
          
-         str = global_index->data[idx];
-         search_start = str;
-         all_found = true;
-         
-         for (j = 0; j < info->slice_count; j++)
+         for (i = 0; i < x->n || j < y->n;)
          {
-             const char *slice = info->slices[j];
-             
-             match_pos = find_pattern(search_start, slice);
-             
-             if (unlikely(!match_pos))
-             {
-                 all_found = false;
-                 break;
-             }
-             
-             search_start = match_pos;
-             slice_ptr = slice;
-             while (*search_start && *slice_ptr)
+             if (j >= y->n || (i < x->n && xv[i] < yv[j]))
+                 out[n++] = xv[i++];
+             else if (i >= x->n || xv[i] > yv[j])
+                 out[n++] = yv[j++];
+             else
              {
-                 if (*slice_ptr == '_' || *search_start == *slice_ptr)
-                 {
-                     search_start++;
-                     slice_ptr++;
-                 }
-                 else
-                 {
-                     break;
-                 }
+                 out[n++] = xv[i++];
+                 j++;
              }
          }
-         
-         if (likely(all_found))
-             roaring_add(verified, idx);
+         c = container_append(result, x->key);
+         c->card = c->n = n;
+         c->capacity = x->n + y->n;
+         c->data = out;
+         return;
      }
      
-     pfree(indices);
-     return verified;
+     if (x->type == CONTAINER_BITSET && y->type == CONTAINER_BITSET)
+         card = bitset_kernels.op_or(wx, (const uint64_t *)x->data, (const uint64_t *)y->data);
+     else
+     {
+         container_to_words(x, wx);
+         container_to_words(y, wy);
+         card = bitset_kernels.op_or(wx, wx, wy);
+     }
+     container_from_words(container_append(result, x->key), wx, card);
  }
  
- static RoaringBitmap* get_length_range(int min_len, int max_len)
+ static RoaringBitmap* roaring_or(const RoaringBitmap *a, const RoaringBitmap *b)
  {
      RoaringBitmap *result = roaring_create();
-     RoaringBitmap *temp_union;
-     int len;
+     int i = 0, j = 0;
      
-     if (max_len < 0 || max_len > global_index->length_idx.max_length)
-         max_len = global_index->length_idx.max_length - 1;
-     
-     for (len = min_len; len <= max_len; len++)
+     while (i < a->num_containers || j < b->num_containers)
      {
-         if (global_index->length_idx.length_bitmaps[len])
+         if (j >= b->num_containers ||
+             (i < a->num_containers && a->containers[i].key < b->containers[j].key))
          {
-             temp_union = roaring_or(result, global_index->length_idx.length_bitmaps[len]);
-             roaring_free(result);
-             result = temp_union;
+             container_copy(container_append(result, a->containers[i].key), &a->containers[i]);
+             i++;
          }
+         else if (i >= a->num_containers || a->containers[i].key > b->containers[j].key)
+         {
+             container_copy(container_append(result, b->containers[j].key), &b->containers[j]);
+             j++;
+         }
+         else
+             container_or(&a->containers[i++], &b->containers[j++], result);
      }
-     
      return result;
  }
  
- /* ==================== MAIN QUERY FUNCTION ==================== */
- 
- static uint32_t* optimized_query(const char *pattern, uint64_t *result_count)
+ static uint64_t roaring_count(const RoaringBitmap *rb)
  {
-     PatternInfo *info;
-     RoaringBitmap *result = NULL;
-     RoaringBitmap *temp, *candidates, *temp2, *temp3;
-     uint32_t *indices;
-     uint32_t *cand_indices;
-     uint64_t i, cand_count;
-     int min_len;
+     uint64_t count = 0;
+     int i;
      
-     /* Check cache first */
-     CacheEntry *cached = cache_lookup(pattern);
-     if (cached)
-     {
-         indices = (uint32_t *)palloc(cached->count * sizeof(uint32_t));
-         memcpy(indices, cached->results, cached->count * sizeof(uint32_t));
-         *result_count = cached->count;
+     for (i = 0; i < rb->num_containers; i++)
+         count += rb->containers[i].card;
+     return count;
+ }
+ 
+ static FORCE_INLINE bool roaring_is_empty(const RoaringBitmap *rb)
+ {
+     return rb->num_containers == 0;
+ }
+ 
+ static FORCE_INLINE bool roaring_contains(const RoaringBitmap *rb, uint32_t value)
+ {
+     int i = container_find(rb, (uint16_t)(value >> 16));
+     
+     return i >= 0 && container_contains(&rb->containers[i], (uint16_t)value);
+ }
+ 
+ static uint32_t* roaring_to_array(const RoaringBitmap *rb, uint64_t *count)
+ {
+     uint32_t *array;
+     uint64_t n = 0;
+     int i;
+     
+     *count = roaring_count(rb);
+     if (unlikely(*count == 0))
+         return NULL;
+     
+     array = (uint32_t *)palloc(*count * sizeof(uint32_t));
+     for (i = 0; i < rb->num_containers; i++)
+         n += container_to_uint32(&rb->containers[i], array + n);
+     return array;
+ }
+ 
+ /* Walks a bitmap a batch of values at a time, one container expanded at once */
+ typedef struct {
+     const RoaringBitmap *rb;
+     int next_container;
+     uint32_t *values;           /* the current container's values, lazily allocated */
+     int num_values;
+     int pos;
+ } RoaringIterator;
+ 
+ static FORCE_INLINE void roaring_iterator_start(const RoaringBitmap *rb, RoaringIterator *it)
+ {
+     it->rb = rb;
+     it->next_container = 0;
+     it->values = NULL;
+     it->num_values = 0;
+     it->pos = 0;
+ }
+ 
+ /* Up to max next values into out; 0 once the bitmap is exhausted */
+ static uint32_t roaring_iterator_read(RoaringIterator *it, uint32_t *out, uint32_t max)
+ {
+     uint32_t n = 0;
+     
+     while (n < max)
+     {
+         uint32_t take;
+         
+         if (it->pos == it->num_values)
+         {
+             if (it->next_container == it->rb->num_containers)
+                 break;
+             if (!it->values)
+                 it->values = (uint32_t *)palloc(CONTAINER_WORDS * 64 * sizeof(uint32_t));
+             it->num_values = container_to_uint32(&it->rb->containers[it->next_container++],
+                                                  it->values);
+             it->pos = 0;
+         }
+         take = Min(max - n, (uint32_t)(it->num_values - it->pos));
+         memcpy(out + n, it->values + it->pos, take * sizeof(uint32_t));
+         it->pos += take;
+         n += take;
+     }
+     return n;
+ }
+ 
+ static FORCE_INLINE void roaring_iterator_end(RoaringIterator *it)
+ {
+     if (it->values)
+         pfree(it->values);
+ }
+ 
+ static size_t roaring_size_bytes(const RoaringBitmap *rb)
+ {
+     size_t size = sizeof(RoaringBitmap) + rb->capacity * sizeof(BitmapContainer);
+     int i;
+     
+     for (i = 0; i < rb->num_containers; i++)
+         size += container_payload_size(rb->containers[i].type, rb->containers[i].capacity);
+     return size;
+ }
+ 
+ static void roaring_free(RoaringBitmap *rb)
+ {
+     int i;
+     
+     if (!rb)
+         return;
+     if (rb->is_palloc)
+         for (i = 0; i < rb->num_containers; i++)
+             if (rb->containers[i].data)
+                 pfree(rb->containers[i].data);
+     if (rb->containers)
+         pfree(rb->containers);
+     pfree(rb);
+ }
+ 
+ static RoaringBitmap* roaring_copy(const RoaringBitmap *rb)
+ {
+     RoaringBitmap *copy = roaring_create();
+     int i;
+     
+     for (i = 0; i < rb->num_containers; i++)
+         container_copy(container_append(copy, rb->containers[i].key), &rb->containers[i]);
+     return copy;
+ }
+ 
+ /*
+  * Intersection of the containers with one key, one from each of n bitmaps,
+  * appended to result if non-empty.  The smallest container drives: an array
+  * is filtered in place by membership in the others, anything else is
+  * expanded into words and ANDed with each of the others in turn.  Either
+  * way the work happens in the caller's scratch and stops once it is empty.
+  */
+ static void container_and_many(const BitmapContainer **cs, int n, RoaringBitmap *result,
+                                uint64_t *words, uint64_t *tmp)
+ {
+     const BitmapContainer *driver = cs[0];
+     BitmapContainer *c;
+     int card, i, j;
+     
+     for (i = 1; i < n; i++)
+         if (cs[i]->card < driver->card)
+             driver = cs[i];
+     
+     if (driver->type == CONTAINER_ARRAY)
+     {
+         uint16_t *values = (uint16_t *)words;
+         
+         card = driver->n;
+         memcpy(values, driver->data, card * sizeof(uint16_t));
+         for (i = 0; i < n && card > 0; i++)
+         {
+             int kept = 0;
+             
+             if (cs[i] == driver)
+                 continue;
+             for (j = 0; j < card; j++)
+                 if (container_contains(cs[i], values[j]))
+                     values[kept++] = values[j];
+             card = kept;
+         }
+         if (card == 0)
+             return;
+         c = container_append(result, driver->key);
+         c->card = c->n = c->capacity = card;
+         c->data = palloc(card * sizeof(uint16_t));
+         memcpy(c->data, values, card * sizeof(uint16_t));
+         return;
+     }
+     
+     container_to_words(driver, words);
+     card = driver->card;
+     for (i = 0; i < n && card > 0; i++)
+     {
+         if (cs[i] == driver)
+             continue;
+         if (cs[i]->type == CONTAINER_BITSET)
+             card = bitset_kernels.op_and(words, words, (const uint64_t *)cs[i]->data);
+         else
+         {
+             container_to_words(cs[i], tmp);
+             card = bitset_kernels.op_and(words, words, tmp);
+         }
+     }
+     if (card > 0)
+         container_from_words(container_append(result, driver->key), words, card);
+ }
+ 
+ /*
+  * Intersection of n >= 2 bitmaps ordered by ascending cardinality, in one
+  * pass over the keys of the smallest; each other bitmap keeps a cursor that
+  * only moves forward.
+  */
+ static RoaringBitmap* roaring_and_sorted(const RoaringBitmap **bms, int n)
+ {
+     RoaringBitmap *result = roaring_create();
+     uint64_t words[CONTAINER_WORDS], tmp[CONTAINER_WORDS];
+     const BitmapContainer *cs[MAX_AND_INPUTS];
+     int cursor[MAX_AND_INPUTS] = {0};
+     int i, j;
+     
+     for (i = 0; i < bms[0]->num_containers; i++)
+     {
+         uint16_t key = bms[0]->containers[i].key;
+         
+         cs[0] = &bms[0]->containers[i];
+         for (j = 1; j < n; j++)
+         {
+             const RoaringBitmap *rb = bms[j];
+             
+             while (cursor[j] < rb->num_containers && rb->containers[cursor[j]].key < key)
+                 cursor[j]++;
+             if (cursor[j] == rb->num_containers)
+                 return result;
+             if (rb->containers[cursor[j]].key != key)
+                 break;
+             cs[j] = &rb->containers[cursor[j]];
+         }
+         if (j == n)
+             container_and_many(cs, n, result, words, tmp);
+     }
+     return result;
+ }
+ 
+ /* Form and length a container takes in a frozen image */
+ static FORCE_INLINE uint8_t container_frozen_type(const BitmapContainer *c, int *n)
+ {
+     return container_pick_type(c->card, container_nruns(c), n);
+ }
+ 
+ static size_t roaring_frozen_size(const RoaringBitmap *rb)
+ {
+     size_t size = sizeof(FrozenHeader) + rb->num_containers * sizeof(FrozenContainer);
+     int i;
+     
+     for (i = 0; i < rb->num_containers; i++)
+     {
+         int n;
+         uint8_t type = container_frozen_type(&rb->containers[i], &n);
+         
+         size = TYPEALIGN(sizeof(uint64_t), size) + container_payload_size(type, n);
+     }
+     return size;
+ }
+ 
+ static void roaring_frozen_write(const RoaringBitmap *rb, char *buf)
+ {
+     FrozenHeader *hdr = (FrozenHeader *)buf;
+     FrozenContainer *fc = (FrozenContainer *)(buf + sizeof(FrozenHeader));
+     size_t offset = sizeof(FrozenHeader) + rb->num_containers * sizeof(FrozenContainer);
+     uint64_t words[CONTAINER_WORDS];
+     int i;
+     
+     hdr->num_containers = rb->num_containers;
+     hdr->pad = 0;
+     for (i = 0; i < rb->num_containers; i++)
+     {
+         const BitmapContainer *c = &rb->containers[i];
+         int n;
+         uint8_t type = container_frozen_type(c, &n);
+         
+         offset = TYPEALIGN(sizeof(uint64_t), offset);
+         fc[i].key = c->key;
+         fc[i].type = type;
+         fc[i].pad = 0;
+         fc[i].card = c->card;
+         fc[i].n = n;
+         fc[i].offset = offset;
+         if (type == c->type)
+             memcpy(buf + offset, c->data, container_payload_size(type, n));
+         else
+         {
+             container_to_words(c, words);
+             words_to_payload(words, type, buf + offset);
+         }
+         offset += container_payload_size(type, n);
+     }
+ }
+ 
+ /*
+  * Read-only view: payloads point into buf, only the container headers are
+  * palloc'd.  NULL when a container lies outside the len bytes at buf.
+  */
+ static RoaringBitmap* roaring_frozen_view(const char *buf, size_t len)
+ {
+     const FrozenHeader *hdr = (const FrozenHeader *)buf;
+     const FrozenContainer *fc = (const FrozenContainer *)(buf + sizeof(FrozenHeader));
+     RoaringBitmap *rb;
+     uint32_t i;
+     
+     if (len < sizeof(FrozenHeader) ||
+         hdr->num_containers > (len - sizeof(FrozenHeader)) / sizeof(FrozenContainer))
+         return NULL;
+     for (i = 0; i < hdr->num_containers; i++)
+     {
+         if (fc[i].type < CONTAINER_ARRAY || fc[i].type > CONTAINER_RUN ||
+             fc[i].n > 65536 || fc[i].card > 65536 ||
+             fc[i].offset % sizeof(uint64_t) != 0 || fc[i].offset > len ||
+             container_payload_size(fc[i].type, (int)fc[i].n) > len - fc[i].offset)
+             return NULL;
+     }
+     
+     rb = roaring_create();
+     rb->is_palloc = false;
+     if (hdr->num_containers == 0)
+         return rb;
+     
+     rb->capacity = rb->num_containers = hdr->num_containers;
+     rb->containers = (BitmapContainer *)palloc(rb->capacity * sizeof(BitmapContainer));
+     for (i = 0; i < rb->num_containers; i++)
+     {
+         BitmapContainer *c = &rb->containers[i];
+         
+         c->key = fc[i].key;
+         c->type = fc[i].type;
+         c->card = fc[i].card;
+         c->n = c->capacity = fc[i].n;
+         c->data = (void *)(buf + fc[i].offset);
+     }
+     return rb;
+ }
+ 
+ /*
+  * Whether the frozen bitmap at buf is well formed and holds no value >= bound.
+  * roaring_frozen_view() only checks where the containers lie; this also
+  * checks key order, sorted arrays and runs, and every stored cardinality,
+  * which the operations trust when they size their output.
+  */
+ static bool roaring_frozen_check(const char *buf, size_t len, uint64_t bound)
+ {
+     RoaringBitmap *rb = roaring_frozen_view(buf, len);
+     uint64_t max = 0;
+     bool valid = rb != NULL;
+     int i, j;
+     
+     for (i = 0; valid && i < rb->num_containers; i++)
+     {
+         const BitmapContainer *c = &rb->containers[i];
+         const uint16_t *values = (const uint16_t *)c->data;
+         int card = 0, low = -1;
+         
+         if (i > 0 && c->key <= rb->containers[i - 1].key)
+             valid = false;
+         else if (c->type == CONTAINER_ARRAY)
+         {
+             for (j = 0; valid && j < c->n; j++)
+             {
+                 valid = values[j] > low;
+                 low = values[j];
+             }
+             card = c->n;
+         }
+         else if (c->type == CONTAINER_BITSET)
+         {
+             const uint64_t *words = (const uint64_t *)c->data;
+             
+             card = words_card(words);
+             for (j = CONTAINER_WORDS - 1; j >= 0 && low < 0; j--)
+                 if (words[j])
+                     low = j * 64 + 63 - __builtin_clzll(words[j]);
+         }
+         else
+         {
+             for (j = 0; valid && j < c->n; j++)
+             {
+                 int start = values[2 * j];
+                 int end = start + values[2 * j + 1];
+                 
+                 valid = start > low && end <= PG_UINT16_MAX;
+                 card += end - start + 1;
+                 low = end;
+             }
+         }
+         valid = valid && card > 0 && card == c->card;
+         max = ((uint64_t)c->key << 16) | (uint16_t)low;
+     }
+     if (valid && rb->num_containers > 0 && max >= bound)
+         valid = false;
+     roaring_free(rb);
+     return valid;
+ }
+ 
+ /* Copy of rb with every value moved up by offset */
+ static RoaringBitmap* roaring_shift(const RoaringBitmap *rb, uint32_t offset)
+ {
+     RoaringBitmap *result = roaring_create();
+     uint64_t count, i;
+     uint32_t *values = roaring_to_array(rb, &count);
+     
+     /* Ascending values hit the append fast path of roaring_add() */
+     for (i = 0; i < count; i++)
+         roaring_add(result, values[i] + offset);
+     if (values)
+         pfree(values);
+     return result;
+ }
+ 
+ #endif
+ 
+ /* Sort bms by ascending cardinality; false when the smallest is empty */
+ static bool roaring_order_by_count(const RoaringBitmap **bms, int n)
+ {
+     uint64_t counts[MAX_AND_INPUTS];
+     int i, j;
+     
+     Assert(n <= MAX_AND_INPUTS);
+     for (i = 0; i < n; i++)
+         counts[i] = roaring_count(bms[i]);
+     for (i = 1; i < n; i++)
+     {
+         const RoaringBitmap *rb = bms[i];
+         uint64_t count = counts[i];
+         
+         for (j = i; j > 0 && counts[j - 1] > count; j--)
+         {
+             bms[j] = bms[j - 1];
+             counts[j] = counts[j - 1];
+         }
+         bms[j] = rb;
+         counts[j] = count;
+     }
+     return counts[0] > 0;
+ }
+ 
+ /*
+  * Intersection of n bitmaps in a single pass, instead of a chain of pairwise
+  * ANDs that each build and free an intermediate.  The array is reordered so
+  * the smallest bitmap comes first and bounds the work.
+  */
+ static RoaringBitmap* roaring_and_many(const RoaringBitmap **bms, int n)
+ {
+     if (n == 0)
+         return roaring_create();
+     if (n == 1)
+         return roaring_copy(bms[0]);
+     if (!roaring_order_by_count(bms, n))
+         return roaring_create();
+     return roaring_and_sorted(bms, n);
+ }
+ 
+ /*
+  * |AND of the n bitmaps|: the largest is only counted against the
+  * intersection of the others, never copied into a result
+  */
+ static uint64_t roaring_and_many_count(const RoaringBitmap **bms, int n)
+ {
+     RoaringBitmap *rest;
+     uint64_t count;
+     
+     if (n == 0)
+         return 0;
+     if (n == 1)
+         return roaring_count(bms[0]);
+     if (!roaring_order_by_count(bms, n))
+         return 0;
+     if (n == 2)
+         return roaring_and_count(bms[0], bms[1]);
+     
+     rest = roaring_and_sorted(bms, n - 1);
+     count = roaring_and_count(rest, bms[n - 1]);
+     roaring_free(rest);
+     return count;
+ }
+ 
+ /* ==================== INDEX STRUCTURES ==================== */
+ 
+ typedef struct PosEntry {
+     RoaringBitmap *bitmap;              /* NULL while a spilled bitmap is not loaded */
+     struct SpilledBitmap *spilled;      /* set when the payload lives in the spill file */
+     uint32_t card;                      /* cardinality, from the image directory */
+ } PosEntry;
+ 
+ /*
+  * Positional bitmaps by [byte][position], with the bytes remapped to the
+  * rows of the directory in the order they were first seen.  Row 0 stays
+  * empty and is where every byte not in the index points, so a lookup is a
+  * single indexed load.  Rows are width positions long; the directory grows
+  * while an index is built and is sized once when an image is attached.
+  */
+ typedef struct {
+     uint16_t slot[CHAR_RANGE];          /* row of each byte, 0 if never seen */
+     int num_slots;                      /* rows in use, including row 0 */
+     int slot_capacity;
+     int width;                          /* positions per row, at most MAX_POSITIONS */
+     PosEntry *pos;                      /* [slot][pos] */
+     PosEntry *neg;                      /* [slot][-neg_offset - 1] */
+ } PosDirectory;
+ 
+ /*
+  * Optional n-gram index: for every bigram and trigram, the values containing
+  * it anywhere.  Keys pack the gram's bytes as b0 << 16 | b1 << 8 | b2, with
+  * b2 = 0 for a bigram (strings hold no NUL bytes), so 0 marks a free slot of
+  * the open-addressing table.
+  */
+ #define GRAM_KEY(b0, b1, b2) \
+     (((uint32_t)(unsigned char)(b0) << 16) | ((uint32_t)(unsigned char)(b1) << 8) | \
+      (uint32_t)(unsigned char)(b2))
+ 
+ /*
+  * Optional positional bigrams: the values holding b0 b1 at position pos, or
+  * ending pos bytes before the end of the string (offset -(pos + 1), like the
+  * negative positional bitmaps).  Only the first and last bigram_positions
+  * positions are indexed.  Kept in a second GramTable; bit 24 of the key
+  * marks a negative offset.
+  */
+ #define POS_GRAM_KEY(b0, b1, pos, from_end) \
+     (((uint32_t)(from_end) << 24) | GRAM_KEY(b0, b1, pos))
+ 
+ /*
+  * Optional gap pairs: the values holding b0, then gap other bytes, then b1,
+  * for gaps 1 .. max_gap, so that %a_b% and %a__b% are narrowed without a
+  * string being read.  Kept in a third GramTable under GRAM_KEY(b0, b1, gap).
+  */
+ 
+ typedef struct {
+     uint32_t key;
+     uint32_t card;                      /* cardinality, from the image directory */
+     RoaringBitmap *bitmap;
+ } GramEntry;
+ 
+ typedef struct {
+     GramEntry *slots;
+     uint32_t mask;                      /* slot count - 1 */
+     uint32_t count;
+ } GramTable;
+ 
+ typedef struct {
+     RoaringBitmap **length_bitmaps;
+     uint32_t *cards;                    /* per length, set on attached images */
+     int max_length;
+ } LengthIndex;
+ 
+ typedef struct CacheEntry {
+     char *pattern;
+     uint32_t *results;          /* NULL when only the count is known */
+     uint64_t count;
+     uint64_t last_used;
+     struct CacheEntry *next;
+ } CacheEntry;
+ 
+ typedef struct {
+     CACHE_ALIGNED CacheEntry *entries[QUERY_CACHE_SIZE];
+     uint64_t access_counter;
+     BloomFilter bloom;
+ } QueryCache;
+ 
+ /* Summary of SEGMENT_ROWS consecutive rows, checked before any bitmap work */
+ typedef struct {
+     uint16_t min_len;           /* lengths are capped at MAX_POSITIONS */
+     uint16_t max_len;
+     uint32_t pad;
+     uint64_t chars[CHAR_RANGE / 64];                        /* bytes anywhere */
+     uint64_t pos_chars[ZONE_POSITIONS][CHAR_RANGE / 64];    /* bytes at position i */
+     uint64_t neg_chars[ZONE_POSITIONS][CHAR_RANGE / 64];    /* bytes i from the end */
+ } ZoneMap;
+ 
+ typedef struct RoaringIndex {
+     PosDirectory pos_dir;
+     CACHE_ALIGNED RoaringBitmap *char_cache[CHAR_RANGE];
+     uint32_t char_cards[CHAR_RANGE];
+     GramTable grams;
+     bool has_grams;                 /* built with the n-gram index */
+     GramTable pos_grams;
+     int bigram_positions;           /* positions with positional bigrams, 0 if none */
+     GramTable gap_pairs;
+     int max_gap;                    /* largest gap with pairs, 0 if none */
+     
+     /*
+      * Optional suffix array over the arena (see SUFFIX ARRAY): the offset of
+      * every byte but the strings' NULs, in the order of the suffixes there
+      */
+     const uint32_t *suffixes;
+     uint32_t num_suffixes;
+     bool has_suffixes;              /* built with, or to be built with, a suffix array */
+     LengthIndex length_idx;
+     QueryCache query_cache;
+     
+     /*
+      * String store: NUL-terminated strings back to back in one arena, row at
+      * str_offsets[row]; str_offsets[num_records] is the arena end, so lengths
+      * come from adjacent offsets
+      */
+     const char *arena;
+     const uint64_t *str_offsets;
+     const ItemPointerData *tids;    /* heap tid per row, NULL if not kept */
+     const int64 *keys;              /* key column per row, NULL if not kept */
+     RoaringBitmap *null_keys;       /* rows whose key is NULL or unknown */
+     AttrNumber key_attnum;          /* column the keys come from, 0 if none */
+     const ZoneMap *zones;           /* one per SEGMENT_ROWS bitmap ids */
+     int num_zones;
+     
+     /*
+      * Dictionary images index distinct values: bitmaps, strings and zones are
+      * over value ids and row_values maps each row to its value.  The rows of
+      * value v are post_rows[post_offsets[v] .. post_offsets[v + 1]).  All
+      * three are NULL otherwise, and num_values == num_records.
+      */
+     const uint32_t *row_values;
+     const uint32_t *post_offsets;
+     const uint32_t *post_rows;
+     int num_values;
+     char *image;
+     struct SpillState *spill;       /* non-NULL when positional bitmaps are spilled */
+     MemoryContext context;
+     bool non_ascii;
+     
+     /* Set on delta segments only (see INCREMENTAL MAINTENANCE) */
+     RoaringBitmap *tombstones;      /* earlier rows deleted by this segment */
+     RoaringBitmap *moved;           /* earlier rows whose tid this segment made stale */
+     uint32_t base_row;              /* row number of the segment's first row */
+     
+     int num_records;
+     int max_len;
+     size_t memory_used;
+ } RoaringIndex;
+ 
+ /*
+  * Positional bitmaps of a spilled index (see BITMAP SPILL).  The payload stays
+  * in the spill file and is read back into buffer on first use; loaded bitmaps
+  * sit on an LRU list and are dropped again when the budget is exceeded,
+  * unless a running plan has pinned them.
+  */
+ typedef struct SpilledBitmap {
+     uint64_t offset;                /* payload position in the spill file */
+     uint64_t size;
+     char *buffer;                   /* palloc'd copy while loaded, else NULL */
+     PosEntry *owner;
+     bool pinned;                    /* on the pinned list instead of the LRU */
+     dlist_node lru_node;
+ } SpilledBitmap;
+ 
+ typedef struct SpillState {
+     File file;                      /* temporary file holding the whole image */
+     char *mapping;                  /* anonymous mapping the image was built in */
+     Size mapping_size;
+     Size resident;                  /* image bytes still in memory */
+     Size budget;                    /* bytes loaded bitmaps may use */
+     Size loaded;
+     int num_loaded;
+     dlist_head lru;                 /* loaded bitmaps, most recently used first */
+     dlist_head pinned;              /* loaded bitmaps the current plan holds */
+     uint64 hits;
+     uint64 misses;
+     uint64 evictions;
+ } SpillState;
+ 
+ 
+ static FORCE_INLINE const char* index_string(RoaringIndex *index, uint32_t idx)
+ {
+     return index->arena + index->str_offsets[idx];
+ }
+
+ /* Stored length of a row, without the terminating NUL */
+ static FORCE_INLINE int index_string_len(RoaringIndex *index, uint32_t idx)
+ {
+     return (int)(index->str_offsets[idx + 1] - index->str_offsets[idx] - 1);
+ }
+ 
+ /*
+  * index_string() and the bitmaps take value ids.  Without a dictionary these
+  * are the rows themselves; with one, a row maps to its value and a value to
+  * the postings posting_row(index, first .. last - 1).
+  */
+ static FORCE_INLINE uint32_t row_value(RoaringIndex *index, uint32_t row)
+ {
+     return index->row_values ? index->row_values[row] : row;
+ }
+ 
+ static FORCE_INLINE void value_rows(RoaringIndex *index, uint32_t value,
+                                     uint32_t *first, uint32_t *last)
+ {
+     if (index->post_offsets)
+     {
+         *first = index->post_offsets[value];
+         *last = index->post_offsets[value + 1];
+     }
+     else
+     {
+         *first = value;
+         *last = value + 1;
+     }
+ }
+ 
+ static FORCE_INLINE uint32_t posting_row(RoaringIndex *index, uint32_t i)
+ {
+     return index->post_rows ? index->post_rows[i] : i;
+ }
+ 
+ /* ==================== HASH FUNCTIONS ==================== */
+ 
+ 
+ static FORCE_INLINE uint32_t hash_string(const char *str)
+ {
+     uint32_t hash = 5381;
+     int c;
+     
+     while ((c = *str++))
+         hash = ((hash << 5) + hash) + c;
+     
+     return hash % QUERY_CACHE_SIZE;
+ }
+ 
+ /* FNV-1a over len bytes, for the build-time value dictionary */
+ static FORCE_INLINE uint32_t hash_value(const char *str, int len)
+ {
+     uint32_t hash = 2166136261U;
+     int i;
+     
+     for (i = 0; i < len; i++)
+         hash = (hash ^ (unsigned char)str[i]) * 16777619U;
+     
+     return hash;
+ }
+ 
+ /* ==================== POSITION BITMAP ACCESS (DIRECTORY) ==================== */
+ 
+ static RoaringBitmap* spill_touch(RoaringIndex *index, PosEntry *entry);
+ 
+ /* Directory entry of ch at pos (or neg_offset), NULL past the directory width */
+ static FORCE_INLINE PosEntry* pos_entry(RoaringIndex *index, unsigned char ch, int pos)
+ {
+     PosDirectory *dir = &index->pos_dir;
+     
+     if (unlikely((unsigned)pos >= (unsigned)dir->width))
+         return NULL;
+     return &dir->pos[dir->slot[ch] * dir->width + pos];
+ }
+ 
+ static FORCE_INLINE PosEntry* neg_entry(RoaringIndex *index, unsigned char ch, int neg_offset)
+ {
+     PosDirectory *dir = &index->pos_dir;
+     int pos = -neg_offset - 1;
+     
+     if (unlikely((unsigned)pos >= (unsigned)dir->width))
+         return NULL;
+     return &dir->neg[dir->slot[ch] * dir->width + pos];
+ }
+ 
+ static FORCE_INLINE RoaringBitmap* entry_bitmap(RoaringIndex *index, PosEntry *entry)
+ {
+     if (!entry)
+         return NULL;
+     return unlikely(entry->spilled != NULL) ? spill_touch(index, entry) : entry->bitmap;
+ }
+ 
+ static FORCE_INLINE RoaringBitmap* get_pos_bitmap(RoaringIndex *index, unsigned char ch, int pos)
+ {
+     return entry_bitmap(index, pos_entry(index, ch, pos));
+ }
+ 
+ static FORCE_INLINE RoaringBitmap* get_neg_bitmap(RoaringIndex *index, unsigned char ch, int neg_offset)
+ {
+     return entry_bitmap(index, neg_entry(index, ch, neg_offset));
+ }
+ 
+ /* Cardinality of a positional bitmap without loading it, 0 if absent */
+ static FORCE_INLINE uint32_t get_pos_card(RoaringIndex *index, unsigned char ch, int pos)
+ {
+     PosEntry *entry = pos_entry(index, ch, pos);
+     
+     return entry ? entry->card : 0;
+ }
+ 
+ static FORCE_INLINE uint32_t get_neg_card(RoaringIndex *index, unsigned char ch, int neg_offset)
+ {
+     PosEntry *entry = neg_entry(index, ch, neg_offset);
+     
+     return entry ? entry->card : 0;
+ }
+ 
+ /*
+  * Reallocate the directory as slot_capacity rows of width positions.  Entries
+  * move, so this must not happen once a spill holds pointers to them.
+  */
+ static void pos_dir_resize(RoaringIndex *index, int slot_capacity, int width)
+ {
+     PosDirectory *dir = &index->pos_dir;
+     Size size = (Size)slot_capacity * width * sizeof(PosEntry);
+     PosEntry *pos = (PosEntry *)MemoryContextAllocZero(index->context, size);
+     PosEntry *neg = (PosEntry *)MemoryContextAllocZero(index->context, size);
+     int i;
+     
+     Assert(!index->spill);
+     if (dir->pos)
+     {
+         for (i = 0; i < dir->num_slots; i++)
+         {
+             memcpy(pos + i * width, dir->pos + i * dir->width, dir->width * sizeof(PosEntry));
+             memcpy(neg + i * width, dir->neg + i * dir->width, dir->width * sizeof(PosEntry));
+         }
+         pfree(dir->pos);
+         pfree(dir->neg);
+     }
+     dir->pos = pos;
+     dir->neg = neg;
+     dir->slot_capacity = slot_capacity;
+     dir->width = width;
+ }
+ 
+ /* Give ch a directory row and make the rows at least pos + 1 wide */
+ static void pos_dir_reserve(RoaringIndex *index, unsigned char ch, int pos)
+ {
+     PosDirectory *dir = &index->pos_dir;
+     int capacity = dir->slot_capacity;
+     int width = dir->width;
+     
+     Assert(pos >= 0 && pos < MAX_POSITIONS);
+     if (dir->num_slots == 0)
+         dir->num_slots = 1;
+     if (dir->slot[ch] == 0 && dir->num_slots >= capacity)
+         capacity = Min(CHAR_RANGE + 1, Max(8, capacity * 2));
+     if (pos >= width)
+         width = Min(MAX_POSITIONS, Max(pos + 1, width * 2));
+     if (capacity != dir->slot_capacity || width != dir->width)
+         pos_dir_resize(index, capacity, width);
+     if (dir->slot[ch] == 0)
+         dir->slot[ch] = (uint16_t)dir->num_slots++;
+ }
+ 
+ static PosEntry* set_pos_bitmap(RoaringIndex *index, unsigned char ch, int pos, RoaringBitmap *bm)
+ {
+     PosEntry *entry;
+     
+     pos_dir_reserve(index, ch, pos);
+     entry = pos_entry(index, ch, pos);
+     entry->bitmap = bm;
+     return entry;
+ }
+ 
+ static PosEntry* set_neg_bitmap(RoaringIndex *index, unsigned char ch, int neg_offset, RoaringBitmap *bm)
+ {
+     PosEntry *entry;
+     
+     pos_dir_reserve(index, ch, -neg_offset - 1);
+     entry = neg_entry(index, ch, neg_offset);
+     entry->bitmap = bm;
+     return entry;
+ }
+ 
+ static FORCE_INLINE uint32_t gram_hash(uint32_t key, uint32_t mask)
+ {
+     return (key * 2654435761U >> 8) & mask;
+ }
+ 
+ /* Entry of a gram, NULL if no value contains it */
+ static FORCE_INLINE GramEntry* gram_find(GramTable *table, uint32_t key)
+ {
+     uint32_t i;
+     
+     if (!table->slots)
+         return NULL;
+     for (i = gram_hash(key, table->mask); table->slots[i].key; i = (i + 1) & table->mask)
+         if (table->slots[i].key == key)
+             return &table->slots[i];
+     return NULL;
+ }
+ 
+ static FORCE_INLINE RoaringBitmap* get_gram_bitmap(GramTable *table, uint32_t key)
+ {
+     GramEntry *entry = gram_find(table, key);
+     
+     return entry ? entry->bitmap : NULL;
+ }
+ 
+ static FORCE_INLINE uint32_t get_gram_card(GramTable *table, uint32_t key)
+ {
+     GramEntry *entry = gram_find(table, key);
+     
+     return entry ? entry->card : 0;
+ }
+ 
+ /* Make room for count grams at a load factor of at most one half */
+ static void gram_table_reserve(RoaringIndex *index, GramTable *table, uint32_t count)
+ {
+     GramEntry *old = table->slots;
+     uint32_t old_size = old ? table->mask + 1 : 0;
+     uint32_t size = 64;
+     uint32_t i, j;
+     
+     while (size < 2 * count)
+         size *= 2;
+     if (size <= old_size)
+         return;
+     
+     table->slots = (GramEntry *)MemoryContextAllocZero(index->context, size * sizeof(GramEntry));
+     table->mask = size - 1;
+     for (i = 0; i < old_size; i++)
+     {
+         if (!old[i].key)
+             continue;
+         for (j = gram_hash(old[i].key, table->mask); table->slots[j].key; j = (j + 1) & table->mask)
+             ;
+         table->slots[j] = old[i];
+     }
+     if (old)
+         pfree(old);
+ }
+ 
+ /* Entry of a gram, added empty if new */
+ static GramEntry* gram_insert(RoaringIndex *index, GramTable *table, uint32_t key)
+ {
+     uint32_t i;
+     
+     gram_table_reserve(index, table, table->count + 1);
+     for (i = gram_hash(key, table->mask); table->slots[i].key; i = (i + 1) & table->mask)
+         if (table->slots[i].key == key)
+             return &table->slots[i];
+     table->slots[i].key = key;
+     table->count++;
+     return &table->slots[i];
+ }
+ 
+ /* ==================== QUERY CACHE ==================== */
+ 
+ static void init_query_cache(RoaringIndex *index)
+ {
+     for (int i = 0; i < QUERY_CACHE_SIZE; i++)
+         index->query_cache.entries[i] = NULL;
+     index->query_cache.access_counter = 0;
+     bloom_init(&index->query_cache.bloom);
+ }
+ 
+ static CacheEntry* cache_lookup(RoaringIndex *index, const char *pattern)
+ {
+     uint32_t hash = hash_string(pattern);
+     
+     if (!bloom_check(&index->query_cache.bloom, hash))
+         return NULL;
+     
+     CacheEntry *entry = index->query_cache.entries[hash];
+     
+     while (entry)
+     {
+         if (strcmp(entry->pattern, pattern) == 0)
+         {
+             entry->last_used = ++index->query_cache.access_counter;
+             return entry;
+         }
+         entry = entry->next;
+     }
+     return NULL;
+ }
+ 
+ /*
+  * Remember the rows of pattern, or with results NULL only their number.  Rows
+  * found later for a pattern whose count is cached are added to that entry.
+  */
+ static void cache_insert(RoaringIndex *index, const char *pattern, uint32_t *results, uint64_t count)
+ {
+     if (results && count > 50000) return;
+     
+     uint32_t hash = hash_string(pattern);
+     CacheEntry *entry = cache_lookup(index, pattern);
+     
+     if (!entry)
+     {
+         entry = (CacheEntry *)MemoryContextAlloc(index->context, sizeof(CacheEntry));
+         entry->pattern = MemoryContextStrdup(index->context, pattern);
+         entry->results = NULL;
+         entry->next = index->query_cache.entries[hash];
+         index->query_cache.entries[hash] = entry;
+         bloom_add(&index->query_cache.bloom, hash);
+     }
+     else if (entry->results || !results)
+         return;
+     
+     if (results)
+     {
+         entry->results = (uint32_t *)MemoryContextAlloc(index->context, count * sizeof(uint32_t));
+         memcpy(entry->results, results, count * sizeof(uint32_t));
+     }
+     entry->count = count;
+     entry->last_used = ++index->query_cache.access_counter;
+ }
+ 
+ /* ==================== INDEX BUILDER ==================== */
+ 
+ /*
+  * Rows are fed one at a time; positional bitmaps are updated immediately and
+  * the strings are appended to an arena laid out exactly like the image's
+  * (NUL-terminated, str_offsets[num_records] is the end), so flattening copies
+  * both in one piece.
+  */
+ 
+ static bool ngram_index = false;   /* build the n-gram index (optimized_like.ngram_index) */
+ static int bigram_positions = 0;   /* optimized_like.bigram_positions */
+ static bool suffix_array = false;  /* optimized_like.suffix_array */
+ static int gap_pairs = 0;          /* optimized_like.gap_pairs: largest gap, 0 = off */
+ static int gap_pair_alphabet = 64; /* optimized_like.gap_pair_alphabet */
+ static bool build_messages = true; /* optimized_like.build_messages */
+ 
+ /* Builds and loads report progress and sizes at INFO, or at DEBUG1 when asked not to */
+ #define BUILD_MESSAGE_LEVEL (build_messages ? INFO : DEBUG1)
+ 
+ typedef struct {
+     RoaringIndex *index;
+     char *arena;
+     uint64_t *str_offsets;      /* capacity + 1 entries */
+     Size arena_capacity;
+     ItemPointerData *tids;      /* heap tid per row, NULL if not kept */
+     int64 *keys;                /* key column per row, NULL if not kept */
+     int capacity;
+     bool non_ascii;
+     
+     /*
+      * Dictionary mode: index->num_records counts distinct values and the
+      * bitmaps are over value ids; rows are counted in num_rows and mapped
+      * to values by row_values.  dict_slots is an open-addressing table of
+      * value id + 1 (0 = empty) keyed by the value's bytes.
+      */
+     uint32_t *row_values;
+     int num_rows;
+     uint32_t *dict_slots;
+     uint32_t dict_mask;
+     
+     /* Distinct bytes seen while gap pairs are built */
+     uint64_t alphabet[CHAR_RANGE / 64];
+     int alphabet_size;
+ } IndexBuilder;
+ 
+ static IndexBuilder* builder_create(MemoryContext context, bool keep_tids, bool keep_keys)
+ {
+     IndexBuilder *b = (IndexBuilder *)MemoryContextAllocZero(context, sizeof(IndexBuilder));
+     
+     b->index = (RoaringIndex *)MemoryContextAllocZero(context, sizeof(RoaringIndex));
+     b->index->context = context;
+     b->capacity = 1024;
+     b->arena_capacity = 16 * 1024;
+     b->arena = (char *)MemoryContextAlloc(context, b->arena_capacity);
+     b->str_offsets = (uint64_t *)MemoryContextAlloc(context, (b->capacity + 1) * sizeof(uint64_t));
+     b->str_offsets[0] = 0;
+     if (keep_tids)
+         b->tids = (ItemPointerData *)MemoryContextAlloc(context, b->capacity * sizeof(ItemPointerData));
+     if (keep_keys)
+         b->keys = (int64 *)MemoryContextAlloc(context, b->capacity * sizeof(int64));
+     return b;
+ }
+ 
+ /* Deduplicate values from here on; must be called before the first row */
+ static void builder_enable_dictionary(IndexBuilder *b)
+ {
+     MemoryContext context = b->index->context;
+     
+     Assert(b->index->num_records == 0);
+     b->row_values = (uint32_t *)MemoryContextAlloc(context, b->capacity * sizeof(uint32_t));
+     b->dict_mask = 1023;
+     b->dict_slots = (uint32_t *)MemoryContextAllocZero(context, (b->dict_mask + 1) * sizeof(uint32_t));
+ }
+ 
+ /*
+  * Optional indexes; must be called before the first row.  grams indexes the
+  * bigrams and trigrams of every value, positions the bigrams at that many
+  * leading and trailing positions, suffixes asks for a suffix array over the
+  * arena when the image is written and max_gap > 0 indexes gap pairs.
+  */
+ static void builder_enable_options(IndexBuilder *b, bool grams, int positions, bool suffixes,
+                                    int max_gap)
+ {
+     RoaringIndex *index = b->index;
+     
+     Assert(index->num_records == 0);
+     index->has_suffixes = suffixes;
+     if (grams)
+     {
+         index->has_grams = true;
+         gram_table_reserve(index, &index->grams, 1024);
+     }
+     if (positions > 0)
+     {
+         index->bigram_positions = Min(positions, MAX_POSITIONS);
+         gram_table_reserve(index, &index->pos_grams, 1024);
+     }
+     if (max_gap > 0)
+     {
+         index->max_gap = max_gap;
+         gram_table_reserve(index, &index->gap_pairs, 1024);
+     }
+ }
+ 
+ /* The optional indexes of from, for a builder replacing or extending it */
+ static void builder_inherit_options(IndexBuilder *b, const RoaringIndex *from)
+ {
+     builder_enable_options(b, from->has_grams, from->bigram_positions, from->has_suffixes,
+                            from->max_gap);
+     b->index->key_attnum = from->key_attnum;
+ }
+ 
+ static FORCE_INLINE int builder_num_rows(IndexBuilder *b)
+ {
+     return b->row_values ? b->num_rows : b->index->num_records;
+ }
+ 
+ static FORCE_INLINE const char* builder_string(IndexBuilder *b, uint32_t idx)
+ {
+     return b->arena + b->str_offsets[idx];
+ }
+ 
+ static FORCE_INLINE int builder_string_len(IndexBuilder *b, uint32_t idx)
+ {
+     return (int)(b->str_offsets[idx + 1] - b->str_offsets[idx] - 1);
+ }
+ 
+ /* Make room for arena_bytes more bytes of string data */
+ static void builder_reserve_arena(IndexBuilder *b, Size arena_bytes)
+ {
+     Size needed = b->str_offsets[b->index->num_records] + arena_bytes;
+     
+     if (likely(needed <= b->arena_capacity))
+         return;
+     while (b->arena_capacity < needed)
+         b->arena_capacity *= 2;
+     b->arena = (char *)repalloc_huge(b->arena, b->arena_capacity);
+ }
+ 
+ /* Slot holding str in the value dictionary, or the empty slot to put it in */
+ static uint32_t* builder_dict_slot(IndexBuilder *b, const char *str, int len)
+ {
+     uint32_t h = hash_value(str, len) & b->dict_mask;
+     
+     for (;;)
+     {
+         uint32_t *slot = &b->dict_slots[h];
+         
+         if (*slot == 0 ||
+             (builder_string_len(b, *slot - 1) == len &&
+              memcmp(builder_string(b, *slot - 1), str, len) == 0))
+             return slot;
+         h = (h + 1) & b->dict_mask;
+     }
+ }
+ 
+ /* Keep the dictionary at most half full */
+ static void builder_dict_grow(IndexBuilder *b)
+ {
+     uint32_t num_values = (uint32_t)b->index->num_records;
+     uint32_t v;
+     
+     if (likely(num_values * 2 <= b->dict_mask + 1))
+         return;
+     
+     pfree(b->dict_slots);
+     b->dict_mask = b->dict_mask * 2 + 1;
+     b->dict_slots = (uint32_t *)MemoryContextAllocExtended(b->index->context,
+                                                            ((Size)b->dict_mask + 1) * sizeof(uint32_t),
+                                                            MCXT_ALLOC_HUGE | MCXT_ALLOC_ZERO);
+     for (v = 0; v < num_values; v++)
+         *builder_dict_slot(b, builder_string(b, v), builder_string_len(b, v)) = v + 1;
+ }
+ 
+ /* Make room for nrows more rows */
+ static void builder_reserve(IndexBuilder *b, int nrows)
+ {
+     int needed = builder_num_rows(b) + nrows;
+     
+     if (likely(needed <= b->capacity))
+         return;
+     while (b->capacity < needed)
+         b->capacity *= 2;
+     b->str_offsets = (uint64_t *)repalloc_huge(b->str_offsets, (b->capacity + 1) * sizeof(uint64_t));
+     if (b->row_values)
+         b->row_values = (uint32_t *)repalloc_huge(b->row_values, b->capacity * sizeof(uint32_t));
+     if (b->tids)
+         b->tids = (ItemPointerData *)repalloc_huge(b->tids, b->capacity * sizeof(ItemPointerData));
+     if (b->keys)
+         b->keys = (int64 *)repalloc_huge(b->keys, b->capacity * sizeof(int64));
+ }
+ 
+ static FORCE_INLINE void add_pos_bit(RoaringIndex *index, unsigned char ch, int pos, uint32_t idx)
+ {
+     RoaringBitmap *bm = get_pos_bitmap(index, ch, pos);
+     
+     if (!bm)
+     {
+         bm = roaring_create();
+         set_pos_bitmap(index, ch, pos, bm);
+     }
+     roaring_add(bm, idx);
+ }
+ 
+ static FORCE_INLINE void add_neg_bit(RoaringIndex *index, unsigned char ch, int neg_offset, uint32_t idx)
+ {
+     RoaringBitmap *bm = get_neg_bitmap(index, ch, neg_offset);
+     
+     if (!bm)
+     {
+         bm = roaring_create();
+         set_neg_bitmap(index, ch, neg_offset, bm);
+     }
+     roaring_add(bm, idx);
+ }
+ 
+ static FORCE_INLINE void add_gram_bit(RoaringIndex *index, GramTable *table, uint32_t key,
+                                        uint32_t idx)
+ {
+     GramEntry *entry = gram_insert(index, table, key);
+     
+     if (!entry->bitmap)
+         entry->bitmap = roaring_create();
+     roaring_add(entry->bitmap, idx);
+ }
+ 
+ /* Give up on gap pairs, for an alphabet too large or a part built without them */
+ static void builder_drop_gap_pairs(IndexBuilder *b)
+ {
+     RoaringIndex *index = b->index;
+     uint32_t i;
+     
+     for (i = 0; index->gap_pairs.slots && i <= index->gap_pairs.mask; i++)
+         roaring_free(index->gap_pairs.slots[i].bitmap);
+     if (index->gap_pairs.slots)
+         pfree(index->gap_pairs.slots);
+     memset(&index->gap_pairs, 0, sizeof(GramTable));
+     index->max_gap = 0;
+ }
+ 
+ /*
+  * Gap pairs of a new value: every two bytes with 1 .. max_gap bytes between.
+  * Pairs grow with the square of the alphabet, so once the values use more
+  * than gap_pair_alphabet distinct bytes the index goes without them.
+  */
+ static void builder_add_gap_pairs(IndexBuilder *b, const char *str, int len, uint32_t idx)
+ {
+     RoaringIndex *index = b->index;
+     int i, gap;
+     
+     for (i = 0; i < len; i++)
+     {
+         unsigned char ch = (unsigned char)str[i];
+         
+         if (b->alphabet[ch >> 6] & (1ULL << (ch & 63)))
+             continue;
+         b->alphabet[ch >> 6] |= 1ULL << (ch & 63);
+         if (++b->alphabet_size > gap_pair_alphabet)
+         {
+             ereport(NOTICE,
+                     (errmsg("optimized_like values use more than %d distinct bytes, building without gap pairs",
+                             gap_pair_alphabet)));
+             builder_drop_gap_pairs(b);
+             return;
+         }
+     }
+     
+     for (i = 0; i < len; i++)
+         for (gap = 1; gap <= index->max_gap && i + gap + 1 < len; gap++)
+             add_gram_bit(index, &index->gap_pairs, GRAM_KEY(str[i], str[i + gap + 1], gap), idx);
+ }
+ 
+ /* Record the heap tid and key of a row */
+ static FORCE_INLINE void builder_add_locator(IndexBuilder *b, uint32_t row, ItemPointer tid,
+                                              const int64 *key)
+ {
+     if (b->tids)
+     {
+         if (tid)
+             b->tids[row] = *tid;
+         else
+             ItemPointerSetInvalid(&b->tids[row]);
+     }
+     if (b->keys)
+     {
+         b->keys[row] = key ? *key : 0;
+         if (!key)
+         {
+             MemoryContext oldcontext = MemoryContextSwitchTo(b->index->context);
+             
+             if (!b->index->null_keys)
+                 b->index->null_keys = roaring_create();
+             roaring_add(b->index->null_keys, row);
+             MemoryContextSwitchTo(oldcontext);
+         }
+     }
+ }
+ 
+ /*
+  * Append one row; str need not be NUL-terminated.  A NULL tid is stored as an
+  * invalid tid and a NULL key is recorded in null_keys.  In dictionary mode a
+  * value seen before only records the row.
+  */
+ static void builder_add(IndexBuilder *b, const char *str, int len, ItemPointer tid,
+                         const int64 *key)
+ {
+     RoaringIndex *index = b->index;
+     uint32_t idx = (uint32_t)index->num_records;
+     int npos = Min(len, MAX_POSITIONS);
+     uint64_t seen[CHAR_RANGE / 64] = {0};
+     MemoryContext oldcontext;
+     int pos;
+     
+     builder_reserve(b, 1);
+     
+     if (b->row_values)
+     {
+         uint32_t row = (uint32_t)b->num_rows++;
+         uint32_t *slot = builder_dict_slot(b, str, len);
+         
+         builder_add_locator(b, row, tid, key);
+         if (*slot)
+         {
+             b->row_values[row] = *slot - 1;
+             return;
+         }
+         *slot = idx + 1;
+         b->row_values[row] = idx;
+     }
+     else
+         builder_add_locator(b, idx, tid, key);
+     
+     builder_reserve_arena(b, len + 1);
+     memcpy(b->arena + b->str_offsets[idx], str, len);
+     b->arena[b->str_offsets[idx] + len] = '\0';
+     b->str_offsets[idx + 1] = b->str_offsets[idx] + len + 1;
+     if (!b->non_ascii)
+     {
+         for (pos = 0; pos < len; pos++)
+             if (unlikely(str[pos] & 0x80))
+                 b->non_ascii = true;
+     }
+     index->num_records++;
+     if (b->row_values)
+         builder_dict_grow(b);
+     
+     if (npos > index->max_len)
+         index->max_len = npos;
+     
+     oldcontext = MemoryContextSwitchTo(index->context);
+     for (pos = 0; pos < npos; pos++)
+     {
+         /* Forward position index */
+         add_pos_bit(index, (unsigned char)str[pos], pos, idx);
+         
+         /* Backward (negative) index, counted from the real end of the string */
+         add_neg_bit(index, (unsigned char)str[len - 1 - pos], -(1 + pos), idx);
+     }
+     
+     /* The char cache covers every byte, including those past MAX_POSITIONS */
+     for (pos = 0; pos < len; pos++)
+     {
+         unsigned char ch = (unsigned char)str[pos];
+         
+         if (seen[ch >> 6] & (1ULL << (ch & 63)))
+             continue;
+         seen[ch >> 6] |= 1ULL << (ch & 63);
+         if (!index->char_cache[ch])
+             index->char_cache[ch] = roaring_create();
+         roaring_add(index->char_cache[ch], idx);
+     }
+     
+     /* N-grams are taken over the whole string, not just MAX_POSITIONS */
+     if (index->has_grams)
+     {
+         for (pos = 0; pos + 1 < len; pos++)
+         {
+             add_gram_bit(index, &index->grams, GRAM_KEY(str[pos], str[pos + 1], 0), idx);
+             if (pos + 2 < len)
+                 add_gram_bit(index, &index->grams,
+                              GRAM_KEY(str[pos], str[pos + 1], str[pos + 2]), idx);
+         }
+     }
+     for (pos = 0; pos < index->bigram_positions && pos + 1 < len; pos++)
+     {
+         add_gram_bit(index, &index->pos_grams,
+                      POS_GRAM_KEY(str[pos], str[pos + 1], pos, false), idx);
+         add_gram_bit(index, &index->pos_grams,
+                      POS_GRAM_KEY(str[len - 2 - pos], str[len - 1 - pos], pos, true), idx);
+     }
+     if (index->max_gap > 0)
+         builder_add_gap_pairs(b, str, len, idx);
+     MemoryContextSwitchTo(oldcontext);
+ }
+ 
+ /* Derive the per-length bitmaps once all rows are in */
+ static void builder_finish(IndexBuilder *b)
+ {
+     RoaringIndex *index = b->index;
+     MemoryContext oldcontext = MemoryContextSwitchTo(index->context);
+     int idx, len;
+     
+     /* Strings longer than MAX_POSITIONS share the last length bucket */
+     index->length_idx.max_length = index->max_len + 1;
+     index->length_idx.length_bitmaps = (RoaringBitmap **)palloc0(
+         index->length_idx.max_length * sizeof(RoaringBitmap *));
+     
+     for (idx = 0; idx < index->num_records; idx++)
+     {
+         len = Min(builder_string_len(b, idx), MAX_POSITIONS);
+         
+         if (!index->length_idx.length_bitmaps[len])
+             index->length_idx.length_bitmaps[len] = roaring_create();
+         
+         roaring_add(index->length_idx.length_bitmaps[len], (uint32_t)idx);
+     }
+     
+     MemoryContextSwitchTo(oldcontext);
+ }
+ 
+ /* ==================== INDEX IMAGE ==================== */
+ 
+ /*
+  * A built index is flattened into one pointer-free image: header, bitmap
+  * directory, bitmap payloads, string offsets, zone maps and string arena.
+  * Queries always run on read-only views into the image, so the same bytes
+  * can be placed in a DSM segment and attached by every backend.
+  */
+ 
+ #define IMAGE_MAGIC         0x4F4C494B  /* "OLIK" */
+ #define IMAGE_VERSION       13
+ #define IMAGE_ALIGN         64
+ #define IMAGE_FLAG_CROARING 0x0001
+ #define IMAGE_FLAG_NON_ASCII 0x0002  /* some row has bytes >= 0x80 */
+ #define IMAGE_FLAG_GRAMS    0x0004  /* built with the n-gram index */
+ 
+ #define INDEX_FILE_DIR      "pg_optimized_like"
+ 
+ #define NUM_ZONES(num_records)  (((num_records) + SEGMENT_ROWS - 1) / SEGMENT_ROWS)
+ 
+ typedef enum {
+     IMAGE_ENTRY_POS = 1,
+     IMAGE_ENTRY_NEG,
+     IMAGE_ENTRY_CHAR,
+     IMAGE_ENTRY_LENGTH,
+     IMAGE_ENTRY_TOMBSTONE,
+     IMAGE_ENTRY_NULL_KEYS,
+     IMAGE_ENTRY_GRAM,           /* ch and pos hold the key's bits 16-23 and 0-15 */
+     IMAGE_ENTRY_POS_GRAM,       /* the same for positional bigrams */
+     IMAGE_ENTRY_NEG_GRAM,
+     IMAGE_ENTRY_GAP_PAIR,       /* and for gap pairs */
+     IMAGE_ENTRY_MOVED
+ } ImageEntryKind;
+ 
+ #define IMAGE_GRAM_KEY(e) \
+     (((e)->kind == IMAGE_ENTRY_NEG_GRAM ? 1U << 24 : 0) | \
+      ((uint32_t)(e)->ch << 16) | (uint16_t)(e)->pos)
+ 
+ typedef struct {
+     uint32_t magic;
+     uint32_t version;
+     uint32_t flags;
+     uint32_t num_records;       /* rows */
+     uint32_t num_values;        /* bitmap ids: distinct values, or rows */
+     uint32_t max_len;
+     uint32_t num_entries;
+     Oid database_oid;
+     uint32_t base_row;          /* non-zero only for delta segments */
+     uint32_t bigram_positions;  /* 0 without positional bigrams */
+     uint32_t max_gap;           /* 0 without gap pairs */
+     uint32_t key_attnum;        /* column of the keys, 0 when none are stored */
+     uint64_t image_size;
+     uint64_t dir_offset;
+     uint64_t str_offsets_offset;
+     uint64_t arena_offset;
+     uint64_t arena_size;
+     uint64_t tids_offset;       /* 0 when no heap tids are stored */
+     uint64_t keys_offset;       /* 0 when no key column is stored */
+     uint64_t zones_offset;
+     uint64_t row_values_offset; /* 0 unless dictionary encoded */
+     uint64_t postings_offset;   /* post_offsets then post_rows */
+     uint64_t suffixes_offset;   /* 0 without a suffix array */
+     uint64_t num_suffixes;
+     char schema_name[NAMEDATALEN];
+     char table_name[NAMEDATALEN];
+     char column_name[NAMEDATALEN];
+ } ImageHeader;
+ 
+ typedef struct {
+     uint8_t kind;
+     uint8_t ch;
+     int16_t pos;
+     uint32_t card;              /* bitmap cardinality, for the query planner */
+     uint64_t offset;
+     uint64_t size;
+ } ImageEntry;
+ 
+ typedef struct {
+     ImageEntry *entries;
+     RoaringBitmap **bitmaps;
+     int num_entries;
+     int capacity;
+     uint64_t arena_size;
+     Size str_offsets_offset;
+     Size tids_offset;
+     Size keys_offset;
+     Size row_values_offset;
+     Size postings_offset;
+     Size zones_offset;
+     Size suffixes_offset;
+     Size num_suffixes;
+     Size total_size;
+ } ImageLayout;
+ 
+ static void layout_add(ImageLayout *layout, ImageEntryKind kind, int ch, int pos, RoaringBitmap *bm)
+ {
+     ImageEntry *e;
+     
+     if (layout->num_entries >= layout->capacity)
+     {
+         layout->capacity *= 2;
+         layout->entries = (ImageEntry *)repalloc(layout->entries, layout->capacity * sizeof(ImageEntry));
+         layout->bitmaps = (RoaringBitmap **)repalloc(layout->bitmaps, layout->capacity * sizeof(RoaringBitmap *));
+     }
+     
+     e = &layout->entries[layout->num_entries];
+     e->kind = (uint8_t)kind;
+     e->ch = (uint8_t)ch;
+     e->pos = (int16_t)pos;
+     e->card = (uint32_t)roaring_count(bm);
+     e->offset = 0;
+     e->size = roaring_frozen_size(bm);
+     layout->bitmaps[layout->num_entries++] = bm;
+ }
+ 
+ /* The table holding a gram entry kind */
+ static GramTable* image_gram_table(RoaringIndex *index, int kind)
+ {
+     switch (kind)
+     {
+         case IMAGE_ENTRY_GRAM:
+             return &index->grams;
+         case IMAGE_ENTRY_GAP_PAIR:
+             return &index->gap_pairs;
+         default:
+             return &index->pos_grams;
+     }
+ }
+ 
+ /* Directory entries of a gram table; bit 24 of a key selects IMAGE_ENTRY_NEG_GRAM */
+ static void layout_add_grams(ImageLayout *layout, GramTable *table, ImageEntryKind kind)
+ {
+     uint32_t i;
+     
+     for (i = 0; table->slots && i <= table->mask; i++)
+     {
+         GramEntry *gram = &table->slots[i];
+         
+         if (gram->key)
+             layout_add(layout, (gram->key >> 24) ? IMAGE_ENTRY_NEG_GRAM : kind,
+                        (gram->key >> 16) & 0xFF, (int16_t)(gram->key & 0xFFFF), gram->bitmap);
+     }
+ }
+ 
+ /* Collect every bitmap of the index and compute the image size */
+ static Size layout_index_image(IndexBuilder *b, ImageLayout *layout)
+ {
+     RoaringIndex *index = b->index;
+     Size num_rows = builder_num_rows(b);
+     Size offset;
+     int ch, pos, i;
+     
+     layout->capacity = 1024;
+     layout->num_entries = 0;
+     layout->entries = (ImageEntry *)palloc(layout->capacity * sizeof(ImageEntry));
+     layout->bitmaps = (RoaringBitmap **)palloc(layout->capacity * sizeof(RoaringBitmap *));
+     
+     for (ch = 0; ch < CHAR_RANGE; ch++)
+     {
+         for (pos = 0; index->pos_dir.slot[ch] && pos < index->pos_dir.width; pos++)
+         {
+             PosEntry *entry = pos_entry(index, ch, pos);
+             
+             if (entry->bitmap)
+                 layout_add(layout, IMAGE_ENTRY_POS, ch, pos, entry->bitmap);
+             entry = neg_entry(index, ch, -(pos + 1));
+             if (entry->bitmap)
+                 layout_add(layout, IMAGE_ENTRY_NEG, ch, -(pos + 1), entry->bitmap);
+         }
+         if (index->char_cache[ch])
+             layout_add(layout, IMAGE_ENTRY_CHAR, ch, 0, index->char_cache[ch]);
+     }
+     
+     layout_add_grams(layout, &index->grams, IMAGE_ENTRY_GRAM);
+     layout_add_grams(layout, &index->pos_grams, IMAGE_ENTRY_POS_GRAM);
+     layout_add_grams(layout, &index->gap_pairs, IMAGE_ENTRY_GAP_PAIR);
+     
+     for (i = 0; i < index->length_idx.max_length; i++)
+         if (index->length_idx.length_bitmaps[i])
+             layout_add(layout, IMAGE_ENTRY_LENGTH, 0, i, index->length_idx.length_bitmaps[i]);
+     
+     if (index->tombstones)
+         layout_add(layout, IMAGE_ENTRY_TOMBSTONE, 0, 0, index->tombstones);
+     if (index->moved)
+         layout_add(layout, IMAGE_ENTRY_MOVED, 0, 0, index->moved);
+     if (index->null_keys)
+         layout_add(layout, IMAGE_ENTRY_NULL_KEYS, 0, 0, index->null_keys);
+     
+     layout->arena_size = b->str_offsets[index->num_records];
+     
+     offset = TYPEALIGN(IMAGE_ALIGN, sizeof(ImageHeader));
+     offset += TYPEALIGN(IMAGE_ALIGN, layout->num_entries * sizeof(ImageEntry));
+     for (i = 0; i < layout->num_entries; i++)
+     {
+         layout->entries[i].offset = offset;
+         offset += TYPEALIGN(IMAGE_ALIGN, layout->entries[i].size);
+     }
+     
+     layout->str_offsets_offset = offset;
+     offset += TYPEALIGN(IMAGE_ALIGN, (index->num_records + 1) * sizeof(uint64_t));
+     if (b->tids)
+     {
+         layout->tids_offset = offset;
+         offset += TYPEALIGN(IMAGE_ALIGN, num_rows * sizeof(ItemPointerData));
+     }
+     else
+         layout->tids_offset = 0;
+     if (b->keys)
+     {
+         layout->keys_offset = offset;
+         offset += TYPEALIGN(IMAGE_ALIGN, num_rows * sizeof(int64));
+     }
+     else
+         layout->keys_offset = 0;
+     if (b->row_values)
+     {
+         layout->row_values_offset = offset;
+         offset += TYPEALIGN(IMAGE_ALIGN, num_rows * sizeof(uint32_t));
+         layout->postings_offset = offset;
+         offset += TYPEALIGN(IMAGE_ALIGN, (index->num_records + 1 + num_rows) * sizeof(uint32_t));
+     }
+     else
+     {
+         layout->row_values_offset = 0;
+         layout->postings_offset = 0;
+     }
+     layout->zones_offset = offset;
+     offset += TYPEALIGN(IMAGE_ALIGN, NUM_ZONES(index->num_records) * sizeof(ZoneMap));
+     
+     /* Suffix positions are 32-bit; larger arenas go without */
+     layout->suffixes_offset = 0;
+     layout->num_suffixes = 0;
+     if (index->has_suffixes && layout->arena_size <= PG_UINT32_MAX)
+     {
+         layout->suffixes_offset = offset;
+         layout->num_suffixes = layout->arena_size - index->num_records;
+         offset += TYPEALIGN(IMAGE_ALIGN, layout->num_suffixes * sizeof(uint32_t));
+     }
+     else if (index->has_suffixes)
+         ereport(NOTICE,
+                 (errmsg("optimized_like strings exceed 4 GB, building without a suffix array")));
+     
+     layout->total_size = offset + layout->arena_size;
+     return layout->total_size;
+ }
+ 
+ static FORCE_INLINE void zone_set(uint64_t *mask, unsigned char ch)
+ {
+     mask[ch >> 6] |= 1ULL << (ch & 63);
+ }
+ 
+ static FORCE_INLINE bool zone_has(const uint64_t *mask, unsigned char ch)
+ {
+     return (mask[ch >> 6] & (1ULL << (ch & 63))) != 0;
+ }
+ 
+ static void compute_zone_maps(IndexBuilder *b, ZoneMap *zones)
+ {
+     int num_zones = NUM_ZONES(b->index->num_records);
+     int z, row, i;
+     
+     memset(zones, 0, num_zones * sizeof(ZoneMap));
+     for (z = 0; z < num_zones; z++)
+     {
+         ZoneMap *zone = &zones[z];
+         int end = Min((z + 1) * SEGMENT_ROWS, b->index->num_records);
+         
+         zone->min_len = MAX_POSITIONS;
+         for (row = z * SEGMENT_ROWS; row < end; row++)
+         {
+             const unsigned char *str = (const unsigned char *)builder_string(b, row);
+             int len = builder_string_len(b, row);
+             int capped = Min(len, MAX_POSITIONS);
+             
+             zone->min_len = Min(zone->min_len, capped);
+             zone->max_len = Max(zone->max_len, capped);
+             for (i = 0; i < len; i++)
+                 zone_set(zone->chars, str[i]);
+             for (i = 0; i < Min(len, ZONE_POSITIONS); i++)
+             {
+                 zone_set(zone->pos_chars[i], str[i]);
+                 zone_set(zone->neg_chars[i], str[len - 1 - i]);
+             }
+         }
+     }
+ }
+ 
+ /* Row-to-value map and its inverse, value-to-rows, by a counting sort */
+ static void write_postings(IndexBuilder *b, uint32_t *row_values, uint32_t *postings)
+ {
+     uint32_t num_values = (uint32_t)b->index->num_records;
+     uint32_t *post_offsets = postings;
+     uint32_t *post_rows = postings + num_values + 1;
+     uint32_t v, row;
+     
+     memcpy(row_values, b->row_values, b->num_rows * sizeof(uint32_t));
+     
+     memset(post_offsets, 0, (num_values + 1) * sizeof(uint32_t));
+     for (row = 0; row < (uint32_t)b->num_rows; row++)
+         post_offsets[b->row_values[row] + 1]++;
+     for (v = 0; v < num_values; v++)
+         post_offsets[v + 1] += post_offsets[v];
+     
+     /* Rows land in ascending order within each value; the cursor ends one value ahead */
+     for (row = 0; row < (uint32_t)b->num_rows; row++)
+         post_rows[post_offsets[b->row_values[row]]++] = row;
+     for (v = num_values; v > 0; v--)
+         post_offsets[v] = post_offsets[v - 1];
+     post_offsets[0] = 0;
+ }
+ 
+ /*
+  * Every string byte's arena offset, sorted by the suffix starting there.  A
+  * suffix ends at its string's NUL, so no match runs into the next value.
+  *
+  * Built by prefix doubling rather than by comparing suffixes, which on long
+  * shared prefixes and duplicate values costs the value length per compare.
+  * After the round with step h the suffixes are ranked by their first 2h
+  * bytes; each round is two counting-sort passes over the arena, and there
+  * are about log2(max_len) of them.  Every NUL ranks below all bytes and
+  * apart from the other NULs, which ends a suffix there and leaves all ranks
+  * distinct once the step passes the longest value.  Needs four uint32 per
+  * arena byte while it runs.
+  */
+ static void write_suffix_array(IndexBuilder *b, uint32_t *suffixes, uint64_t num_suffixes)
+ {
+     uint32_t n = (uint32_t)b->str_offsets[b->index->num_records];
+     uint32_t num_records = (uint32_t)b->index->num_records;
+     uint32_t *sa, *rank, *tmp, *count, *swap;
+     uint32_t i, h, classes, nuls = 0;
+     uint64_t k = 0;
+     
+     if (num_suffixes == 0)
+         return;
+     
+     sa = (uint32_t *)palloc_extended((Size)n * sizeof(uint32_t), MCXT_ALLOC_HUGE);
+     rank = (uint32_t *)palloc_extended((Size)n * sizeof(uint32_t), MCXT_ALLOC_HUGE);
+     tmp = (uint32_t *)palloc_extended((Size)n * sizeof(uint32_t), MCXT_ALLOC_HUGE);
+     count = (uint32_t *)palloc_extended(((Size)n + CHAR_RANGE) * sizeof(uint32_t), MCXT_ALLOC_HUGE);
+     
+     /* First byte: NULs by position, then the bytes by value */
+     for (i = 0; i < n; i++)
+         rank[i] = b->arena[i] == '\0' ? nuls++ : num_records + (unsigned char)b->arena[i];
+     memset(count, 0, ((Size)num_records + CHAR_RANGE) * sizeof(uint32_t));
+     for (i = 0; i < n; i++)
+         count[rank[i]]++;
+     for (i = 1; i < num_records + CHAR_RANGE; i++)
+         count[i] += count[i - 1];
+     for (i = n; i-- > 0;)
+         sa[--count[rank[i]]] = i;
+     
+     tmp[sa[0]] = 0;
+     classes = 1;
+     for (i = 1; i < n; i++)
+         tmp[sa[i]] = rank[sa[i]] == rank[sa[i - 1]] ? classes - 1 : classes++;
+     swap = rank;
+     rank = tmp;
+     tmp = swap;
+     
+     for (h = 1; classes < n; h *= 2)
+     {
+         uint32_t p = 0;
+         
+         CHECK_FOR_INTERRUPTS();
+         
+         /* Order by the second h bytes: suffixes without them come first */
+         for (i = n - h; i < n; i++)
+             tmp[p++] = i;
+         for (i = 0; i < n; i++)
+             if (sa[i] >= h)
+                 tmp[p++] = sa[i] - h;
+         
+         /* then stably by the first h */
+         memset(count, 0, (Size)classes * sizeof(uint32_t));
+         for (i = 0; i < n; i++)
+             count[rank[i]]++;
+         for (i = 1; i < classes; i++)
+             count[i] += count[i - 1];
+         for (i = n; i-- > 0;)
+             sa[--count[rank[tmp[i]]]] = tmp[i];
+         
+         /* and rank by both halves */
+         tmp[sa[0]] = 0;
+         classes = 1;
+         for (i = 1; i < n; i++)
+         {
+             uint32_t prev = sa[i - 1], cur = sa[i];
+             bool prev_tail = (uint64_t)prev + h < n;
+             bool cur_tail = (uint64_t)cur + h < n;
+             bool same = rank[prev] == rank[cur] && prev_tail == cur_tail &&
+                         (!prev_tail || rank[prev + h] == rank[cur + h]);
+             
+             tmp[cur] = same ? classes - 1 : classes++;
+         }
+         swap = rank;
+         rank = tmp;
+         tmp = swap;
+     }
+     
+     for (i = 0; i < n; i++)
+         if (b->arena[sa[i]] != '\0')
+             suffixes[k++] = sa[i];
+     Assert(k == num_suffixes);
+     
+     pfree(sa);
+     pfree(rank);
+     pfree(tmp);
+     pfree(count);
+ }
+ 
+ static void write_index_image(char *image, ImageLayout *layout, IndexBuilder *b,
+                               const char *schema_name, const char *table_name,
+                               const char *column_name)
+ {
+     RoaringIndex *index = b->index;
+     ImageHeader *hdr = (ImageHeader *)image;
+     int i;
+     
+     memset(hdr, 0, sizeof(ImageHeader));
+     hdr->magic = IMAGE_MAGIC;
+     hdr->version = IMAGE_VERSION;
+ #ifdef HAVE_ROARING
+     hdr->flags |= IMAGE_FLAG_CROARING;
+ #endif
+     if (b->non_ascii)
+         hdr->flags |= IMAGE_FLAG_NON_ASCII;
+     if (index->has_grams)
+         hdr->flags |= IMAGE_FLAG_GRAMS;
+     hdr->bigram_positions = index->bigram_positions;
+     hdr->max_gap = index->max_gap;
+     hdr->key_attnum = b->keys ? index->key_attnum : 0;
+     hdr->num_records = builder_num_rows(b);
+     hdr->num_values = index->num_records;
+     hdr->max_len = index->max_len;
+     hdr->num_entries = layout->num_entries;
+     hdr->database_oid = MyDatabaseId;
+     hdr->base_row = index->base_row;
+     hdr->image_size = layout->total_size;
+     hdr->dir_offset = TYPEALIGN(IMAGE_ALIGN, sizeof(ImageHeader));
+     hdr->str_offsets_offset = layout->str_offsets_offset;
+     hdr->tids_offset = layout->tids_offset;
+     hdr->keys_offset = layout->keys_offset;
+     hdr->zones_offset = layout->zones_offset;
+     hdr->row_values_offset = layout->row_values_offset;
+     hdr->postings_offset = layout->postings_offset;
+     hdr->suffixes_offset = layout->suffixes_offset;
+     hdr->num_suffixes = layout->num_suffixes;
+     hdr->arena_offset = layout->total_size - layout->arena_size;
+     hdr->arena_size = layout->arena_size;
+     strlcpy(hdr->schema_name, schema_name, NAMEDATALEN);
+     strlcpy(hdr->table_name, table_name, NAMEDATALEN);
+     strlcpy(hdr->column_name, column_name, NAMEDATALEN);
+     
+     memcpy(image + hdr->dir_offset, layout->entries, layout->num_entries * sizeof(ImageEntry));
+     for (i = 0; i < layout->num_entries; i++)
+         roaring_frozen_write(layout->bitmaps[i], image + layout->entries[i].offset);
+     
+     memcpy(image + hdr->str_offsets_offset, b->str_offsets,
+            (index->num_records + 1) * sizeof(uint64_t));
+     memcpy(image + hdr->arena_offset, b->arena, layout->arena_size);
+     
+     if (b->tids)
+         memcpy(image + hdr->tids_offset, b->tids, hdr->num_records * sizeof(ItemPointerData));
+     if (b->keys)
+         memcpy(image + hdr->keys_offset, b->keys, hdr->num_records * sizeof(int64));
+     if (b->row_values)
+         write_postings(b, (uint32_t *)(image + hdr->row_values_offset),
+                        (uint32_t *)(image + hdr->postings_offset));
+     compute_zone_maps(b, (ZoneMap *)(image + hdr->zones_offset));
+     if (hdr->suffixes_offset)
+         write_suffix_array(b, (uint32_t *)(image + hdr->suffixes_offset), hdr->num_suffixes);
+     
+     pfree(layout->entries);
+     pfree(layout->bitmaps);
+ }
+ 
+ /* Build an index of read-only views over image, allocated in context */
+ static RoaringIndex* attach_index_image(char *image, MemoryContext context)
+ {
+     RoaringIndex *index;
+     ImageHeader *hdr = (ImageHeader *)image;
+     ImageEntry *dir;
+     MemoryContext oldcontext;
+     uint32_t num_grams = 0;
+     uint32_t num_pos_grams = 0;
+     uint32_t num_gap_pairs = 0;
+     int i;
+     
+     if (hdr->magic != IMAGE_MAGIC || hdr->version != IMAGE_VERSION)
+         ereport(ERROR,
+                 (errcode(ERRCODE_DATA_CORRUPTED),
+                  errmsg("invalid optimized_like index image (magic %08X, version %u)",
+                         hdr->magic, hdr->version)));
+ #ifdef HAVE_ROARING
+     if (!(hdr->flags & IMAGE_FLAG_CROARING))
+ #else
+     if (hdr->flags & IMAGE_FLAG_CROARING)
+ #endif
+         ereport(ERROR,
+                 (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+                  errmsg("optimized_like index image was built with a different bitmap backend")));
+     
+     oldcontext = MemoryContextSwitchTo(context);
+     
+     index = (RoaringIndex *)MemoryContextAllocZero(context, sizeof(RoaringIndex));
+     index->context = context;
+     index->num_records = hdr->num_records;
+     index->max_len = hdr->max_len;
+     index->image = image;
+     index->str_offsets = (const uint64_t *)(image + hdr->str_offsets_offset);
+     index->arena = image + hdr->arena_offset;
+     index->non_ascii = (hdr->flags & IMAGE_FLAG_NON_ASCII) != 0;
+     index->has_grams = (hdr->flags & IMAGE_FLAG_GRAMS) != 0;
+     index->bigram_positions = hdr->bigram_positions;
+     index->max_gap = hdr->max_gap;
+     if (hdr->suffixes_offset)
+     {
+         index->suffixes = (const uint32_t *)(image + hdr->suffixes_offset);
+         index->num_suffixes = (uint32_t)hdr->num_suffixes;
+         index->has_suffixes = true;
+     }
+     index->base_row = hdr->base_row;
+     index->tids = hdr->tids_offset ? (const ItemPointerData *)(image + hdr->tids_offset) : NULL;
+     index->keys = hdr->keys_offset ? (const int64 *)(image + hdr->keys_offset) : NULL;
+     index->key_attnum = (AttrNumber)hdr->key_attnum;
+     index->zones = (const ZoneMap *)(image + hdr->zones_offset);
+     index->num_values = hdr->num_values;
+     index->num_zones = NUM_ZONES(hdr->num_values);
+     if (hdr->row_values_offset)
+     {
+         index->row_values = (const uint32_t *)(image + hdr->row_values_offset);
+         index->post_offsets = (const uint32_t *)(image + hdr->postings_offset);
+         index->post_rows = index->post_offsets + hdr->num_values + 1;
+     }
+     index->length_idx.max_length = hdr->max_len + 1;
+     index->length_idx.length_bitmaps = (RoaringBitmap **)palloc0(
+         index->length_idx.max_length * sizeof(RoaringBitmap *));
+     index->length_idx.cards = (uint32_t *)palloc0(index->length_idx.max_length * sizeof(uint32_t));
+     
+     /* Size the position directory and gram table once, from the image directory */
+     dir = (ImageEntry *)(image + hdr->dir_offset);
+     index->pos_dir.num_slots = 1;
+     for (i = 0; i < hdr->num_entries; i++)
+     {
+         if ((dir[i].kind == IMAGE_ENTRY_POS || dir[i].kind == IMAGE_ENTRY_NEG) &&
+             index->pos_dir.slot[dir[i].ch] == 0)
+             index->pos_dir.slot[dir[i].ch] = (uint16_t)index->pos_dir.num_slots++;
+         else if (dir[i].kind == IMAGE_ENTRY_GRAM)
+             num_grams++;
+         else if (dir[i].kind == IMAGE_ENTRY_POS_GRAM || dir[i].kind == IMAGE_ENTRY_NEG_GRAM)
+             num_pos_grams++;
+         else if (dir[i].kind == IMAGE_ENTRY_GAP_PAIR)
+             num_gap_pairs++;
+     }
+     if (index->pos_dir.num_slots > 1)
+         pos_dir_resize(index, index->pos_dir.num_slots, Min(index->max_len, MAX_POSITIONS));
+     if (num_grams > 0)
+         gram_table_reserve(index, &index->grams, num_grams);
+     if (num_pos_grams > 0)
+         gram_table_reserve(index, &index->pos_grams, num_pos_grams);
+     if (num_gap_pairs > 0)
+         gram_table_reserve(index, &index->gap_pairs, num_gap_pairs);
+     
+     for (i = 0; i < hdr->num_entries; i++)
+     {
+         RoaringBitmap *bm = roaring_frozen_view(image + dir[i].offset, dir[i].size);
+         
+         if (!bm)
+             ereport(ERROR,
+                     (errcode(ERRCODE_DATA_CORRUPTED),
+                      errmsg("invalid bitmap in directory entry %d of optimized_like index image", i)));
+         switch (dir[i].kind)
+         {
+             case IMAGE_ENTRY_POS:
+                 set_pos_bitmap(index, dir[i].ch, dir[i].pos, bm)->card = dir[i].card;
+                 break;
+             case IMAGE_ENTRY_NEG:
+                 set_neg_bitmap(index, dir[i].ch, dir[i].pos, bm)->card = dir[i].card;
+                 break;
+             case IMAGE_ENTRY_CHAR:
+                 index->char_cache[dir[i].ch] = bm;
+                 index->char_cards[dir[i].ch] = dir[i].card;
+                 break;
+             case IMAGE_ENTRY_LENGTH:
+                 if (dir[i].pos >= 0 && dir[i].pos < index->length_idx.max_length)
+                 {
+                     index->length_idx.length_bitmaps[dir[i].pos] = bm;
+                     index->length_idx.cards[dir[i].pos] = dir[i].card;
+                 }
+                 break;
+             case IMAGE_ENTRY_TOMBSTONE:
+                 index->tombstones = bm;
+                 break;
+             case IMAGE_ENTRY_MOVED:
+                 index->moved = bm;
+                 break;
+             case IMAGE_ENTRY_NULL_KEYS:
+                 index->null_keys = bm;
+                 break;
+             case IMAGE_ENTRY_GRAM:
+             case IMAGE_ENTRY_POS_GRAM:
+             case IMAGE_ENTRY_NEG_GRAM:
+             case IMAGE_ENTRY_GAP_PAIR:
+                 {
+                     GramEntry *gram = gram_insert(index, image_gram_table(index, dir[i].kind),
+                                                   IMAGE_GRAM_KEY(&dir[i]));
+                     
+                     gram->bitmap = bm;
+                     gram->card = dir[i].card;
+                 }
+                 break;
+             default:
+                 ereport(ERROR,
+                         (errcode(ERRCODE_DATA_CORRUPTED),
+                          errmsg("unknown entry kind %d in optimized_like index image", dir[i].kind)));
+         }
+     }
+     
+     index->memory_used = hdr->image_size +
+         2 * (Size)index->pos_dir.slot_capacity * index->pos_dir.width * sizeof(PosEntry);
+     if (index->grams.slots)
+         index->memory_used += (Size)(index->grams.mask + 1) * sizeof(GramEntry);
+     if (index->pos_grams.slots)
+         index->memory_used += (Size)(index->pos_grams.mask + 1) * sizeof(GramEntry);
+     if (index->gap_pairs.slots)
+         index->memory_used += (Size)(index->gap_pairs.mask + 1) * sizeof(GramEntry);
+     init_query_cache(index);
+     
+     MemoryContextSwitchTo(oldcontext);
+     return index;
+ }
+ 
+ /*
+  * Append the rows of a finished image (a build part) after the builder's own:
+  * every bitmap is shifted by the current row count and ORed in, and the
+  * part's arena is copied in one piece.  The image can be released afterwards.
+  */
+ static void builder_append_image(IndexBuilder *b, const char *image)
+ {
+     RoaringIndex *index = b->index;
+     const ImageHeader *hdr = (const ImageHeader *)image;
+     const ImageEntry *dir = (const ImageEntry *)(image + hdr->dir_offset);
+     const uint64_t *str_offsets = (const uint64_t *)(image + hdr->str_offsets_offset);
+     uint32_t offset = (uint32_t)index->num_records;
+     MemoryContext oldcontext;
+     uint64_t base;
+     uint32_t row;
+     int i;
+     
+     Assert(!b->row_values && !hdr->row_values_offset);
+     if (hdr->num_records == 0)
+         return;
+     
+     builder_reserve(b, hdr->num_records);
+     if (!index->length_idx.length_bitmaps)
+         index->length_idx.length_bitmaps = (RoaringBitmap **)MemoryContextAllocZero(
+             index->context, (MAX_POSITIONS + 1) * sizeof(RoaringBitmap *));
+     
+     /* Gap pairs missing from one part are missing from the whole index */
+     if (index->max_gap > 0 && hdr->max_gap == 0)
+         builder_drop_gap_pairs(b);
+     
+     oldcontext = MemoryContextSwitchTo(index->context);
+     for (i = 0; i < hdr->num_entries; i++)
+     {
+         RoaringBitmap *view;
+         RoaringBitmap *bm;
+         RoaringBitmap *existing = NULL;
+         
+         if (dir[i].kind == IMAGE_ENTRY_GAP_PAIR && index->max_gap == 0)
+             continue;
+         view = roaring_frozen_view(image + dir[i].offset, dir[i].size);
+         bm = roaring_shift(view, offset);
+         roaring_free(view);
+         switch (dir[i].kind)
+         {
+             case IMAGE_ENTRY_POS:
+                 existing = get_pos_bitmap(index, dir[i].ch, dir[i].pos);
+                 break;
+             case IMAGE_ENTRY_NEG:
+                 existing = get_neg_bitmap(index, dir[i].ch, dir[i].pos);
+                 break;
+             case IMAGE_ENTRY_CHAR:
+                 existing = index->char_cache[dir[i].ch];
+                 break;
+             case IMAGE_ENTRY_LENGTH:
+                 existing = index->length_idx.length_bitmaps[dir[i].pos];
+                 break;
+             case IMAGE_ENTRY_NULL_KEYS:
+                 existing = index->null_keys;
+                 break;
+             case IMAGE_ENTRY_GRAM:
+             case IMAGE_ENTRY_POS_GRAM:
+             case IMAGE_ENTRY_NEG_GRAM:
+             case IMAGE_ENTRY_GAP_PAIR:
+                 existing = get_gram_bitmap(image_gram_table(index, dir[i].kind),
+                                            IMAGE_GRAM_KEY(&dir[i]));
+                 break;
+             default:
+                 ereport(ERROR,
+                         (errcode(ERRCODE_DATA_CORRUPTED),
+                          errmsg("unexpected entry kind %d in optimized_like build part", dir[i].kind)));
+         }
+         if (existing)
+         {
+             RoaringBitmap *temp = roaring_or(existing, bm);
+             
+             roaring_free(existing);
+             roaring_free(bm);
+             bm = temp;
+         }
+         switch (dir[i].kind)
+         {
+             case IMAGE_ENTRY_POS:
+                 set_pos_bitmap(index, dir[i].ch, dir[i].pos, bm);
+                 break;
+             case IMAGE_ENTRY_NEG:
+                 set_neg_bitmap(index, dir[i].ch, dir[i].pos, bm);
+                 break;
+             case IMAGE_ENTRY_CHAR:
+                 index->char_cache[dir[i].ch] = bm;
+                 break;
+             case IMAGE_ENTRY_NULL_KEYS:
+                 index->null_keys = bm;
+                 break;
+             case IMAGE_ENTRY_GRAM:
+             case IMAGE_ENTRY_POS_GRAM:
+             case IMAGE_ENTRY_NEG_GRAM:
+             case IMAGE_ENTRY_GAP_PAIR:
+                 gram_insert(index, image_gram_table(index, dir[i].kind),
+                             IMAGE_GRAM_KEY(&dir[i]))->bitmap = bm;
+                 break;
+             default:
+                 index->length_idx.length_bitmaps[dir[i].pos] = bm;
+                 break;
+         }
+     }
+     MemoryContextSwitchTo(oldcontext);
+     
+     base = b->str_offsets[offset];
+     builder_reserve_arena(b, hdr->arena_size);
+     memcpy(b->arena + base, image + hdr->arena_offset, hdr->arena_size);
+     for (row = 1; row <= hdr->num_records; row++)
+         b->str_offsets[offset + row] = base + str_offsets[row];
+     if (b->tids && hdr->tids_offset)
+         memcpy(b->tids + offset, image + hdr->tids_offset, hdr->num_records * sizeof(ItemPointerData));
+     if (b->keys && hdr->keys_offset)
+         memcpy(b->keys + offset, image + hdr->keys_offset, hdr->num_records * sizeof(int64));
+     if (hdr->flags & IMAGE_FLAG_NON_ASCII)
+         b->non_ascii = true;
+     index->num_records += hdr->num_records;
+     index->max_len = Max(index->max_len, (int)hdr->max_len);
+     index->length_idx.max_length = index->max_len + 1;
+ }
+ 
+ /*
+  * roaring_free every bitmap reachable from the index (CRoaring mallocs them)
+  * and close its spill file, if any
+  */
+ static void free_index_bitmaps(RoaringIndex *index)
+ {
+     PosDirectory *dir = &index->pos_dir;
+     int ch, i;
+     
+     for (i = dir->width; i < dir->num_slots * dir->width; i++)
+     {
+         roaring_free(dir->pos[i].bitmap);
+         roaring_free(dir->neg[i].bitmap);
+     }
+     for (ch = 0; ch < CHAR_RANGE; ch++)
+         roaring_free(index->char_cache[ch]);
+     for (i = 0; index->grams.slots && i <= (int)index->grams.mask; i++)
+         roaring_free(index->grams.slots[i].bitmap);
+     for (i = 0; index->pos_grams.slots && i <= (int)index->pos_grams.mask; i++)
+         roaring_free(index->pos_grams.slots[i].bitmap);
+     for (i = 0; index->gap_pairs.slots && i <= (int)index->gap_pairs.mask; i++)
+         roaring_free(index->gap_pairs.slots[i].bitmap);
+     
+     for (i = 0; i < index->length_idx.max_length; i++)
+         roaring_free(index->length_idx.length_bitmaps[i]);
+     roaring_free(index->tombstones);
+     roaring_free(index->moved);
+     roaring_free(index->null_keys);
+     
+     if (index->spill)
+     {
+         FileClose(index->spill->file);
+         munmap(index->spill->mapping, index->spill->mapping_size);
+         index->spill = NULL;
+     }
+ }
+ 
+ /* ==================== BITMAP SPILL ==================== */
+ 
+ /*
+  * A backend-local image larger than optimized_like.memory_budget is built in
+  * an anonymous mapping and copied to a temporary file.  The header, directory,
+  * character/length bitmaps and row data stay in memory; the pages under the
+  * larger positional bitmaps are handed back to the kernel and those bitmaps are
+  * read from the file on first use.  Loaded bitmaps are kept on an LRU list
+  * bounded by whatever the budget leaves after the resident part.  A plan
+  * collects all its bitmaps before intersecting them, so plan_bitmaps() pins
+  * each one it takes until the plan has run; only those may push the index
+  * over its budget.  Any other bitmap returned stays valid until the next one
+  * is loaded.  Shared (DSM) and file-mapped images are never spilled: the
+  * former must stay addressable by every backend and the kernel already pages
+  * the latter.
+  */
+ 
+ #define SPILL_COPY_CHUNK ((Size)1 << 20)
+ 
+ static int memory_budget = 0;   /* kB, 0 = unlimited */
+ 
+ static bool spill_wanted(Size image_size)
+ {
+     return memory_budget > 0 && image_size > (Size)memory_budget * 1024;
+ }
+ 
+ /* Reserve address space for an image without committing memory up front */
+ static char* spill_mapping_create(Size image_size)
+ {
+     char *mapping = mmap(NULL, image_size, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+     
+     if (mapping == MAP_FAILED)
+         ereport(ERROR,
+                 (errcode(ERRCODE_OUT_OF_MEMORY),
+                  errmsg("could not map %zu bytes for optimized_like index: %m", image_size)));
+     return mapping;
+ }
+ 
+ static void spill_read(SpillState *spill, char *buffer, Size size, uint64_t offset)
+ {
+     while (size > 0)
+     {
+         int chunk = (int)Min(size, (Size)1 << 30);
+         int rc = FileRead(spill->file, buffer, chunk, (off_t)offset, PG_WAIT_EXTENSION);
+         
+         if (rc < 0)
+             ereport(ERROR,
+                     (errcode_for_file_access(),
+                      errmsg("could not read optimized_like spill file: %m")));
+         if (rc != chunk)
+             ereport(ERROR,
+                     (errcode(ERRCODE_DATA_CORRUPTED),
+                      errmsg("could not read optimized_like spill file: read %d of %d bytes",
+                             rc, chunk)));
+         buffer += chunk;
+         offset += chunk;
+         size -= chunk;
+     }
+ }
+ 
+ static void spill_write(SpillState *spill, const char *buffer, Size size)
+ {
+     uint64_t offset = 0;
+     
+     while (size > 0)
+     {
+         int chunk = (int)Min(size, (Size)1 << 30);
+         int rc;
+         
+         errno = 0;
+         rc = FileWrite(spill->file, (char *)buffer, chunk, (off_t)offset, PG_WAIT_EXTENSION);
+         if (rc != chunk)
+         {
+             if (rc >= 0 && errno == 0)
+                 errno = ENOSPC;
+             ereport(ERROR,
+                     (errcode_for_file_access(),
+                      errmsg("could not write optimized_like spill file: %m")));
+         }
+         buffer += chunk;
+         offset += chunk;
+         size -= chunk;
+     }
+ }
+ 
+ static void spill_evict(SpillState *spill)
+ {
+     SpilledBitmap *sb = dlist_tail_element(SpilledBitmap, lru_node, &spill->lru);
+     
+     dlist_delete(&sb->lru_node);
+     roaring_free(sb->owner->bitmap);
+     sb->owner->bitmap = NULL;
+     pfree(sb->buffer);
+     sb->buffer = NULL;
+     spill->loaded -= sb->size;
+     spill->num_loaded--;
+     spill->evictions++;
+ }
+ 
+ /* Return a spilled entry's bitmap, reading it back from the file if needed */
+ static RoaringBitmap* spill_touch(RoaringIndex *index, PosEntry *entry)
+ {
+     SpillState *spill = index->spill;
+     SpilledBitmap *sb = entry->spilled;
+     RoaringBitmap *bitmap = NULL;
+     MemoryContext oldcontext;
+     char *buffer;
+     
+     if (entry->bitmap)
+     {
+         spill->hits++;
+         if (!sb->pinned)
+             dlist_move_head(&spill->lru, &sb->lru_node);
+         return entry->bitmap;
+     }
+     
+     spill->misses++;
+     while (!dlist_is_empty(&spill->lru) && spill->loaded + sb->size > spill->budget)
+         spill_evict(spill);
+     
+     /* The entry only takes the buffer once it holds a valid bitmap */
+     buffer = (char *)MemoryContextAllocHuge(index->context, sb->size + IMAGE_ALIGN);
+     PG_TRY();
+     {
+         spill_read(spill, (char *)TYPEALIGN(IMAGE_ALIGN, buffer), sb->size, sb->offset);
+         oldcontext = MemoryContextSwitchTo(index->context);
+         bitmap = roaring_frozen_view((char *)TYPEALIGN(IMAGE_ALIGN, buffer), sb->size);
+         MemoryContextSwitchTo(oldcontext);
+         if (!bitmap)
+             ereport(ERROR,
+                     (errcode(ERRCODE_DATA_CORRUPTED),
+                      errmsg("invalid bitmap in optimized_like spill file at offset " UINT64_FORMAT,
+                             sb->offset)));
+     }
+     PG_CATCH();
+     {
+         pfree(buffer);
+         PG_RE_THROW();
+     }
+     PG_END_TRY();
+     sb->buffer = buffer;
+     entry->bitmap = bitmap;
+     
+     dlist_push_head(&spill->lru, &sb->lru_node);
+     spill->loaded += sb->size;
+     spill->num_loaded++;
+     return entry->bitmap;
+ }
+ 
+ /* Keep a loaded spilled bitmap from eviction until spill_unpin_all() */
+ static void spill_pin(RoaringIndex *index, PosEntry *entry)
+ {
+     SpilledBitmap *sb = entry ? entry->spilled : NULL;
+     
+     if (!sb || !entry->bitmap || sb->pinned)
+         return;
+     dlist_delete(&sb->lru_node);
+     dlist_push_head(&index->spill->pinned, &sb->lru_node);
+     sb->pinned = true;
+ }
+ 
+ /* Hand every pinned bitmap back to the LRU list */
+ static void spill_unpin_all(RoaringIndex *index)
+ {
+     SpillState *spill = index->spill;
+     
+     if (!spill)
+         return;
+     while (!dlist_is_empty(&spill->pinned))
+     {
+         SpilledBitmap *sb = dlist_head_element(SpilledBitmap, lru_node, &spill->pinned);
+         
+         dlist_delete(&sb->lru_node);
+         dlist_push_head(&spill->lru, &sb->lru_node);
+         sb->pinned = false;
+     }
+ }
+ 
+ /*
+  * Move the positional bitmaps of an index attached over a spill mapping out
+  * to a temporary file.  Only whole pages inside a payload are released, so
+  * bitmaps smaller than a page stay resident as ordinary views.
+  */
+ static void spill_index(RoaringIndex *index)
+ {
+     ImageHeader *hdr = (ImageHeader *)index->image;
+     ImageEntry *dir = (ImageEntry *)(index->image + hdr->dir_offset);
+     Size page_size = (Size)sysconf(_SC_PAGESIZE);
+     Size budget = (Size)memory_budget * 1024;
+     SpillState *spill;
+     int i;
+     
+     spill = (SpillState *)MemoryContextAllocZero(index->context, sizeof(SpillState));
+     spill->mapping = index->image;
+     spill->mapping_size = hdr->image_size;
+     spill->resident = hdr->image_size;
+     dlist_init(&spill->lru);
+     dlist_init(&spill->pinned);
+     spill->file = OpenTemporaryFile(true);
+     index->spill = spill;
+     spill_write(spill, index->image, hdr->image_size);
+     
+     for (i = 0; i < hdr->num_entries; i++)
+     {
+         uintptr_t start = TYPEALIGN(page_size, (uintptr_t)(index->image + dir[i].offset));
+         uintptr_t end = TYPEALIGN_DOWN(page_size,
+                                        (uintptr_t)(index->image + dir[i].offset + dir[i].size));
+         PosEntry *entry;
+         SpilledBitmap *sb;
+         
+         if (end <= start)
+             continue;
+         if (dir[i].kind == IMAGE_ENTRY_POS)
+         {
+             roaring_free(get_pos_bitmap(index, dir[i].ch, dir[i].pos));
+             entry = set_pos_bitmap(index, dir[i].ch, dir[i].pos, NULL);
+         }
+         else if (dir[i].kind == IMAGE_ENTRY_NEG)
+         {
+             roaring_free(get_neg_bitmap(index, dir[i].ch, dir[i].pos));
+             entry = set_neg_bitmap(index, dir[i].ch, dir[i].pos, NULL);
+         }
+         else
+             continue;
+         
+         sb = (SpilledBitmap *)MemoryContextAllocZero(index->context, sizeof(SpilledBitmap));
+         sb->offset = dir[i].offset;
+         sb->size = dir[i].size;
+         sb->owner = entry;
+         entry->spilled = sb;
+         
+         if (madvise((void *)start, end - start, MADV_DONTNEED) == 0)
+             spill->resident -= end - start;
+     }
+     
+     spill->budget = budget > spill->resident ? budget - spill->resident : 0;
+     index->memory_used = spill->resident;
+ }
+ 
+ /* ==================== INDEX REGISTRY ==================== */
+ 
+ /*
+  * Every built or loaded index is registered under (relation oid, column)
+  * in a backend-local hash table.  Each entry owns its RoaringIndex, and
+  * with it a private memory context and query cache, plus whatever backs
+  * the image: a DSM segment, an mmap'd file, or the index context.
+  */
+ 
+ typedef struct {
+     Oid relid;
+     AttrNumber attnum;
+ } IndexKey;
+ 
+ /* Changes applied since the build, see INCREMENTAL MAINTENANCE */
+ typedef struct {
+     RoaringIndex *index;
+     dsm_segment *segment;       /* NULL when the image is in index->context */
+     bool pinned;                /* segment is referenced from a shared slot */
+ } DeltaSegment;
+ 
+ typedef struct {
+     IndexKey key;               /* hash key, must be first */
+     RoaringIndex *index;
+     dsm_segment *segment;
+     char *mapped_image;
+     Size mapped_size;
+     uint64 generation;          /* shared slot generation, 0 if backend-local */
+     
+     int num_deltas;
+     DeltaSegment deltas[MAX_DELTA_SEGMENTS];
+     RoaringBitmap *deleted;     /* union of the delta tombstones */
+     RoaringBitmap *moved;       /* union of the delta moved rows */
+     uint64 delta_generation;
+ } LoadedIndex;
+ 
+ static HTAB *index_registry = NULL;
+ 
+ /* Index used by the single-argument functions: the last one built or loaded */
+ static IndexKey default_key;
+ 
+ static FORCE_INLINE IndexKey make_index_key(Oid relid, AttrNumber attnum)
+ {
+     IndexKey key;
+     
+     /* Hashed as raw bytes, so the padding has to be zero */
+     memset(&key, 0, sizeof(key));
+     key.relid = relid;
+     key.attnum = attnum;
+     return key;
+ }
+ 
+ static void registry_relcache_callback(Datum arg, Oid relid);
+ 
+ static void registry_init(void)
+ {
+     HASHCTL ctl;
+     
+     if (index_registry)
+         return;
+     
+     memset(&ctl, 0, sizeof(ctl));
+     ctl.keysize = sizeof(IndexKey);
+     ctl.entrysize = sizeof(LoadedIndex);
+     index_registry = hash_create("optimized_like indexes", 16, &ctl,
+                                  HASH_ELEM | HASH_BLOBS);
+     CacheRegisterRelcacheCallback(registry_relcache_callback, (Datum)0);
+ }
+ 
+ static void release_deltas(LoadedIndex *entry)
+ {
+     int i;
+     
+     for (i = 0; i < entry->num_deltas; i++)
+     {
+         DeltaSegment *delta = &entry->deltas[i];
+         
+         free_index_bitmaps(delta->index);
+         MemoryContextDelete(delta->index->context);
+         if (delta->segment)
+             dsm_detach(delta->segment);
+     }
+     entry->num_deltas = 0;
+     entry->delta_generation = 0;
+     
+     roaring_free(entry->deleted);
+     entry->deleted = NULL;
+     roaring_free(entry->moved);
+     entry->moved = NULL;
+ }
+ 
+ /* acc OR bm, either of which may be NULL; acc is consumed */
+ static RoaringBitmap* roaring_or_into(RoaringBitmap *acc, const RoaringBitmap *bm)
+ {
+     RoaringBitmap *temp;
+     
+     if (!bm)
+         return acc;
+     if (!acc)
+         return roaring_copy(bm);
+     temp = roaring_or(acc, bm);
+     roaring_free(acc);
+     return temp;
+ }
+ 
+ /* Recompute the unions of all delta tombstones and moved rows */
+ static void rebuild_deleted(LoadedIndex *entry)
+ {
+     MemoryContext oldcontext = MemoryContextSwitchTo(entry->index->context);
+     int i;
+     
+     roaring_free(entry->deleted);
+     entry->deleted = NULL;
+     roaring_free(entry->moved);
+     entry->moved = NULL;
+     
+     for (i = 0; i < entry->num_deltas; i++)
+     {
+         entry->deleted = roaring_or_into(entry->deleted, entry->deltas[i].index->tombstones);
+         entry->moved = roaring_or_into(entry->moved, entry->deltas[i].index->moved);
+     }
+     MemoryContextSwitchTo(oldcontext);
+ }
+ 
+ static void release_loaded_index(LoadedIndex *entry)
+ {
+     release_deltas(entry);
+     
+     if (entry->index)
+     {
+         free_index_bitmaps(entry->index);
+         MemoryContextDelete(entry->index->context);
+         entry->index = NULL;
+     }
+     
+     if (entry->segment)
+     {
+         dsm_detach(entry->segment);
+         entry->segment = NULL;
+     }
+     
+     if (entry->mapped_image)
+     {
+         munmap(entry->mapped_image, entry->mapped_size);
+         entry->mapped_image = NULL;
+         entry->mapped_size = 0;
+     }
+ }
+ 
+ static void drop_loaded_index(IndexKey key)
+ {
+     LoadedIndex *entry;
+     
+     registry_init();
+     entry = (LoadedIndex *)hash_search(index_registry, &key, HASH_FIND, NULL);
+     if (!entry)
+         return;
+     
+     release_loaded_index(entry);
+     hash_search(index_registry, &key, HASH_REMOVE, NULL);
+ }
+ 
+ /* Take ownership of an attached image, replacing any index under the same key */
+ static LoadedIndex* register_index(IndexKey key, RoaringIndex *index, dsm_segment *seg,
+                                    char *mapped_image, Size mapped_size)
+ {
+     LoadedIndex *entry;
+     bool found;
+     
+     registry_init();
+     entry = (LoadedIndex *)hash_search(index_registry, &key, HASH_ENTER, &found);
+     if (found)
+         release_loaded_index(entry);
+     
+     entry->index = index;
+     entry->segment = seg;
+     entry->mapped_image = mapped_image;
+     entry->mapped_size = mapped_size;
+     entry->generation = 0;
+     entry->num_deltas = 0;
+     entry->deleted = NULL;
+     entry->moved = NULL;
+     entry->delta_generation = 0;
+     return entry;
+ }
+ 
+ /* ==================== SHARED INDEX (DSM) ==================== */
+ 
+ /*
+  * When the library is in shared_preload_libraries, a built image is copied
+  * into a pinned DSM segment whose handle is published in a slot here.  Other
+  * backends notice the generation bump and attach the segment read-only, so
+  * each index costs O(index) memory instead of O(connections x index).
+  */
+ 
+ typedef struct {
+     Oid database_oid;           /* InvalidOid while the slot is free */
+     IndexKey key;
+     uint64 generation;
+     dsm_handle handle;
+     char path[MAXPGPATH];       /* set instead of handle for a loaded file */
+     
+     uint64 delta_generation;
+     int num_deltas;
+     dsm_handle delta_handles[MAX_DELTA_SEGMENTS];
+ } SharedIndexSlot;
+ 
+ typedef struct {
+     LWLock *lock;
+     LWLock *maintenance_lock;       /* serializes delta and compaction writers */
+     pg_atomic_uint64 generation;    /* bumped by every publish and drop */
+     int num_slots;
+     SharedIndexSlot slots[FLEXIBLE_ARRAY_MEMBER];
+ } SharedIndexState;
+ 
+ static SharedIndexState *shared_state = NULL;
+ static uint64 seen_generation = 0;
+ 
+ static void attach_shared_deltas(LoadedIndex *entry, SharedIndexSlot *slot);
+ static int max_shared_indexes = 64;
+ 
+ static char *index_file_setting = NULL;
+ static char *index_file_mapped = NULL;
+ 
+ static RoaringIndex* map_index_file(const char *path, char **image, Size *size);
+ static char* resolve_index_path(const char *name);
+ static IndexKey image_index_key(ImageHeader *hdr);
+ 
+ static bool registry_prune_pending = false;
+ static void prune_dropped_indexes(void);
+ 
+ static shmem_startup_hook_type prev_shmem_startup_hook = NULL;
+ #if PG_VERSION_NUM >= 150000
+ static shmem_request_hook_type prev_shmem_request_hook = NULL;
+ #endif
+ 
+ void _PG_init(void);
+ 
+ static Size shared_state_size(void)
+ {
+     return add_size(offsetof(SharedIndexState, slots),
+                     mul_size(max_shared_indexes, sizeof(SharedIndexSlot)));
+ }
+ 
+ static void optimized_like_shmem_request(void)
+ {
+ #if PG_VERSION_NUM >= 150000
+     if (prev_shmem_request_hook)
+         prev_shmem_request_hook();
+ #endif
+     RequestAddinShmemSpace(MAXALIGN(shared_state_size()));
+     RequestNamedLWLockTranche("optimized_like", 2);
+ }
+ 
+ static void optimized_like_shmem_startup(void)
+ {
+     bool found;
+     int i;
+     
+     if (prev_shmem_startup_hook)
+         prev_shmem_startup_hook();
+     
+     LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+     shared_state = (SharedIndexState *)ShmemInitStruct("optimized_like",
+                                                        shared_state_size(),
+                                                        &found);
+     if (!found)
+     {
+         shared_state->lock = &(GetNamedLWLockTranche("optimized_like"))[0].lock;
+         shared_state->maintenance_lock = &(GetNamedLWLockTranche("optimized_like"))[1].lock;
+         pg_atomic_init_u64(&shared_state->generation, 0);
+         shared_state->num_slots = max_shared_indexes;
+         for (i = 0; i < max_shared_indexes; i++)
+         {
+             shared_state->slots[i].database_oid = InvalidOid;
+             shared_state->slots[i].handle = DSM_HANDLE_INVALID;
+             shared_state->slots[i].num_deltas = 0;
+         }
+     }
+     LWLockRelease(AddinShmemInitLock);
+ }
+ 
+ void _PG_init(void)
+ {
+ #ifndef HAVE_ROARING
+     bitset_kernels_init();
+ #endif
+     DefineCustomStringVariable("optimized_like.index_file",
+                                "Index file under PGDATA/" INDEX_FILE_DIR " to map when its index is not loaded.",
+                                NULL,
+                                &index_file_setting,
+                                NULL,
+                                PGC_SUSET,
+                                0,
+                                NULL, NULL, NULL);
+     DefineCustomIntVariable("optimized_like.max_shared_indexes",
+                             "Number of indexes that can be shared between backends at once.",
+                             NULL,
+                             &max_shared_indexes,
+                             64,
+                             1,
+                             4096,
+                             PGC_POSTMASTER,
+                             0,
+                             NULL, NULL, NULL);
+     DefineCustomIntVariable("optimized_like.memory_budget",
+                             "Memory a backend-local index may use before its positional bitmaps are spilled to a temporary file.",
+                             "0 keeps every index fully in memory.",
+                             &memory_budget,
+                             0,
+                             0,
+                             INT_MAX,
+                             PGC_USERSET,
+                             GUC_UNIT_KB,
+                             NULL, NULL, NULL);
+     DefineCustomIntVariable("optimized_like.bigram_positions",
+                             "Leading and trailing positions at which bigrams are indexed, for anchored patterns.",
+                             "0 indexes none.  Takes effect when an index is built; the index then keeps it.",
+                             &bigram_positions,
+                             0,
+                             0,
+                             MAX_POSITIONS,
+                             PGC_USERSET,
+                             0,
+                             NULL, NULL, NULL);
+     DefineCustomBoolVariable("optimized_like.suffix_array",
+                              "Build a suffix array over the indexed strings, for infix patterns on long values.",
+                              "Takes effect when an index is built; the index then keeps it.",
+                              &suffix_array,
+                              false,
+                              PGC_USERSET,
+                              0,
+                              NULL, NULL, NULL);
+     DefineCustomIntVariable("optimized_like.gap_pairs",
+                             "Largest run of '_' around which byte pairs are indexed, for patterns like %a_b%.",
+                             "0 indexes none.  Takes effect when an index is built; the index then keeps it.",
+                             &gap_pairs,
+                             0,
+                             0,
+                             16,
+                             PGC_USERSET,
+                             0,
+                             NULL, NULL, NULL);
+     DefineCustomIntVariable("optimized_like.gap_pair_alphabet",
+                             "Most distinct bytes the indexed values may hold and still get gap pairs.",
+                             NULL,
+                             &gap_pair_alphabet,
+                             64,
+                             2,
+                             CHAR_RANGE,
+                             PGC_USERSET,
+                             0,
+                             NULL, NULL, NULL);
+     DefineCustomBoolVariable("optimized_like.build_messages",
+                              "Report the progress and size of index builds and loads at INFO level.",
+                              "When off they are logged at DEBUG1 instead.",
+                              &build_messages,
+                              true,
+                              PGC_USERSET,
+                              0,
+                              NULL, NULL, NULL);
+     DefineCustomBoolVariable("optimized_like.ngram_index",
+                              "Index the bigrams and trigrams of every value, for infix patterns.",
+                              "Takes effect when an index is built; the index then keeps it.",
+                              &ngram_index,
+                              false,
+                              PGC_USERSET,
+                              0,
+                              NULL, NULL, NULL);
+ #if PG_VERSION_NUM >= 150000
+     MarkGUCPrefixReserved("optimized_like");
+ #else
+     EmitWarningsOnPlaceholders("optimized_like");
+ #endif
+     
+     /* Without preloading indexes stay backend-local */
+     if (!process_shared_preload_libraries_in_progress)
+         return;
+     
+ #if PG_VERSION_NUM >= 150000
+     prev_shmem_request_hook = shmem_request_hook;
+     shmem_request_hook = optimized_like_shmem_request;
+ #else
+     optimized_like_shmem_request();
+ #endif
+     prev_shmem_startup_hook = shmem_startup_hook;
+     shmem_startup_hook = optimized_like_shmem_startup;
+ }
+ 
+ static SharedIndexSlot* find_shared_slot(IndexKey key, bool for_insert)
+ {
+     SharedIndexSlot *free_slot = NULL;
+     int i;
+     
+     for (i = 0; i < shared_state->num_slots; i++)
+     {
+         SharedIndexSlot *slot = &shared_state->slots[i];
+         
+         if (slot->database_oid == InvalidOid)
+         {
+             if (!free_slot)
+                 free_slot = slot;
+         }
+         else if (slot->database_oid == MyDatabaseId &&
+                  slot->key.relid == key.relid && slot->key.attnum == key.attnum)
+             return slot;
+     }
+     return for_insert ? free_slot : NULL;
+ }
+ 
+ static void attach_shared_deltas(LoadedIndex *entry, SharedIndexSlot *slot)
+ {
+     int i;
+     
+     release_deltas(entry);
+     for (i = 0; i < slot->num_deltas; i++)
+     {
+         DeltaSegment *delta = &entry->deltas[i];
+         
+         /* Merged away meanwhile; keep the base alone until the next sync */
+         delta->segment = dsm_attach(slot->delta_handles[i]);
+         if (!delta->segment)
+         {
+             release_deltas(entry);
+             return;
+         }
+         dsm_pin_mapping(delta->segment);
+         delta->pinned = true;
+         delta->index = attach_index_image((char *)dsm_segment_address(delta->segment),
+                                           AllocSetContextCreate(TopMemoryContext,
+                                                                 "RoaringLikeIndexDelta",
+                                                                 ALLOCSET_SMALL_SIZES));
+         entry->num_deltas++;
+     }
+     rebuild_deleted(entry);
+     entry->delta_generation = slot->delta_generation;
+ }
+ 
+ /* Attach whatever other backends published since we last looked */
+ static void sync_shared_indexes(void)
+ {
+     SharedIndexSlot *slots;
+     HASH_SEQ_STATUS status;
+     LoadedIndex *entry;
+     uint64 generation, newest;
+     int nslots = 0, i;
+     
+     if (!shared_state ||
+         pg_atomic_read_u64(&shared_state->generation) == seen_generation)
+         return;
+     
+     slots = (SharedIndexSlot *)palloc(shared_state->num_slots * sizeof(SharedIndexSlot));
+     LWLockAcquire(shared_state->lock, LW_SHARED);
+     generation = pg_atomic_read_u64(&shared_state->generation);
+     for (i = 0; i < shared_state->num_slots; i++)
+     {
+         if (shared_state->slots[i].database_oid == MyDatabaseId)
+             slots[nslots++] = shared_state->slots[i];
+     }
+     LWLockRelease(shared_state->lock);
+     
+     registry_init();
+     newest = seen_generation;
+     
+     /* Forget shared indexes that were dropped or replaced elsewhere */
+     hash_seq_init(&status, index_registry);
+     while ((entry = (LoadedIndex *)hash_seq_search(&status)) != NULL)
+     {
+         bool current = (entry->generation == 0);
+         
+         for (i = 0; i < nslots && !current; i++)
+             current = slots[i].key.relid == entry->key.relid &&
+                       slots[i].key.attnum == entry->key.attnum &&
+                       slots[i].generation == entry->generation;
+         if (!current)
+         {
+             release_loaded_index(entry);
+             hash_search(index_registry, &entry->key, HASH_REMOVE, NULL);
+         }
+     }
+     
+     for (i = 0; i < nslots; i++)
+     {
+         RoaringIndex *index;
+         
+         entry = (LoadedIndex *)hash_search(index_registry, &slots[i].key, HASH_FIND, NULL);
+         if (entry && entry->generation == slots[i].generation)
+         {
+             if (entry->delta_generation != slots[i].delta_generation)
+                 attach_shared_deltas(entry, &slots[i]);
+             continue;
+         }
+         
+         if (slots[i].path[0])
+         {
+             /* Every backend maps the same file, so the page cache is shared */
+             char *image;
+             Size size;
+             
+             index = map_index_file(slots[i].path, &image, &size);
+             entry = register_index(slots[i].key, index, NULL, image, size);
+         }
+         else
+         {
+             /* A NULL attach means it was replaced meanwhile; the next sync picks that up */
+             dsm_segment *seg = dsm_attach(slots[i].handle);
+             
+             if (!seg)
+                 continue;
+             dsm_pin_mapping(seg);
+             index = attach_index_image((char *)dsm_segment_address(seg),
+                                        AllocSetContextCreate(TopMemoryContext,
+                                                              "RoaringLikeIndex",
+                                                              ALLOCSET_DEFAULT_SIZES));
+             entry = register_index(slots[i].key, index, seg, NULL, 0);
+         }
+         entry->generation = slots[i].generation;
+         if (slots[i].delta_generation != 0)
+             attach_shared_deltas(entry, &slots[i]);
+         
+         /* The newest index published since we last looked becomes the default */
+         if (slots[i].generation > newest)
+         {
+             newest = slots[i].generation;
+             default_key = slots[i].key;
+         }
+     }
+     
+     seen_generation = generation;
+     pfree(slots);
+ }
+ 
+ /* Publish either a DSM segment or an index file path for key */
+ static void publish_shared_index(LoadedIndex *entry, const char *path)
+ {
+     dsm_handle old_handles[MAX_DELTA_SEGMENTS + 1];
+     int num_old = 0, i;
+     SharedIndexSlot *slot;
+     
+     LWLockAcquire(shared_state->lock, LW_EXCLUSIVE);
+     slot = find_shared_slot(entry->key, true);
+     if (!slot)
+     {
+         LWLockRelease(shared_state->lock);
+         ereport(WARNING,
+                 (errcode(ERRCODE_INSUFFICIENT_RESOURCES),
+                  errmsg("no free shared index slot, index stays backend-local"),
+                  errhint("Increase optimized_like.max_shared_indexes or drop unused indexes.")));
+         return;
+     }
+     
+     if (entry->segment)
+         dsm_pin_segment(entry->segment);
+     if (slot->database_oid != InvalidOid)
+     {
+         old_handles[num_old++] = slot->handle;
+         for (i = 0; i < slot->num_deltas; i++)
+             old_handles[num_old++] = slot->delta_handles[i];
+     }
+     
+     /* A new base image starts without deltas */
+     slot->database_oid = MyDatabaseId;
+     slot->key = entry->key;
+     slot->handle = entry->segment ? dsm_segment_handle(entry->segment) : DSM_HANDLE_INVALID;
+     strlcpy(slot->path, path ? path : "", MAXPGPATH);
+     slot->num_deltas = 0;
+     slot->delta_generation = 0;
+     slot->generation = pg_atomic_add_fetch_u64(&shared_state->generation, 1);
+     entry->generation = slot->generation;
+     LWLockRelease(shared_state->lock);
+     
+     /* Backends still attached to the old images keep them alive until they detach */
+     for (i = 0; i < num_old; i++)
+         if (old_handles[i] != DSM_HANDLE_INVALID)
+             dsm_unpin_segment(old_handles[i]);
+ }
+ 
+ static void unpublish_shared_index(IndexKey key)
+ {
+     dsm_handle old_handles[MAX_DELTA_SEGMENTS + 1];
+     int num_old = 0, i;
+     SharedIndexSlot *slot;
+     
+     LWLockAcquire(shared_state->lock, LW_EXCLUSIVE);
+     slot = find_shared_slot(key, false);
+     if (slot)
+     {
+         old_handles[num_old++] = slot->handle;
+         for (i = 0; i < slot->num_deltas; i++)
+             old_handles[num_old++] = slot->delta_handles[i];
+         slot->database_oid = InvalidOid;
+         slot->handle = DSM_HANDLE_INVALID;
+         slot->path[0] = '\0';
+         slot->num_deltas = 0;
+         pg_atomic_add_fetch_u64(&shared_state->generation, 1);
+     }
+     LWLockRelease(shared_state->lock);
+     
+     for (i = 0; i < num_old; i++)
+         if (old_handles[i] != DSM_HANDLE_INVALID)
+             dsm_unpin_segment(old_handles[i]);
+ }
+ 
+ /* Replace the deltas of a shared index after a maintenance batch */
+ static void publish_shared_deltas(LoadedIndex *entry)
+ {
+     dsm_handle old_handles[MAX_DELTA_SEGMENTS];
+     int num_old = 0, i, j;
+     SharedIndexSlot *slot;
+     
+     LWLockAcquire(shared_state->lock, LW_EXCLUSIVE);
+     slot = find_shared_slot(entry->key, false);
+     if (!slot || slot->generation != entry->generation)
+     {
+         /* Not shared (no free slot at build time): the deltas stay local */
+         LWLockRelease(shared_state->lock);
+         return;
+     }
+     
+     for (i = 0; i < entry->num_deltas; i++)
+     {
+         if (!entry->deltas[i].pinned)
+         {
+             dsm_pin_segment(entry->deltas[i].segment);
+             entry->deltas[i].pinned = true;
+         }
+     }
+     
+     /* Unpin the segments that were merged away */
+     for (j = 0; j < slot->num_deltas; j++)
+     {
+         bool kept = false;
+         
+         for (i = 0; i < entry->num_deltas && !kept; i++)
+             kept = dsm_segment_handle(entry->deltas[i].segment) == slot->delta_handles[j];
+         if (!kept)
+             old_handles[num_old++] = slot->delta_handles[j];
+     }
+     
+     slot->num_deltas = entry->num_deltas;
+     for (i = 0; i < entry->num_deltas; i++)
+         slot->delta_handles[i] = dsm_segment_handle(entry->deltas[i].segment);
+     slot->delta_generation = pg_atomic_add_fetch_u64(&shared_state->generation, 1);
+     entry->delta_generation = slot->delta_generation;
+     LWLockRelease(shared_state->lock);
+     
+     for (j = 0; j < num_old; j++)
+         dsm_unpin_segment(old_handles[j]);
+ }
+ 
+ /* Map optimized_like.index_file once, if set and not mapped yet */
+ static void load_index_file_setting(void)
+ {
+     RoaringIndex *index;
+     char *image;
+     Size size;
+     
+     if (!index_file_setting || !index_file_setting[0])
+         return;
+     if (index_file_mapped && strcmp(index_file_mapped, index_file_setting) == 0)
+         return;
+     
+     if (index_file_mapped)
+         pfree(index_file_mapped);
+     index_file_mapped = MemoryContextStrdup(TopMemoryContext, index_file_setting);
+     
+     index = map_index_file(resolve_index_path(index_file_setting), &image, &size);
+     default_key = image_index_key((ImageHeader *)image);
+     register_index(default_key, index, NULL, image, size);
+ }
+ 
+ /* Bring the registry up to date; LoadedIndex pointers stay valid until the next call */
+ static void registry_refresh(void)
+ {
+     sync_shared_indexes();
+     load_index_file_setting();
+     registry_init();
+     if (registry_prune_pending)
+         prune_dropped_indexes();
+ }
+ 
+ static LoadedIndex* lookup_index(IndexKey key)
+ {
+     registry_refresh();
+     return (LoadedIndex *)hash_search(index_registry, &key, HASH_FIND, NULL);
+ }
+ 
+ static LoadedIndex* lookup_default_index(void)
+ {
+     return lookup_index(default_key);
+ }
+ 
+ /* (relation oid, column number) for user-supplied table and column names */
+ static IndexKey resolve_index_key(text *table_name, text *column_name)
+ {
+     char *column_str = text_to_cstring(column_name);
+     Oid relid;
+     AttrNumber attnum;
+     
+     relid = RangeVarGetRelid(makeRangeVarFromNameList(textToQualifiedNameList(table_name)),
+                              AccessShareLock, false);
+     attnum = get_attnum(relid, column_str);
+     if (attnum == InvalidAttrNumber)
+         ereport(ERROR,
+                 (errcode(ERRCODE_UNDEFINED_COLUMN),
+                  errmsg("column \"%s\" of relation \"%s\" does not exist",
+                         column_str, get_rel_name(relid))));
+     
+     return make_index_key(relid, attnum);
+ }
+ 
+ /* Index for a saved image, looked up by the names it was built from */
+ static IndexKey image_index_key(ImageHeader *hdr)
+ {
+     Oid nspid = get_namespace_oid(hdr->schema_name, false);
+     Oid relid = get_relname_relid(hdr->table_name, nspid);
+     AttrNumber attnum;
+     
+     if (!OidIsValid(relid))
+         ereport(ERROR,
+                 (errcode(ERRCODE_UNDEFINED_TABLE),
+                  errmsg("relation \"%s.%s\" of the index file does not exist",
+                         hdr->schema_name, hdr->table_name)));
+     
+     attnum = get_attnum(relid, hdr->column_name);
+     if (attnum == InvalidAttrNumber)
+         ereport(ERROR,
+                 (errcode(ERRCODE_UNDEFINED_COLUMN),
+                  errmsg("column \"%s\" of relation \"%s.%s\" does not exist",
+                         hdr->column_name, hdr->schema_name, hdr->table_name)));
+     
+     return make_index_key(relid, attnum);
+ }
+ 
+ /* ==================== PERSISTENT INDEX FILE ==================== */
+ 
+ /*
+  * The on-disk format is the image itself, so loading is an mmap plus a
+  * check that the header, directory and sections fit the file and that it
+  * comes from this database: bitmaps are used in place and pages fault in on
+  * demand.  Files live in PGDATA/pg_optimized_like.
+  */
+ 
+ static char* resolve_index_path(const char *name)
+ {
+     if (name[0] == '\0' || is_absolute_path(name) || path_contains_parent_reference(name))
+         ereport(ERROR,
+                 (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                  errmsg("invalid index file name \"%s\"", name),
+                  errhint("Use a relative name; files are kept in PGDATA/%s.", INDEX_FILE_DIR)));
+     
+     return psprintf("%s/%s", INDEX_FILE_DIR, name);
+ }
+ 
+ static void save_index_file(RoaringIndex *index, const char *path)
+ {
+     ImageHeader *hdr = (ImageHeader *)index->image;
+     char *tmppath = psprintf("%s.tmp", path);
+     char *copybuf = NULL;
+     Size written = 0;
+     int fd;
+     
+     if (MakePGDirectory(INDEX_FILE_DIR) < 0 && errno != EEXIST)
+         ereport(ERROR,
+                 (errcode_for_file_access(),
+                  errmsg("could not create directory \"%s\": %m", INDEX_FILE_DIR)));
+     
+     fd = OpenTransientFile(tmppath, O_WRONLY | O_CREAT | O_TRUNC | PG_BINARY);
+     if (fd < 0)
+         ereport(ERROR,
+                 (errcode_for_file_access(),
+                  errmsg("could not create file \"%s\": %m", tmppath)));
+     
+     /* A spilled image is only partly in memory; copy it from its spill file */
+     if (index->spill)
+         copybuf = (char *)palloc(SPILL_COPY_CHUNK);
+     
+     while (written < hdr->image_size)
+     {
+         Size chunk = Min(hdr->image_size - written, (Size)1 << 30);
+         const char *src = index->image + written;
+         ssize_t rc;
+         
+         if (copybuf)
+         {
+             chunk = Min(chunk, SPILL_COPY_CHUNK);
+             spill_read(index->spill, copybuf, chunk, written);
+             src = copybuf;
+         }
+         rc = write(fd, src, chunk);
+         
+         if (rc <= 0)
+         {
+             if (rc < 0 && errno == EINTR)
+                 continue;
+             if (rc == 0)
+                 errno = ENOSPC;
+             ereport(ERROR,
+                     (errcode_for_file_access(),
+                      errmsg("could not write file \"%s\": %m", tmppath)));
+         }
+         written += rc;
+     }
+     
+     if (pg_fsync(fd) != 0)
+         ereport(ERROR,
+                 (errcode_for_file_access(),
+                  errmsg("could not fsync file \"%s\": %m", tmppath)));
+     CloseTransientFile(fd);
+     if (copybuf)
+         pfree(copybuf);
+     
+     durable_rename(tmppath, path, ERROR);
+     pfree(tmppath);
+ }
+ 
+ static FORCE_INLINE bool image_section_valid(uint64_t offset, uint64_t len, Size size)
+ {
+     return offset % IMAGE_ALIGN == 0 && offset <= size && len <= size - offset;
+ }
+ 
+ /*
+  * Name of the first part of an image read from disk that does not lie inside
+  * its size bytes or is not well formed, or NULL when all are sound.  The
+  * header must already have been checked against the size.  Everything a query
+  * indexes with a stored number is checked here: directory positions, bitmap
+  * values against the row and value counts, string offsets, postings and
+  * suffixes.  This is linear in the image, as reading it was.
+  */
+ static const char* image_bounds_error(const char *image, Size size)
+ {
+     const ImageHeader *hdr = (const ImageHeader *)image;
+     const ImageEntry *dir = (const ImageEntry *)(image + hdr->dir_offset);
+     const uint64_t *str_offsets = (const uint64_t *)(image + hdr->str_offsets_offset);
+     int width = (int)Min(hdr->max_len, (uint32_t)MAX_POSITIONS);
+     uint64_t i;
+     
+     if (hdr->max_len > MAX_POSITIONS || hdr->num_values > hdr->num_records)
+         return "header";
+     if (!image_section_valid(hdr->dir_offset, (uint64_t)hdr->num_entries * sizeof(ImageEntry), size))
+         return "directory";
+     for (i = 0; i < hdr->num_entries; i++)
+     {
+         uint64_t bound = hdr->num_values;
+         
+         if (!image_section_valid(dir[i].offset, dir[i].size, size))
+             return "bitmap";
+         switch (dir[i].kind)
+         {
+             case IMAGE_ENTRY_POS:
+             case IMAGE_ENTRY_NEG:
+                 if (dir[i].pos < 0 || dir[i].pos >= width)
+                     return "directory";
+                 break;
+             case IMAGE_ENTRY_CHAR:
+                 if (dir[i].pos != 0)
+                     return "directory";
+                 break;
+             case IMAGE_ENTRY_LENGTH:
+                 if (dir[i].pos < 0 || dir[i].pos > width)
+                     return "directory";
+                 break;
+             case IMAGE_ENTRY_TOMBSTONE:
+             case IMAGE_ENTRY_MOVED:
+                 bound = hdr->base_row;
+                 break;
+             case IMAGE_ENTRY_NULL_KEYS:
+                 bound = hdr->num_records;
+                 break;
+             case IMAGE_ENTRY_GRAM:
+             case IMAGE_ENTRY_POS_GRAM:
+             case IMAGE_ENTRY_NEG_GRAM:
+             case IMAGE_ENTRY_GAP_PAIR:
+                 break;
+             default:
+                 return "directory";
+         }
+         if (!roaring_frozen_check(image + dir[i].offset, dir[i].size, bound))
+             return "bitmap";
+     }
+     
+     if (!image_section_valid(hdr->str_offsets_offset,
+                              ((uint64_t)hdr->num_values + 1) * sizeof(uint64_t), size))
+         return "string offsets";
+     if (!image_section_valid(hdr->arena_offset, hdr->arena_size, size) ||
+         str_offsets[0] != 0 || str_offsets[hdr->num_values] != hdr->arena_size)
+         return "string arena";
+     /* Every string ends in its own NUL, so the offsets strictly increase */
+     for (i = 0; i < hdr->num_values; i++)
+         if (str_offsets[i + 1] <= str_offsets[i] ||
+             image[hdr->arena_offset + str_offsets[i + 1] - 1] != '\0')
+             return "string offsets";
+     if (hdr->tids_offset &&
+         !image_section_valid(hdr->tids_offset, (uint64_t)hdr->num_records * sizeof(ItemPointerData), size))
+         return "tids";
+     if (hdr->keys_offset &&
+         !image_section_valid(hdr->keys_offset, (uint64_t)hdr->num_records * sizeof(int64), size))
+         return "keys";
+     if (hdr->row_values_offset)
+     {
+         const uint32_t *row_values = (const uint32_t *)(image + hdr->row_values_offset);
+         const uint32_t *post_offsets = (const uint32_t *)(image + hdr->postings_offset);
+         const uint32_t *post_rows = post_offsets + hdr->num_values + 1;
+         
+         if (!image_section_valid(hdr->row_values_offset, (uint64_t)hdr->num_records * sizeof(uint32_t), size) ||
+             !image_section_valid(hdr->postings_offset,
+                                  ((uint64_t)hdr->num_values + 1 + hdr->num_records) * sizeof(uint32_t), size) ||
+             post_offsets[0] != 0 || post_offsets[hdr->num_values] != hdr->num_records)
+             return "postings";
+         for (i = 0; i < hdr->num_values; i++)
+             if (post_offsets[i + 1] < post_offsets[i])
+                 return "postings";
+         for (i = 0; i < hdr->num_records; i++)
+             if (row_values[i] >= hdr->num_values || post_rows[i] >= hdr->num_records)
+                 return "postings";
+     }
+     if (!image_section_valid(hdr->zones_offset,
+                              (uint64_t)NUM_ZONES(hdr->num_values) * sizeof(ZoneMap), size))
+         return "zone maps";
+     if (hdr->suffixes_offset)
+     {
+         const uint32_t *suffixes = (const uint32_t *)(image + hdr->suffixes_offset);
+         
+         if (hdr->num_suffixes > hdr->arena_size ||
+             !image_section_valid(hdr->suffixes_offset, hdr->num_suffixes * sizeof(uint32_t), size))
+             return "suffix array";
+         for (i = 0; i < hdr->num_suffixes; i++)
+             if (suffixes[i] >= hdr->arena_size)
+                 return "suffix array";
+     }
+     return NULL;
+ }
+ 
+ /* Map path read-only and attach it; the caller owns image and size */
+ static RoaringIndex* map_index_file(const char *path, char **image_out, Size *size_out)
+ {
+     struct stat st;
+     ImageHeader *hdr;
+     RoaringIndex *index = NULL;
+     MemoryContext context;
+     char *image;
+     int fd;
+     
+     fd = OpenTransientFile(path, O_RDONLY | PG_BINARY);
+     if (fd < 0)
+         ereport(ERROR,
+                 (errcode_for_file_access(),
+                  errmsg("could not open index file \"%s\": %m", path)));
+     
+     if (fstat(fd, &st) < 0)
+         ereport(ERROR,
+                 (errcode_for_file_access(),
+                  errmsg("could not stat index file \"%s\": %m", path)));
+     
+     if ((Size)st.st_size < sizeof(ImageHeader))
+         ereport(ERROR,
+                 (errcode(ERRCODE_DATA_CORRUPTED),
+                  errmsg("index file \"%s\" is truncated", path)));
+     
+     image = (char *)mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+     if (image == MAP_FAILED)
+         ereport(ERROR,
+                 (errcode_for_file_access(),
+                  errmsg("could not map index file \"%s\": %m", path)));
+     CloseTransientFile(fd);
+     
+     hdr = (ImageHeader *)image;
+     if (hdr->magic != IMAGE_MAGIC || hdr->version != IMAGE_VERSION ||
+         hdr->image_size != (uint64_t)st.st_size)
+     {
+         munmap(image, st.st_size);
+         ereport(ERROR,
+                 (errcode(ERRCODE_DATA_CORRUPTED),
+                  errmsg("\"%s\" is not a valid optimized_like index file", path)));
+     }
+     else
+     {
+         const char *bad = image_bounds_error(image, st.st_size);
+         
+         if (bad)
+         {
+             munmap(image, st.st_size);
+             ereport(ERROR,
+                     (errcode(ERRCODE_DATA_CORRUPTED),
+                      errmsg("index file \"%s\" is corrupted", path),
+                      errdetail("The %s section is not valid.", bad)));
+         }
+     }
+     
+     /* Tids and relation names only mean something in the database that built it */
+     if (hdr->database_oid != MyDatabaseId)
+     {
+         Oid database_oid = hdr->database_oid;
+         
+         munmap(image, st.st_size);
+         ereport(ERROR,
+                 (errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+                  errmsg("index file \"%s\" was built in another database", path),
+                  errdetail("It belongs to the database with OID %u.", database_oid)));
+     }
+     
+     /* A bad bitmap only shows when attached; do not leak the mapping then */
+     context = AllocSetContextCreate(TopMemoryContext, "RoaringLikeIndex", ALLOCSET_DEFAULT_SIZES);
+     PG_TRY();
+     {
+         index = attach_index_image(image, context);
+     }
+     PG_CATCH();
+     {
+         munmap(image, st.st_size);
+         MemoryContextDelete(context);
+         PG_RE_THROW();
+     }
+     PG_END_TRY();
+     
+     *image_out = image;
+     *size_out = st.st_size;
+     return index;
+ }
+ 
+ /* ==================== PATTERN ANALYSIS ==================== */
+ 
+ typedef struct {
+     char **slices;
+     int slice_count;
+     bool starts_with_percent;
+     bool ends_with_percent;
+ } PatternInfo;
+ 
+ static PatternInfo* analyze_pattern(const char *pattern)
+ {
+     PatternInfo *info = (PatternInfo *)palloc(sizeof(PatternInfo));
+     int plen = strlen(pattern);
+     int slice_cap = 16;
+     int slice_count = 0;
+     const char *start = pattern;
+     const char *p;
+     int len;
+     
+     info->starts_with_percent = (plen > 0 && pattern[0] == '%');
+     info->ends_with_percent = (plen > 0 && pattern[plen - 1] == '%');
+     info->slices = (char **)palloc(slice_cap * sizeof(char *));
+     
+     for (p = pattern; *p; p++)
+     {
+         if (*p == '%')
+         {
+             len = p - start;
+             if (len > 0)
+             {
+                 if (slice_count >= slice_cap)
+                 {
+                     slice_cap *= 2;
+                     info->slices = (char **)repalloc(info->slices, slice_cap * sizeof(char *));
+                 }
+                 info->slices[slice_count++] = pnstrdup(start, len);
+             }
+             start = p + 1;
+         }
+     }
+     
+     len = p - start;
+     if (len > 0)
+     {
+         if (slice_count >= slice_cap)
+         {
+             slice_cap *= 2;
+             info->slices = (char **)repalloc(info->slices, slice_cap * sizeof(char *));
+         }
+         info->slices[slice_count++] = pnstrdup(start, len);
+     }
+     
+     info->slice_count = slice_count;
+     return info;
+ }
+ 
+ static void free_pattern_info(PatternInfo *info)
+ {
+     for (int i = 0; i < info->slice_count; i++)
+         pfree(info->slices[i]);
+     pfree(info->slices);
+     pfree(info);
+ }
+ 
+ /* ==================== OPTIMIZED MATCHING FUNCTIONS ==================== */
+ 
+ /*
+  * Rows of the segments whose zone maps admit the pattern, or NULL when all
+  * of them do.  An empty result means nothing can match.
+  */
+ static RoaringBitmap* zone_filter(RoaringIndex *index, const char *pattern, PatternInfo *info)
+ {
+     const char *prefix = info->starts_with_percent ? NULL : info->slices[0];
+     const char *suffix = info->ends_with_percent ? NULL : info->slices[info->slice_count - 1];
+     int suffix_len = suffix ? strlen(suffix) : 0;
+     bool exact = strchr(pattern, '%') == NULL;
+     int min_len = 0, live = 0, z, i;
+     RoaringBitmap *rows;
+     bool *admit;
+     
+     if (!index->zones || index->num_zones == 0)
+         return NULL;
+     
+     for (i = 0; pattern[i]; i++)
+         if (pattern[i] != '%')
+             min_len++;
+     min_len = Min(min_len, MAX_POSITIONS);
+     
+     admit = (bool *)palloc(index->num_zones * sizeof(bool));
+     for (z = 0; z < index->num_zones; z++)
+     {
+         const ZoneMap *zone = &index->zones[z];
+         bool ok = zone->max_len >= min_len && (!exact || zone->min_len <= min_len);
+         
+         for (i = 0; ok && pattern[i]; i++)
+             if (pattern[i] != '%' && pattern[i] != '_')
+                 ok = zone_has(zone->chars, (unsigned char)pattern[i]);
+         for (i = 0; ok && prefix && prefix[i] && i < ZONE_POSITIONS; i++)
+             if (prefix[i] != '_')
+                 ok = zone_has(zone->pos_chars[i], (unsigned char)prefix[i]);
+         for (i = 0; ok && i < Min(suffix_len, ZONE_POSITIONS); i++)
+             if (suffix[suffix_len - 1 - i] != '_')
+                 ok = zone_has(zone->neg_chars[i], (unsigned char)suffix[suffix_len - 1 - i]);
+         
+         admit[z] = ok;
+         live += ok;
+     }
+     
+     if (live == index->num_zones)
+     {
+         pfree(admit);
+         return NULL;
+     }
+     
+     rows = roaring_create();
+     for (z = 0; z < index->num_zones; z++)
+         if (admit[z])
+             roaring_add_range(rows, z * SEGMENT_ROWS,
+                               Min((z + 1) * SEGMENT_ROWS, index->num_values));
+     pfree(admit);
+     return rows;
+ }
+ 
+ /* Optimized contiguous pattern matching */
+ static FORCE_INLINE bool matches_at_position(const char *str, const char *pattern)
+ {
+     const char *s = str;
+     const char *p = pattern;
+     
+     while (*p)
+     {
+         if (*p == '_')
+         {
+             if (unlikely(!*s)) return false;
+             s++;
+             p++;
+         }
+         else if (likely(*s == *p))
+         {
+             s++;
+             p++;
+         }
+         else
+         {
+             return false;
+         }
+     }
+     
+     return true;
+ }
+ 
+ /* First match of pattern (plen bytes) that lies entirely before end */
+ static FORCE_INLINE const char* find_pattern(const char *str, const char *end,
+                                              const char *pattern, int plen)
+ {
+     const char *s = str;
+     const char *last = end - plen;
+     
+     while (s <= last)
+     {
+         PREFETCH(s + 64);
+         if (matches_at_position(s, pattern))
+             return s;
+         s++;
+     }
+     
+     return NULL;
+ }
+ 
+ static FORCE_INLINE bool contains_substring(const char *str, int len,
+                                              const char *pattern, int plen)
+ {
+     return find_pattern(str, str + len, pattern, plen) != NULL;
+ }
+ 
+ /* Full '%' / '_' wildcard match with backtracking on the last '%' */
+ static bool like_match(const char *str, const char *pattern)
+ {
+     const char *s = str;
+     const char *p = pattern;
+     const char *star = NULL;
+     const char *retry = NULL;
+     
+     while (*s)
+     {
+         if (*p == '%')
+         {
+             while (*p == '%')
+                 p++;
+             if (!*p)
+                 return true;
+             star = p;
+             retry = s;
+         }
+         else if (*p && (*p == '_' || *p == *s))
+         {
+             p++;
+             s++;
+         }
+         else if (star)
+         {
+             p = star;
+             s = ++retry;
+         }
+         else
+         {
+             return false;
+         }
+     }
+     
+     while (*p == '%')
+         p++;
+     return *p == '\0';
+ }
+ 
+ /*
+  * Verification feeds the candidates to a matcher a batch at a time.  Matches
+  * are added to verified when one is given and counted either way, so a count
+  * needs neither the candidate array nor a result bitmap.
+  */
+ 
+ #define VERIFY_BATCH 4096
+ 
+ typedef bool (*ValueMatcher)(const char *str, int len, const void *arg);
+ 
+ /* The slices of a pattern with their lengths, for the matchers below */
+ typedef struct {
+     PatternInfo *info;
+     int *slice_lens;
+ } SliceMatch;
+ 
+ /* Every slice, in order and without overlap */
+ static bool match_slices(const char *str, int len, const void *arg)
+ {
+     const SliceMatch *m = (const SliceMatch *)arg;
+     const char *end = str + len;
+     const char *search_start = str;
+     int j;
+     
+     for (j = 0; j < m->info->slice_count; j++)
+     {
+         const char *slice_ptr = m->info->slices[j];
+         const char *match_pos = find_pattern(search_start, end, slice_ptr, m->slice_lens[j]);
+         
+         if (unlikely(!match_pos))
+             return false;
+         
+         search_start = match_pos;
+         while (*search_start && *slice_ptr)
+         {
+             if (*slice_ptr == '_' || *search_start == *slice_ptr)
+             {
+                 search_start++;
+                 slice_ptr++;
+             }
+             else
+             {
+                 break;
+             }
+         }
+     }
+     return true;
+ }
+ 
+ /* The lone slice of %slice% anywhere */
+ static bool match_substring(const char *str, int len, const void *arg)
+ {
+     const SliceMatch *m = (const SliceMatch *)arg;
+     
+     return contains_substring(str, len, m->info->slices[0], m->slice_lens[0]);
+ }
+ 
+ /* The whole pattern, passed as arg */
+ static bool match_like(const char *str, int len, const void *arg)
+ {
+     return like_match(str, (const char *)arg);
+ }
+ 
+ static uint64_t verify_candidates(RoaringIndex *index, const RoaringBitmap *candidates,
+                                   ValueMatcher matcher, const void *arg, RoaringBitmap *verified)
+ {
+     uint32_t batch[VERIFY_BATCH];
+     RoaringIterator it;
+     uint64_t count = 0;
+     uint32_t n, i;
+     
+     roaring_iterator_start(candidates, &it);
+     while ((n = roaring_iterator_read(&it, batch, VERIFY_BATCH)) > 0)
+     {
+         for (i = 0; i < n; i++)
+         {
+             if (i + 1 < n)
+                 PREFETCH(index_string(index, batch[i + 1]));
+             
+             if (matcher(index_string(index, batch[i]), index_string_len(index, batch[i]), arg))
+             {
+                 if (verified)
+                     roaring_add(verified, batch[i]);
+                 count++;
+             }
+         }
+     }
+     roaring_iterator_end(&it);
+     return count;
+ }
+ 
+ static RoaringBitmap* get_length_range(RoaringIndex *index, int min_len, int max_len)
+ {
+     RoaringBitmap *result = roaring_create();
+     RoaringBitmap *temp_union;
+     int len;
+     
+     /* The last length bucket also holds every longer string */
+     if (min_len > MAX_POSITIONS)
+         min_len = MAX_POSITIONS;
+     if (max_len < 0 || max_len >= index->length_idx.max_length)
+         max_len = index->length_idx.max_length - 1;
+     
+     for (len = min_len; len <= max_len; len++)
+     {
+         if (index->length_idx.length_bitmaps[len])
+         {
+             temp_union = roaring_or(result, index->length_idx.length_bitmaps[len]);
+             roaring_free(result);
+             result = temp_union;
+         }
+     }
+     
+     return result;
+ }
+ 
+ /* ==================== SUFFIX ARRAY ==================== */
+ 
+ /*
+  * With optimized_like.suffix_array the image also holds the arena's suffix
+  * array.  The occurrences of a literal are one contiguous range of it, found
+  * by two binary searches, and each maps to its value through str_offsets.
+  * That answers a %literal% slice exactly however long the values are, where
+  * grams and chars only narrow it.
+  */
+ 
+ /* Entries [*lo, *hi) of the suffix array whose suffix starts with the len bytes at s */
+ static void suffix_range(RoaringIndex *index, const char *s, int len, uint32_t *lo, uint32_t *hi)
+ {
+     uint32_t l = 0, h = index->num_suffixes;
+     
+     while (l < h)
+     {
+         uint32_t mid = l + (h - l) / 2;
+         
+         if (strncmp(index->arena + index->suffixes[mid], s, len) < 0)
+             l = mid + 1;
+         else
+             h = mid;
+     }
+     *lo = l;
+     
+     h = index->num_suffixes;
+     while (l < h)
+     {
+         uint32_t mid = l + (h - l) / 2;
+         
+         if (strncmp(index->arena + index->suffixes[mid], s, len) <= 0)
+             l = mid + 1;
+         else
+             h = mid;
+     }
+     *hi = l;
+ }
+ 
+ /* Value id of the string holding arena offset pos */
+ static FORCE_INLINE uint32_t suffix_value(RoaringIndex *index, uint64_t pos)
+ {
+     uint32_t l = 0, h = (uint32_t)index->num_values;
+     
+     /* str_offsets[l] <= pos < str_offsets[h] */
+     while (h - l > 1)
+     {
+         uint32_t mid = l + (h - l) / 2;
+         
+         if (index->str_offsets[mid] <= pos)
+             l = mid;
+         else
+             h = mid;
+     }
+     return l;
+ }
+ 
+ /* Values holding the occurrences [lo, hi) */
+ static RoaringBitmap* suffix_values(RoaringIndex *index, uint32_t lo, uint32_t hi)
+ {
+     RoaringBitmap *result = roaring_create();
+     uint32_t i;
+     
+     for (i = lo; i < hi; i++)
+         roaring_add(result, suffix_value(index, index->suffixes[i]));
+     return result;
+ }
+ 
+ /* ==================== QUERY PLANNER ==================== */
+ 
+ /*
+  * optimized_query() turns the pattern into terms, each a bitmap every match
+  * must be in: the char bitmap of each distinct character, the positional
+  * bitmaps (or positional bigrams, where built) of an anchored prefix, the
+  * negative ones of an anchored suffix and a length range.  Optional indexes
+  * add the trigrams of every literal run of the slices (its bigram when it is
+  * two bytes long), the bytes around each short run of '_' as gap pairs, and
+  * suffix array hits.  These are what narrow an infix slice; its chars alone
+  * leave most of a small alphabet's rows to verify.  The image directory
+  * carries every bitmap's cardinality, so terms are priced without touching
+  * a bitmap (or reading a spilled one back).  Taken from the most selective
+  * down and assuming independence, a term is ANDed only while the candidates
+  * it should remove would cost more to verify against their strings than
+  * the AND does; near-full bitmaps never pay for themselves, and one holding
+  * every value is a no-op.
+  *
+  * A single anchored slice can be answered from bitmaps alone once all of its
+  * required terms are applied, and so can a lone %literal% slice from the
+  * suffix array.  For those the planner also prices that plan and keeps
+  * whichever of the two is cheaper.
+  */
+ 
+ #define PLAN_AND_COST           1.0     /* per candidate, per bitmap ANDed */
+ #define PLAN_VERIFY_COST        8.0     /* per candidate checked against its string */
+ #define PLAN_VERIFY_BYTE_COST   0.25    /* ... plus this per byte of the string */
+ #define PLAN_SUFFIX_HIT_COST    4.0     /* per suffix array hit mapped to its value */
+ 
+ typedef enum {
+     TERM_CHAR,
+     TERM_POS,
+     TERM_NEG,
+     TERM_LENGTH,
+     TERM_GRAM,
+     TERM_POS_GRAM,
+     TERM_SUFFIX,
+     TERM_GAP_PAIR
+ } PlanTermKind;
+ 
+ typedef struct {
+     PlanTermKind kind;
+     unsigned char ch;
+     int pos;                    /* position, shortest length, or the gram's key */
+     int max_len;                /* TERM_LENGTH: longest length, -1 for no limit */
+     uint64_t card;
+     uint32_t lo, hi;            /* TERM_SUFFIX: range of the suffix array */
+     bool required;              /* needed for an answer without verification */
+     bool anchor;                /* positional term of an anchored slice */
+     bool chosen;
+ } PlanTerm;
+ 
+ typedef struct {
+     PlanTerm terms[MAX_AND_INPUTS];
+     int num_terms;
+     int num_grams;              /* gram, gap pair and suffix array terms */
+     bool empty;                 /* some term is empty, so nothing matches */
+     bool verify;                /* candidates must be checked against the strings */
+     bool anchors_applied;       /* every anchor term holds for the candidates */
+     double est_rows;
+ } QueryPlan;
+ 
+ static void plan_add(QueryPlan *plan, PlanTermKind kind, unsigned char ch, int pos,
+                      int max_len, uint64_t card, bool required, bool anchor)
+ {
+     PlanTerm *t;
+     
+     if (card == 0)
+         plan->empty = true;
+     
+     Assert(plan->num_terms < MAX_AND_INPUTS);
+     t = &plan->terms[plan->num_terms++];
+     t->kind = kind;
+     t->ch = ch;
+     t->pos = pos;
+     t->max_len = max_len;
+     t->card = card;
+     t->required = required;
+     t->anchor = anchor;
+     t->chosen = false;
+ }
+ 
+ /* Values whose length falls in [min_len, max_len], as get_length_range() counts them */
+ static uint64_t length_range_card(RoaringIndex *index, int min_len, int max_len)
+ {
+     uint64_t card = 0;
+     int len;
+     
+     if (min_len > MAX_POSITIONS)
+         min_len = MAX_POSITIONS;
+     if (max_len < 0 || max_len >= index->length_idx.max_length)
+         max_len = index->length_idx.max_length - 1;
+     for (len = min_len; len <= max_len; len++)
+         card += index->length_idx.cards[len];
+     return card;
+ }
+ 
+ /*
+  * Positional terms of an anchored slice, from the front or from the back.
+  * Within the index's bigram_positions two adjacent bytes take one positional
+  * bigram, which stands for both of their positional bitmaps.
+  */
+ static void plan_add_anchor(RoaringIndex *index, QueryPlan *plan, const char *slice,
+                             bool from_end, bool required)
+ {
+     int plen = strlen(slice);
+     int i;
+     
+     for (i = 0; i < plen && i < MAX_POSITIONS; i++)
+     {
+         int at = from_end ? plen - 1 - i : i;
+         unsigned char ch = (unsigned char)slice[at];
+         
+         if (ch == '_')
+             continue;
+         if (i < index->bigram_positions && i + 1 < plen)
+         {
+             unsigned char next = (unsigned char)slice[from_end ? at - 1 : at + 1];
+             uint32_t key = from_end ? POS_GRAM_KEY(next, ch, i, true)
+                                     : POS_GRAM_KEY(ch, next, i, false);
+             
+             if (next != '_')
+             {
+                 plan_add(plan, TERM_POS_GRAM, 0, (int)key, 0,
+                          get_gram_card(&index->pos_grams, key), required, true);
+                 i++;
+                 continue;
+             }
+         }
+         if (from_end)
+             plan_add(plan, TERM_NEG, ch, -(i + 1), 0, get_neg_card(index, ch, -(i + 1)),
+                      required, true);
+         else
+             plan_add(plan, TERM_POS, ch, i, 0, get_pos_card(index, ch, i), required, true);
+     }
+ }
+ 
+ /* A TERM_GRAM or TERM_GAP_PAIR term, once per key */
+ static void plan_add_gram(QueryPlan *plan, PlanTermKind kind, GramTable *table, uint32_t key)
+ {
+     int i;
+     
+     if (plan->num_grams >= MAX_GRAM_TERMS)
+         return;
+     for (i = 0; i < plan->num_terms; i++)
+         if (plan->terms[i].kind == kind && plan->terms[i].pos == (int)key)
+             return;
+     plan->num_grams++;
+     plan_add(plan, kind, 0, (int)key, 0, get_gram_card(table, key), false, false);
+ }
+ 
+ /* N-gram terms of a slice, from each run of bytes between '_' wildcards */
+ static void plan_add_grams(RoaringIndex *index, QueryPlan *plan, const char *slice)
+ {
+     int len = strlen(slice);
+     int start, end, i;
+     
+     for (start = 0; start < len; start = end + 1)
+     {
+         for (end = start; end < len && slice[end] != '_'; end++)
+             ;
+         if (end - start == 2)
+             plan_add_gram(plan, TERM_GRAM, &index->grams,
+                           GRAM_KEY(slice[start], slice[start + 1], 0));
+         for (i = start; i + 2 < end; i++)
+             plan_add_gram(plan, TERM_GRAM, &index->grams,
+                           GRAM_KEY(slice[i], slice[i + 1], slice[i + 2]));
+     }
+ }
+ 
+ /* Gap pair terms of a slice: the bytes on either side of each run of '_' */
+ static void plan_add_gap_pairs(RoaringIndex *index, QueryPlan *plan, const char *slice)
+ {
+     int i, j;
+     
+     for (i = 0; slice[i]; i = j)
+     {
+         for (j = i + 1; slice[j] == '_'; j++)
+             ;
+         if (!slice[j])
+             break;
+         if (slice[i] != '_' && j - i - 1 >= 1 && j - i - 1 <= index->max_gap)
+             plan_add_gram(plan, TERM_GAP_PAIR, &index->gap_pairs,
+                           GRAM_KEY(slice[i], slice[j], j - i - 1));
+     }
+ }
+ 
+ /*
+  * Suffix array term of a slice: the occurrences of its longest run of bytes
+  * between '_' wildcards, if at least two long.  Returns whether one was added.
+  */
+ static bool plan_add_suffix(RoaringIndex *index, QueryPlan *plan, const char *slice, bool required)
+ {
+     int len = strlen(slice);
+     int best = 0, best_len = 0;
+     int start, end;
+     uint32_t lo, hi;
+     PlanTerm *t;
+     
+     for (start = 0; start < len; start = end + 1)
+     {
+         for (end = start; end < len && slice[end] != '_'; end++)
+             ;
+         if (end - start > best_len)
+         {
+             best = start;
+             best_len = end - start;
+         }
+     }
+     if (best_len < 2 || plan->num_grams >= MAX_GRAM_TERMS)
+         return false;
+     
+     suffix_range(index, slice + best, best_len, &lo, &hi);
+     plan->num_grams++;
+     plan_add(plan, TERM_SUFFIX, 0, 0, 0, Min(hi - lo, (uint32_t)index->num_values), required, false);
+     t = &plan->terms[plan->num_terms - 1];
+     t->lo = lo;
+     t->hi = hi;
+     return true;
+ }
+ 
+ static int compare_plan_terms(const void *a, const void *b)
+ {
+     uint64_t ca = ((const PlanTerm *)a)->card;
+     uint64_t cb = ((const PlanTerm *)b)->card;
+     
+     return ca < cb ? -1 : ca > cb ? 1 : 0;
+ }
+ 
+ /* Cost of ANDing term t into est candidates; a length range or suffix hits are built first */
+ static FORCE_INLINE double plan_and_cost(const PlanTerm *t, double est)
+ {
+     double cost = PLAN_AND_COST * Min(est, (double)t->card);
+     
+     if (t->kind == TERM_LENGTH && t->pos != t->max_len)
+         cost += PLAN_AND_COST * t->card;
+     else if (t->kind == TERM_SUFFIX)
+         cost += PLAN_SUFFIX_HIT_COST * (t->hi - t->lo);
+     return cost;
+ }
+ 
+ /* start_rows is the candidate count before any term: the zone filter's, or all values */
+ static QueryPlan* plan_query(RoaringIndex *index, const char *pattern, PatternInfo *info,
+                              uint64_t start_rows)
+ {
+     QueryPlan *plan = (QueryPlan *)palloc0(sizeof(QueryPlan));
+     const char *first = info->slices[0];
+     const char *last = info->slices[info->slice_count - 1];
+     bool anchored = info->slice_count == 1 &&
+                     !(info->starts_with_percent && info->ends_with_percent);
+     bool exact = strchr(pattern, '%') == NULL;
+     bool infix = false;
+     double total = (double)Max(index->num_values, 1);
+     double avg_len = (double)index->str_offsets[index->num_values] / total;
+     double verify_cost = PLAN_VERIFY_COST + avg_len * PLAN_VERIFY_BYTE_COST;
+     double est, cost, est_exact, cost_exact;
+     bool seen[CHAR_RANGE] = {false};
+     int min_len = 0;
+     int i;
+     
+     for (i = 0; pattern[i]; i++)
+     {
+         unsigned char ch = (unsigned char)pattern[i];
+         
+         if (ch != '_' && ch != '%' && !seen[ch])
+         {
+             seen[ch] = true;
+             plan_add(plan, TERM_CHAR, ch, 0, 0, index->char_cards[ch], false, false);
+         }
+     }
+     
+     if (index->has_grams)
+     {
+         for (i = 0; i < info->slice_count; i++)
+             plan_add_grams(index, plan, info->slices[i]);
+     }
+     if (index->max_gap > 0)
+     {
+         for (i = 0; i < info->slice_count; i++)
+             plan_add_gap_pairs(index, plan, info->slices[i]);
+     }
+     
+     /* The suffix array answers a lone %literal% by itself */
+     if (index->suffixes)
+     {
+         bool lone = info->slice_count == 1 && !anchored && !strchr(first, '_');
+         
+         for (i = 0; i < info->slice_count; i++)
+             if (plan_add_suffix(index, plan, info->slices[i], lone))
+                 infix = lone;
+     }
+     
+     /* An exact match is found by its prefix; its suffix only narrows */
+     if (!info->starts_with_percent)
+         plan_add_anchor(index, plan, first, false, anchored);
+     if (!info->ends_with_percent)
+         plan_add_anchor(index, plan, last, true, anchored && !exact);
+     
+     /* Slices match disjoint stretches, so their lengths add up */
+     for (i = 0; i < info->slice_count; i++)
+         min_len += strlen(info->slices[i]);
+     if (exact)
+     {
+         min_len = Min(min_len, MAX_POSITIONS);
+         plan_add(plan, TERM_LENGTH, 0, min_len, min_len,
+                  min_len < index->length_idx.max_length ? index->length_idx.cards[min_len] : 0,
+                  true, false);
+     }
+     else if (!anchored || strchr(first, '_'))
+     {
+         /* '_' only checks a position that exists, so anchors need it too */
+         plan_add(plan, TERM_LENGTH, 0, min_len, -1, length_range_card(index, min_len, -1),
+                  anchored, false);
+     }
+     
+     if (plan->empty)
+         return plan;
+     
+     qsort(plan->terms, plan->num_terms, sizeof(PlanTerm), compare_plan_terms);
+     
+     /* Plan with verification: AND the terms that pay for themselves */
+     est = (double)start_rows;
+     cost = 0;
+     for (i = 0; i < plan->num_terms; i++)
+     {
+         PlanTerm *t = &plan->terms[i];
+         double selectivity = (double)t->card / total;
+         double and_cost = plan_and_cost(t, est);
+         
+         if (t->card >= (uint64_t)index->num_values)
+             continue;
+         if (est * (1 - selectivity) * verify_cost > and_cost)
+         {
+             t->chosen = true;
+             cost += and_cost;
+             est *= selectivity;
+         }
+     }
+     cost += est * verify_cost;
+     plan->verify = true;
+     plan->est_rows = est;
+     
+     /* Plan from bitmaps alone: every required term, nothing verified */
+     if (anchored || infix)
+     {
+         est_exact = (double)start_rows;
+         cost_exact = 0;
+         for (i = 0; i < plan->num_terms; i++)
+         {
+             PlanTerm *t = &plan->terms[i];
+             
+             if (!t->required || t->card >= (uint64_t)index->num_values)
+                 continue;
+             cost_exact += plan_and_cost(t, est_exact);
+             est_exact *= (double)t->card / total;
+         }
+         
+         if (cost_exact <= cost)
+         {
+             for (i = 0; i < plan->num_terms; i++)
+                 plan->terms[i].chosen = plan->terms[i].required &&
+                     plan->terms[i].card < (uint64_t)index->num_values;
+             plan->verify = false;
+             plan->est_rows = est_exact;
+         }
+     }
+     
+     plan->anchors_applied = true;
+     for (i = 0; i < plan->num_terms; i++)
+         if (plan->terms[i].anchor && !plan->terms[i].chosen &&
+             plan->terms[i].card < (uint64_t)index->num_values)
+             plan->anchors_applied = false;
+     return plan;
+ }
+ 
+ /*
+  * Bitmaps of the chosen terms, after zone when given, into bms; returns how
+  * many, or -1 if one is missing.  Those built for the query (a length range,
+  * suffix array hits) also go into built, *num_built of them, to be freed.
+  * Spilled positional bitmaps stay pinned until the caller's spill_unpin_all().
+  */
+ static int plan_bitmaps(RoaringIndex *index, QueryPlan *plan, const RoaringBitmap *zone,
+                         const RoaringBitmap **bms, RoaringBitmap **built, int *num_built)
+ {
+     int n = 0;
+     int i;
+     
+     /* Pins left behind by a plan that errored out */
+     spill_unpin_all(index);
+     
+     *num_built = 0;
+     if (zone)
+         bms[n++] = zone;
+     for (i = 0; i < plan->num_terms; i++)
+     {
+         PlanTerm *t = &plan->terms[i];
+         const RoaringBitmap *bm;
+         
+         if (!t->chosen)
+             continue;
+         switch (t->kind)
+         {
+             case TERM_CHAR:
+                 bm = index->char_cache[t->ch];
+                 break;
+             case TERM_POS:
+                 bm = get_pos_bitmap(index, t->ch, t->pos);
+                 spill_pin(index, pos_entry(index, t->ch, t->pos));
+                 break;
+             case TERM_NEG:
+                 bm = get_neg_bitmap(index, t->ch, t->pos);
+                 spill_pin(index, neg_entry(index, t->ch, t->pos));
+                 break;
+             case TERM_GRAM:
+                 bm = get_gram_bitmap(&index->grams, (uint32_t)t->pos);
+                 break;
+             case TERM_POS_GRAM:
+                 bm = get_gram_bitmap(&index->pos_grams, (uint32_t)t->pos);
+                 break;
+             case TERM_GAP_PAIR:
+                 bm = get_gram_bitmap(&index->gap_pairs, (uint32_t)t->pos);
+                 break;
+             case TERM_SUFFIX:
+                 bm = built[(*num_built)++] = suffix_values(index, t->lo, t->hi);
+                 break;
+             default:
+                 if (t->pos == t->max_len)
+                     bm = index->length_idx.length_bitmaps[t->pos];
+                 else
+                     bm = built[(*num_built)++] = get_length_range(index, t->pos, t->max_len);
+                 break;
+         }
+         if (unlikely(!bm))
+             return -1;
+         bms[n++] = bm;
+     }
+     return n;
+ }
+ 
+ /* Intersection of the chosen terms, within zone when given */
+ static RoaringBitmap* run_plan(RoaringIndex *index, QueryPlan *plan, const RoaringBitmap *zone)
+ {
+     const RoaringBitmap *bms[MAX_AND_INPUTS];
+     RoaringBitmap *built[MAX_AND_INPUTS];
+     RoaringBitmap *result;
+     int num_built, i;
+     int n = plan_bitmaps(index, plan, zone, bms, built, &num_built);
+     
+     if (n < 0)
+         result = roaring_create();
+     else if (n == 0)
+     {
+         result = roaring_create();
+         roaring_add_range(result, 0, (uint32_t)index->num_values);
+     }
+     else
+         result = roaring_and_many(bms, n);
+     for (i = 0; i < num_built; i++)
+         roaring_free(built[i]);
+     spill_unpin_all(index);
+     return result;
+ }
+ 
+ /* Size of run_plan()'s result, without building it */
+ static uint64_t run_plan_count(RoaringIndex *index, QueryPlan *plan, const RoaringBitmap *zone)
+ {
+     const RoaringBitmap *bms[MAX_AND_INPUTS];
+     RoaringBitmap *built[MAX_AND_INPUTS];
+     uint64_t count;
+     int num_built, i;
+     int n = plan_bitmaps(index, plan, zone, bms, built, &num_built);
+     
+     if (n < 0)
+         count = 0;
+     else if (n == 0)
+         count = index->num_values;
+     else
+         count = roaring_and_many_count(bms, n);
+     for (i = 0; i < num_built; i++)
+         roaring_free(built[i]);
+     spill_unpin_all(index);
+     return count;
+ }
+ 
+ /* ==================== MAIN QUERY FUNCTION ==================== */
+ 
+ /* Rows holding the matched values of a dictionary index */
+ static RoaringBitmap* expand_to_rows(RoaringIndex *index, RoaringBitmap *values)
+ {
+     RoaringBitmap *rows = roaring_create();
+     uint32_t *ids;
+     uint64_t count, i;
+     
+     ids = roaring_to_array(values, &count);
+     for (i = 0; i < count; i++)
+     {
+         uint32_t first, last, p;
+         
+         value_rows(index, ids[i], &first, &last);
+         for (p = first; p < last; p++)
+             roaring_add(rows, posting_row(index, p));
+     }
+     if (ids)
+         pfree(ids);
+     return rows;
+ }
+ 
+ /* Number of rows holding the matched values of a dictionary index */
+ static uint64_t count_value_rows(RoaringIndex *index, const RoaringBitmap *values)
+ {
+     uint32_t batch[VERIFY_BATCH];
+     RoaringIterator it;
+     uint64_t count = 0;
+     uint32_t n, i;
+     
+     roaring_iterator_start(values, &it);
+     while ((n = roaring_iterator_read(&it, batch, VERIFY_BATCH)) > 0)
+     {
+         for (i = 0; i < n; i++)
+         {
+             uint32_t first, last;
+             
+             value_rows(index, batch[i], &first, &last);
+             count += last - first;
+         }
+     }
+     roaring_iterator_end(&it);
+     return count;
+ }
+ 
+ /*
+  * Plan pattern (with at least one slice) over index, or NULL when the zone
+  * maps or an empty term already rule out every value.  *zone is the zone
+  * filter the plan runs within, or NULL.
+  */
+ static QueryPlan* query_plan(RoaringIndex *index, const char *pattern, PatternInfo *info,
+                              RoaringBitmap **zone)
+ {
+     QueryPlan *plan;
+     
+     /* Whole segments the zone maps rule out are never touched */
+     *zone = zone_filter(index, pattern, info);
+     if (*zone && roaring_is_empty(*zone))
+     {
+         roaring_free(*zone);
+         *zone = NULL;
+         return NULL;
+     }
+     
+     plan = plan_query(index, pattern, info, *zone ? roaring_count(*zone) : (uint64_t)index->num_values);
+     if (plan->empty)
+     {
+         pfree(plan);
+         if (*zone)
+             roaring_free(*zone);
+         *zone = NULL;
+         return NULL;
+     }
+     
+     /*
+      * Positions beyond MAX_POSITIONS were not checked against the index, and
+      * the last length bucket also holds every longer string
+      */
+     if (unlikely(strlen(pattern) >= MAX_POSITIONS))
+         plan->verify = true;
+     return plan;
+ }
+ 
+ /*
+  * How a plan's candidates are verified, or NULL if they need not be.  m is
+  * filled in as the argument of the slice matchers; *arg is what to pass.
+  */
+ static ValueMatcher plan_matcher(QueryPlan *plan, PatternInfo *info, const char *pattern,
+                                  SliceMatch *m, const void **arg)
+ {
+     int i;
+     
+     m->info = info;
+     m->slice_lens = NULL;
+     if (!plan->verify)
+         return NULL;
+     
+     if (strlen(pattern) > MAX_POSITIONS || (info->slice_count > 1 && !plan->anchors_applied) ||
+         (info->slice_count == 1 && !(info->starts_with_percent && info->ends_with_percent)))
+     {
+         *arg = pattern;
+         return match_like;
+     }
+     
+     m->slice_lens = (int *)palloc(info->slice_count * sizeof(int));
+     for (i = 0; i < info->slice_count; i++)
+         m->slice_lens[i] = strlen(info->slices[i]);
+     *arg = m;
+     return info->slice_count == 1 ? match_substring : match_slices;
+ }
+ 
+ /*
+  * Rows of index matching pattern and their number.  With rows NULL only the
+  * count is wanted: then a plan that needs no verification ends in an AND
+  * cardinality, verification counts instead of collecting, and a dictionary
+  * index sums posting lengths instead of expanding them.
+  */
+ static uint64_t pattern_matches(RoaringIndex *index, const char *pattern, RoaringBitmap **rows)
+ {
+     PatternInfo *info = analyze_pattern(pattern);
+     QueryPlan *plan;
+     RoaringBitmap *result, *zone;
+     ValueMatcher matcher;
+     const void *arg;
+     SliceMatch m;
+     uint64_t count;
+     
+     /* Only % characters match everything */
+     if (info->slice_count == 0)
+     {
+         free_pattern_info(info);
+         if (rows)
+         {
+             *rows = roaring_create();
+             roaring_add_range(*rows, 0, (uint32_t)index->num_records);
+         }
+         return index->num_records;
+     }
+     
+     plan = query_plan(index, pattern, info, &zone);
+     if (!plan)
+     {
+         free_pattern_info(info);
+         if (rows)
+             *rows = roaring_create();
+         return 0;
+     }
+     
+     if (!rows && !plan->verify && !index->row_values)
+     {
+         count = run_plan_count(index, plan, zone);
+         result = NULL;
+     }
+     else
+     {
+         result = run_plan(index, plan, zone);
+         count = roaring_count(result);
+     }
+     if (zone)
+         roaring_free(zone);
+     
+     matcher = plan_matcher(plan, info, pattern, &m, &arg);
+     if (matcher && count > 0)
+     {
+         RoaringBitmap *verified = (rows || index->row_values) ? roaring_create() : NULL;
+         
+         count = verify_candidates(index, result, matcher, arg, verified);
+         roaring_free(result);
+         result = verified;
+     }
+     if (m.slice_lens)
+         pfree(m.slice_lens);
+     pfree(plan);
+     free_pattern_info(info);
+     
+     /* Pattern work ran over distinct values; report the rows holding them */
+     if (result && index->row_values)
+     {
+         if (rows)
+         {
+             RoaringBitmap *temp = expand_to_rows(index, result);
+             
+             roaring_free(result);
+             result = temp;
+             count = roaring_count(result);
+         }
+         else
+             count = count_value_rows(index, result);
+     }
+     
+     if (rows)
+         *rows = result;
+     else if (result)
+         roaring_free(result);
+     return count;
+ }
+ 
+ static uint32_t* optimized_query(RoaringIndex *index, const char *pattern, uint64_t *result_count)
+ {
+     RoaringBitmap *rows;
+     uint32_t *indices;
+     
+     /* Check cache first; an entry made by a count holds no rows unless there are none */
+     CacheEntry *cached = cache_lookup(index, pattern);
+     if (cached && (cached->results || cached->count == 0))
+     {
+         *result_count = cached->count;
+         if (cached->count == 0)
+             return NULL;
+         indices = (uint32_t *)palloc(cached->count * sizeof(uint32_t));
+         memcpy(indices, cached->results, cached->count * sizeof(uint32_t));
          return indices;
      }
      
-     /* Pattern: % - match all */
-     if (strcmp(pattern, "%") == 0)
+     pattern_matches(index, pattern, &rows);
+     indices = roaring_to_array(rows, result_count);
+     roaring_free(rows);
+     
+     /* Cache results */
+     if (indices && *result_count > 0 && *result_count < 50000)
+         cache_insert(index, pattern, indices, *result_count);
+     
+     return indices;
+ }
+ 
+ /* Number of rows optimized_query() would return, without building them */
+ static uint64_t optimized_count(RoaringIndex *index, const char *pattern)
+ {
+     CacheEntry *cached = cache_lookup(index, pattern);
+     uint64_t count;
+     
+     if (cached)
+         return cached->count;
+     
+     count = pattern_matches(index, pattern, NULL);
+     cache_insert(index, pattern, NULL, count);
+     return count;
+ }
+ 
+ /*
+  * A query cursor returns the matching rows of one index a few at a time.
+  * The bitmap work happens when it is opened, but candidates are verified,
+  * and dictionary values expanded to their rows, only as rows are asked for,
+  * so a caller that stops early never pays for the rest.  Rows come in
+  * ascending order, except that a dictionary index groups them by value.
+  */
+ 
+ #define CURSOR_BATCH 256
+ 
+ typedef struct {
+     RoaringIndex *index;
+     char *pattern;
+     PatternInfo *info;
+     SliceMatch slices;
+     ValueMatcher matcher;           /* NULL when candidates need no check */
+     const void *matcher_arg;
+     RoaringBitmap *candidates;
+     RoaringIterator it;
+     uint32_t batch[CURSOR_BATCH];
+     uint32_t batch_len;
+     uint32_t batch_pos;
+     uint32_t post_next;             /* postings of the current dictionary value */
+     uint32_t post_end;
+ } QueryCursor;
+ 
+ static QueryCursor* query_open(RoaringIndex *index, const char *pattern)
+ {
+     QueryCursor *c = (QueryCursor *)palloc0(sizeof(QueryCursor));
+     RoaringBitmap *zone;
+     QueryPlan *plan;
+     
+     c->index = index;
+     c->pattern = pstrdup(pattern);
+     c->info = analyze_pattern(c->pattern);
+     if (c->info->slice_count == 0)
+     {
+         c->candidates = roaring_create();
+         roaring_add_range(c->candidates, 0, (uint32_t)index->num_values);
+     }
+     else if ((plan = query_plan(index, c->pattern, c->info, &zone)) != NULL)
+     {
+         c->candidates = run_plan(index, plan, zone);
+         c->matcher = plan_matcher(plan, c->info, c->pattern, &c->slices, &c->matcher_arg);
+         if (zone)
+             roaring_free(zone);
+         pfree(plan);
+     }
+     else
+         c->candidates = roaring_create();
+     
+     roaring_iterator_start(c->candidates, &c->it);
+     return c;
+ }
+ 
+ /* Next matching row of the cursor's index; false once there are none */
+ static bool query_next(QueryCursor *c, uint32_t *row)
+ {
+     for (;;)
+     {
+         uint32_t value;
+         
+         if (c->post_next < c->post_end)
+         {
+             *row = posting_row(c->index, c->post_next++);
+             return true;
+         }
+         if (c->batch_pos == c->batch_len)
+         {
+             c->batch_len = roaring_iterator_read(&c->it, c->batch, CURSOR_BATCH);
+             c->batch_pos = 0;
+             if (c->batch_len == 0)
+                 return false;
+         }
+         
+         value = c->batch[c->batch_pos++];
+         if (c->batch_pos < c->batch_len)
+             PREFETCH(index_string(c->index, c->batch[c->batch_pos]));
+         if (c->matcher &&
+             !c->matcher(index_string(c->index, value), index_string_len(c->index, value),
+                         c->matcher_arg))
+             continue;
+         
+         if (!c->index->row_values)
+         {
+             *row = value;
+             return true;
+         }
+         value_rows(c->index, value, &c->post_next, &c->post_end);
+     }
+ }
+ 
+ static void query_close(QueryCursor *c)
+ {
+     roaring_iterator_end(&c->it);
+     roaring_free(c->candidates);
+     if (c->slices.slice_lens)
+         pfree(c->slices.slice_lens);
+     free_pattern_info(c->info);
+     pfree(c->pattern);
+     pfree(c);
+ }
+ 
+ /* ==================== INCREMENTAL MAINTENANCE ==================== */
+ 
+ /*
+  * optimized_like_maintain() is a statement-level AFTER trigger that reads
+  * the transition tables and queues the changed values.  At commit the queue
+  * is applied as one batch on top of the immutable base image: new values
+  * become a delta segment whose row ids follow the existing ones, deleted
+  * values are recorded in the segment's tombstone bitmap, and the strings
+  * go into the segment's own arena.
+  *
+  * Small segments are merged into their predecessor when they grow to half
+  * its size, so a batch rewrites O(log n) rows amortized and at most
+  * MAX_DELTA_SEGMENTS segments exist.  optimized_like_compact_index() folds
+  * everything back into a new base image without reading the table.
+  *
+  * Without shared_preload_libraries every session has its own copy of an
+  * index, so a batch only reaches the copy of the committing session; a
+  * session without one drops it with a WARNING.
+  *
+  * Partitioned tables are not maintained: their indexes live under the leaf
+  * partitions, statement triggers on the parent do not say which partition a
+  * row went to, and those on a leaf do not fire for changes made through the
+  * parent.  optimized_like_enable_maintenance() refuses both.
+  *
+  * When the index keeps a key column, the trigger collects the key with each
+  * value: new rows carry it into the delta segment, and a deleted row is
+  * resolved to the live row holding both its value and its key.  Otherwise
+  * the index is a multiset of values and a deleted value tombstones any live
+  * row holding the same string.  An UPDATE that leaves the column (and key)
+  * alone cancels out before it reaches the index.
+  *
+  * Transition tables carry no ctids, so rows added by maintenance have no
+  * tid.  A base row keeps its tid until a batch may have moved it: the row
+  * an UPDATE resolved by key, or every live row holding a value that was
+  * updated or deleted without a key to tell the rows apart.  Those rows go
+  * into the segment's moved bitmap and report no tid from then on.
+  */
+ 
+ /* A value from a transition table, with its key when the index keeps one */
+ typedef struct {
+     char *value;
+     int64 key;
+     bool has_key;
+ } ChangedRow;
+ 
+ typedef struct {
+     IndexKey key;
+     int nest_level;             /* subtransaction that queued the changes */
+     List *inserted;             /* ChangedRows from NEW TABLE */
+     List *deleted;              /* ChangedRows from OLD TABLE */
+ } PendingChanges;
+ 
+ /* Lives in TopTransactionContext */
+ static List *pending_changes = NIL;
+ static bool xact_callbacks_registered = false;
+ 
+ static FORCE_INLINE uint32_t loaded_num_rows(LoadedIndex *entry)
+ {
+     RoaringIndex *last;
+     
+     if (entry->num_deltas == 0)
+         return entry->index->num_records;
+     last = entry->deltas[entry->num_deltas - 1].index;
+     return last->base_row + last->num_records;
+ }
+ 
+ /* The base image or delta segment holding row, and the row's number within it */
+ static RoaringIndex* loaded_index_segment(LoadedIndex *entry, uint32_t row, uint32_t *local_row)
+ {
+     int i;
+     
+     for (i = entry->num_deltas - 1; i >= 0; i--)
+     {
+         RoaringIndex *delta = entry->deltas[i].index;
+         
+         if (row >= delta->base_row)
+         {
+             *local_row = row - delta->base_row;
+             return delta;
+         }
+     }
+     *local_row = row;
+     return entry->index;
+ }
+ 
+ static const char* loaded_index_string(LoadedIndex *entry, uint32_t row, int *len)
+ {
+     uint32_t local_row;
+     RoaringIndex *index = loaded_index_segment(entry, row, &local_row);
+     
+     local_row = row_value(index, local_row);
+     *len = index_string_len(index, local_row);
+     return index_string(index, local_row);
+ }
+ 
+ /*
+  * The heap tid and key of a row, or NULL when unknown.  Rows added by
+  * maintenance have no tid, and base rows lose theirs once a batch may have
+  * moved them (see INCREMENTAL MAINTENANCE).
+  */
+ static ItemPointer loaded_index_tid(LoadedIndex *entry, uint32_t row)
+ {
+     uint32_t local_row;
+     RoaringIndex *index = loaded_index_segment(entry, row, &local_row);
+     
+     if (!index->tids || !ItemPointerIsValid(&index->tids[local_row]) ||
+         (entry->moved && roaring_contains(entry->moved, row)))
+         return NULL;
+     return (ItemPointer)&index->tids[local_row];
+ }
+ 
+ /* The key of row local_row of one segment, or NULL */
+ static FORCE_INLINE const int64* index_row_key(RoaringIndex *index, uint32_t local_row)
+ {
+     if (!index->keys || (index->null_keys && roaring_contains(index->null_keys, local_row)))
+         return NULL;
+     return &index->keys[local_row];
+ }
+ 
+ static const int64* loaded_index_key(LoadedIndex *entry, uint32_t row)
+ {
+     uint32_t local_row;
+     RoaringIndex *index = loaded_index_segment(entry, row, &local_row);
+     
+     return index_row_key(index, local_row);
+ }
+ 
+ /* optimized_query over the base image and every delta, minus tombstones */
+ static uint32_t* registry_query(LoadedIndex *entry, const char *pattern, uint64_t *result_count)
+ {
+     uint32_t *rows;
+     uint64_t count, kept, i;
+     int d;
+     
+     rows = optimized_query(entry->index, pattern, &count);
+     if (entry->num_deltas == 0)
+     {
+         *result_count = count;
+         return rows;
+     }
+     
+     for (d = 0; d < entry->num_deltas; d++)
+     {
+         RoaringIndex *delta = entry->deltas[d].index;
+         uint64_t delta_count = 0;
+         uint32_t *delta_rows;
+         
+         /* A segment may carry only tombstones */
+         if (delta->num_records == 0)
+             continue;
+         
+         delta_rows = optimized_query(delta, pattern, &delta_count);
+         if (delta_count == 0)
+             continue;
+         
+         rows = rows ? (uint32_t *)repalloc_huge(rows, (count + delta_count) * sizeof(uint32_t))
+                     : (uint32_t *)palloc_extended(delta_count * sizeof(uint32_t), MCXT_ALLOC_HUGE);
+         for (i = 0; i < delta_count; i++)
+             rows[count + i] = delta_rows[i] + delta->base_row;
+         count += delta_count;
+         pfree(delta_rows);
+     }
+     
+     kept = count;
+     if (entry->deleted)
+     {
+         kept = 0;
+         for (i = 0; i < count; i++)
+             if (!roaring_contains(entry->deleted, rows[i]))
+                 rows[kept++] = rows[i];
+     }
+     
+     *result_count = kept;
+     return rows;
+ }
+ 
+ /* Number of rows registry_query() would return, without building them */
+ static uint64_t registry_count(LoadedIndex *entry, const char *pattern)
+ {
+     uint64_t count;
+     int d;
+     
+     if (!entry->deleted || roaring_is_empty(entry->deleted))
+     {
+         count = optimized_count(entry->index, pattern);
+         for (d = 0; d < entry->num_deltas; d++)
+             if (entry->deltas[d].index->num_records > 0)
+                 count += optimized_count(entry->deltas[d].index, pattern);
+         return count;
+     }
+     
+     /* Deleted rows are taken off each segment's matches by an AND count */
+     count = 0;
+     for (d = -1; d < entry->num_deltas; d++)
+     {
+         RoaringIndex *segment = d < 0 ? entry->index : entry->deltas[d].index;
+         RoaringBitmap *rows;
+         
+         if (segment->num_records == 0)
+             continue;
+         
+         count += pattern_matches(segment, pattern, &rows);
+         if (segment->base_row > 0)
+         {
+             RoaringBitmap *shifted = roaring_shift(rows, segment->base_row);
+             
+             roaring_free(rows);
+             rows = shifted;
+         }
+         count -= roaring_and_count(rows, entry->deleted);
+         roaring_free(rows);
+     }
+     return count;
+ }
+ 
+ /* The rows of registry_query() one at a time, segment after segment */
+ typedef struct {
+     LoadedIndex *entry;
+     const char *pattern;
+     int segment;                    /* 0 is the base image, then the deltas */
+     QueryCursor *cursor;            /* open on the current segment, or NULL */
+ } RegistryCursor;
+ 
+ static bool registry_next(RegistryCursor *rc, uint32_t *row)
+ {
+     while (rc->segment <= rc->entry->num_deltas)
+     {
+         RoaringIndex *segment = rc->segment == 0 ? rc->entry->index
+                                                 : rc->entry->deltas[rc->segment - 1].index;
+         uint32_t local_row;
+         
+         if (!rc->cursor)
+         {
+             /* A segment may carry only tombstones */
+             if (segment->num_records == 0)
+             {
+                 rc->segment++;
+                 continue;
+             }
+             rc->cursor = query_open(segment, rc->pattern);
+         }
+         
+         while (query_next(rc->cursor, &local_row))
+         {
+             *row = segment->base_row + local_row;
+             if (!rc->entry->deleted || !roaring_contains(rc->entry->deleted, *row))
+                 return true;
+         }
+         query_close(rc->cursor);
+         rc->cursor = NULL;
+         rc->segment++;
+     }
+     return false;
+ }
+ 
+ /*
+  * A row of index holding exactly value, and key when it is given, that is in
+  * neither bitmap, or -1.  With all set, every such row is added to it.
+  */
+ static int64 find_live_row(RoaringIndex *index, const char *value, const int64 *key,
+                            const RoaringBitmap *deleted, const RoaringBitmap *batch,
+                            RoaringBitmap *all)
+ {
+     int len = strlen(value);
+     int npos = Min(len, MAX_POSITIONS);
+     RoaringBitmap *candidates = get_length_range(index, npos, npos);
+     uint32_t *rows;
+     uint64_t count, i;
+     int64 found = -1;
+     int pos;
+     
+     for (pos = 0; pos < npos && !roaring_is_empty(candidates); pos++)
+     {
+         RoaringBitmap *bm = get_pos_bitmap(index, (unsigned char)value[pos], pos);
+         RoaringBitmap *temp;
+         
+         if (!bm)
+         {
+             roaring_free(candidates);
+             return -1;
+         }
+         temp = roaring_and(candidates, bm);
+         roaring_free(candidates);
+         candidates = temp;
+     }
+     
+     rows = roaring_to_array(candidates, &count);
+     roaring_free(candidates);
+     
+     for (i = 0; i < count && (found < 0 || all); i++)
+     {
+         uint32_t first, last, p;
+         
+         if (index_string_len(index, rows[i]) != len ||
+             memcmp(index_string(index, rows[i]), value, len) != 0)
+             continue;
+         value_rows(index, rows[i], &first, &last);
+         for (p = first; p < last && (found < 0 || all); p++)
+         {
+             uint32_t local_row = posting_row(index, p);
+             uint32_t row = local_row + index->base_row;
+             const int64 *row_key;
+             
+             if ((deleted && roaring_contains(deleted, row)) || roaring_contains(batch, row))
+                 continue;
+             if (key && (!(row_key = index_row_key(index, local_row)) || *row_key != *key))
+                 continue;
+             if (found < 0)
+                 found = row;
+             if (all)
+                 roaring_add(all, row);
+         }
+     }
+     
+     if (rows)
+         pfree(rows);
+     return found;
+ }
+ 
+ /* Flatten a finished builder, in shared memory when the library is preloaded */
+ static RoaringIndex* flatten_builder(IndexBuilder *b, const char *schema_name,
+                                      const char *table_name, const char *column_name,
+                                      const char *context_name, dsm_segment **seg_out)
+ {
+     RoaringIndex *index;
+     MemoryContext context;
+     ImageLayout layout;
+     Size image_size;
+     char *image;
+     
+     image_size = layout_index_image(b, &layout);
+     context = AllocSetContextCreate(TopMemoryContext, context_name, ALLOCSET_DEFAULT_SIZES);
+     *seg_out = NULL;
+     if (shared_state)
+     {
+         *seg_out = dsm_create(image_size, 0);
+         dsm_pin_mapping(*seg_out);
+         image = (char *)dsm_segment_address(*seg_out);
+     }
+     else if (spill_wanted(image_size))
+     {
+         /* mmap is page aligned, which satisfies IMAGE_ALIGN */
+         image = spill_mapping_create(image_size);
+     }
+     else
+     {
+         image = (char *)TYPEALIGN(IMAGE_ALIGN,
+                                   MemoryContextAllocHuge(context, image_size + IMAGE_ALIGN));
+     }
+     write_index_image(image, &layout, b, schema_name, table_name, column_name);
+     free_index_bitmaps(b->index);
+     
+     index = attach_index_image(image, context);
+     if (!shared_state && spill_wanted(image_size))
+         spill_index(index);
+     return index;
+ }
+ 
+ /* Register a finished builder as the base image for key and publish it */
+ static LoadedIndex* install_built_index(IndexKey key, IndexBuilder *b, const char *schema_name,
+                                         const char *table_name, const char *column_name)
+ {
+     dsm_segment *seg;
+     RoaringIndex *index = flatten_builder(b, schema_name, table_name, column_name,
+                                           "RoaringLikeIndex", &seg);
+     LoadedIndex *entry = register_index(key, index, seg, NULL, 0);
+     
+     default_key = key;
+     if (seg)
+         publish_shared_index(entry, NULL);
+     return entry;
+ }
+ 
+ /* Order by value, then rows without a key, then by key */
+ static int compare_changed_rows(const void *a, const void *b)
+ {
+     const ChangedRow *ra = *(ChangedRow *const *)a;
+     const ChangedRow *rb = *(ChangedRow *const *)b;
+     int cmp = strcmp(ra->value, rb->value);
+     
+     if (cmp != 0)
+         return cmp;
+     if (ra->has_key != rb->has_key)
+         return ra->has_key ? 1 : -1;
+     if (!ra->has_key || ra->key == rb->key)
+         return 0;
+     return ra->key < rb->key ? -1 : 1;
+ }
+ 
+ static ChangedRow** list_to_sorted_array(List *rows, int *count)
+ {
+     ChangedRow **array;
+     ListCell *lc;
+     int n = 0;
+     
+     *count = list_length(rows);
+     if (*count == 0)
+         return NULL;
+     
+     array = (ChangedRow **)palloc(*count * sizeof(ChangedRow *));
+     foreach(lc, rows)
+         array[n++] = (ChangedRow *)lfirst(lc);
+     qsort(array, n, sizeof(ChangedRow *), compare_changed_rows);
+     return array;
+ }
+ 
+ /*
+  * Record in moved the base rows whose tid a change to value may have made
+  * stale: the row with key when it can be told apart, else every live one
+  */
+ static void mark_moved_rows(LoadedIndex *entry, const ChangedRow *change,
+                             const RoaringBitmap *batch, RoaringBitmap *moved)
+ {
+     int d;
+     
+     if (!entry->index->tids)
+         return;
+     if (change->has_key && entry->index->keys)
+     {
+         int64 row = find_live_row(entry->index, change->value, &change->key,
+                                   entry->deleted, batch, NULL);
+         
+         if (row >= 0)
+         {
+             roaring_add(moved, (uint32_t)row);
+             return;
+         }
+         
+         /* Rows added by maintenance have no tid to lose */
+         for (d = 0; d < entry->num_deltas; d++)
+             if (find_live_row(entry->deltas[d].index, change->value, &change->key,
+                               entry->deleted, batch, NULL) >= 0)
+                 return;
+     }
+     find_live_row(entry->index, change->value, NULL, entry->deleted, batch, moved);
+ }
+ 
+ /*
+  * The newest live row holding the value of a deleted row, matched on the key
+  * as well when there is one; -1 if none.  *by_key tells which.
+  */
+ static int64 resolve_deleted_row(LoadedIndex *entry, const ChangedRow *change,
+                                  const RoaringBitmap *batch, bool *by_key)
+ {
+     const int64 *key = change->has_key && entry->index->keys ? &change->key : NULL;
+     int64 row = -1;
+     int d;
+     
+     *by_key = key != NULL;
+     for (;;)
+     {
+         for (d = entry->num_deltas - 1; d >= 0 && row < 0; d--)
+             row = find_live_row(entry->deltas[d].index, change->value, key, entry->deleted, batch, NULL);
+         if (row < 0)
+             row = find_live_row(entry->index, change->value, key, entry->deleted, batch, NULL);
+         
+         /* A row indexed without its key still has to go */
+         if (row >= 0 || !key)
+             return row;
+         key = NULL;
+         *by_key = false;
+     }
+ }
+ 
+ static void apply_index_changes(IndexKey key, List *inserted, List *deleted)
+ {
+     ImageHeader *hdr;
+     LoadedIndex *entry;
+     MemoryContext batch_context, oldcontext;
+     IndexBuilder *builder;
+     RoaringBitmap *batch, *moved, *tombstones = NULL;
+     DeltaSegment merged;
+     ChangedRow **ins, **del;
+     int nins, ndel, i, j, d, first;
+     uint32_t base_row;
+     int64 new_rows;
+     
+     /*
+      * Without the library preloaded, indexes are backend-local: a session
+      * that has none loaded cannot apply the batch, and the session that
+      * built the index never sees it.  Say so rather than drop it silently.
+      */
+     entry = lookup_index(key);
+     if (!entry)
+     {
+         char *relname = get_rel_name(key.relid);
+         char *attname = get_attname(key.relid, key.attnum, true);
+         
+         /* Dropped later in the transaction: nothing left to index */
+         if (!relname || !attname)
+             return;
+         ereport(WARNING,
+                 (errmsg("changes to column \"%s\" of relation \"%s\" were not applied to its optimized_like index",
+                         attname, relname),
+                  shared_state ?
+                  errdetail("No index is built on the column.") :
+                  errdetail("This session has no copy of the index, and other sessions' copies are private to them."),
+                  errhint("Add optimized_like to shared_preload_libraries so that all sessions share one index, "
+                          "or rebuild the index after the changes.")));
+         return;
+     }
+     
+     batch_context = AllocSetContextCreate(CurrentMemoryContext,
+                                           "RoaringLikeIndexBatch",
+                                           ALLOCSET_DEFAULT_SIZES);
+     oldcontext = MemoryContextSwitchTo(batch_context);
+     
+     /*
+      * Equal insert/delete pairs (e.g. an UPDATE of another column) cancel
+      * out, though the row has a new tid now
+      */
+     batch = roaring_create();
+     moved = roaring_create();
+     ins = list_to_sorted_array(inserted, &nins);
+     del = list_to_sorted_array(deleted, &ndel);
+     for (i = 0, j = 0; i < nins && j < ndel;)
+     {
+         int cmp = compare_changed_rows(&ins[i], &del[j]);
+         
+         if (cmp == 0)
+         {
+             mark_moved_rows(entry, del[j], batch, moved);
+             ins[i++] = NULL;
+             del[j++] = NULL;
+         }
+         else if (cmp < 0)
+             i++;
+         else
+             j++;
+     }
+     
+     /* Resolve each remaining deletion to a live row, newest segments first */
+     for (j = 0; j < ndel; j++)
+     {
+         bool by_key;
+         int64 row;
+         
+         if (!del[j])
+             continue;
+         row = resolve_deleted_row(entry, del[j], batch, &by_key);
+         if (row >= 0)
+             roaring_add(batch, (uint32_t)row);
+         
+         /* Without a key, any row holding the value may be the one deleted */
+         if (!by_key)
+             mark_moved_rows(entry, del[j], batch, moved);
+     }
+     
+     new_rows = 0;
+     for (i = 0; i < nins; i++)
+         if (ins[i])
+             new_rows++;
+     
+     if (new_rows == 0 && roaring_is_empty(batch) && roaring_is_empty(moved))
+     {
+         roaring_free(batch);
+         roaring_free(moved);
+         MemoryContextSwitchTo(oldcontext);
+         MemoryContextDelete(batch_context);
+         return;
+     }
+     
+     /* Merge trailing segments that are no more than twice the new rows */
+     first = entry->num_deltas;
+     while (first > 0 &&
+            (first >= MAX_DELTA_SEGMENTS ||
+             entry->deltas[first - 1].index->num_records <= 2 * new_rows))
+     {
+         first--;
+         new_rows += entry->deltas[first].index->num_records;
+     }
+     base_row = first < entry->num_deltas ? entry->deltas[first].index->base_row
+                                          : loaded_num_rows(entry);
+     
+     /* Segments keep keys like the base image, but never tids */
+     builder = builder_create(batch_context, false, entry->index->keys != NULL);
+     builder_inherit_options(builder, entry->index);
+     for (d = first; d < entry->num_deltas; d++)
+     {
+         RoaringIndex *delta = entry->deltas[d].index;
+         uint32_t row;
+         
+         /* Rows deleted by a merged segment or this batch are dropped, not tombstoned */
+         for (row = 0; row < (uint32_t)delta->num_records; row++)
+         {
+             uint32_t global = row + delta->base_row;
+             
+             if ((entry->deleted && roaring_contains(entry->deleted, global)) ||
+                 roaring_contains(batch, global))
+                 continue;
+             builder_add(builder, index_string(delta, row), index_string_len(delta, row),
+                         NULL, index_row_key(delta, row));
+         }
+         moved = roaring_or_into(moved, delta->moved);
+     }
+     for (i = 0; i < nins; i++)
+         if (ins[i])
+             builder_add(builder, ins[i]->value, strlen(ins[i]->value), NULL,
+                         ins[i]->has_key ? &ins[i]->key : NULL);
+     builder_finish(builder);
+     
+     /* Tombstones that still point below the merged segment are kept */
+     for (d = first; d <= entry->num_deltas; d++)
+     {
+         const RoaringBitmap *source = d < entry->num_deltas ? entry->deltas[d].index->tombstones : batch;
+         uint32_t *rows;
+         uint64_t count, k;
+         
+         if (!source)
+             continue;
+         rows = roaring_to_array(source, &count);
+         for (k = 0; k < count; k++)
+         {
+             if (rows[k] >= base_row)
+                 continue;
+             if (!tombstones)
+                 tombstones = roaring_create();
+             roaring_add(tombstones, rows[k]);
+         }
+         if (rows)
+             pfree(rows);
+     }
+     builder->index->tombstones = tombstones;
+     /* Moved rows are all base rows, below any segment */
+     if (!roaring_is_empty(moved))
+         builder->index->moved = moved;
+     else
+         roaring_free(moved);
+     builder->index->base_row = base_row;
+     
+     hdr = (ImageHeader *)entry->index->image;
+     merged.index = NULL;
+     merged.pinned = false;
+     if (builder->index->num_records > 0 || tombstones || builder->index->moved)
+         merged.index = flatten_builder(builder, hdr->schema_name, hdr->table_name,
+                                        hdr->column_name, "RoaringLikeIndexDelta",
+                                        &merged.segment);
+     else
+         free_index_bitmaps(builder->index);
+     roaring_free(batch);
+     
+     MemoryContextSwitchTo(oldcontext);
+     MemoryContextDelete(batch_context);
+     
+     /* Swap the merged segments for the new one */
+     for (d = first; d < entry->num_deltas; d++)
+     {
+         DeltaSegment *delta = &entry->deltas[d];
+         
+         free_index_bitmaps(delta->index);
+         MemoryContextDelete(delta->index->context);
+         if (delta->segment)
+             dsm_detach(delta->segment);
+     }
+     entry->num_deltas = first;
+     if (merged.index)
+         entry->deltas[entry->num_deltas++] = merged;
+     rebuild_deleted(entry);
+     
+     if (shared_state)
+         publish_shared_deltas(entry);
+ }
+ 
+ static void apply_pending_changes(void)
+ {
+     ListCell *lc;
+     
+     if (pending_changes == NIL)
+         return;
+     
+     /* One writer at a time, so concurrent batches never lose each other's segments */
+     if (shared_state)
+         LWLockAcquire(shared_state->maintenance_lock, LW_EXCLUSIVE);
+     
+     foreach(lc, pending_changes)
+     {
+         PendingChanges *changes = (PendingChanges *)lfirst(lc);
+         
+         apply_index_changes(changes->key, changes->inserted, changes->deleted);
+     }
+     
+     if (shared_state)
+         LWLockRelease(shared_state->maintenance_lock);
+     pending_changes = NIL;
+ }
+ 
+ static void maintenance_xact_callback(XactEvent event, void *arg)
+ {
+     switch (event)
+     {
+         case XACT_EVENT_PRE_COMMIT:
+             apply_pending_changes();
+             break;
+         case XACT_EVENT_PRE_PREPARE:
+             if (pending_changes != NIL)
+                 ereport(ERROR,
+                         (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+                          errmsg("cannot PREPARE a transaction that changed a column with an optimized_like index")));
+             break;
+         case XACT_EVENT_COMMIT:
+         case XACT_EVENT_ABORT:
+         case XACT_EVENT_PREPARE:
+         case XACT_EVENT_PARALLEL_COMMIT:
+         case XACT_EVENT_PARALLEL_ABORT:
+             /* The lists were in TopTransactionContext, which is gone now */
+             pending_changes = NIL;
+             break;
+         default:
+             break;
+     }
+ }
+ 
+ static void maintenance_subxact_callback(SubXactEvent event, SubTransactionId mySubid,
+                                          SubTransactionId parentSubid, void *arg)
+ {
+     int level = GetCurrentTransactionNestLevel();
+     List *kept = NIL;
+     ListCell *lc;
+     MemoryContext oldcontext;
+     
+     if (pending_changes == NIL ||
+         (event != SUBXACT_EVENT_ABORT_SUB && event != SUBXACT_EVENT_COMMIT_SUB))
+         return;
+     
+     oldcontext = MemoryContextSwitchTo(TopTransactionContext);
+     foreach(lc, pending_changes)
+     {
+         PendingChanges *changes = (PendingChanges *)lfirst(lc);
+         
+         if (changes->nest_level < level)
+         {
+             kept = lappend(kept, changes);
+             continue;
+         }
+         if (event == SUBXACT_EVENT_ABORT_SUB)
+             continue;
+         
+         /* Committed subtransaction: hand the changes to the parent */
+         changes->nest_level = level - 1;
+         kept = lappend(kept, changes);
+     }
+     MemoryContextSwitchTo(oldcontext);
+     
+     pending_changes = kept;
+ }
+ 
+ static PendingChanges* get_pending_changes(IndexKey key)
+ {
+     int level = GetCurrentTransactionNestLevel();
+     PendingChanges *changes;
+     MemoryContext oldcontext;
+     ListCell *lc;
+     
+     if (!xact_callbacks_registered)
+     {
+         RegisterXactCallback(maintenance_xact_callback, NULL);
+         RegisterSubXactCallback(maintenance_subxact_callback, NULL);
+         xact_callbacks_registered = true;
+     }
+     
+     foreach(lc, pending_changes)
+     {
+         changes = (PendingChanges *)lfirst(lc);
+         if (changes->nest_level == level &&
+             changes->key.relid == key.relid && changes->key.attnum == key.attnum)
+             return changes;
+     }
+     
+     oldcontext = MemoryContextSwitchTo(TopTransactionContext);
+     changes = (PendingChanges *)palloc0(sizeof(PendingChanges));
+     changes->key = key;
+     changes->nest_level = level;
+     pending_changes = lappend(pending_changes, changes);
+     MemoryContextSwitchTo(oldcontext);
+     return changes;
+ }
+ 
+ static int64 key_datum_to_int64(Datum datum, Oid type);
+ 
+ /*
+  * Copy the column, and the key column unless key_attnum is invalid, of every
+  * tuple in a transition table into TopTransactionContext; NULL is indexed as
+  * '' like in the build
+  */
+ static List* collect_transition_values(Tuplestorestate *table, TupleDesc tupdesc,
+                                        AttrNumber attnum, AttrNumber key_attnum, List *rows)
+ {
+     TupleTableSlot *slot = MakeSingleTupleTableSlot(tupdesc, &TTSOpsMinimalTuple);
+     Oid key_type = key_attnum != InvalidAttrNumber ? TupleDescAttr(tupdesc, key_attnum - 1)->atttypid
+                                                    : InvalidOid;
+     
+     tuplestore_rescan(table);
+     while (tuplestore_gettupleslot(table, true, false, slot))
+     {
+         bool isnull;
+         Datum datum = slot_getattr(slot, attnum, &isnull);
+         MemoryContext oldcontext;
+         text *txt = isnull ? NULL : DatumGetTextPP(datum);
+         int len = txt ? VARSIZE_ANY_EXHDR(txt) : 0;
+         ChangedRow *row;
+         
+         oldcontext = MemoryContextSwitchTo(TopTransactionContext);
+         row = (ChangedRow *)palloc0(sizeof(ChangedRow));
+         row->value = (char *)palloc(len + 1);
+         if (txt)
+             memcpy(row->value, VARDATA_ANY(txt), len);
+         row->value[len] = '\0';
+         if (key_type != InvalidOid)
+         {
+             Datum key_datum = slot_getattr(slot, key_attnum, &isnull);
+             
+             if (!isnull)
+             {
+                 row->key = key_datum_to_int64(key_datum, key_type);
+                 row->has_key = true;
+             }
+         }
+         rows = lappend(rows, row);
+         MemoryContextSwitchTo(oldcontext);
+     }
+     
+     ExecDropSingleTupleTableSlot(slot);
+     return rows;
+ }
+ 
+ /* ==================== INDEX BUILD ==================== */
+ 
+ /*
+  * Rows are numbered in ctid order.  Heap tables are read with a plain heap
+  * scan in physical order, taking each value in place from the buffer page
+  * (detoasting only when needed).  Other relations stream the column through
+  * an SPI cursor in batches, so only one batch of tuples is held next to the
+  * index.  The parallel build splits the heap into block ranges that
+  * the leader and its workers claim from a shared counter.  Each range is
+  * built into its own image (workers leave theirs in a pinned DSM segment)
+  * and the leader concatenates the parts in range order with
+  * builder_append_image().
+  *
+  * Heap scans also keep each row's ctid, and any build can keep an integer
+  * key column, so query results can be joined back to the table.
+  */
+ 
+ #define BUILD_BATCH_SIZE                    10000
+ #define PARALLEL_BUILD_KEY_SHARED           UINT64CONST(0x4F4C494B00000001)
+ #define PARALLEL_RANGES_PER_PARTICIPANT     4
+ 
+ typedef struct {
+     Oid relid;
+     AttrNumber attnum;
+     AttrNumber key_attnum;      /* InvalidAttrNumber when no key is kept */
+     bool grams;                 /* build the n-gram index */
+     int bigram_positions;
+     int max_gap;
+     BlockNumber nblocks;
+     BlockNumber blocks_per_range;
+     uint32 nranges;
+     pg_atomic_uint32 next_range;
+     pg_atomic_uint32 aborted;   /* set by the leader on error: claim no more ranges */
+     dsm_handle parts[FLEXIBLE_ARRAY_MEMBER];    /* worker part images by range */
+ } ParallelBuildShared;
+ 
+ PGDLLEXPORT void optimized_like_build_worker(dsm_segment *seg, shm_toc *toc);
+ 
+ /* Key columns are stored as int64 whatever their width */
+ static int64 key_datum_to_int64(Datum datum, Oid type)
+ {
+     switch (type)
+     {
+         case INT2OID:
+             return DatumGetInt16(datum);
+         case INT4OID:
+             return DatumGetInt32(datum);
+         default:
+             return DatumGetInt64(datum);
+     }
+ }
+ 
+ /* Stream the column through an SPI cursor, BUILD_BATCH_SIZE rows at a time */
+ static void build_serial(IndexBuilder *builder, const char *schema_name,
+                          const char *table_name, const char *column_name,
+                          const char *key_name)
+ {
+     StringInfoData query;
+     SPIPlanPtr plan;
+     Portal portal;
+     uint64 num_records = 0;
+     uint64 idx;
+     HeapTuple tuple;
+     bool isnull, key_isnull;
+     Datum datum, key_datum;
+     int64 key;
+     text *txt;
+     
+     if (SPI_connect() != SPI_OK_CONNECT)
+         ereport(ERROR, (errmsg("SPI_connect failed")));
+     
+     initStringInfo(&query);
+     appendStringInfo(&query, "SELECT %s", quote_identifier(column_name));
+     if (key_name)
+         appendStringInfo(&query, ", %s", quote_identifier(key_name));
+     appendStringInfo(&query, " FROM %s ORDER BY ctid",
+                      quote_qualified_identifier(schema_name, table_name));
+     
+     plan = SPI_prepare(query.data, 0, NULL);
+     if (!plan)
+     {
+         SPI_finish();
+         ereport(ERROR, (errmsg("Query failed: %s", SPI_result_code_string(SPI_result))));
+     }
+     portal = SPI_cursor_open(NULL, plan, NULL, NULL, true);
+     
+     /* Only one batch of tuples is materialized at a time */
+     for (;;)
+     {
+         SPI_cursor_fetch(portal, true, BUILD_BATCH_SIZE);
+         if (SPI_processed == 0)
+             break;
+         
+         for (idx = 0; idx < SPI_processed; idx++)
+         {
+             tuple = SPI_tuptable->vals[idx];
+             datum = SPI_getbinval(tuple, SPI_tuptable->tupdesc, 1, &isnull);
+             key_isnull = true;
+             if (key_name)
+             {
+                 key_datum = SPI_getbinval(tuple, SPI_tuptable->tupdesc, 2, &key_isnull);
+                 if (!key_isnull)
+                     key = key_datum_to_int64(key_datum, SPI_gettypeid(SPI_tuptable->tupdesc, 2));
+             }
+             
+             if (isnull)
+             {
+                 builder_add(builder, "", 0, NULL, key_isnull ? NULL : &key);
+                 continue;
+             }
+             
+             txt = DatumGetTextPP(datum);
+             builder_add(builder, VARDATA_ANY(txt), VARSIZE_ANY_EXHDR(txt), NULL,
+                         key_isnull ? NULL : &key);
+             
+             if ((Pointer)txt != DatumGetPointer(datum))
+                 pfree(txt);
+         }
+         
+         num_records += SPI_processed;
+         SPI_freetuptable(SPI_tuptable);
+         elog(BUILD_MESSAGE_LEVEL, "Processed %lu records", (unsigned long)num_records);
+     }
+     
+     SPI_cursor_close(portal);
+     SPI_freeplan(plan);
+     
+     elog(BUILD_MESSAGE_LEVEL, "Index building complete, building length index...");
+     builder_finish(builder);
+     
+     SPI_finish();
+ }
+ 
+ /* Feed the live tuples of blocks [start, start + nblocks) to the builder */
+ static void build_scan_range(Relation rel, AttrNumber attnum, AttrNumber key_attnum,
+                              BlockNumber start, BlockNumber nblocks, IndexBuilder *b)
+ {
+     TupleDesc tupdesc = RelationGetDescr(rel);
+     Oid key_type = key_attnum != InvalidAttrNumber ? TupleDescAttr(tupdesc, key_attnum - 1)->atttypid
+                                                    : InvalidOid;
+     TableScanDesc scan;
+     HeapTuple tuple;
+     
+     /* No syncscan: the range has to start at its first block */
+     scan = table_beginscan_strat(rel, GetActiveSnapshot(), 0, NULL, true, false);
+     heap_setscanlimits(scan, start, nblocks);
+     
+     while ((tuple = heap_getnext(scan, ForwardScanDirection)) != NULL)
+     {
+         bool isnull, key_isnull = true;
+         Datum datum = heap_getattr(tuple, attnum, tupdesc, &isnull);
+         int64 key = 0;
+         text *txt;
+         
+         CHECK_FOR_INTERRUPTS();
+         
+         if (key_type != InvalidOid)
+         {
+             Datum key_datum = heap_getattr(tuple, key_attnum, tupdesc, &key_isnull);
+             
+             if (!key_isnull)
+                 key = key_datum_to_int64(key_datum, key_type);
+         }
+         
+         if (isnull)
+         {
+             builder_add(b, "", 0, &tuple->t_self, key_isnull ? NULL : &key);
+             continue;
+         }
+         
+         txt = DatumGetTextPP(datum);
+         builder_add(b, VARDATA_ANY(txt), VARSIZE_ANY_EXHDR(txt), &tuple->t_self,
+                     key_isnull ? NULL : &key);
+         
+         if ((Pointer)txt != DatumGetPointer(datum))
+             pfree(txt);
+     }
+     
+     table_endscan(scan);
+ }
+ 
+ /*
+  * Build one block range into an image.  A worker passes handle_out and gets a
+  * DSM segment that is pinned before anything is written, so the leader can
+  * always find (and release) it; the leader's own parts are palloc'd.
+  */
+ static char* build_part_image(Relation rel, ParallelBuildShared *shared, uint32 range,
+                               dsm_handle *handle_out)
+ {
+     MemoryContext part_context, oldcontext;
+     IndexBuilder *b;
+     ImageLayout layout;
+     BlockNumber start = range * shared->blocks_per_range;
+     BlockNumber nblocks = Min(shared->blocks_per_range, shared->nblocks - start);
+     Size image_size;
+     char *image;
+     
+     part_context = AllocSetContextCreate(CurrentMemoryContext,
+                                          "RoaringLikeIndexPart",
+                                          ALLOCSET_DEFAULT_SIZES);
+     b = builder_create(part_context, true, shared->key_attnum != InvalidAttrNumber);
+     /* The suffix array is built over the whole arena once the parts are appended */
+     builder_enable_options(b, shared->grams, shared->bigram_positions, false, shared->max_gap);
+     build_scan_range(rel, shared->attnum, shared->key_attnum, start, nblocks, b);
+     builder_finish(b);
+     
+     oldcontext = MemoryContextSwitchTo(part_context);
+     image_size = layout_index_image(b, &layout);
+     MemoryContextSwitchTo(oldcontext);
+     
+     if (handle_out)
+     {
+         dsm_segment *seg = dsm_create(image_size, 0);
+         
+         dsm_pin_segment(seg);
+         *handle_out = dsm_segment_handle(seg);
+         image = (char *)dsm_segment_address(seg);
+         write_index_image(image, &layout, b, "", "", "");
+         dsm_detach(seg);
+     }
+     else
+     {
+         image = (char *)TYPEALIGN(IMAGE_ALIGN,
+                                   MemoryContextAllocHuge(CurrentMemoryContext, image_size + IMAGE_ALIGN));
+         write_index_image(image, &layout, b, "", "", "");
+     }
+     
+     free_index_bitmaps(b->index);
+     MemoryContextDelete(part_context);
+     return image;
+ }
+ 
+ /* Claim and build ranges until none are left; local_parts is NULL in workers */
+ static void build_claim_ranges(Relation rel, ParallelBuildShared *shared, char **local_parts)
+ {
+     uint32 range;
+     
+     while (pg_atomic_read_u32(&shared->aborted) == 0 &&
+            (range = pg_atomic_fetch_add_u32(&shared->next_range, 1)) < shared->nranges)
+     {
+         if (local_parts)
+             local_parts[range] = build_part_image(rel, shared, range, NULL);
+         else
+             build_part_image(rel, shared, range, &shared->parts[range]);
+     }
+ }
+ 
+ void optimized_like_build_worker(dsm_segment *seg, shm_toc *toc)
+ {
+     ParallelBuildShared *shared;
+     Relation rel;
+     
+     shared = (ParallelBuildShared *)shm_toc_lookup(toc, PARALLEL_BUILD_KEY_SHARED, false);
+     rel = table_open(shared->relid, AccessShareLock);
+     build_claim_ranges(rel, shared, NULL);
+     table_close(rel, AccessShareLock);
+ }
+ 
+ /* Heap tables are scanned directly; anything else goes through SPI */
+ static bool heap_scan_supported(Oid relid, bool parallel)
+ {
+     Relation rel = table_open(relid, AccessShareLock);
+     bool supported = (rel->rd_rel->relkind == RELKIND_RELATION ||
+                       rel->rd_rel->relkind == RELKIND_MATVIEW) &&
+                      rel->rd_rel->relam == HEAP_TABLE_AM_OID;
+     
+     /* Workers cannot see the leader's local buffers */
+     if (parallel && rel->rd_rel->relpersistence == RELPERSISTENCE_TEMP)
+         supported = false;
+     table_close(rel, AccessShareLock);
+     return supported;
+ }
+ 
+ /* Serial build straight from the heap in physical (ctid) order */
+ static void build_heap(IndexBuilder *builder, IndexKey key, AttrNumber key_attnum)
+ {
+     Relation rel = table_open(key.relid, AccessShareLock);
+     
+     build_scan_range(rel, key.attnum, key_attnum, 0, RelationGetNumberOfBlocks(rel), builder);
+     table_close(rel, AccessShareLock);
+     
+     elog(BUILD_MESSAGE_LEVEL, "Scanned %d rows, building length index...",
+          builder_num_rows(builder));
+     builder_finish(builder);
+ }
+ 
+ static void build_parallel(IndexBuilder *builder, IndexKey key, AttrNumber key_attnum, int nworkers)
+ {
+     Relation rel = table_open(key.relid, AccessShareLock);
+     BlockNumber nblocks = RelationGetNumberOfBlocks(rel);
+     ParallelContext *pcxt;
+     ParallelBuildShared *shared;
+     MemoryContext parts_context, oldcontext;
+     char **local_parts;
+     Size shared_size;
+     uint32 nranges, range;
+     BlockNumber blocks_per_range;
+     
+     nranges = Min((uint32)(nworkers + 1) * PARALLEL_RANGES_PER_PARTICIPANT, nblocks);
+     nranges = Max(nranges, 1);
+     blocks_per_range = Max((nblocks + nranges - 1) / nranges, 1);
+     /* Rounding blocks_per_range up can leave trailing ranges past the end */
+     nranges = Max((nblocks + blocks_per_range - 1) / blocks_per_range, 1);
+     shared_size = add_size(offsetof(ParallelBuildShared, parts),
+                            mul_size(nranges, sizeof(dsm_handle)));
+     
+     EnterParallelMode();
+     pcxt = CreateParallelContext("optimized_like", "optimized_like_build_worker", nworkers);
+     shm_toc_estimate_chunk(&pcxt->estimator, shared_size);
+     shm_toc_estimate_keys(&pcxt->estimator, 1);
+     InitializeParallelDSM(pcxt);
+     
+     shared = (ParallelBuildShared *)shm_toc_allocate(pcxt->toc, shared_size);
+     memset(shared, 0, shared_size);
+     shared->relid = key.relid;
+     shared->attnum = key.attnum;
+     shared->key_attnum = key_attnum;
+     shared->grams = builder->index->has_grams;
+     shared->bigram_positions = builder->index->bigram_positions;
+     shared->max_gap = builder->index->max_gap;
+     shared->nblocks = nblocks;
+     shared->nranges = nranges;
+     shared->blocks_per_range = blocks_per_range;
+     pg_atomic_init_u32(&shared->next_range, 0);
+     pg_atomic_init_u32(&shared->aborted, 0);
+     for (range = 0; range < nranges; range++)
+         shared->parts[range] = DSM_HANDLE_INVALID;
+     shm_toc_insert(pcxt->toc, PARALLEL_BUILD_KEY_SHARED, shared);
+     
+     LaunchParallelWorkers(pcxt);
+     elog(BUILD_MESSAGE_LEVEL, "Parallel build: %d of %d workers launched, %u block ranges over %u blocks",
+          pcxt->nworkers_launched, nworkers, nranges, nblocks);
+     
+     parts_context = AllocSetContextCreate(CurrentMemoryContext,
+                                           "RoaringLikeIndexParts",
+                                           ALLOCSET_DEFAULT_SIZES);
+     oldcontext = MemoryContextSwitchTo(parts_context);
+     local_parts = (char **)palloc0(nranges * sizeof(char *));
+     
+     PG_TRY();
+     {
+         /* The leader builds ranges too, so a build with no workers still completes */
+         build_claim_ranges(rel, shared, local_parts);
+         WaitForParallelWorkersToFinish(pcxt);
+         
+         for (range = 0; range < nranges; range++)
+         {
+             if (local_parts[range])
+             {
+                 builder_append_image(builder, local_parts[range]);
+             }
+             else
+             {
+                 dsm_handle handle = shared->parts[range];
+                 dsm_segment *seg = dsm_attach(handle);
+                 
+                 if (!seg)
+                     ereport(ERROR,
+                             (errmsg("could not attach to optimized_like build part %u", range)));
+                 builder_append_image(builder, (char *)dsm_segment_address(seg));
+                 dsm_detach(seg);
+                 dsm_unpin_segment(handle);
+                 shared->parts[range] = DSM_HANDLE_INVALID;
+             }
+         }
+     }
+     PG_CATCH();
+     {
+         /*
+          * Pinned parts outlive the error unless released here.  A worker
+          * still building would pin its part after this loop, so stop the
+          * workers first: they finish the range in hand and claim no more.
+          */
+         pg_atomic_write_u32(&shared->aborted, 1);
+         WaitForParallelWorkersToFinish(pcxt);
+         for (range = 0; range < nranges; range++)
+             if (shared->parts[range] != DSM_HANDLE_INVALID)
+                 dsm_unpin_segment(shared->parts[range]);
+         PG_RE_THROW();
+     }
+     PG_END_TRY();
+     
+     MemoryContextSwitchTo(oldcontext);
+     MemoryContextDelete(parts_context);
+     
+     DestroyParallelContext(pcxt);
+     ExitParallelMode();
+     table_close(rel, AccessShareLock);
+     
+     elog(BUILD_MESSAGE_LEVEL, "Merged %u parts into %d rows", nranges, builder->index->num_records);
+ }
+ 
+ /* ==================== PARTITIONED TABLES ==================== */
+ 
+ /*
+  * A partitioned table has no index of its own.  Each leaf partition gets a
+  * sub-index registered under the partition's relid, so partitions are built,
+  * rebuilt and dropped independently.  A query that names the parent fans out
+  * over the leaves that have a sub-index, optionally limited to a set of
+  * partitions, and concatenates the results.  When a partition is dropped,
+  * its sub-index is released on the next lookup after the relcache reports
+  * the drop.
+  */
+ 
+ static void registry_relcache_callback(Datum arg, Oid relid)
+ {
+     HASH_SEQ_STATUS status;
+     LoadedIndex *entry;
+     
+     if (relid == InvalidOid)
+     {
+         registry_prune_pending = true;
+         return;
+     }
+     
+     /* No catalog access here; the check is deferred to prune_dropped_indexes */
+     hash_seq_init(&status, index_registry);
+     while ((entry = (LoadedIndex *)hash_seq_search(&status)) != NULL)
+     {
+         if (entry->key.relid == relid)
+         {
+             registry_prune_pending = true;
+             hash_seq_term(&status);
+             break;
+         }
+     }
+ }
+ 
+ /* Release the indexes of relations that no longer exist */
+ static void prune_dropped_indexes(void)
+ {
+     HASH_SEQ_STATUS status;
+     LoadedIndex *entry;
+     List *dropped = NIL;
+     ListCell *lc;
+     
+     registry_prune_pending = false;
+     
+     hash_seq_init(&status, index_registry);
+     while ((entry = (LoadedIndex *)hash_seq_search(&status)) != NULL)
+     {
+         if (!SearchSysCacheExists1(RELOID, ObjectIdGetDatum(entry->key.relid)))
+         {
+             IndexKey *key = (IndexKey *)palloc(sizeof(IndexKey));
+             
+             *key = entry->key;
+             dropped = lappend(dropped, key);
+         }
+     }
+     
+     foreach(lc, dropped)
+     {
+         IndexKey key = *(IndexKey *)lfirst(lc);
+         
+         drop_loaded_index(key);
+         if (shared_state)
+             unpublish_shared_index(key);
+     }
+     list_free_deep(dropped);
+ }
+ 
+ /* Keys for the leaf partitions of parent, matching its column by name */
+ static List* leaf_partition_keys(IndexKey parent)
+ {
+     char *column_name = get_attname(parent.relid, parent.attnum, false);
+     List *children = find_all_inheritors(parent.relid, AccessShareLock, NULL);
+     List *keys = NIL;
+     ListCell *lc;
+     
+     foreach(lc, children)
+     {
+         Oid child = lfirst_oid(lc);
+         IndexKey *key;
+         
+         if (get_rel_relkind(child) == RELKIND_PARTITIONED_TABLE)
+             continue;
+         
+         /* Partitions may have a different column layout than the parent */
+         key = (IndexKey *)palloc(sizeof(IndexKey));
+         *key = make_index_key(child, get_attnum(child, column_name));
+         keys = lappend(keys, key);
+     }
+     list_free(children);
+     return keys;
+ }
+ 
+ /* True when filter holds relid or one of its ancestors */
+ static bool partition_in_filter(Oid relid, const Oid *filter, int nfilter)
+ {
+     List *ancestors;
+     ListCell *lc;
+     bool found = false;
+     int i;
+     
+     for (i = 0; i < nfilter; i++)
+         if (filter[i] == relid)
+             return true;
+     
+     ancestors = get_partition_ancestors(relid);
+     foreach(lc, ancestors)
+     {
+         for (i = 0; i < nfilter && !found; i++)
+             found = filter[i] == lfirst_oid(lc);
+         if (found)
+             break;
+     }
+     list_free(ancestors);
+     return found;
+ }
+ 
+ /* The sub-indexes answering a query on parent, limited to filter when given */
+ static List* partition_indexes(IndexKey parent, ArrayType *filter)
+ {
+     List *keys = leaf_partition_keys(parent);
+     List *indexes = NIL;
+     Oid *filter_oids = NULL;
+     int nfilter = 0, missing = 0, i;
+     ListCell *lc;
+     
+     if (filter)
+     {
+         Datum *elems;
+         bool *nulls;
+         
+         deconstruct_array(filter, REGCLASSOID, sizeof(Oid), true, 'i',
+                           &elems, &nulls, &nfilter);
+         filter_oids = (Oid *)palloc(Max(nfilter, 1) * sizeof(Oid));
+         for (i = 0; i < nfilter; i++)
+             filter_oids[i] = nulls[i] ? InvalidOid : DatumGetObjectId(elems[i]);
+     }
+     
+     registry_refresh();
+     foreach(lc, keys)
+     {
+         IndexKey *key = (IndexKey *)lfirst(lc);
+         LoadedIndex *entry;
+         
+         if (filter && !partition_in_filter(key->relid, filter_oids, nfilter))
+             continue;
+         
+         entry = (LoadedIndex *)hash_search(index_registry, key, HASH_FIND, NULL);
+         if (entry)
+             indexes = lappend(indexes, entry);
+         else
+             missing++;
+     }
+     
+     if (missing > 0)
+         elog(WARNING, "%d partitions of %s have no index on %s and were skipped",
+              missing, get_rel_name(parent.relid), get_attname(parent.relid, parent.attnum, false));
+     list_free_deep(keys);
+     return indexes;
+ }
+ 
+ /* ==================== POSTGRESQL FUNCTIONS ==================== */
+ 
+ /*
+  * Functions taking (table, column, ...) use the index registered for that
+  * column; the older forms without them use the last index built or loaded.
+  * Either way a missing index is reported and treated as empty.
+  */
+ /*
+  * The indexes a query runs on: the default index, the index on the named
+  * table, or the sub-indexes of a partitioned table's leaves.  filter_arg is
+  * an optional regclass[] of partitions to search.  nargs counts the
+  * arguments that take part, in case trailing ones mean something else.
+  */
+ static List* get_call_indexes(FunctionCallInfo fcinfo, int nargs, int table_arg, int filter_arg)
+ {
+     LoadedIndex *index;
+     
+     if (nargs > table_arg + 1)
+     {
+         IndexKey key = resolve_index_key(PG_GETARG_TEXT_PP(table_arg),
+                                          PG_GETARG_TEXT_PP(table_arg + 1));
+         
+         if (get_rel_relkind(key.relid) == RELKIND_PARTITIONED_TABLE)
+             return partition_indexes(key, nargs > filter_arg ? PG_GETARG_ARRAYTYPE_P(filter_arg)
+                                                              : NULL);
+         if (nargs > filter_arg)
+             ereport(ERROR,
+                     (errcode(ERRCODE_WRONG_OBJECT_TYPE),
+                      errmsg("\"%s\" is not a partitioned table", get_rel_name(key.relid))));
+         
+         index = lookup_index(key);
+         if (!index)
+             elog(WARNING, "No index on %s.%s. Call build_optimized_index() first.",
+                  get_rel_name(key.relid), get_attname(key.relid, key.attnum, false));
+     }
+     else
+     {
+         index = lookup_default_index();
+         if (!index)
+             elog(WARNING, "Index not built. Call build_optimized_index() first.");
+     }
+     return index ? list_make1(index) : NIL;
+ }
+ 
+ /* Build and install the index on one table (or leaf partition) */
+ static void build_index(IndexKey key, int nworkers, const char *key_str, bool dictionary)
+ {
+     char *schema_str = get_namespace_name(get_rel_namespace(key.relid));
+     char *table_str = get_rel_name(key.relid);
+     char *column_str = get_attname(key.relid, key.attnum, false);
+     Oid column_type = get_atttype(key.relid, key.attnum);
+     AttrNumber key_attnum = InvalidAttrNumber;
+     
+     instr_time start_time, end_time;
+     int num_records;
+     double ms;
+     bool parallel, heap_scan;
+     MemoryContext build_context;
+     IndexBuilder *builder;
+     LoadedIndex *entry;
+     
+     if (column_type != TEXTOID && column_type != VARCHAROID && column_type != BPCHAROID)
+         ereport(ERROR,
+                 (errcode(ERRCODE_DATATYPE_MISMATCH),
+                  errmsg("column \"%s\" is of type %s, expected a text column",
+                         column_str, format_type_be(column_type))));
+     
+     if (key_str)
+     {
+         Oid key_type;
+         
+         key_attnum = get_attnum(key.relid, key_str);
+         if (key_attnum == InvalidAttrNumber)
+             ereport(ERROR,
+                     (errcode(ERRCODE_UNDEFINED_COLUMN),
+                      errmsg("column \"%s\" of relation \"%s\" does not exist",
+                             key_str, table_str)));
+         key_type = get_atttype(key.relid, key_attnum);
+         if (key_type != INT2OID && key_type != INT4OID && key_type != INT8OID)
+             ereport(ERROR,
+                     (errcode(ERRCODE_DATATYPE_MISMATCH),
+                      errmsg("key column \"%s\" is of type %s, expected an integer column",
+                             key_str, format_type_be(key_type))));
+     }
+     
+     /* Build parts cannot share a dictionary, so dictionary builds are serial */
+     parallel = nworkers > 0 && !dictionary && heap_scan_supported(key.relid, true);
+     heap_scan = parallel || heap_scan_supported(key.relid, false);
+     if (nworkers > 0 && !parallel)
+         ereport(NOTICE,
+                 (errmsg("parallel build is only supported on permanent heap tables "
+                         "without a dictionary, building serially")));
+     
+     INSTR_TIME_SET_CURRENT(start_time);
+     elog(BUILD_MESSAGE_LEVEL, "Building index on %s.%s...",
+          table_str, column_str);
+     
+     /* Only the index being rebuilt is released; others stay loaded */
+     drop_loaded_index(key);
+     
+     /* Build into a scratch context; the result is flattened into an image */
+     build_context = AllocSetContextCreate(TopMemoryContext,
+                                           "RoaringLikeIndexBuild",
+                                           ALLOCSET_DEFAULT_SIZES);
+     /* Only a heap scan sees ctids */
+     builder = builder_create(build_context, heap_scan, key_str != NULL);
+     builder->index->key_attnum = key_attnum;
+     if (dictionary)
+         builder_enable_dictionary(builder);
+     builder_enable_options(builder, ngram_index, bigram_positions, suffix_array, gap_pairs);
+     
+     elog(BUILD_MESSAGE_LEVEL, "Initialized index structures (position directory, cache, bloom filter)");
+     
+     if (parallel)
+         build_parallel(builder, key, key_attnum, nworkers);
+     else if (heap_scan)
+         build_heap(builder, key, key_attnum);
+     else
+         build_serial(builder, schema_str, table_str, column_str, key_str);
+     num_records = builder_num_rows(builder);
+     if (dictionary)
+         elog(BUILD_MESSAGE_LEVEL, "Dictionary: %d distinct values in %d rows",
+              builder->index->num_records, num_records);
+     if (ngram_index)
+         elog(BUILD_MESSAGE_LEVEL, "N-grams: %u bigrams and trigrams", builder->index->grams.count);
+     if (bigram_positions > 0)
+         elog(BUILD_MESSAGE_LEVEL, "Positional bigrams: %u at the first and last %d positions",
+              builder->index->pos_grams.count, builder->index->bigram_positions);
+     if (builder->index->max_gap > 0)
+         elog(BUILD_MESSAGE_LEVEL, "Gap pairs: %u for gaps up to %d",
+              builder->index->gap_pairs.count, builder->index->max_gap);
+     
+     entry = install_built_index(key, builder, schema_str, table_str, column_str);
+     MemoryContextDelete(build_context);
+     
+     INSTR_TIME_SET_CURRENT(end_time);
+     INSTR_TIME_SUBTRACT(end_time, start_time);
+     ms = INSTR_TIME_GET_MILLISEC(end_time);
+     
+     elog(BUILD_MESSAGE_LEVEL, "Build time: %.0f ms", ms);
+     elog(BUILD_MESSAGE_LEVEL, "Index: %d records, max_len=%d, memory=%zu bytes (%.2f MB)",
+          num_records, entry->index->max_len, entry->index->memory_used,
+          entry->index->memory_used / (1024.0 * 1024.0));
+     elog(BUILD_MESSAGE_LEVEL, "Query cache: %d slots with bloom filter", QUERY_CACHE_SIZE);
+     elog(BUILD_MESSAGE_LEVEL, "Storage: %s", entry->generation ? "shared memory (attached by all backends)" : "backend-local");
+ }
+ 
+ /* Build the index of a table, or one per leaf of a partitioned table */
+ static void build_all_indexes(IndexKey key, int nworkers, const char *key_str, bool dictionary)
+ {
+     List *partitions;
+     ListCell *lc;
+     
+     if (get_rel_relkind(key.relid) != RELKIND_PARTITIONED_TABLE)
+     {
+         build_index(key, nworkers, key_str, dictionary);
+         return;
+     }
+     
+     /* One sub-index per leaf; a new partition can later be built on its own */
+     partitions = leaf_partition_keys(key);
+     foreach(lc, partitions)
+         build_index(*(IndexKey *)lfirst(lc), nworkers, key_str, dictionary);
+     elog(BUILD_MESSAGE_LEVEL, "Built %d partition indexes of %s", list_length(partitions), get_rel_name(key.relid));
+ }
+ 
+ PG_FUNCTION_INFO_V1(build_optimized_index);
+ Datum build_optimized_index(PG_FUNCTION_ARGS)
+ {
+     IndexKey key = resolve_index_key(PG_GETARG_TEXT_PP(0), PG_GETARG_TEXT_PP(1));
+     int nworkers = PG_NARGS() > 2 ? PG_GETARG_INT32(2) : 0;
+     char *key_str = PG_NARGS() > 3 ? text_to_cstring(PG_GETARG_TEXT_PP(3)) : NULL;
+     
+     build_all_indexes(key, nworkers, key_str, false);
+     PG_RETURN_BOOL(true);
+ }
+ 
+ /*
+  * Like build_optimized_index(), but the index covers distinct values only and
+  * keeps a value-to-rows postings list, which pays off on columns with heavy
+  * repetition: pattern matching and verification run over the dictionary and
+  * only the matches are expanded to rows.
+  */
+ PG_FUNCTION_INFO_V1(build_optimized_dictionary_index);
+ Datum build_optimized_dictionary_index(PG_FUNCTION_ARGS)
+ {
+     IndexKey key = resolve_index_key(PG_GETARG_TEXT_PP(0), PG_GETARG_TEXT_PP(1));
+     char *key_str = PG_NARGS() > 2 ? text_to_cstring(PG_GETARG_TEXT_PP(2)) : NULL;
+     
+     build_all_indexes(key, 0, key_str, true);
+     PG_RETURN_BOOL(true);
+ }
+ 
+ PG_FUNCTION_INFO_V1(optimized_like_query);
+ Datum optimized_like_query(PG_FUNCTION_ARGS)
+ {
+     List *indexes = get_call_indexes(fcinfo, PG_NARGS(), 0, 3);
+     char *pattern = text_to_cstring(PG_GETARG_TEXT_PP(PG_NARGS() > 1 ? 2 : 0));
+     uint64_t total = 0;
+     ListCell *lc;
+     
+     foreach(lc, indexes)
+         total += registry_count((LoadedIndex *)lfirst(lc), pattern);
+     
+     PG_RETURN_INT32(total);
+ }
+ 
+ typedef struct {
+     RegistryCursor *parts;          /* one per index (partition) */
+     int num_parts;
+     int part;                       /* part being returned */
+     int64 remaining;                /* rows still to return, -1 for no limit */
+     MemoryContextCallback cleanup;
+ } QueryRowsState;
+ 
+ /* Close the cursors left open when the caller stops early */
+ static void query_rows_cleanup(void *arg)
+ {
+     QueryRowsState *state = (QueryRowsState *)arg;
+     int i;
+     
+     for (i = 0; i < state->num_parts; i++)
+         if (state->parts[i].cursor)
+         {
+             query_close(state->parts[i].cursor);
+             state->parts[i].cursor = NULL;
+         }
+ }
+ 
+ /*
+  * Rows are found as they are returned, so LIMIT or a max_rows argument ends
+  * the scan without verifying the candidates after the last row taken.  The
+  * first nargs arguments are the usual (pattern) or (table, column, pattern
+  * [, partitions]).  tid and key are NULL when unknown (see loaded_index_tid).
+  */
+ static Datum query_rows_srf(FunctionCallInfo fcinfo, int nargs, int64 max_rows)
+ {
+     FuncCallContext *funcctx;
+     QueryRowsState *state;
+     RegistryCursor *part;
+     MemoryContext oldcontext;
+     uint32_t row_idx;
+     ItemPointer tid;
+     const int64 *row_key;
+     Datum values[5];
+     bool nulls[5];
+     HeapTuple tuple;
+     Datum result;
+     bool found = false;
+     
+     if (SRF_IS_FIRSTCALL())
+     {
+         char *pattern;
+         TupleDesc tupdesc;
+         List *indexes;
+         ListCell *lc;
+         
+         funcctx = SRF_FIRSTCALL_INIT();
+         oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+         
+         indexes = get_call_indexes(fcinfo, nargs, 0, 3);
+         pattern = text_to_cstring(PG_GETARG_TEXT_PP(nargs > 1 ? 2 : 0));
+         state = (QueryRowsState *)palloc0(sizeof(QueryRowsState));
+         state->parts = (RegistryCursor *)palloc0(Max(list_length(indexes), 1) * sizeof(RegistryCursor));
+         state->remaining = max_rows;
+         foreach(lc, indexes)
+         {
+             part = &state->parts[state->num_parts++];
+             part->entry = (LoadedIndex *)lfirst(lc);
+             part->pattern = pattern;
+         }
+         state->cleanup.func = query_rows_cleanup;
+         state->cleanup.arg = state;
+         MemoryContextRegisterResetCallback(funcctx->multi_call_memory_ctx, &state->cleanup);
+         funcctx->user_fctx = (void *)state;
+         
+         if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+             ereport(ERROR, (errmsg("function returning record in invalid context")));
+         
+         funcctx->tuple_desc = BlessTupleDesc(tupdesc);
+         MemoryContextSwitchTo(oldcontext);
+     }
+     
+     funcctx = SRF_PERCALL_SETUP();
+     state = (QueryRowsState *)funcctx->user_fctx;
+     
+     /* Cursors live as long as the whole call */
+     if (state->remaining != 0)
+     {
+         oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+         while (state->part < state->num_parts &&
+                !(found = registry_next(&state->parts[state->part], &row_idx)))
+             state->part++;
+         MemoryContextSwitchTo(oldcontext);
+     }
+     
+     if (found)
+     {
+         const char *str;
+         int len;
+         
+         part = &state->parts[state->part];
+         if (state->remaining > 0)
+             state->remaining--;
+         tid = loaded_index_tid(part->entry, row_idx);
+         row_key = loaded_index_key(part->entry, row_idx);
+         
+         nulls[0] = false;
+         nulls[1] = false;
+         nulls[2] = tid == NULL;
+         nulls[3] = row_key == NULL;
+         nulls[4] = false;
+         
+         values[0] = Int32GetDatum((int32_t)row_idx);
+         str = loaded_index_string(part->entry, row_idx, &len);
+         values[1] = PointerGetDatum(cstring_to_text_with_len(str, len));
+         values[2] = tid ? ItemPointerGetDatum(tid) : (Datum)0;
+         values[3] = row_key ? Int64GetDatum(*row_key) : (Datum)0;
+         values[4] = ObjectIdGetDatum(part->entry->key.relid);
+         
+         tuple = heap_form_tuple(funcctx->tuple_desc, values, nulls);
+         result = HeapTupleGetDatum(tuple);
+         
+         SRF_RETURN_NEXT(funcctx, result);
+     }
+     
+     SRF_RETURN_DONE(funcctx);
+ }
+ 
+ PG_FUNCTION_INFO_V1(optimized_like_query_rows);
+ Datum optimized_like_query_rows(PG_FUNCTION_ARGS)
+ {
+     return query_rows_srf(fcinfo, PG_NARGS(), -1);
+ }
+ 
+ /* The same with a trailing max_rows argument */
+ PG_FUNCTION_INFO_V1(optimized_like_query_rows_limit);
+ Datum optimized_like_query_rows_limit(PG_FUNCTION_ARGS)
+ {
+     int32 max_rows = PG_GETARG_INT32(PG_NARGS() - 1);
+     
+     if (max_rows < 0)
+         ereport(ERROR,
+                 (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                  errmsg("max_rows must not be negative")));
+     return query_rows_srf(fcinfo, PG_NARGS() - 1, max_rows);
+ }
+ 
+ PG_FUNCTION_INFO_V1(optimized_like_status);
+ Datum optimized_like_status(PG_FUNCTION_ARGS)
+ {
+     StringInfoData buf;
+     HASH_SEQ_STATUS status;
+     LoadedIndex *entry;
+     
+     sync_shared_indexes();
+     load_index_file_setting();
+     registry_init();
+     
+     if (hash_get_num_entries(index_registry) == 0)
+     {
+         PG_RETURN_TEXT_P(cstring_to_text("No index loaded. Call build_optimized_index() first."));
+     }
+     
+     initStringInfo(&buf);
+     appendStringInfo(&buf, "optimized_like index status:\n");
+ #ifndef HAVE_ROARING
+     appendStringInfo(&buf, "Bitmap kernels: %s (built-in containers)\n", bitset_kernels.name);
+ #endif
+     
+     hash_seq_init(&status, index_registry);
+     while ((entry = (LoadedIndex *)hash_seq_search(&status)) != NULL)
+     {
+         ImageHeader *hdr = (ImageHeader *)entry->index->image;
+         
+         appendStringInfo(&buf, "\nIndex on %s.%s.%s%s:\n",
+                         hdr->schema_name, hdr->table_name, hdr->column_name,
+                         (entry->key.relid == default_key.relid &&
+                          entry->key.attnum == default_key.attnum) ? " (default)" : "");
+         appendStringInfo(&buf, "  Records: %d\n", entry->index->num_records);
+         if (entry->index->row_values)
+             appendStringInfo(&buf, "  Dictionary: %d distinct values\n",
+                             entry->index->num_values);
+         if (entry->index->has_grams)
+             appendStringInfo(&buf, "  N-grams: %u bigrams and trigrams\n",
+                             entry->index->grams.count);
+         if (entry->index->suffixes)
+             appendStringInfo(&buf, "  Suffix array: %u suffixes\n", entry->index->num_suffixes);
+         if (entry->index->bigram_positions > 0)
+             appendStringInfo(&buf, "  Positional bigrams: %u at the first and last %d positions\n",
+                             entry->index->pos_grams.count, entry->index->bigram_positions);
+         if (entry->index->max_gap > 0)
+             appendStringInfo(&buf, "  Gap pairs: %u for gaps up to %d\n",
+                             entry->index->gap_pairs.count, entry->index->max_gap);
+         appendStringInfo(&buf, "  Max length: %d\n", entry->index->max_len);
+         appendStringInfo(&buf, "  Segments: %d of %d rows (zone maps)\n",
+                         entry->index->num_zones, SEGMENT_ROWS);
+         appendStringInfo(&buf, "  Memory used: %zu bytes (%.2f MB)\n", 
+                         entry->index->memory_used,
+                         entry->index->memory_used / (1024.0 * 1024.0));
+         appendStringInfo(&buf, "  Storage: %s\n",
+                         entry->mapped_image ? "memory-mapped index file" :
+                         entry->segment ? "shared memory (DSM)" : "backend-local");
+         if (entry->index->spill)
+         {
+             SpillState *spill = entry->index->spill;
+             
+             appendStringInfo(&buf, "  Spilled bitmaps: %d loaded (%zu bytes), "
+                             UINT64_FORMAT " hits, " UINT64_FORMAT " misses, "
+                             UINT64_FORMAT " evictions\n",
+                             spill->num_loaded, spill->loaded,
+                             spill->hits, spill->misses, spill->evictions);
+         }
+         appendStringInfo(&buf, "  Row locators: %s%s\n",
+                         entry->index->tids ? "ctid" : "none",
+                         entry->index->keys ? " + key column" : "");
+         if (entry->num_deltas > 0)
+             appendStringInfo(&buf, "  Changes since build: %u rows in %d delta segments, "
+                             UINT64_FORMAT " deleted\n",
+                             loaded_num_rows(entry) - entry->index->num_records,
+                             entry->num_deltas,
+                             entry->deleted ? roaring_count(entry->deleted) : 0);
+     }
+     
+     appendStringInfo(&buf, "\nOptimizations:\n");
+     appendStringInfo(&buf, "  - [char][position] bitmap directory (one load per lookup)\n");
+     appendStringInfo(&buf, "  - Query cache: %d slots with bloom filter (per index)\n", QUERY_CACHE_SIZE);
+     appendStringInfo(&buf, "  - Zone maps over %d-row segments\n", SEGMENT_ROWS);
+     appendStringInfo(&buf, "  - Prefetching of candidate strings during verification\n");
+     appendStringInfo(&buf, "\nSupported: '%%' (multi-char), '_' (single-char)\n");
+     
+     #ifdef HAVE_ROARING
+     appendStringInfo(&buf, "Backend: Native CRoaring library\n");
+     #else
+     appendStringInfo(&buf, "Backend: Optimized fallback bitmap\n");
+     #endif
+     
+     PG_RETURN_TEXT_P(cstring_to_text(buf.data));
+ }
+ 
+ PG_FUNCTION_INFO_V1(optimized_like_clear_cache);
+ Datum optimized_like_clear_cache(PG_FUNCTION_ARGS)
+ {
+     HASH_SEQ_STATUS status;
+     LoadedIndex *entry;
+     
+     registry_init();
+     if (hash_get_num_entries(index_registry) == 0)
+         PG_RETURN_TEXT_P(cstring_to_text("No index loaded."));
+     
+     hash_seq_init(&status, index_registry);
+     while ((entry = (LoadedIndex *)hash_seq_search(&status)) != NULL)
+         init_query_cache(entry->index);
+     
+     PG_RETURN_TEXT_P(cstring_to_text("Query cache cleared successfully."));
+ }
+ 
+ PG_FUNCTION_INFO_V1(optimized_like_save_index);
+ Datum optimized_like_save_index(PG_FUNCTION_ARGS)
+ {
+     int file_arg = PG_NARGS() - 1;
+     LoadedIndex *index;
+     ImageHeader *hdr;
+     char *path;
+     
+     if (PG_NARGS() > 1)
+         index = lookup_index(resolve_index_key(PG_GETARG_TEXT_PP(0), PG_GETARG_TEXT_PP(1)));
+     else
+         index = lookup_default_index();
+     
+     if (!index)
+         ereport(ERROR,
+                 (errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+                  errmsg("no index loaded"),
+                  errhint("Call build_optimized_index() first.")));
+     
+     /* The file holds the base image only */
+     if (index->num_deltas > 0)
+         ereport(ERROR,
+                 (errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+                  errmsg("index has changes that are not part of its base image"),
+                  errhint("Call optimized_like_compact_index() first.")));
+     
+     hdr = (ImageHeader *)index->index->image;
+     if (PG_ARGISNULL(file_arg))
+         path = resolve_index_path(psprintf("%s.%s.oli", hdr->table_name, hdr->column_name));
+     else
+         path = resolve_index_path(text_to_cstring(PG_GETARG_TEXT_PP(file_arg)));
+     
+     save_index_file(index->index, path);
+     
+     PG_RETURN_TEXT_P(cstring_to_text(path));
+ }
+ 
+ PG_FUNCTION_INFO_V1(optimized_like_load_index);
+ Datum optimized_like_load_index(PG_FUNCTION_ARGS)
+ {
+     char *path = resolve_index_path(text_to_cstring(PG_GETARG_TEXT_PP(0)));
+     instr_time start_time, end_time;
+     RoaringIndex *index;
+     LoadedIndex *entry;
+     char *image;
+     Size size;
+     
+     INSTR_TIME_SET_CURRENT(start_time);
+     index = map_index_file(path, &image, &size);
+     default_key = image_index_key((ImageHeader *)image);
+     entry = register_index(default_key, index, NULL, image, size);
+     if (shared_state)
+         publish_shared_index(entry, path);
+     INSTR_TIME_SET_CURRENT(end_time);
+     INSTR_TIME_SUBTRACT(end_time, start_time);
+     
+     elog(BUILD_MESSAGE_LEVEL, "Mapped %s: %d records, %zu bytes in %.2f ms",
+          path, index->num_records, index->memory_used,
+          INSTR_TIME_GET_MILLISEC(end_time));
+     
+     PG_RETURN_BOOL(true);
+ }
+ 
+ PG_FUNCTION_INFO_V1(optimized_like_drop_index);
+ Datum optimized_like_drop_index(PG_FUNCTION_ARGS)
+ {
+     IndexKey key = resolve_index_key(PG_GETARG_TEXT_PP(0), PG_GETARG_TEXT_PP(1));
+     List *keys;
+     ListCell *lc;
+     bool found = false;
+     
+     /* Dropping on a partitioned table drops every partition's sub-index */
+     if (get_rel_relkind(key.relid) == RELKIND_PARTITIONED_TABLE)
+         keys = leaf_partition_keys(key);
+     else
+         keys = list_make1(&key);
+     
+     foreach(lc, keys)
+     {
+         IndexKey *k = (IndexKey *)lfirst(lc);
+         
+         found |= lookup_index(*k) != NULL;
+         drop_loaded_index(*k);
+         if (shared_state)
+             unpublish_shared_index(*k);
+     }
+     
+     PG_RETURN_BOOL(found);
+ }
+
+ PG_FUNCTION_INFO_V1(optimized_like_compact_index);
+ Datum optimized_like_compact_index(PG_FUNCTION_ARGS)
+ {
+     IndexKey key = resolve_index_key(PG_GETARG_TEXT_PP(0), PG_GETARG_TEXT_PP(1));
+     MemoryContext build_context, oldcontext;
+     IndexBuilder *builder;
+     LoadedIndex *entry;
+     ImageHeader *hdr;
+     uint32_t row, num_rows;
+     
+     if (shared_state)
+         LWLockAcquire(shared_state->maintenance_lock, LW_EXCLUSIVE);
+     
+     entry = lookup_index(key);
+     if (!entry || entry->num_deltas == 0)
      {
-         indices = (uint32_t *)palloc(global_index->num_records * sizeof(uint32_t));
-         for (i = 0; i < global_index->num_records; i++)
-             indices[i] = (uint32_t)i;
-         *result_count = global_index->num_records;
-         return indices;
+         if (shared_state)
+             LWLockRelease(shared_state->maintenance_lock);
+         PG_RETURN_BOOL(false);
      }
      
-     info = analyze_pattern(pattern);
+     /*
+      * Rebuild from the live strings without reading the table.  Rows keep
+      * the tid and key they report now, so a tid lost to maintenance stays
+      * lost until the next full build (see loaded_index_tid).
+      */
+     build_context = AllocSetContextCreate(TopMemoryContext,
+                                           "RoaringLikeIndexBuild",
+                                           ALLOCSET_DEFAULT_SIZES);
+     oldcontext = MemoryContextSwitchTo(build_context);
+     builder = builder_create(build_context, entry->index->tids != NULL, entry->index->keys != NULL);
+     if (entry->index->row_values)
+         builder_enable_dictionary(builder);
+     builder_inherit_options(builder, entry->index);
      
-     /* No slices - only % characters */
-     if (info->slice_count == 0)
+     num_rows = loaded_num_rows(entry);
+     for (row = 0; row < num_rows; row++)
      {
-         free_pattern_info(info);
-         indices = (uint32_t *)palloc(global_index->num_records * sizeof(uint32_t));
-         for (i = 0; i < global_index->num_records; i++)
-             indices[i] = (uint32_t)i;
-         *result_count = global_index->num_records;
-         return indices;
+         const char *str;
+         int len;
+         
+         if (entry->deleted && roaring_contains(entry->deleted, row))
+             continue;
+         str = loaded_index_string(entry, row, &len);
+         builder_add(builder, str, len, loaded_index_tid(entry, row), loaded_index_key(entry, row));
      }
+     builder_finish(builder);
+     
+     hdr = (ImageHeader *)entry->index->image;
+     install_built_index(key, builder, pstrdup(hdr->schema_name),
+                         pstrdup(hdr->table_name), pstrdup(hdr->column_name));
+     
+     MemoryContextSwitchTo(oldcontext);
+     MemoryContextDelete(build_context);
+     
+     if (shared_state)
+         LWLockRelease(shared_state->maintenance_lock);
+     
+     PG_RETURN_BOOL(true);
+ }
+ 
+ /*
+  * Statement-level AFTER trigger installed by optimized_like_enable_maintenance();
+  * its one argument is the indexed column name.
+  */
+ PG_FUNCTION_INFO_V1(optimized_like_maintain);
+ Datum optimized_like_maintain(PG_FUNCTION_ARGS)
+ {
+     TriggerData *trigdata = (TriggerData *)fcinfo->context;
+     Relation rel;
+     AttrNumber attnum;
+     AttrNumber key_attnum = InvalidAttrNumber;
+     LoadedIndex *entry;
+     PendingChanges *changes;
+     
+     if (!CALLED_AS_TRIGGER(fcinfo))
+         ereport(ERROR,
+                 (errcode(ERRCODE_E_R_I_E_TRIGGER_PROTOCOL_VIOLATED),
+                  errmsg("optimized_like_maintain: not called by trigger manager")));
+     
+     if (!TRIGGER_FIRED_AFTER(trigdata->tg_event) ||
+         !TRIGGER_FIRED_FOR_STATEMENT(trigdata->tg_event) ||
+         trigdata->tg_trigger->tgnargs != 1)
+         ereport(ERROR,
+                 (errcode(ERRCODE_E_R_I_E_TRIGGER_PROTOCOL_VIOLATED),
+                  errmsg("optimized_like_maintain must be fired AFTER ... FOR EACH STATEMENT with the column name as argument")));
+     
+     rel = trigdata->tg_relation;
+     if (rel->rd_rel->relkind == RELKIND_PARTITIONED_TABLE || rel->rd_rel->relispartition)
+         ereport(ERROR,
+                 (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+                  errmsg("optimized_like maintenance is not supported on partitioned table \"%s\"",
+                         RelationGetRelationName(rel)),
+                  errdetail("Changes made through the partitioned table cannot be routed to the index of each partition.")));
+     attnum = get_attnum(RelationGetRelid(rel), trigdata->tg_trigger->tgargs[0]);
+     if (attnum == InvalidAttrNumber)
+         ereport(ERROR,
+                 (errcode(ERRCODE_UNDEFINED_COLUMN),
+                  errmsg("column \"%s\" of relation \"%s\" does not exist",
+                         trigdata->tg_trigger->tgargs[0], RelationGetRelationName(rel))));
+     
+     /* Keys are only worth collecting for an index that keeps them */
+     entry = lookup_index(make_index_key(RelationGetRelid(rel), attnum));
+     if (entry && entry->index->keys && entry->index->key_attnum > 0 &&
+         entry->index->key_attnum <= RelationGetDescr(rel)->natts &&
+         !TupleDescAttr(RelationGetDescr(rel), entry->index->key_attnum - 1)->attisdropped)
+         key_attnum = entry->index->key_attnum;
+     
+     changes = get_pending_changes(make_index_key(RelationGetRelid(rel), attnum));
+     if (trigdata->tg_oldtable)
+         changes->deleted = collect_transition_values(trigdata->tg_oldtable, RelationGetDescr(rel),
+                                                      attnum, key_attnum, changes->deleted);
+     if (trigdata->tg_newtable)
+         changes->inserted = collect_transition_values(trigdata->tg_newtable, RelationGetDescr(rel),
+                                                       attnum, key_attnum, changes->inserted);
+     
+     return PointerGetDatum(NULL);
+ }
+
+ PG_FUNCTION_INFO_V1(test_pattern_match);
+ Datum test_pattern_match(PG_FUNCTION_ARGS)
+ {
+     char *str = text_to_cstring(PG_GETARG_TEXT_PP(0));
+     char *pattern = text_to_cstring(PG_GETARG_TEXT_PP(1));
+     
+     PG_RETURN_BOOL(like_match(str, pattern));
+ }
+ 
+ /* ==================== INDEX ACCESS METHOD ==================== */
+ 
+ /*
+  * CREATE INDEX ... USING optimized_like (col) keeps the same image inside
+  * the index relation: a metapage, then a chain of pages holding the image
+  * bytes.  Rows inserted after the build go to a pending list that scans
+  * check one by one, and VACUUM folds the pending list and dead tuples into
+  * a fresh image.  The AM only supports bitmap scans and always asks for a
+  * recheck, so escapes and multibyte '_' only have to produce a superset.
+  *
+  * Chains replaced by a rewrite are only marked deleted, with the next xid.
+  * A scan may still be reading them from its copy of the metapage, so they
+  * go to the free space map on a later VACUUM, once no snapshot is old enough
+  * to have seen the metapage that pointed at them (as GIN does).
+  */
+ 
+ #define OL_METAPAGE_BLKNO   0
+ #define OL_META_MAGIC       0x4F4C4D54  /* "OLMT" */
+ #define OL_META_VERSION     1
+ 
+ #define OL_PAGE_META        0x0001
+ #define OL_PAGE_IMAGE       0x0002
+ #define OL_PAGE_PENDING     0x0004
+ #define OL_PAGE_DELETED     0x0008
+ 
+ #define OL_PENDING_TRUNCATED 0x0001
+ 
+ typedef struct {
+     BlockNumber next;
+     uint16 flags;
+     uint16 unused;
+ } OLPageOpaqueData;
+ 
+ typedef OLPageOpaqueData *OLPageOpaque;
+ 
+ typedef struct {
+     uint32 magic;
+     uint32 version;
+     uint64 build_id;            /* changes on every CREATE INDEX / REINDEX */
+     uint64 generation;          /* changes whenever VACUUM rewrites the image */
+     BlockNumber image_head;
+     uint32 image_pages;
+     uint64 image_size;
+     BlockNumber pending_head;
+     BlockNumber pending_tail;
+     uint64 pending_count;
+ } OLMetaPageData;
+ 
+ typedef struct {
+     ItemPointerData heap_tid;
+     uint16 flags;
+     char data[FLEXIBLE_ARRAY_MEMBER];
+ } OLPendingTuple;
+ 
+ /* A pending tuple copied off its page, with its length */
+ typedef struct {
+     Size size;
+     OLPendingTuple *tup;
+ } OLPendingCopy;
+ 
+ #define OLPageGetOpaque(page)   ((OLPageOpaque) PageGetSpecialPointer(page))
+ #define OLPageGetMeta(page)     ((OLMetaPageData *) PageGetContents(page))
+ /* A deleted page keeps the xid it was deleted at in place of its contents */
+ #define OLPageGetDeleteXid(page) (*(TransactionId *) PageGetContents(page))
+ #define OL_PAGE_CAPACITY \
+     (BLCKSZ - MAXALIGN(SizeOfPageHeaderData) - MAXALIGN(sizeof(OLPageOpaqueData)))
+ #define OL_PENDING_MAX \
+     (((OL_PAGE_CAPACITY - sizeof(ItemIdData)) & ~(Size)(MAXIMUM_ALIGNOF - 1)) - \
+      offsetof(OLPendingTuple, data))
+ 
+ typedef struct {
+     Oid indexoid;
+     uint64 build_id;
+     uint64 generation;
+     RoaringIndex *index;
+ } OLIndexCacheEntry;
+ 
+ /* Per-backend cache of loaded index images, keyed by index OID */
+ static HTAB *am_index_cache = NULL;
+ 
+ static void ol_init_page(Page page, uint16 flags)
+ {
+     PageInit(page, BLCKSZ, sizeof(OLPageOpaqueData));
+     OLPageGetOpaque(page)->next = InvalidBlockNumber;
+     OLPageGetOpaque(page)->flags = flags;
+ }
+ 
+ static void ol_fill_metapage(Page page)
+ {
+     OLMetaPageData *meta;
+     
+     ol_init_page(page, OL_PAGE_META);
+     meta = OLPageGetMeta(page);
+     memset(meta, 0, sizeof(OLMetaPageData));
+     meta->magic = OL_META_MAGIC;
+     meta->version = OL_META_VERSION;
+     meta->build_id = (uint64)GetCurrentTimestamp();
+     meta->image_head = InvalidBlockNumber;
+     meta->pending_head = InvalidBlockNumber;
+     meta->pending_tail = InvalidBlockNumber;
+     ((PageHeader)page)->pd_lower = ((char *)meta + sizeof(OLMetaPageData)) - (char *)page;
+ }
+ 
+ static OLMetaPageData* ol_check_meta(Relation index, Page page)
+ {
+     OLMetaPageData *meta = OLPageGetMeta(page);
+     
+     if (meta->magic != OL_META_MAGIC || meta->version != OL_META_VERSION)
+         ereport(ERROR,
+                 (errcode(ERRCODE_INDEX_CORRUPTED),
+                  errmsg("index \"%s\" is not a valid optimized_like index",
+                         RelationGetRelationName(index))));
+     return meta;
+ }
+ 
+ /* Whether no scan can still reach a deleted page through an old metapage */
+ static bool ol_page_recyclable(Page page)
+ {
+     if (PageIsNew(page))
+         return true;
+     if (!(OLPageGetOpaque(page)->flags & OL_PAGE_DELETED))
+         return false;
+ #if PG_VERSION_NUM >= 140000
+     return GlobalVisCheckRemovableXid(NULL, OLPageGetDeleteXid(page));
+ #else
+     return TransactionIdPrecedes(OLPageGetDeleteXid(page), RecentGlobalXmin);
+ #endif
+ }
+ 
+ /* Reuse a free page from the FSM or extend the relation; returned locked */
+ static Buffer ol_new_buffer(Relation index)
+ {
+     Buffer buffer;
      
-     /* Single slice */
-     if (info->slice_count == 1)
+     for (;;)
      {
-         const char *slice = info->slices[0];
+         BlockNumber blkno = GetFreeIndexPage(index);
          
-         candidates = get_char_candidates(slice);
-         if (unlikely(roaring_is_empty(candidates)))
-         {
-             free_pattern_info(info);
-             roaring_free(candidates);
-             *result_count = 0;
-             return NULL;
-         }
+         if (blkno == InvalidBlockNumber)
+             break;
          
-         /* Case: pattern (exact match) */
-         if (!info->starts_with_percent && !info->ends_with_percent)
+         buffer = ReadBuffer(index, blkno);
+         if (ConditionalLockBuffer(buffer))
          {
-             result = match_at_pos(slice, 0);
+             Page page = BufferGetPage(buffer);
              
-             if (strlen(slice) < global_index->length_idx.max_length && 
-                 global_index->length_idx.length_bitmaps[strlen(slice)])
-             {
-                 temp = roaring_and(result, global_index->length_idx.length_bitmaps[strlen(slice)]);
-                 roaring_free(result);
-                 result = temp;
-             }
-             else
-             {
-                 roaring_free(result);
-                 result = roaring_create();
-             }
-         }
-         /* Case: pattern% */
-         else if (!info->starts_with_percent && info->ends_with_percent)
-         {
-             result = match_at_pos(slice, 0);
-             temp = roaring_and(result, candidates);
-             roaring_free(result);
-             result = temp;
+             if (ol_page_recyclable(page))
+                 return buffer;
+             LockBuffer(buffer, BUFFER_LOCK_UNLOCK);
          }
-         /* Case: %pattern */
-         else if (info->starts_with_percent && !info->ends_with_percent)
+         ReleaseBuffer(buffer);
+     }
+     
+ #if PG_VERSION_NUM >= 160000
+     buffer = ExtendBufferedRel(BMR_REL(index), MAIN_FORKNUM, NULL, EB_LOCK_FIRST);
+ #else
+     {
+         bool needLock = !RELATION_IS_LOCAL(index);
+         
+         if (needLock)
+             LockRelationForExtension(index, ExclusiveLock);
+         buffer = ReadBuffer(index, P_NEW);
+         LockBuffer(buffer, BUFFER_LOCK_EXCLUSIVE);
+         if (needLock)
+             UnlockRelationForExtension(index, ExclusiveLock);
+     }
+ #endif
+     return buffer;
+ }
+ 
+ /* Write image into a new chain of pages; returns the head block */
+ static BlockNumber ol_write_image(Relation index, const char *image, Size size, uint32 *npages)
+ {
+     Buffer prevbuf = InvalidBuffer;
+     BlockNumber head = InvalidBlockNumber;
+     Size off;
+     
+     *npages = 0;
+     for (off = 0; off < size; off += OL_PAGE_CAPACITY)
+     {
+         Size len = Min(OL_PAGE_CAPACITY, size - off);
+         Buffer buf = ol_new_buffer(index);
+         GenericXLogState *state = GenericXLogStart(index);
+         Page page = GenericXLogRegisterBuffer(state, buf, GENERIC_XLOG_FULL_IMAGE);
+         
+         ol_init_page(page, OL_PAGE_IMAGE);
+         memcpy(PageGetContents(page), image + off, len);
+         ((PageHeader)page)->pd_lower = (PageGetContents(page) + len) - (char *)page;
+         
+         if (BufferIsValid(prevbuf))
          {
-             result = match_at_neg_pos(slice, 0);
-             temp = roaring_and(result, candidates);
-             roaring_free(result);
-             result = temp;
+             Page prevpage = GenericXLogRegisterBuffer(state, prevbuf, 0);
+             
+             OLPageGetOpaque(prevpage)->next = BufferGetBlockNumber(buf);
          }
-         /* Case: %pattern% */
          else
+             head = BufferGetBlockNumber(buf);
+         
+         GenericXLogFinish(state);
+         
+         if (BufferIsValid(prevbuf))
+             UnlockReleaseBuffer(prevbuf);
+         prevbuf = buf;
+         (*npages)++;
+     }
+     
+     if (BufferIsValid(prevbuf))
+         UnlockReleaseBuffer(prevbuf);
+     return head;
+ }
+ 
+ /*
+  * Copy the image chain described by meta into context.  Returns NULL when the
+  * chain is not intact, which for a stale copy of the metapage means a
+  * concurrent VACUUM freed it; callers recheck the generation to tell that
+  * from corruption (ol_chain_corrupted).
+  */
+ static char* ol_read_image(Relation index, OLMetaPageData *meta, MemoryContext context)
+ {
+     char *raw = MemoryContextAllocHuge(context, meta->image_size + IMAGE_ALIGN);
+     char *image = (char *)TYPEALIGN(IMAGE_ALIGN, raw);
+     BlockNumber blkno = meta->image_head;
+     Size off = 0;
+     
+     while (blkno != InvalidBlockNumber)
+     {
+         Buffer buf = ReadBuffer(index, blkno);
+         Page page;
+         Size len;
+         uint16 flags;
+         
+         CHECK_FOR_INTERRUPTS();
+         LockBuffer(buf, BUFFER_LOCK_SHARE);
+         page = BufferGetPage(buf);
+         flags = OLPageGetOpaque(page)->flags;
+         len = ((PageHeader)page)->pd_lower - (PageGetContents(page) - (char *)page);
+         
+         if (!(flags & OL_PAGE_IMAGE) || (flags & OL_PAGE_DELETED) ||
+             len > OL_PAGE_CAPACITY || off + len > meta->image_size)
          {
-             result = roaring_create();
-             cand_indices = roaring_to_array(candidates, &cand_count);
-             
-             if (cand_indices)
-             {
-                 for (i = 0; i < cand_count; i++)
-                 {
-                     uint32_t idx = cand_indices[i];
-                     
-                     if (i + 1 < cand_count)
-                         PREFETCH(global_index->data[cand_indices[i + 1]]);
-                     
-                     const char *str = global_index->data[idx];
-                     
-                     if (contains_substring(str, slice))
-                         roaring_add(result, idx);
-                 }
-                 pfree(cand_indices);
-             }
+             UnlockReleaseBuffer(buf);
+             pfree(raw);
+             return NULL;
          }
          
-         roaring_free(candidates);
+         memcpy(image + off, PageGetContents(page), len);
+         off += len;
+         blkno = OLPageGetOpaque(page)->next;
+         UnlockReleaseBuffer(buf);
      }
-     /* Multiple slices */
-     else
+     
+     if (off != meta->image_size)
      {
-         /* Calculate min length */
-         min_len = 0;
-         for (i = 0; i < info->slice_count; i++)
-             min_len += count_non_wildcard(info->slices[i]);
+         pfree(raw);
+         return NULL;
+     }
+     return image;
+ }
+ 
+ /*
+  * Read and attach the image chain described by meta.  The bytes come from
+  * disk, so they are checked like an index file before attaching; NULL when
+  * the chain is not intact or the image is not sound.  An image of another
+  * format version is left to attach_index_image() to report.
+  */
+ static RoaringIndex* ol_load_image(Relation index, OLMetaPageData *meta, MemoryContext context)
+ {
+     char *image = ol_read_image(index, meta, context);
+     ImageHeader *hdr = (ImageHeader *)image;
+     
+     if (!image)
+         return NULL;
+     if (meta->image_size < sizeof(ImageHeader) ||
+         (hdr->magic == IMAGE_MAGIC && hdr->version == IMAGE_VERSION &&
+          (hdr->image_size != meta->image_size || !hdr->tids_offset ||
+           image_bounds_error(image, meta->image_size) != NULL)))
+         return NULL;
+     return attach_index_image(image, context);
+ }
+ 
+ static void ol_chain_corrupted(Relation index)
+ {
+     ereport(ERROR,
+             (errcode(ERRCODE_INDEX_CORRUPTED),
+              errmsg("corrupted page chain in index \"%s\"", RelationGetRelationName(index))));
+ }
+ 
+ /* Copy of the metapage, taken under a short share lock */
+ static void ol_read_meta(Relation index, OLMetaPageData *meta)
+ {
+     Buffer metabuf = ReadBuffer(index, OL_METAPAGE_BLKNO);
+     
+     LockBuffer(metabuf, BUFFER_LOCK_SHARE);
+     *meta = *ol_check_meta(index, BufferGetPage(metabuf));
+     UnlockReleaseBuffer(metabuf);
+ }
+ 
+ /*
+  * Mark every page of a chain deleted.  The pages are recycled by a later
+  * VACUUM (ol_recycle_pages), not here.
+  */
+ static void ol_free_chain(Relation index, BlockNumber blkno)
+ {
+ #if PG_VERSION_NUM >= 140000
+     TransactionId delete_xid = ReadNextTransactionId();
+ #else
+     TransactionId delete_xid = ReadNewTransactionId();
+ #endif
+     
+     while (blkno != InvalidBlockNumber)
+     {
+         Buffer buf = ReadBuffer(index, blkno);
+         GenericXLogState *state;
+         Page page;
+         BlockNumber next;
          
-         /* Get candidates with all required characters */
-         candidates = NULL;
+         LockBuffer(buf, BUFFER_LOCK_EXCLUSIVE);
+         state = GenericXLogStart(index);
+         page = GenericXLogRegisterBuffer(state, buf, 0);
+         OLPageGetOpaque(page)->flags |= OL_PAGE_DELETED;
+         OLPageGetDeleteXid(page) = delete_xid;
+         ((PageHeader)page)->pd_lower = (PageGetContents(page) + sizeof(TransactionId)) - (char *)page;
+         /* page is the xlog copy, which GenericXLogFinish frees */
+         next = OLPageGetOpaque(page)->next;
+         GenericXLogFinish(state);
          
-         for (i = 0; i < info->slice_count; i++)
+         blkno = next;
+         UnlockReleaseBuffer(buf);
+     }
+ }
+ 
+ /* Hand every deleted page no scan can reach any more to the FSM */
+ static void ol_recycle_pages(Relation index, IndexBulkDeleteResult *stats)
+ {
+     BlockNumber nblocks = RelationGetNumberOfBlocks(index);
+     BlockNumber blkno;
+     
+     stats->pages_deleted = 0;
+     stats->pages_free = 0;
+     for (blkno = OL_METAPAGE_BLKNO + 1; blkno < nblocks; blkno++)
+     {
+         Buffer buf = ReadBuffer(index, blkno);
+         Page page;
+         
+         CHECK_FOR_INTERRUPTS();
+         LockBuffer(buf, BUFFER_LOCK_SHARE);
+         page = BufferGetPage(buf);
+         if (PageIsNew(page) || (OLPageGetOpaque(page)->flags & OL_PAGE_DELETED))
          {
-             temp = get_char_candidates(info->slices[i]);
-             if (!candidates)
-             {
-                 candidates = temp;
-             }
-             else
-             {
-                 temp2 = roaring_and(candidates, temp);
-                 roaring_free(candidates);
-                 roaring_free(temp);
-                 candidates = temp2;
-             }
-             
-             if (unlikely(roaring_is_empty(candidates)))
+             stats->pages_deleted++;
+             if (ol_page_recyclable(page))
              {
-                 roaring_free(candidates);
-                 free_pattern_info(info);
-                 *result_count = 0;
-                 return NULL;
+                 RecordFreeIndexPage(index, blkno);
+                 stats->pages_free++;
              }
          }
+         UnlockReleaseBuffer(buf);
+     }
+     IndexFreeSpaceMapVacuum(index);
+ }
+ 
+ static void ol_cache_invalidate(Datum arg, Oid relid)
+ {
+     HASH_SEQ_STATUS status;
+     OLIndexCacheEntry *entry;
+     
+     if (!am_index_cache)
+         return;
+     
+     hash_seq_init(&status, am_index_cache);
+     while ((entry = (OLIndexCacheEntry *)hash_seq_search(&status)) != NULL)
+     {
+         if (relid != InvalidOid && entry->indexoid != relid)
+             continue;
+         if (entry->index)
+         {
+             free_index_bitmaps(entry->index);
+             MemoryContextDelete(entry->index->context);
+         }
+         hash_search(am_index_cache, &entry->indexoid, HASH_REMOVE, NULL);
+     }
+ }
+ 
+ /*
+  * Image of the index as described by meta, loading it on first use.  Returns
+  * NULL when the chain was freed under a stale meta or is not sound (see
+  * ol_load_image).
+  */
+ static RoaringIndex* ol_get_index(Relation index, OLMetaPageData *meta)
+ {
+     Oid indexoid = RelationGetRelid(index);
+     OLIndexCacheEntry *entry;
+     MemoryContext context;
+     bool found;
+     
+     if (!am_index_cache)
+     {
+         HASHCTL ctl;
          
-         /* Apply length constraint */
-         temp = get_length_range(min_len, -1);
-         result = roaring_and(candidates, temp);
-         roaring_free(candidates);
-         roaring_free(temp);
+         memset(&ctl, 0, sizeof(ctl));
+         ctl.keysize = sizeof(Oid);
+         ctl.entrysize = sizeof(OLIndexCacheEntry);
+         am_index_cache = hash_create("optimized_like index images", 16, &ctl,
+                                      HASH_ELEM | HASH_BLOBS);
+         CacheRegisterRelcacheCallback(ol_cache_invalidate, (Datum)0);
+     }
+     
+     entry = (OLIndexCacheEntry *)hash_search(am_index_cache, &indexoid, HASH_ENTER, &found);
+     if (!found)
+         entry->index = NULL;
+     
+     if (entry->index &&
+         entry->build_id == meta->build_id &&
+         entry->generation == meta->generation)
+         return entry->index;
+     
+     if (entry->index)
+     {
+         free_index_bitmaps(entry->index);
+         MemoryContextDelete(entry->index->context);
+         entry->index = NULL;
+     }
+     
+     context = AllocSetContextCreate(TopMemoryContext,
+                                     "OptimizedLikeIndexImage",
+                                     ALLOCSET_DEFAULT_SIZES);
+     entry->index = ol_load_image(index, meta, context);
+     if (!entry->index)
+     {
+         MemoryContextDelete(context);
+         return NULL;
+     }
+     entry->build_id = meta->build_id;
+     entry->generation = meta->generation;
+     return entry->index;
+ }
+ 
+ /*
+  * Turn a ~~ operand into an engine pattern matching a superset of it:
+  * escaped characters become literals, except escaped wildcards which become
+  * '_'.  With loose set, '_' becomes '%' since one character may span
+  * several bytes.
+  */
+ static char* ol_scan_pattern(text *pattern, bool loose)
+ {
+     const char *p = VARDATA_ANY(pattern);
+     int len = VARSIZE_ANY_EXHDR(pattern);
+     StringInfoData buf;
+     int i;
+     
+     initStringInfo(&buf);
+     for (i = 0; i < len; i++)
+     {
+         char c = p[i];
          
-         if (unlikely(roaring_is_empty(result)))
+         if (c == '\\' && i + 1 < len)
+         {
+             c = p[++i];
+             if (c == '%' || c == '_')
+                 c = '_';
+         }
+         else if (c == '_' && loose)
+             c = '%';
+         appendStringInfoChar(&buf, c);
+     }
+     return buf.data;
+ }
+ 
+ static bool ol_value_matches(const char *value, int len, char **strict, char **loose, int npatterns)
+ {
+     bool multibyte = false;
+     int i;
+     
+     if (pg_database_encoding_max_length() > 1)
+     {
+         for (i = 0; i < len && !multibyte; i++)
+             multibyte = (value[i] & 0x80) != 0;
+     }
+     
+     for (i = 0; i < npatterns; i++)
+         if (!like_match(value, multibyte ? loose[i] : strict[i]))
+             return false;
+     return true;
+ }
+ 
+ static void ol_add_tuples(TIDBitmap *tbm, RoaringIndex *index, uint32_t *rows, uint64_t count)
+ {
+     ItemPointerData tids[1024];
+     uint64_t i;
+     int n = 0;
+     
+     for (i = 0; i < count; i++)
+     {
+         tids[n++] = index->tids[rows[i]];
+         if (n == lengthof(tids))
          {
-             roaring_free(result);
-             free_pattern_info(info);
-             *result_count = 0;
-             return NULL;
+             tbm_add_tuples(tbm, tids, n, true);
+             n = 0;
          }
+     }
+     if (n > 0)
+         tbm_add_tuples(tbm, tids, n, true);
+ }
+ 
+ /* Add the rows of a loaded image that match every pattern */
+ static int64 ol_scan_image(RoaringIndex *ridx, TIDBitmap *tbm, char **strict, char **loose,
+                            int npatterns)
+ {
+     bool use_loose = ridx->non_ascii && pg_database_encoding_max_length() > 1;
+     uint64_t count = 0, kept = 0, j;
+     uint32_t *rows;
+     
+     rows = optimized_query(ridx, use_loose ? loose[0] : strict[0], &count);
+     
+     /* Further keys on the same column only filter the first key's rows */
+     for (j = 0; j < count; j++)
+     {
+         if (npatterns == 1 ||
+             ol_value_matches(index_string(ridx, rows[j]), index_string_len(ridx, rows[j]),
+                              strict + 1, loose + 1, npatterns - 1))
+             rows[kept++] = rows[j];
+     }
+     
+     ol_add_tuples(tbm, ridx, rows, kept);
+     if (rows)
+         pfree(rows);
+     return kept;
+ }
+ 
+ /*
+  * Add the matching pending tuples from blkno on.  Returns false on meeting a
+  * page that is no longer part of a pending list, like ol_read_image.
+  */
+ static bool ol_scan_pending(Relation index, BlockNumber blkno, TIDBitmap *tbm,
+                             char **strict, char **loose, int npatterns, int64 *ntids)
+ {
+     while (blkno != InvalidBlockNumber)
+     {
+         Buffer buf = ReadBuffer(index, blkno);
+         Page page;
+         OffsetNumber off, maxoff;
+         uint16 flags;
          
-         /* Apply anchor constraints */
-         if (!info->starts_with_percent)
+         CHECK_FOR_INTERRUPTS();
+         LockBuffer(buf, BUFFER_LOCK_SHARE);
+         page = BufferGetPage(buf);
+         flags = OLPageGetOpaque(page)->flags;
+         if (!(flags & OL_PAGE_PENDING) || (flags & OL_PAGE_DELETED))
          {
-             temp = match_at_pos(info->slices[0], 0);
-             temp3 = roaring_and(result, temp);
-             roaring_free(result);
-             roaring_free(temp);
-             result = temp3;
-             
-             if (unlikely(roaring_is_empty(result)))
-             {
-                 roaring_free(result);
-                 free_pattern_info(info);
-                 *result_count = 0;
-                 return NULL;
-             }
+             UnlockReleaseBuffer(buf);
+             return false;
          }
+         maxoff = PageGetMaxOffsetNumber(page);
          
-         if (!info->ends_with_percent)
+         for (off = FirstOffsetNumber; off <= maxoff; off++)
          {
-             temp = match_at_neg_pos(info->slices[info->slice_count - 1], 0);
-             temp3 = roaring_and(result, temp);
-             roaring_free(result);
-             roaring_free(temp);
-             result = temp3;
+             ItemId iid = PageGetItemId(page, off);
+             OLPendingTuple *tup = (OLPendingTuple *)PageGetItem(page, iid);
+             int len = ItemIdGetLength(iid) - offsetof(OLPendingTuple, data);
+             char *value;
              
-             if (unlikely(roaring_is_empty(result)))
+             /* A truncated value cannot be checked here; the heap recheck will */
+             if (!(tup->flags & OL_PENDING_TRUNCATED))
              {
-                 roaring_free(result);
-                 free_pattern_info(info);
-                 *result_count = 0;
-                 return NULL;
+                 value = pnstrdup(tup->data, len);
+                 if (!ol_value_matches(value, len, strict, loose, npatterns))
+                 {
+                     pfree(value);
+                     continue;
+                 }
+                 pfree(value);
              }
+             
+             tbm_add_tuples(tbm, &tup->heap_tid, 1, true);
+             (*ntids)++;
          }
          
-         /* Verify multi-slice patterns with contiguous matching */
-         RoaringBitmap *verified = verify_multislice_pattern(result, info);
-         roaring_free(result);
-         result = verified;
+         blkno = OLPageGetOpaque(page)->next;
+         UnlockReleaseBuffer(buf);
      }
+     return true;
+ }
+ 
+ /* Append one tuple to the pending list under the metapage lock */
+ static void ol_append_pending(Relation index, OLPendingTuple *tup, Size size)
+ {
+     Buffer metabuf, buf = InvalidBuffer, newbuf = InvalidBuffer;
+     GenericXLogState *state;
+     OLMetaPageData *meta;
+     Page page = NULL;
+     bool done = false;
      
-     free_pattern_info(info);
+     metabuf = ReadBuffer(index, OL_METAPAGE_BLKNO);
+     LockBuffer(metabuf, BUFFER_LOCK_EXCLUSIVE);
+     state = GenericXLogStart(index);
+     meta = ol_check_meta(index, GenericXLogRegisterBuffer(state, metabuf, 0));
+     
+     if (meta->pending_tail != InvalidBlockNumber)
+     {
+         buf = ReadBuffer(index, meta->pending_tail);
+         LockBuffer(buf, BUFFER_LOCK_EXCLUSIVE);
+         page = GenericXLogRegisterBuffer(state, buf, 0);
+         done = PageAddItem(page, (Item)tup, size, InvalidOffsetNumber, false, false) != InvalidOffsetNumber;
+     }
      
-     indices = roaring_to_array(result, result_count);
-     roaring_free(result);
+     if (!done)
+     {
+         Page newpage;
+         
+         newbuf = ol_new_buffer(index);
+         newpage = GenericXLogRegisterBuffer(state, newbuf, GENERIC_XLOG_FULL_IMAGE);
+         ol_init_page(newpage, OL_PAGE_PENDING);
+         if (PageAddItem(newpage, (Item)tup, size, InvalidOffsetNumber, false, false) == InvalidOffsetNumber)
+             elog(ERROR, "could not add pending tuple to index \"%s\"", RelationGetRelationName(index));
+         
+         if (page)
+             OLPageGetOpaque(page)->next = BufferGetBlockNumber(newbuf);
+         else
+             meta->pending_head = BufferGetBlockNumber(newbuf);
+         meta->pending_tail = BufferGetBlockNumber(newbuf);
+     }
+     meta->pending_count++;
      
-     /* Cache results */
-     if (indices && *result_count > 0 && *result_count < 50000)
-         cache_insert(pattern, indices, *result_count);
+     GenericXLogFinish(state);
      
-     return indices;
+     if (BufferIsValid(newbuf))
+         UnlockReleaseBuffer(newbuf);
+     if (BufferIsValid(buf))
+         UnlockReleaseBuffer(buf);
+     UnlockReleaseBuffer(metabuf);
  }
  
- /* ==================== POSTGRESQL FUNCTIONS ==================== */
+ static OLPendingTuple* ol_form_pending(ItemPointer tid, const char *value, int len, Size *size)
+ {
+     OLPendingTuple *tup;
+     uint16 flags = 0;
+     
+     if (len > OL_PENDING_MAX)
+     {
+         len = OL_PENDING_MAX;
+         flags |= OL_PENDING_TRUNCATED;
+     }
+     
+     *size = offsetof(OLPendingTuple, data) + len;
+     tup = (OLPendingTuple *)palloc(*size);
+     tup->heap_tid = *tid;
+     tup->flags = flags;
+     memcpy(tup->data, value, len);
+     return tup;
+ }
  
- PG_FUNCTION_INFO_V1(build_optimized_index);
- Datum build_optimized_index(PG_FUNCTION_ARGS)
+ /*
+  * Write a finished builder as a new, still unreferenced image chain, filling
+  * in the image fields of meta
+  */
+ static void ol_store_image(Relation index, IndexBuilder *b, OLMetaPageData *meta)
  {
-     text *table_name = PG_GETARG_TEXT_PP(0);
-     text *column_name = PG_GETARG_TEXT_PP(1);
-     char *table_str = text_to_cstring(table_name);
-     char *column_str = text_to_cstring(column_name);
+     ImageLayout layout;
+     Size image_size;
+     char *image;
      
-     instr_time start_time, end_time;
-     StringInfoData query;
-     int ret, num_records, idx, len, pos;
-     MemoryContext oldcontext;
-     HeapTuple tuple;
-     bool isnull;
-     Datum datum;
+     image_size = layout_index_image(b, &layout);
+     image = (char *)TYPEALIGN(IMAGE_ALIGN, MemoryContextAllocHuge(CurrentMemoryContext,
+                                                                  image_size + IMAGE_ALIGN));
+     write_index_image(image, &layout, b,
+                       get_namespace_name(RelationGetNamespace(index)),
+                       RelationGetRelationName(index),
+                       NameStr(TupleDescAttr(RelationGetDescr(index), 0)->attname));
+     meta->image_head = ol_write_image(index, image, image_size, &meta->image_pages);
+     meta->image_size = image_size;
+ }
+ 
+ /* Point the locked metapage at the chains in meta, as a new generation */
+ static void ol_swap_meta(Relation index, Buffer metabuf, OLMetaPageData *meta)
+ {
+     GenericXLogState *state = GenericXLogStart(index);
+     OLMetaPageData *page_meta = OLPageGetMeta(GenericXLogRegisterBuffer(state, metabuf, 0));
+     
+     page_meta->image_head = meta->image_head;
+     page_meta->image_pages = meta->image_pages;
+     page_meta->image_size = meta->image_size;
+     page_meta->generation++;
+     page_meta->pending_head = meta->pending_head;
+     page_meta->pending_tail = meta->pending_tail;
+     page_meta->pending_count = meta->pending_count;
+     GenericXLogFinish(state);
+ }
+ 
+ typedef struct {
+     IndexBuilder *builder;
+     double indtuples;
+ } OLBuildState;
+ 
+ #if PG_VERSION_NUM >= 130000
+ static void ol_build_callback(Relation index, ItemPointer tid, Datum *values,
+                               bool *isnull, bool tupleIsAlive, void *state)
+ #else
+ static void ol_build_callback(Relation index, HeapTuple htup, Datum *values,
+                               bool *isnull, bool tupleIsAlive, void *state)
+ #endif
+ {
+     OLBuildState *bs = (OLBuildState *)state;
      text *txt;
-     char *str;
-     unsigned char uch;
-     RoaringBitmap *existing_bm;
-     int ch_idx;
-     double ms;
-     int i;
-     int neg_offset;
+ #if PG_VERSION_NUM < 130000
+     ItemPointer tid = &htup->t_self;
+ #endif
      
-     INSTR_TIME_SET_CURRENT(start_time);
-     elog(INFO, "Building ULTIMATE optimized index (hash tables + hardware opts)...");
+     if (isnull[0])
+         return;
      
-     if (SPI_connect() != SPI_OK_CONNECT)
-         ereport(ERROR, (errmsg("SPI_connect failed")));
+     txt = DatumGetTextPP(values[0]);
+     builder_add(bs->builder, VARDATA_ANY(txt), VARSIZE_ANY_EXHDR(txt), tid, NULL);
+     bs->indtuples += 1;
+ }
+ 
+ static IndexBuildResult* ol_build(Relation heap, Relation index, IndexInfo *indexInfo)
+ {
+     IndexBuildResult *result;
+     OLBuildState bs;
+     MemoryContext build_context, oldcontext;
+     OLMetaPageData meta;
+     GenericXLogState *state;
+     Buffer metabuf;
+     double reltuples;
      
-     initStringInfo(&query);
-     appendStringInfo(&query, "SELECT %s FROM %s ORDER BY ctid",
-                      quote_identifier(column_str), quote_identifier(table_str));
+     if (RelationGetNumberOfBlocks(index) != 0)
+         elog(ERROR, "index \"%s\" already contains data", RelationGetRelationName(index));
      
-     ret = SPI_execute(query.data, true, 0);
-     if (ret != SPI_OK_SELECT)
-     {
-         SPI_finish();
-         ereport(ERROR, (errmsg("Query failed")));
-     }
+     /* Metapage first, so it lands on block 0 */
+     metabuf = ol_new_buffer(index);
+     Assert(BufferGetBlockNumber(metabuf) == OL_METAPAGE_BLKNO);
+     state = GenericXLogStart(index);
+     ol_fill_metapage(GenericXLogRegisterBuffer(state, metabuf, GENERIC_XLOG_FULL_IMAGE));
+     GenericXLogFinish(state);
      
-     num_records = SPI_processed;
-     elog(INFO, "Retrieved %d rows", num_records);
+     build_context = AllocSetContextCreate(CurrentMemoryContext,
+                                           "OptimizedLikeIndexBuild",
+                                           ALLOCSET_DEFAULT_SIZES);
+     oldcontext = MemoryContextSwitchTo(build_context);
      
-     if (index_context)
-         MemoryContextDelete(index_context);
+     bs.builder = builder_create(build_context, true, false);
+     builder_enable_options(bs.builder, ngram_index, bigram_positions, suffix_array, gap_pairs);
+     bs.indtuples = 0;
+     reltuples = table_index_build_scan(heap, index, indexInfo, true, true,
+                                        ol_build_callback, (void *)&bs, NULL);
+     builder_finish(bs.builder);
+     memset(&meta, 0, sizeof(meta));
+     ol_store_image(index, bs.builder, &meta);
+     meta.pending_head = InvalidBlockNumber;
+     meta.pending_tail = InvalidBlockNumber;
+     ol_swap_meta(index, metabuf, &meta);
+     UnlockReleaseBuffer(metabuf);
      
-     index_context = AllocSetContextCreate(TopMemoryContext,
-                                          "RoaringLikeIndex",
-                                          ALLOCSET_DEFAULT_SIZES);
+     free_index_bitmaps(bs.builder->index);
+     MemoryContextSwitchTo(oldcontext);
+     MemoryContextDelete(build_context);
+     
+     result = (IndexBuildResult *)palloc(sizeof(IndexBuildResult));
+     result->heap_tuples = reltuples;
+     result->index_tuples = bs.indtuples;
+     return result;
+ }
+ 
+ static void ol_buildempty(Relation index)
+ {
+     Buffer metabuf;
      
-     oldcontext = MemoryContextSwitchTo(index_context);
+ #if PG_VERSION_NUM >= 160000
+     metabuf = ExtendBufferedRel(BMR_REL(index), INIT_FORKNUM, NULL,
+                                 EB_SKIP_EXTENSION_LOCK | EB_LOCK_FIRST);
+ #else
+     metabuf = ReadBufferExtended(index, INIT_FORKNUM, P_NEW, RBM_NORMAL, NULL);
+     LockBuffer(metabuf, BUFFER_LOCK_EXCLUSIVE);
+ #endif
      
-     global_index = (RoaringIndex *)MemoryContextAlloc(index_context, sizeof(RoaringIndex));
-     global_index->num_records = num_records;
-     global_index->max_len = 0;
-     global_index->memory_used = 0;
-     global_index->data = (char **)MemoryContextAlloc(index_context, num_records * sizeof(char *));
+     START_CRIT_SECTION();
+     ol_fill_metapage(BufferGetPage(metabuf));
+     MarkBufferDirty(metabuf);
+     log_newpage_buffer(metabuf, true);
+     END_CRIT_SECTION();
      
-     /* Initialize hash tables */
-     for (ch_idx = 0; ch_idx < CHAR_RANGE; ch_idx++)
-     {
-         memset(global_index->pos_idx[ch_idx].buckets, 0, sizeof(PosHashEntry*) * HASH_TABLE_SIZE);
-         memset(global_index->neg_idx[ch_idx].buckets, 0, sizeof(PosHashEntry*) * HASH_TABLE_SIZE);
-         global_index->char_cache[ch_idx] = NULL;
-     }
+     UnlockReleaseBuffer(metabuf);
+ }
+ 
+ #if PG_VERSION_NUM >= 140000
+ static bool ol_insert(Relation index, Datum *values, bool *isnull, ItemPointer ht_ctid,
+                       Relation heapRel, IndexUniqueCheck checkUnique,
+                       bool indexUnchanged, IndexInfo *indexInfo)
+ #else
+ static bool ol_insert(Relation index, Datum *values, bool *isnull, ItemPointer ht_ctid,
+                       Relation heapRel, IndexUniqueCheck checkUnique,
+                       IndexInfo *indexInfo)
+ #endif
+ {
+     OLPendingTuple *tup;
+     text *txt;
+     Size size;
+     
+     /* LIKE never matches NULL */
+     if (isnull[0])
+         return false;
      
-     global_index->length_idx.max_length = 0;
-     global_index->length_idx.length_bitmaps = NULL;
-     init_query_cache();
+     txt = DatumGetTextPP(values[0]);
+     tup = ol_form_pending(ht_ctid, VARDATA_ANY(txt), VARSIZE_ANY_EXHDR(txt), &size);
+     ol_append_pending(index, tup, size);
+     pfree(tup);
      
-     elog(INFO, "Initialized index structures (hash tables, cache, bloom filter)");
+     return false;
+ }
+ 
+ /* Chain tuples onto the pending list ending at *tail, starting one if empty */
+ static void ol_chain_pending(Relation index, List *tuples, BlockNumber *head, BlockNumber *tail)
+ {
+     Buffer buf = InvalidBuffer;
+     ListCell *lc;
      
-     /* Build index from data */
-     for (idx = 0; idx < num_records; idx++)
+     if (tuples == NIL)
+         return;
+     if (*tail != InvalidBlockNumber)
      {
-         if (idx % 10000 == 0)
-             elog(INFO, "Processing record %d/%d", idx, num_records);
-         
-         tuple = SPI_tuptable->vals[idx];
-         datum = SPI_getbinval(tuple, SPI_tuptable->tupdesc, 1, &isnull);
+         buf = ReadBuffer(index, *tail);
+         LockBuffer(buf, BUFFER_LOCK_EXCLUSIVE);
+     }
+     
+     foreach(lc, tuples)
+     {
+         OLPendingCopy *copy = (OLPendingCopy *)lfirst(lc);
+         GenericXLogState *state = GenericXLogStart(index);
+         Page page = NULL, newpage;
+         Buffer newbuf;
          
-         if (isnull)
+         if (BufferIsValid(buf))
          {
-             global_index->data[idx] = MemoryContextStrdup(index_context, "");
-             continue;
+             page = GenericXLogRegisterBuffer(state, buf, 0);
+             if (PageAddItem(page, (Item)copy->tup, copy->size, InvalidOffsetNumber,
+                             false, false) != InvalidOffsetNumber)
+             {
+                 GenericXLogFinish(state);
+                 continue;
+             }
          }
          
-         txt = DatumGetTextPP(datum);
-         str = text_to_cstring(txt);
-         len = strlen(str);
+         newbuf = ol_new_buffer(index);
+         newpage = GenericXLogRegisterBuffer(state, newbuf, GENERIC_XLOG_FULL_IMAGE);
+         ol_init_page(newpage, OL_PAGE_PENDING);
+         if (PageAddItem(newpage, (Item)copy->tup, copy->size, InvalidOffsetNumber,
+                         false, false) == InvalidOffsetNumber)
+             elog(ERROR, "could not add pending tuple to index \"%s\"", RelationGetRelationName(index));
+         if (page)
+             OLPageGetOpaque(page)->next = BufferGetBlockNumber(newbuf);
+         else
+             *head = BufferGetBlockNumber(newbuf);
+         *tail = BufferGetBlockNumber(newbuf);
+         GenericXLogFinish(state);
          
-         if (len > MAX_POSITIONS)
-             len = MAX_POSITIONS;
+         if (BufferIsValid(buf))
+             UnlockReleaseBuffer(buf);
+         buf = newbuf;
+     }
+     UnlockReleaseBuffer(buf);
+ }
+ 
+ /*
+  * Fold the live pending tuples of page from offset from on into builder.
+  * Those that cannot go into the image, truncated ones or all of them without
+  * a builder, are copied onto *kept instead.  Returns the number removed.
+  */
+ static double ol_fold_pending(Page page, OffsetNumber from, IndexBuilder *builder, List **kept,
+                               IndexBulkDeleteCallback callback, void *callback_state)
+ {
+     OffsetNumber off, maxoff = PageGetMaxOffsetNumber(page);
+     double removed = 0;
+     
+     for (off = from; off <= maxoff; off++)
+     {
+         ItemId iid = PageGetItemId(page, off);
+         OLPendingTuple *tup = (OLPendingTuple *)PageGetItem(page, iid);
          
-         global_index->data[idx] = MemoryContextStrdup(index_context, str);
-         if (len > global_index->max_len)
-             global_index->max_len = len;
+         if (callback && callback(&tup->heap_tid, callback_state))
+         {
+             removed++;
+             continue;
+         }
          
-         /* Build position and negative indices */
-         for (pos = 0; pos < len; pos++)
+         if (!builder || (tup->flags & OL_PENDING_TRUNCATED))
          {
-             /* Forward position index */
-             uch = (unsigned char)str[pos];
-             
-             existing_bm = get_pos_bitmap(uch, pos);
-             if (!existing_bm)
-             {
-                 existing_bm = roaring_create();
-                 set_pos_bitmap(uch, pos, existing_bm);
-             }
-             roaring_add(existing_bm, (uint32_t)idx);
+             OLPendingCopy *copy = (OLPendingCopy *)palloc(sizeof(OLPendingCopy));
              
-             /* Backward (negative) index */
-             neg_offset = -(1 + pos);
-             uch = (unsigned char)str[len - 1 - pos];
-             
-             existing_bm = get_neg_bitmap(uch, neg_offset);
-             if (!existing_bm)
-             {
-                 existing_bm = roaring_create();
-                 set_neg_bitmap(uch, neg_offset, existing_bm);
-             }
-             roaring_add(existing_bm, (uint32_t)idx);
+             copy->size = ItemIdGetLength(iid);
+             copy->tup = (OLPendingTuple *)palloc(copy->size);
+             memcpy(copy->tup, tup, copy->size);
+             *kept = lappend(*kept, copy);
+             continue;
          }
-         
-         pfree(str);
+         builder_add(builder, tup->data, ItemIdGetLength(iid) - offsetof(OLPendingTuple, data),
+                     &tup->heap_tid, NULL);
+     }
+     return removed;
+ }
+ 
+ /*
+  * Rebuild the image without dead tuples and with the pending list folded in.
+  * The rebuild works from a copy of the metapage without holding its buffer
+  * lock, so scans and inserts go on meanwhile; a heavyweight lock on the
+  * metapage block keeps rewriters apart.  Tuples inserted after the pending
+  * list was read are carried over onto the new list when the chains are
+  * swapped, under the metapage lock.
+  */
+ static void ol_rewrite(Relation index, IndexBulkDeleteCallback callback, void *callback_state,
+                        IndexBulkDeleteResult *stats)
+ {
+     MemoryContext rewrite_context, oldcontext;
+     OLMetaPageData old, fresh;
+     IndexBuilder *builder;
+     List *kept = NIL, *arrived = NIL;
+     Buffer metabuf;
+     BlockNumber blkno, last_blkno = InvalidBlockNumber;
+     OffsetNumber last_off = InvalidOffsetNumber;
+     double removed = 0;
+     int i;
+     
+     LockPage(index, OL_METAPAGE_BLKNO, ExclusiveLock);
+     ol_read_meta(index, &old);
+     
+     /* Cleanup-only pass with nothing pending: the image is already current */
+     if (!callback && old.pending_count == 0)
+     {
+         stats->estimated_count = true;
+         UnlockPage(index, OL_METAPAGE_BLKNO, ExclusiveLock);
+         return;
      }
      
-     elog(INFO, "Index building complete, building char cache...");
+     rewrite_context = AllocSetContextCreate(CurrentMemoryContext,
+                                             "OptimizedLikeIndexRewrite",
+                                             ALLOCSET_DEFAULT_SIZES);
+     oldcontext = MemoryContextSwitchTo(rewrite_context);
+     builder = builder_create(rewrite_context, true, false);
      
-     /* Build character cache */
-     for (ch_idx = 0; ch_idx < CHAR_RANGE; ch_idx++)
+     if (old.image_size > 0)
      {
-         RoaringBitmap *char_bm = NULL;
+         RoaringIndex *current = ol_load_image(index, &old, rewrite_context);
+         
+         /* Only a rewriter frees the image chain, and we are the only one */
+         if (!current)
+             ol_chain_corrupted(index);
          
-         for (int bucket = 0; bucket < HASH_TABLE_SIZE; bucket++)
+         /* A rewrite keeps the options the index was built with */
+         builder_inherit_options(builder, current);
+         for (i = 0; i < current->num_records; i++)
          {
-             PosHashEntry *entry = global_index->pos_idx[ch_idx].buckets[bucket];
-             while (entry)
+             ItemPointerData tid = current->tids[i];
+             const char *str = index_string(current, i);
+             
+             if ((i & 1023) == 0)
+                 CHECK_FOR_INTERRUPTS();
+             if (callback && callback(&tid, callback_state))
              {
-                 if (!char_bm)
-                 {
-                     char_bm = roaring_copy(entry->bitmap);
-                 }
-                 else
-                 {
-                     RoaringBitmap *temp = roaring_or(char_bm, entry->bitmap);
-                     roaring_free(char_bm);
-                     char_bm = temp;
-                 }
-                 entry = entry->next;
+                 removed++;
+                 continue;
              }
+             builder_add(builder, str, index_string_len(current, i), &tid, NULL);
          }
-         
-         if (char_bm)
-             global_index->char_cache[ch_idx] = char_bm;
+         free_index_bitmaps(current);
      }
      
-     elog(INFO, "Character cache complete");
-     
-     /* Build length index */
-     elog(INFO, "Building length index...");
-     global_index->length_idx.max_length = global_index->max_len + 1;
-     global_index->length_idx.length_bitmaps = (RoaringBitmap **)MemoryContextAlloc(
-         index_context, 
-         global_index->length_idx.max_length * sizeof(RoaringBitmap *)
-     );
-     
-     for (i = 0; i < global_index->length_idx.max_length; i++)
-         global_index->length_idx.length_bitmaps[i] = NULL;
-     
-     for (idx = 0; idx < num_records; idx++)
+     for (blkno = old.pending_head; blkno != InvalidBlockNumber;)
      {
-         len = strlen(global_index->data[idx]);
-         if (len >= global_index->length_idx.max_length)
-             continue;
+         Buffer buf = ReadBuffer(index, blkno);
+         Page page;
          
-         if (!global_index->length_idx.length_bitmaps[len])
-             global_index->length_idx.length_bitmaps[len] = roaring_create();
+         CHECK_FOR_INTERRUPTS();
+         LockBuffer(buf, BUFFER_LOCK_SHARE);
+         page = BufferGetPage(buf);
+         removed += ol_fold_pending(page, FirstOffsetNumber, builder, &kept,
+                                    callback, callback_state);
          
-         roaring_add(global_index->length_idx.length_bitmaps[len], (uint32_t)idx);
+         /* Remember how far the list was read; inserts only ever append */
+         last_blkno = blkno;
+         last_off = PageGetMaxOffsetNumber(page);
+         blkno = OLPageGetOpaque(page)->next;
+         UnlockReleaseBuffer(buf);
      }
      
-     elog(INFO, "Length index complete");
+     builder_finish(builder);
      
-     /* Calculate memory usage */
-     global_index->memory_used = sizeof(RoaringIndex);
-     for (ch_idx = 0; ch_idx < CHAR_RANGE; ch_idx++)
-     {
-         if (global_index->char_cache[ch_idx])
-             global_index->memory_used += roaring_size_bytes(global_index->char_cache[ch_idx]);
-     }
-     for (i = 0; i < global_index->length_idx.max_length; i++)
+     if (removed > 0 || old.pending_count > (uint64)list_length(kept))
      {
-         if (global_index->length_idx.length_bitmaps[i])
-             global_index->memory_used += roaring_size_bytes(global_index->length_idx.length_bitmaps[i]);
+         BlockNumber cur_pending_head;
+         OLMetaPageData *meta;
+         
+         /* The new chains are unreferenced until the swap, so no lock yet */
+         fresh = old;
+         ol_store_image(index, builder, &fresh);
+         fresh.pending_head = InvalidBlockNumber;
+         fresh.pending_tail = InvalidBlockNumber;
+         ol_chain_pending(index, kept, &fresh.pending_head, &fresh.pending_tail);
+         
+         metabuf = ReadBuffer(index, OL_METAPAGE_BLKNO);
+         LockBuffer(metabuf, BUFFER_LOCK_EXCLUSIVE);
+         meta = ol_check_meta(index, BufferGetPage(metabuf));
+         cur_pending_head = meta->pending_head;
+         
+         /* Inserts wait on the metapage now; pick up what they appended */
+         blkno = last_blkno != InvalidBlockNumber ? last_blkno : cur_pending_head;
+         while (blkno != InvalidBlockNumber)
+         {
+             Buffer buf = ReadBuffer(index, blkno);
+             Page page;
+             
+             LockBuffer(buf, BUFFER_LOCK_SHARE);
+             page = BufferGetPage(buf);
+             removed += ol_fold_pending(page, blkno == last_blkno ? OffsetNumberNext(last_off)
+                                                                 : FirstOffsetNumber,
+                                        NULL, &arrived, callback, callback_state);
+             blkno = OLPageGetOpaque(page)->next;
+             UnlockReleaseBuffer(buf);
+         }
+         ol_chain_pending(index, arrived, &fresh.pending_head, &fresh.pending_tail);
+         fresh.pending_count = list_length(kept) + list_length(arrived);
+         
+         ol_swap_meta(index, metabuf, &fresh);
+         UnlockReleaseBuffer(metabuf);
+         
+         ol_free_chain(index, old.image_head);
+         ol_free_chain(index, cur_pending_head);
      }
+     free_index_bitmaps(builder->index);
      
-     MemoryContextSwitchTo(oldcontext);
-     SPI_finish();
+     stats->tuples_removed += removed;
+     stats->num_index_tuples = builder->index->num_records + list_length(kept) + list_length(arrived);
      
-     INSTR_TIME_SET_CURRENT(end_time);
-     INSTR_TIME_SUBTRACT(end_time, start_time);
-     ms = INSTR_TIME_GET_MILLISEC(end_time);
+     MemoryContextSwitchTo(oldcontext);
+     MemoryContextDelete(rewrite_context);
      
-     elog(INFO, "Build time: %.0f ms", ms);
-     elog(INFO, "Index: %d records, max_len=%d, memory=%zu bytes (%.2f MB)",
-          num_records, global_index->max_len, global_index->memory_used,
-          global_index->memory_used / (1024.0 * 1024.0));
-     elog(INFO, "Optimizations: Hash tables (4096 buckets), prefetch, bloom filter, cache (%d slots)",
-          QUERY_CACHE_SIZE);
+     UnlockPage(index, OL_METAPAGE_BLKNO, ExclusiveLock);
+ }
+ 
+ static IndexBulkDeleteResult* ol_bulkdelete(IndexVacuumInfo *info, IndexBulkDeleteResult *stats,
+                                             IndexBulkDeleteCallback callback, void *callback_state)
+ {
+     if (stats == NULL)
+         stats = (IndexBulkDeleteResult *)palloc0(sizeof(IndexBulkDeleteResult));
      
-     PG_RETURN_BOOL(true);
+     ol_rewrite(info->index, callback, callback_state, stats);
+     return stats;
  }
  
- PG_FUNCTION_INFO_V1(optimized_like_query);
- Datum optimized_like_query(PG_FUNCTION_ARGS)
+ static IndexBulkDeleteResult* ol_vacuumcleanup(IndexVacuumInfo *info, IndexBulkDeleteResult *stats)
  {
-     text *pattern_text = PG_GETARG_TEXT_PP(0);
-     char *pattern = text_to_cstring(pattern_text);
-     uint64_t result_count = 0;
-     uint32_t *results;
+     if (info->analyze_only)
+         return stats;
      
-     if (!global_index)
+     /* Without a preceding bulkdelete, still fold the pending list in */
+     if (stats == NULL)
      {
-         elog(WARNING, "Index not built. Call build_optimized_index() first.");
-         PG_RETURN_INT32(0);
+         stats = (IndexBulkDeleteResult *)palloc0(sizeof(IndexBulkDeleteResult));
+         ol_rewrite(info->index, NULL, NULL, stats);
      }
      
-     results = optimized_query(pattern, &result_count);
+     /* Chains replaced by an earlier VACUUM are normally safe to reuse now */
+     ol_recycle_pages(info->index, stats);
+     stats->num_pages = RelationGetNumberOfBlocks(info->index);
+     return stats;
+ }
+ 
+ static void ol_costestimate(PlannerInfo *root, IndexPath *path, double loop_count,
+                             Cost *indexStartupCost, Cost *indexTotalCost,
+                             Selectivity *indexSelectivity, double *indexCorrelation,
+                             double *indexPages)
+ {
+     GenericCosts costs;
      
-     if (results)
-         pfree(results);
+     MemSet(&costs, 0, sizeof(costs));
+     genericcostestimate(root, path, loop_count, &costs);
      
-     PG_RETURN_INT32(result_count);
+     *indexStartupCost = costs.indexStartupCost;
+     *indexTotalCost = costs.indexTotalCost;
+     *indexSelectivity = costs.indexSelectivity;
+     *indexCorrelation = costs.indexCorrelation;
+     *indexPages = costs.numIndexPages;
  }
  
- PG_FUNCTION_INFO_V1(optimized_like_query_rows);
- Datum optimized_like_query_rows(PG_FUNCTION_ARGS)
+ static bytea* ol_options(Datum reloptions, bool validate)
  {
-     FuncCallContext *funcctx;
-     uint32_t *matches;
-     uint64_t row_idx;
-     Datum values[2];
-     bool nulls[2];
-     HeapTuple tuple;
-     Datum result;
+     return NULL;
+ }
+ 
+ static bool ol_validate(Oid opclassoid)
+ {
+     return true;
+ }
+ 
+ static IndexScanDesc ol_beginscan(Relation index, int nkeys, int norderbys)
+ {
+     return RelationGetIndexScan(index, nkeys, norderbys);
+ }
+ 
+ static void ol_rescan(IndexScanDesc scan, ScanKey scankey, int nscankeys,
+                       ScanKey orderbys, int norderbys)
+ {
+     if (scankey && scan->numberOfKeys > 0)
+         memmove(scan->keyData, scankey, scan->numberOfKeys * sizeof(ScanKeyData));
+ }
+ 
+ static void ol_endscan(IndexScanDesc scan)
+ {
+ }
+ 
+ static int64 ol_getbitmap(IndexScanDesc scan, TIDBitmap *tbm)
+ {
+     Relation index = scan->indexRelation;
+     int npatterns = scan->numberOfKeys;
+     char **strict = (char **)palloc(npatterns * sizeof(char *));
+     char **loose = (char **)palloc(npatterns * sizeof(char *));
+     OLMetaPageData meta, now;
+     int64 ntids;
+     int i;
      
-     if (SRF_IS_FIRSTCALL())
+     for (i = 0; i < npatterns; i++)
      {
-         MemoryContext oldcontext;
-         text *pattern_text = PG_GETARG_TEXT_PP(0);
-         char *pattern = text_to_cstring(pattern_text);
-         uint64_t result_count = 0;
-         TupleDesc tupdesc;
-         
-         funcctx = SRF_FIRSTCALL_INIT();
-         oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
-         
-         if (!global_index)
-         {
-             MemoryContextSwitchTo(oldcontext);
-             SRF_RETURN_DONE(funcctx);
-         }
+         ScanKey key = &scan->keyData[i];
+         text *pattern;
          
-         matches = optimized_query(pattern, &result_count);
-         funcctx->max_calls = result_count;
-         funcctx->user_fctx = (void *)matches;
+         if (key->sk_flags & SK_ISNULL)
+             return 0;
          
-         if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
-             ereport(ERROR, (errmsg("function returning record in invalid context")));
-         
-         funcctx->tuple_desc = BlessTupleDesc(tupdesc);
-         MemoryContextSwitchTo(oldcontext);
+         pattern = DatumGetTextPP(key->sk_argument);
+         strict[i] = ol_scan_pattern(pattern, false);
+         loose[i] = ol_scan_pattern(pattern, true);
      }
      
-     funcctx = SRF_PERCALL_SETUP();
-     
-     if (funcctx->call_cntr < funcctx->max_calls)
+     /*
+      * Work from a copy of the metapage so that no buffer lock is held while
+      * the image loads or the query runs.  A VACUUM that rewrites the index
+      * meanwhile marks the chains the copy points at deleted (it cannot reuse
+      * them while this scan's snapshot is alive); then start over.  Tuples
+      * already added stay, they are only rechecked.
+      */
+     for (;;)
      {
-         matches = (uint32_t *)funcctx->user_fctx;
-         row_idx = matches[funcctx->call_cntr];
+         bool intact = true;
          
-         nulls[0] = false;
-         nulls[1] = false;
+         ol_read_meta(index, &meta);
+         ntids = 0;
          
-         values[0] = Int32GetDatum((int32_t)row_idx);
-         values[1] = CStringGetTextDatum(global_index->data[row_idx]);
+         if (meta.image_size > 0)
+         {
+             RoaringIndex *ridx = ol_get_index(index, &meta);
+             
+             if (ridx)
+                 ntids += ol_scan_image(ridx, tbm, strict, loose, npatterns);
+             else
+                 intact = false;
+         }
          
-         tuple = heap_form_tuple(funcctx->tuple_desc, values, nulls);
-         result = HeapTupleGetDatum(tuple);
+         if (intact)
+             intact = ol_scan_pending(index, meta.pending_head, tbm, strict, loose, npatterns, &ntids);
          
-         SRF_RETURN_NEXT(funcctx, result);
-     }
-     
-     if (funcctx->user_fctx)
-     {
-         pfree(funcctx->user_fctx);
-         funcctx->user_fctx = NULL;
+         ol_read_meta(index, &now);
+         if (now.build_id == meta.build_id && now.generation == meta.generation)
+         {
+             if (!intact)
+                 ol_chain_corrupted(index);
+             break;
+         }
      }
      
-     SRF_RETURN_DONE(funcctx);
+     return ntids;
  }
  
- PG_FUNCTION_INFO_V1(optimized_like_status);
- Datum optimized_like_status(PG_FUNCTION_ARGS)
+ PG_FUNCTION_INFO_V1(optimized_like_handler);
+ Datum optimized_like_handler(PG_FUNCTION_ARGS)
  {
-     StringInfoData buf;
-     
-     if (!global_index)
-     {
-         PG_RETURN_TEXT_P(cstring_to_text("No index loaded. Call build_optimized_index() first."));
-     }
+     IndexAmRoutine *amroutine = makeNode(IndexAmRoutine);
      
-     initStringInfo(&buf);
-     appendStringInfo(&buf, "ULTIMATE Roaring Bitmap Index Status:\n");
-     appendStringInfo(&buf, "  Records: %d\n", global_index->num_records);
-     appendStringInfo(&buf, "  Max length: %d\n", global_index->max_len);
-     appendStringInfo(&buf, "  Memory used: %zu bytes (%.2f MB)\n", 
-                     global_index->memory_used,
-                     global_index->memory_used / (1024.0 * 1024.0));
-     appendStringInfo(&buf, "\nOptimizations:\n");
-     appendStringInfo(&buf, "  - Hash tables: %d buckets/char (O(1) lookup)\n", HASH_TABLE_SIZE);
-     appendStringInfo(&buf, "  - Query cache: %d slots with bloom filter\n", QUERY_CACHE_SIZE);
-     appendStringInfo(&buf, "  - CPU prefetching & branch hints\n");
-     appendStringInfo(&buf, "  - Cache-aligned structures (64 bytes)\n");
-     appendStringInfo(&buf, "  - Loop unrolling (4x)\n");
-     appendStringInfo(&buf, "  - Contiguous pattern matching\n");
-     appendStringInfo(&buf, "  - Hardware popcount (SIMD)\n");
-     appendStringInfo(&buf, "\nSupported: '%%' (multi-char), '_' (single-char)\n");
+     amroutine->amstrategies = 1;
+     amroutine->amsupport = 0;
+     amroutine->amcanorder = false;
+     amroutine->amcanorderbyop = false;
+     amroutine->amcanbackward = false;
+     amroutine->amcanunique = false;
+     amroutine->amcanmulticol = false;
+     amroutine->amoptionalkey = false;
+     amroutine->amsearcharray = false;
+     amroutine->amsearchnulls = false;
+     amroutine->amstorage = false;
+     amroutine->amclusterable = false;
+     amroutine->ampredlocks = false;
+     amroutine->amcanparallel = false;
+     amroutine->amcaninclude = false;
+ #if PG_VERSION_NUM >= 130000
+     amroutine->amusemaintenanceworkmem = false;
+     amroutine->amparallelvacuumoptions = VACUUM_OPTION_NO_PARALLEL;
+ #endif
+     amroutine->amkeytype = InvalidOid;
      
-     #ifdef HAVE_ROARING
-     appendStringInfo(&buf, "Backend: Native CRoaring library\n");
-     #else
-     appendStringInfo(&buf, "Backend: Optimized fallback bitmap\n");
-     #endif
+     amroutine->ambuild = ol_build;
+     amroutine->ambuildempty = ol_buildempty;
+     amroutine->aminsert = ol_insert;
+     amroutine->ambulkdelete = ol_bulkdelete;
+     amroutine->amvacuumcleanup = ol_vacuumcleanup;
+     amroutine->amcanreturn = NULL;
+     amroutine->amcostestimate = ol_costestimate;
+     amroutine->amoptions = ol_options;
+     amroutine->amproperty = NULL;
+     amroutine->ambuildphasename = NULL;
+     amroutine->amvalidate = ol_validate;
+     amroutine->ambeginscan = ol_beginscan;
+     amroutine->amrescan = ol_rescan;
+     amroutine->amgettuple = NULL;
+     amroutine->amgetbitmap = ol_getbitmap;
+     amroutine->amendscan = ol_endscan;
+     amroutine->ammarkpos = NULL;
+     amroutine->amrestrpos = NULL;
+     amroutine->amestimateparallelscan = NULL;
+     amroutine->aminitparallelscan = NULL;
+     amroutine->amparallelrescan = NULL;
      
-     PG_RETURN_TEXT_P(cstring_to_text(buf.data));
+     PG_RETURN_POINTER(amroutine);
  }
- 
- PG_FUNCTION_INFO_V1(optimized_like_clear_cache);
- Datum optimized_like_clear_cache(PG_FUNCTION_ARGS)
- {
-     if (!global_index)
-         PG_RETURN_TEXT_P(cstring_to_text("No index loaded."));
-     
-     init_query_cache();
-     
-     PG_RETURN_TEXT_P(cstring_to_text("Query cache cleared successfully."));
- }
\ No newline at end of file
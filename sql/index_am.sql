@@ -0,0 +1,70 @@
+--
+-- Index access method: LIKE through CREATE INDEX ... USING optimized_like
+-- must return exactly the rows a sequential scan returns
+--
+CREATE EXTENSION optimized_like;
+
+CREATE TABLE ol_words (id serial, val text);
+INSERT INTO ol_words (val) SELECT md5(i::text) FROM generate_series(1, 2000) i;
+-- values longer than the positional directory, marked past their 512th byte
+INSERT INTO ol_words (val) SELECT repeat(md5(i::text), 20) || 'tail' || i FROM generate_series(1, 50) i;
+INSERT INTO ol_words (val) VALUES
+    ('100% pure'), ('under_score'), ('back\slash'), ('café'), ('naïve façade'),
+    ('日本語テキスト'), (''), (NULL);
+
+CREATE TABLE ol_patterns (n serial, pat text);
+INSERT INTO ol_patterns (pat) VALUES
+    ('%'), (''), ('a%'), ('%f'), ('%abc%'), ('%a_c%'), ('_b%'), ('___'),
+    ('%tail4%'), ('%tail49'), ('%0%1%2%'), ('%zzz%'),
+    ('%\%%'), ('%\_%'), ('%\\%'), ('100\% %'), ('under\_score'),
+    ('caf_'), ('%ç%'), ('%_ade'), ('na_ve%'), ('%本%'), ('日本_%');
+
+CREATE INDEX ol_words_val_idx ON ol_words USING optimized_like (val);
+
+-- Patterns whose matches through the index differ from a sequential scan
+CREATE FUNCTION ol_mismatches() RETURNS SETOF text LANGUAGE plpgsql AS $$
+DECLARE
+    q text := 'SELECT array_agg(id ORDER BY id) FROM ol_words WHERE val LIKE %L';
+    p text;
+    via_index int[];
+    via_seqscan int[];
+BEGIN
+    FOR p IN SELECT pat FROM ol_patterns ORDER BY n LOOP
+        PERFORM set_config('enable_seqscan', 'off', true);
+        PERFORM set_config('enable_bitmapscan', 'on', true);
+        EXECUTE format(q, p) INTO via_index;
+        PERFORM set_config('enable_seqscan', 'on', true);
+        PERFORM set_config('enable_bitmapscan', 'off', true);
+        EXECUTE format(q, p) INTO via_seqscan;
+        IF via_index IS DISTINCT FROM via_seqscan THEN
+            RETURN NEXT p;
+        END IF;
+    END LOOP;
+END;
+$$;
+
+SET enable_seqscan = off;
+EXPLAIN (COSTS OFF) SELECT count(*) FROM ol_words WHERE val LIKE '%tail4%';
+SELECT count(*) FROM ol_words WHERE val LIKE '%tail4%';
+RESET enable_seqscan;
+
+SELECT * FROM ol_mismatches();
+
+-- Rows inserted after the build go to the pending list
+INSERT INTO ol_words (val) SELECT 'late' || md5(i::text) FROM generate_series(1, 300) i;
+SELECT * FROM ol_mismatches();
+
+-- VACUUM folds the pending list and the dead rows into a new image
+DELETE FROM ol_words WHERE id % 3 = 0;
+VACUUM ol_words;
+SELECT * FROM ol_mismatches();
+SET enable_seqscan = off;
+SELECT count(*) FROM ol_words WHERE val LIKE 'late%';
+RESET enable_seqscan;
+
+-- A second VACUUM recycles the pages of the replaced image
+INSERT INTO ol_words (val) SELECT 'later' || i FROM generate_series(1, 100) i;
+UPDATE ol_words SET val = val || 'tail4' WHERE id % 10 = 1;
+VACUUM ol_words;
+VACUUM ol_words;
+SELECT * FROM ol_mismatches();
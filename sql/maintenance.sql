@@ -0,0 +1,81 @@
+--
+-- Registry index kept up to date by the maintenance triggers
+--
+SET optimized_like.build_messages = off;
+
+CREATE TABLE ol_docs (id int NOT NULL, body text NOT NULL);
+INSERT INTO ol_docs SELECT i, 'doc ' || md5(i::text) FROM generate_series(1, 1000) i;
+INSERT INTO ol_docs VALUES
+    (1001, repeat('x', 256)), (1002, repeat('x', 300)), (1003, repeat('ab', 300) || 'needle');
+
+SELECT build_optimized_index('ol_docs', 'body', 0, 'id');
+
+-- Patterns whose count from the index differs from the table's
+CREATE FUNCTION ol_docs_mismatches() RETURNS SETOF text LANGUAGE sql AS $$
+    SELECT p FROM unnest(ARRAY['%', 'doc %', '%abc%', '%a_c%', '_oc%', '%0%1%2%',
+                               '%needle', 'x%', '%x', repeat('x', 256), repeat('x', 255) || '%',
+                               'new %', 'changed %', '%zzz%']) p
+    WHERE optimized_like_query('ol_docs', 'body', p) <> (SELECT count(*) FROM ol_docs WHERE body LIKE p)
+$$;
+
+-- Keys reported by the index that the table does not hold, or the reverse
+CREATE FUNCTION ol_docs_key_mismatches(p text) RETURNS SETOF bigint LANGUAGE sql AS $$
+    (SELECT key FROM optimized_like_query_rows('ol_docs', 'body', p)
+     EXCEPT ALL SELECT id FROM ol_docs WHERE body LIKE p)
+    UNION ALL
+    (SELECT id FROM ol_docs WHERE body LIKE p
+     EXCEPT ALL SELECT key FROM optimized_like_query_rows('ol_docs', 'body', p))
+$$;
+
+-- Reported tids that do not point at the row holding the reported key
+CREATE FUNCTION ol_docs_bad_tids(p text) RETURNS bigint LANGUAGE sql AS $$
+    SELECT count(*) FROM optimized_like_query_rows('ol_docs', 'body', p) r
+    LEFT JOIN ol_docs d ON d.ctid = r.tid
+    WHERE r.tid IS NOT NULL AND d.id IS DISTINCT FROM r.key
+$$;
+
+SELECT * FROM ol_docs_mismatches();
+-- The last length bucket also holds longer strings
+SELECT optimized_like_query('ol_docs', 'body', repeat('x', 256));
+SELECT * FROM ol_docs_key_mismatches('%ab%') AS key;
+SELECT count(*) FROM optimized_like_query_rows('ol_docs', 'body', '%ab%') WHERE tid IS NULL;
+SELECT ol_docs_bad_tids('%ab%');
+
+SELECT optimized_like_enable_maintenance('ol_docs', 'body');
+
+INSERT INTO ol_docs SELECT i, 'new ' || md5(i::text) FROM generate_series(1004, 1200) i;
+UPDATE ol_docs SET body = 'changed ' || body WHERE id % 7 = 0;
+DELETE FROM ol_docs WHERE id % 5 = 0;
+-- An UPDATE that leaves the column alone does not reach the index
+UPDATE ol_docs SET id = id WHERE id % 11 = 0;
+-- Nothing from a rolled back transaction is applied
+BEGIN;
+INSERT INTO ol_docs VALUES (5000, 'doc rolled back');
+DELETE FROM ol_docs WHERE id < 100;
+ROLLBACK;
+
+SELECT * FROM ol_docs_mismatches();
+SELECT * FROM ol_docs_key_mismatches('%ab%') AS key;
+SELECT * FROM ol_docs_key_mismatches('changed %') AS key;
+SELECT ol_docs_bad_tids('%ab%');
+
+-- Compaction folds the changes into a new base image, keeping keys and tids
+SELECT optimized_like_compact_index('ol_docs', 'body');
+SELECT * FROM ol_docs_mismatches();
+SELECT * FROM ol_docs_key_mismatches('%ab%') AS key;
+SELECT ol_docs_bad_tids('%ab%');
+
+-- Changes after compaction start a new delta segment
+DELETE FROM ol_docs WHERE body LIKE 'new %';
+SELECT * FROM ol_docs_mismatches();
+SELECT * FROM ol_docs_key_mismatches('%ab%') AS key;
+
+SELECT optimized_like_disable_maintenance('ol_docs', 'body');
+
+-- Partitioned tables and their partitions are refused
+CREATE TABLE ol_parted (id int NOT NULL, body text NOT NULL) PARTITION BY RANGE (id);
+CREATE TABLE ol_parted_1 PARTITION OF ol_parted FOR VALUES FROM (0) TO (1000);
+\set VERBOSITY terse
+SELECT optimized_like_enable_maintenance('ol_parted', 'body');
+SELECT optimized_like_enable_maintenance('ol_parted_1', 'body');
+\set VERBOSITY default
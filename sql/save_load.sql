@@ -0,0 +1,37 @@
+--
+-- An index saved to a file and mapped back answers like the one built
+--
+SET optimized_like.build_messages = off;
+
+CREATE TABLE ol_names (id int NOT NULL, name text NOT NULL);
+INSERT INTO ol_names SELECT i, md5(i::text) || repeat('z', i % 600) FROM generate_series(1, 1500) i;
+
+SELECT build_optimized_index('ol_names', 'name', 0, 'id');
+
+CREATE TABLE ol_name_patterns AS
+    SELECT p, optimized_like_query('ol_names', 'name', p) AS n
+    FROM unnest(ARRAY['%', 'a%', '%z', '%ab%', '%a_c%', '_0%', '%zzzz%', '%1z%', '%zzz_']) p;
+
+-- Counts the built index got wrong
+SELECT p FROM ol_name_patterns
+WHERE n <> (SELECT count(*) FROM ol_names WHERE name LIKE p);
+
+SELECT optimized_like_save_index('ol_names', 'name', 'ol_names.oli');
+SELECT optimized_like_drop_index('ol_names', 'name');
+SELECT optimized_like_query('ol_names', 'name', '%ab%');
+
+SELECT optimized_like_load_index('ol_names.oli');
+
+-- Counts the mapped index answers differently
+SELECT p FROM ol_name_patterns
+WHERE n <> optimized_like_query('ol_names', 'name', p);
+
+-- Keys and tids come back with the rows
+SELECT count(*) FROM optimized_like_query_rows('ol_names', 'name', '%ab%') r
+JOIN ol_names t ON t.ctid = r.tid AND t.id = r.key;
+SELECT count(*) FROM ol_names WHERE name LIKE '%ab%';
+
+-- Only names inside the index directory are accepted
+\set VERBOSITY terse
+SELECT optimized_like_load_index('../ol_names.oli');
+\set VERBOSITY default